@@ -226,6 +226,22 @@ copy_address(const struct Address *addr) {
     return new_addr;
 }
 
+/*
+ * Copy an address into storage, returning the copy or NULL if the address
+ * is too large for it
+ */
+struct Address *
+copy_address_to(const struct Address *addr, union AddressStorage *storage) {
+    size_t len = address_len(addr);
+
+    if (len > sizeof(storage->data))
+        return NULL;
+
+    memcpy(storage->data, addr, len);
+
+    return (struct Address *)storage->data;
+}
+
 size_t
 address_len(const struct Address *addr) {
     switch (addr->type) {
@@ -276,6 +292,21 @@ address_compare(const struct Address *addr_1, const struct Address *addr_2) {
     return result;
 }
 
+/*
+ * Hash of an address, equal for addresses address_compare() finds equal
+ */
+uint32_t
+address_hash(const struct Address *addr) {
+    uint32_t hash = 2166136261u ^ (uint32_t)addr->type;
+
+    for (size_t i = 0; i < addr->len; i++)
+        hash = (hash ^ (uint8_t)addr->data[i]) * 16777619u;
+    hash = (hash ^ (addr->port & 0xFF)) * 16777619u;
+    hash = (hash ^ (addr->port >> 8)) * 16777619u;
+
+    return hash;
+}
+
 int
 address_is_hostname(const struct Address *addr) {
     return addr != NULL && addr->type == HOSTNAME;
@@ -37,13 +37,26 @@
  */
 #define ADDRESS_BUFFER_SIZE 262
 
+/*
+ * Space for a copy of any hostname or socket address, to keep one without
+ * allocating it, see copy_address_to()
+ */
+#define ADDRESS_STORAGE_SIZE 320
+
 struct Address;
 
+union AddressStorage {
+    size_t align;
+    char data[ADDRESS_STORAGE_SIZE];
+};
+
 struct Address *new_address(const char *);
 struct Address *new_address_sa(const struct sockaddr *, socklen_t);
 struct Address *copy_address(const struct Address *);
+struct Address *copy_address_to(const struct Address *, union AddressStorage *);
 size_t address_len(const struct Address *);
 int address_compare(const struct Address *, const struct Address *);
+uint32_t address_hash(const struct Address *);
 int address_is_hostname(const struct Address *);
 int address_is_pattern(const struct Address *);
 int address_is_sockaddr(const struct Address *);
@@ -26,16 +26,58 @@
  */
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h> /* isalnum(), tolower() */
 #include <sys/queue.h>
-#include <pcre.h>
 #include <assert.h>
 #include "backend.h"
 #include "address.h"
 #include "logger.h"
 
+/* Captured substrings available to pattern addresses, $0 to $9 */
+#define PATTERN_SUBSTRINGS 10
+
+
+/*
+ * Match state shared by all patterns, allocated once as lookups are made
+ * from the single event loop: match data for patterns whose substrings are
+ * used and for those whose are not, and the stack and context for JIT
+ * compiled patterns
+ */
+static pcre2_match_data *capture_match_data;
+static pcre2_match_data *match_data;
+static pcre2_jit_stack *jit_stack;
+static pcre2_match_context *match_context;
+
 
 static void free_backend(struct Backend *);
+static struct Address *last_address(const struct Backend *);
+static int init_balancer(struct Backend *);
+static int is_pool_address(const char *);
+static int init_match_state();
+static pcre2_code *compile_pattern(const char *, uint32_t);
 static const char *backend_config_options(const struct Backend *);
+static int alpn_list_contains(const uint8_t *, size_t, const char *);
+static int classify_pattern(struct Backend *);
+static char *literal_hostname(const char *);
+static uint32_t hash_hostname(const char *, size_t);
+static int backend_accepts_alpn(const struct Backend *,
+        const struct ClientHello *);
+static struct Backend *first_backend(struct Backend *, struct Backend *);
+static void append_backend(struct Backend **, struct Backend *);
+static void index_hostname(struct BackendIndex *, struct Backend *);
+static struct Backend *lookup_hostname(const struct BackendIndex *,
+        const char *, size_t, const struct ClientHello *);
+static struct DomainLabel *domain_label(const struct BackendIndex *, size_t,
+        const char *, size_t);
+static void index_domain(struct BackendIndex *, struct Backend *);
+static struct Backend *first_domain_backend(struct Backend *,
+        struct Backend *, const struct ClientHello *, int);
+static struct Backend *lookup_domain(const struct BackendIndex *,
+        const char *, size_t, const struct ClientHello *);
+static struct Backend *match_patterns(struct Backend **, size_t,
+        const struct Backend *, const char *, size_t,
+        const struct ClientHello *, int *);
+static int match_pattern(const struct Backend *, const char *, size_t, int *);
 
 
 struct Backend *
@@ -72,14 +114,90 @@ accept_backend_arg(struct Backend *backend, const char *arg) {
             return -1;
         }
 #endif
-    } else if (address_port(backend->address) == 0 && is_numeric(arg)) {
-        if (!address_set_port_str(backend->address, arg)) {
+    } else if (address_port(last_address(backend)) == 0 && is_numeric(arg)) {
+        if (!address_set_port_str(last_address(backend), arg)) {
             err("Invalid port: %s", arg);
             return -1;
         }
+        /* The first server of a pool has its own copy of the address */
+        if (backend->balancer != NULL && backend->balancer->len == 1)
+            address_set_port(backend->address,
+                    address_port(last_address(backend)));
     } else if (backend->use_proxy_header == 0 &&
         strcasecmp(arg, "proxy_protocol") == 0) {
-        backend->use_proxy_header = 1;
+        backend->use_proxy_header = PROXY_PROTOCOL_V1;
+    } else if (backend->use_proxy_header == 0 &&
+        strcasecmp(arg, "proxy_protocol_v2") == 0) {
+        backend->use_proxy_header = PROXY_PROTOCOL_V2;
+    } else if (backend->alpn == NULL &&
+        strncasecmp(arg, "alpn=", 5) == 0) {
+        size_t len = strlen(arg + 5);
+        if (len < 1 || len > 255) {
+            err("Invalid ALPN protocol: %s", arg + 5);
+            return -1;
+        }
+        backend->alpn = strdup(arg + 5);
+        if (backend->alpn == NULL) {
+            err("strdup failed");
+            return -1;
+        }
+    } else if (strncasecmp(arg, "weight=", 7) == 0) {
+        if (!init_balancer(backend))
+            return -1;
+        if (!balancer_set_weight(backend->balancer, arg + 7)) {
+            err("Invalid weight: %s", arg + 7);
+            return -1;
+        }
+    } else if (strncasecmp(arg, "balance=", 8) == 0) {
+        if (!init_balancer(backend))
+            return -1;
+        if (!balancer_set_algorithm(backend->balancer, arg + 8)) {
+            err("Invalid load balancing algorithm: %s", arg + 8);
+            return -1;
+        }
+    } else if (strncasecmp(arg, "hash=", 5) == 0) {
+        if (!init_balancer(backend))
+            return -1;
+        if (!balancer_set_hash(backend->balancer, arg + 5)) {
+            err("Invalid hash key: %s", arg + 5);
+            return -1;
+        }
+    } else if (strncasecmp(arg, "check", 5) == 0 &&
+            strchr(arg, '=') != NULL) {
+        if (!init_balancer(backend))
+            return -1;
+        if (!balancer_set_check(backend->balancer, arg)) {
+            err("Invalid health check option: %s", arg);
+            return -1;
+        }
+    } else if (strncasecmp(arg, "retries=", 8) == 0 ||
+            strncasecmp(arg, "connect_timeout=", 16) == 0 ||
+            strncasecmp(arg, "eject=", 6) == 0 ||
+            strncasecmp(arg, "eject_time=", 11) == 0) {
+        if (!init_balancer(backend))
+            return -1;
+        if (!balancer_set_retry(backend->balancer, arg)) {
+            err("Invalid retry option: %s", arg);
+            return -1;
+        }
+    } else if (is_pool_address(arg)) {
+        if (!init_balancer(backend))
+            return -1;
+
+        struct Address *address = new_address(arg);
+        if (address == NULL) {
+            err("invalid address: %s", arg);
+            return -1;
+        }
+#ifndef HAVE_LIBUDNS
+        if (!address_is_sockaddr(address)) {
+            err("Only socket address backends are permitted when compiled without libudns");
+            free(address);
+            return -1;
+        }
+#endif
+        if (!balancer_add_server(backend->balancer, address))
+            return -1;
     } else {
         err("Unexpected table backend argument: %s", arg);
         return -1;
@@ -88,6 +206,63 @@ accept_backend_arg(struct Backend *backend, const char *arg) {
     return 1;
 }
 
+/* The address a following port number applies to */
+static struct Address *
+last_address(const struct Backend *backend) {
+    if (backend->balancer != NULL)
+        return backend->balancer->members[backend->balancer->len - 1]
+            .server->address;
+
+    return backend->address;
+}
+
+/*
+ * Make a backend a pool of servers, beginning with its address
+ *
+ * Returns true on success
+ */
+static int
+init_balancer(struct Backend *backend) {
+    if (backend->balancer != NULL)
+        return 1;
+
+    if (address_is_pattern(backend->address) ||
+            address_is_wildcard(backend->address)) {
+        err("Pattern and wildcard addresses can not be load balanced");
+        return 0;
+    }
+
+    struct Address *address = copy_address(backend->address);
+    if (address == NULL) {
+        err("%s: malloc", __func__);
+        return 0;
+    }
+
+    backend->balancer = new_balancer();
+    if (backend->balancer == NULL) {
+        free(address);
+        return 0;
+    }
+
+    return balancer_add_server(backend->balancer, address);
+}
+
+/*
+ * Further servers of a pool are socket addresses or hostnames with more
+ * than one label, so misspelt options are not taken for hostnames
+ */
+static int
+is_pool_address(const char *arg) {
+    struct Address *address = new_address(arg);
+    int result = address != NULL && (address_is_sockaddr(address) ||
+            (address_is_hostname(address) &&
+             strchr(address_hostname(address), '.') != NULL));
+
+    free(address);
+
+    return result;
+}
+
 void
 add_backend(struct Backend_head *backends, struct Backend *backend) {
     STAILQ_INSERT_TAIL(backends, backend, entries);
@@ -95,15 +270,22 @@ add_backend(struct Backend_head *backends, struct Backend *backend) {
 
 int
 init_backend(struct Backend *backend) {
-    if (backend->pattern_re == NULL) {
-        const char *reerr;
-        int reerroffset;
-        backend->pattern_re =
-            pcre_compile(backend->pattern, 0, &reerr, &reerroffset, NULL);
-        if (backend->pattern_re == NULL) {
-            err("Regex compilation of \"%s\" failed: %s, offset %d",
-                    backend->pattern, reerr, reerroffset);
-            return 0;
+    if (backend->pattern_re == NULL && backend->match == BACKEND_PATTERN) {
+        /* Patterns matching hostnames or domains are looked up by name */
+        if (!classify_pattern(backend)) {
+            if (!init_match_state())
+                return 0;
+
+            /* Without a pattern address, groups need not capture, unless
+             * the pattern refers back to them */
+            backend->captures = address_is_pattern(backend->address);
+            if (!backend->captures)
+                backend->pattern_re = compile_pattern(backend->pattern,
+                        PCRE2_NO_AUTO_CAPTURE);
+            if (backend->pattern_re == NULL)
+                backend->pattern_re = compile_pattern(backend->pattern, 0);
+            if (backend->pattern_re == NULL)
+                return 0;
         }
 
         char address[ADDRESS_BUFFER_SIZE];
@@ -116,29 +298,244 @@ init_backend(struct Backend *backend) {
     return 1;
 }
 
+/*
+ * Allocate the match state shared by all patterns, once
+ *
+ * Returns true on success
+ */
+static int
+init_match_state() {
+    if (match_context != NULL)
+        return 1;
+
+    capture_match_data = pcre2_match_data_create(PATTERN_SUBSTRINGS, NULL);
+    match_data = pcre2_match_data_create(1, NULL);
+    match_context = pcre2_match_context_create(NULL);
+    if (capture_match_data == NULL || match_data == NULL ||
+            match_context == NULL) {
+        err("%s: malloc", __func__);
+        pcre2_match_data_free(capture_match_data);
+        pcre2_match_data_free(match_data);
+        pcre2_match_context_free(match_context);
+        capture_match_data = match_data = NULL;
+        match_context = NULL;
+        return 0;
+    }
+
+    /* Without JIT support patterns are interpreted, and no stack needed */
+    jit_stack = pcre2_jit_stack_create(32 * 1024, 512 * 1024, NULL);
+    if (jit_stack != NULL)
+        pcre2_jit_stack_assign(match_context, NULL, jit_stack);
+
+    return 1;
+}
+
+/*
+ * Compile a pattern, then JIT compile it if supported. Letters match either
+ * case, hostnames being looked up in lower case.
+ */
+static pcre2_code *
+compile_pattern(const char *pattern, uint32_t options) {
+    int error;
+    PCRE2_SIZE offset;
+    pcre2_code *re = pcre2_compile((PCRE2_SPTR)pattern, PCRE2_ZERO_TERMINATED,
+            options | PCRE2_CASELESS, &error, &offset, NULL);
+    if (re == NULL) {
+        PCRE2_UCHAR message[256];
+
+        /* Patterns referring to groups are retried allowing captures */
+        if (options & PCRE2_NO_AUTO_CAPTURE)
+            return NULL;
+
+        pcre2_get_error_message(error, message, sizeof(message));
+        err("Regex compilation of \"%s\" failed: %s, offset %zu",
+                pattern, message, (size_t)offset);
+        return NULL;
+    }
+
+    /* Matching falls back to the interpreter */
+    int result = pcre2_jit_compile(re, PCRE2_JIT_COMPLETE);
+    if (result < 0 && result != PCRE2_ERROR_JIT_BADOPTION)
+        debug("JIT compilation of \"%s\" failed: %d", pattern, result);
+
+    return re;
+}
+
+/*
+ * Index the initialized backends of a table
+ *
+ * Returns true on success
+ */
+int
+init_backend_index(struct BackendIndex *index, const struct Backend_head *head) {
+    struct Backend *iter;
+    size_t position = 0;
+    size_t hostnames = 0, patterns = 0, labels = 0;
+
+    free_backend_index(index);
+
+    STAILQ_FOREACH(iter, head, entries) {
+        iter->position = position++;
+        iter->next_hostname = NULL;
+        if (iter->alpn != NULL)
+            index->alpn = 1;
+
+        switch (iter->match) {
+            case BACKEND_PATTERN:
+                patterns++;
+                break;
+            case BACKEND_HOSTNAME:
+                hostnames++;
+                break;
+            case BACKEND_SUBDOMAINS:
+            case BACKEND_DOMAIN:
+                for (size_t i = 0; i < iter->hostname_len; i++)
+                    labels += iter->hostname[i] == '.';
+                labels++;
+                break;
+        }
+    }
+
+    /* Hash tables are at most half full, so probe sequences stay short */
+    if (hostnames > 0) {
+        index->hostnames_size = 16;
+        while (index->hostnames_size < 2 * hostnames)
+            index->hostnames_size *= 2;
+        index->hostnames =
+            calloc(index->hostnames_size, sizeof(struct Backend *));
+    }
+    if (labels > 0) {
+        /* A node for the root and for at most each label */
+        index->domains = calloc(labels + 1, sizeof(struct DomainNode));
+        index->domains_len = 1;
+        index->labels_size = 16;
+        while (index->labels_size < 2 * labels)
+            index->labels_size *= 2;
+        index->labels = calloc(index->labels_size, sizeof(struct DomainLabel));
+    }
+    if (patterns > 0) {
+        index->pattern_set = new_pattern_set();
+        index->pattern_set_backends =
+            malloc(patterns * sizeof(struct Backend *));
+        index->patterns = malloc(patterns * sizeof(struct Backend *));
+    }
+
+    if ((hostnames > 0 && index->hostnames == NULL) ||
+            (labels > 0 && (index->domains == NULL || index->labels == NULL)) ||
+            (patterns > 0 && (index->pattern_set == NULL ||
+                index->pattern_set_backends == NULL ||
+                index->patterns == NULL))) {
+        err("%s: malloc", __func__);
+        free_backend_index(index);
+        return 0;
+    }
+
+    STAILQ_FOREACH(iter, head, entries) {
+        switch (iter->match) {
+            case BACKEND_PATTERN:
+                /* Patterns which failed to compile never match */
+                if (iter->pattern_re == NULL)
+                    break;
+
+                if (iter->alpn == NULL &&
+                        pattern_set_add(index->pattern_set, iter->pattern) >= 0)
+                    index->pattern_set_backends[index->pattern_set_len++] = iter;
+                else
+                    index->patterns[index->patterns_len++] = iter;
+                break;
+            case BACKEND_HOSTNAME:
+                index_hostname(index, iter);
+                break;
+            case BACKEND_SUBDOMAINS:
+            case BACKEND_DOMAIN:
+                index_domain(index, iter);
+                break;
+        }
+    }
+
+    if (index->pattern_set_len == 0) {
+        free_pattern_set(index->pattern_set);
+        index->pattern_set = NULL;
+    }
+
+    return 1;
+}
+
+void
+free_backend_index(struct BackendIndex *index) {
+    free(index->hostnames);
+    free(index->domains);
+    free(index->labels);
+    free_pattern_set(index->pattern_set);
+    free(index->pattern_set_backends);
+    free(index->patterns);
+    memset(index, 0, sizeof(*index));
+}
+
+/*
+ * Find the first backend matching the hostname, and if the backend requires
+ * an ALPN protocol, with that protocol in the client's ALPN protocol list.
+ * hello may be NULL when the request was not TLS.
+ *
+ * Literal hostnames are found with a single probe of the index, domain
+ * patterns by following the labels of the name from the top level domain
+ * and other patterns by a single pass of the automaton over the name, so
+ * regular expressions are only evaluated in turn for those the automaton
+ * does not support preceding the first of those entries to match.
+ */
 struct BackendLookupResult
-lookup_backend(const struct Backend_head *head, const char *name, size_t name_len) {
+lookup_backend(const struct BackendIndex *index, const char *name, size_t name_len,
+        const struct ClientHello *hello) {
     struct BackendLookupResult result;
-    struct Backend *iter;
 
     if (name == NULL) {
         name = "";
         name_len = 0;
     }
 
-    STAILQ_FOREACH(iter, head, entries) {
-        assert(iter->pattern_re != NULL);
+    /* As with PCRE, $ also matches before a final newline */
+    size_t matched_len = name_len;
+    if (name_len > 0 && name[name_len - 1] == '\n')
+        matched_len--;
 
-        if ((result.matches[0] = pcre_exec(iter->pattern_re, NULL,
-                    name, name_len, 0, 0, result.matches + 1, 31)) >= 0) {
+    struct Backend *indexed = lookup_hostname(index, name, name_len, hello);
+    if (matched_len < name_len)
+        indexed = first_backend(indexed,
+                lookup_hostname(index, name, matched_len, hello));
+    indexed = first_backend(indexed,
+            lookup_domain(index, name, matched_len, hello));
 
-            result.backend = iter;
-            return result;
-        }
+    /* One pass of the automaton finds the first of its patterns to match,
+     * unless memory for its states could not be allocated */
+    if (index->pattern_set != NULL) {
+        int id = pattern_set_match(index->pattern_set, name, name_len);
+
+        if (id >= 0)
+            indexed = first_backend(indexed, index->pattern_set_backends[id]);
+        else if (id == PATTERN_SET_ERROR)
+            indexed = first_backend(indexed,
+                    match_patterns(index->pattern_set_backends,
+                        index->pattern_set_len, indexed, name, name_len,
+                        hello, result.matches));
+    }
+
+    result.backend = match_patterns(index->patterns, index->patterns_len,
+            indexed, name, name_len, hello, result.matches);
+    if (result.backend != NULL)
+        return result;
+
+    result.backend = indexed;
+    if (indexed != NULL && !(indexed->match == BACKEND_PATTERN &&
+                indexed->captures &&
+                match_pattern(indexed, name, name_len, result.matches))) {
+        /* The name, as the only substring of the match. Indexed patterns
+         * are not used with pattern addresses, and those the automaton
+         * matched are evaluated again for the offsets of subpatterns. */
+        result.matches[0] = 1;
+        result.matches[1] = 0;
+        result.matches[2] = (int)matched_len;
     }
 
-    result.backend = NULL;
-    
     return result;
 }
 
@@ -154,10 +551,17 @@ int apply_pattern(const char * name, const char * pattern, int * matches, char *
                 src += 2;
 
                 *dst=0;
-                ret = pcre_copy_substring(name, matches + 1, matches[0], stringnumber, dst, length);
-                if (ret < 0) {
+                if (stringnumber >= matches[0]) {
+                    return 0;
+                }
+                int start = matches[1 + 2 * stringnumber];
+                /* Unset substrings are empty */
+                ret = start < 0 ? 0 : matches[2 + 2 * stringnumber] - start;
+                if (ret >= length) {
                     return 0;
                 }
+                if (ret > 0)
+                    memcpy(dst, name + start, ret);
                 dst += ret;
                 length -= ret;
             } else {
@@ -185,15 +589,65 @@ void
 print_backend_config(FILE *file, const struct Backend *backend) {
     char address[ADDRESS_BUFFER_SIZE];
 
-    fprintf(file, "\t%s %s%s\n",
-            backend->pattern,
-            display_address(backend->address, address, sizeof(address)),
+    fprintf(file, "\t%s", backend->pattern);
+
+    if (backend->balancer == NULL) {
+        fprintf(file, " %s",
+                display_address(backend->address, address, sizeof(address)));
+    } else {
+        for (size_t i = 0; i < backend->balancer->len; i++) {
+            const struct BalancerMember *member =
+                &backend->balancer->members[i];
+
+            fprintf(file, " %s", display_address(member->server->address,
+                        address, sizeof(address)));
+            if (member->weight != 1)
+                fprintf(file, " weight=%u", member->weight);
+        }
+    }
+
+    fprintf(file, "%s%s%s",
+            backend->alpn != NULL ? " alpn=" : "",
+            backend->alpn != NULL ? backend->alpn : "",
             backend_config_options(backend));
+
+    if (backend->balancer != NULL &&
+            backend->balancer->algorithm != BALANCE_ROUND_ROBIN)
+        fprintf(file, " balance=%s",
+                balancer_algorithm_name(backend->balancer));
+    if (backend->balancer != NULL && backend->balancer->hash != HASH_CLIENT)
+        fprintf(file, " hash=%s", balancer_hash_name(backend->balancer));
+    if (backend->balancer != NULL &&
+            backend->balancer->retries != BALANCER_RETRIES)
+        fprintf(file, " retries=%u", backend->balancer->retries);
+    if (backend->balancer != NULL &&
+            backend->balancer->connect_timeout != BALANCER_CONNECT_TIMEOUT)
+        fprintf(file, " connect_timeout=%g",
+                backend->balancer->connect_timeout);
+    if (backend->balancer != NULL &&
+            backend->balancer->eject != BALANCER_EJECT)
+        fprintf(file, " eject=%u", backend->balancer->eject);
+    if (backend->balancer != NULL &&
+            backend->balancer->eject_time != BALANCER_EJECT_TIME)
+        fprintf(file, " eject_time=%g", backend->balancer->eject_time);
+    if (backend->balancer != NULL &&
+            backend->balancer->check.type != CHECK_NONE) {
+        const struct HealthCheckConfig *check = &backend->balancer->check;
+
+        fprintf(file, " check=%s check_interval=%g check_rise=%u "
+                "check_fall=%u check_jitter=%u",
+                balancer_check_name(backend->balancer), check->interval,
+                check->rise, check->fall, check->jitter);
+    }
+
+    fprintf(file, "\n");
 }
 
 static const char *
 backend_config_options(const struct Backend *backend) {
-    if (backend->use_proxy_header)
+    if (backend->use_proxy_header == PROXY_PROTOCOL_V2)
+        return " proxy_protocol_v2";
+    else if (backend->use_proxy_header)
         return " proxy_protocol";
     else
         return "";
@@ -212,7 +666,384 @@ free_backend(struct Backend *backend) {
 
     free(backend->pattern);
     free(backend->address);
+    free(backend->alpn);
+    free_balancer(backend->balancer);
+    free(backend->hostname);
     if (backend->pattern_re != NULL)
-        pcre_free(backend->pattern_re);
+        pcre2_code_free(backend->pattern_re);
     free(backend);
 }
+
+/*
+ * Search an ALPN ProtocolNameList for protocol
+ */
+static int
+alpn_list_contains(const uint8_t *list, size_t list_len, const char *protocol) {
+    size_t protocol_len = strlen(protocol);
+    size_t pos = 0;
+
+    while (list != NULL && pos < list_len) {
+        size_t len = list[pos];
+
+        if (len == protocol_len && pos + 1 + len <= list_len &&
+                memcmp(list + pos + 1, protocol, len) == 0)
+            return 1;
+
+        pos += 1 + len;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Domain forms of patterns, which match a domain's subdomains, or the domain
+ * and its subdomains, when followed by the domain and $
+ */
+static const struct {
+    const char *prefix;
+    enum BackendMatch match;
+    int anchored;
+} domain_patterns[] = {
+    { "^.*\\.", BACKEND_SUBDOMAINS, 1 },
+    { ".*\\.", BACKEND_SUBDOMAINS, 0 },
+    { "\\.", BACKEND_SUBDOMAINS, 0 },
+    { "^(.*\\.)?", BACKEND_DOMAIN, 1 },
+    { "^(?:.*\\.)?", BACKEND_DOMAIN, 1 },
+};
+
+/*
+ * Recognize patterns which can be indexed: those matching a single hostname,
+ * and those matching a domain or its subdomains which are not used to build
+ * a pattern address
+ *
+ * Returns true if the backend's hostname and match were set
+ */
+static int
+classify_pattern(struct Backend *backend) {
+    const char *pattern = backend->pattern;
+
+    if (!address_is_pattern(backend->address)) {
+        for (size_t i = 0; i < sizeof(domain_patterns) / sizeof(domain_patterns[0]); i++) {
+            size_t prefix_len = strlen(domain_patterns[i].prefix);
+
+            if (strncmp(pattern, domain_patterns[i].prefix, prefix_len) != 0)
+                continue;
+
+            char *domain = literal_hostname(pattern + prefix_len);
+            if (domain == NULL)
+                return 0;
+
+            /* Labels are matched whole, so none may be empty */
+            if (domain[0] == '\0' || domain[0] == '.' ||
+                    domain[strlen(domain) - 1] == '.' ||
+                    strstr(domain, "..") != NULL) {
+                free(domain);
+                return 0;
+            }
+
+            backend->hostname = domain;
+            backend->hostname_len = strlen(domain);
+            backend->match = domain_patterns[i].match;
+            backend->anchored = domain_patterns[i].anchored;
+
+            return 1;
+        }
+    }
+
+    if (pattern[0] == '^') {
+        backend->hostname = literal_hostname(pattern + 1);
+        if (backend->hostname != NULL) {
+            backend->hostname_len = strlen(backend->hostname);
+            backend->match = BACKEND_HOSTNAME;
+            backend->anchored = 1;
+
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Decode the literal characters of a pattern up to a final $, such as
+ * example\.com$, in lower case as names are looked up, or return NULL if it
+ * contains other elements
+ */
+static char *
+literal_hostname(const char *pattern) {
+    char *hostname = malloc(strlen(pattern) + 1);
+    if (hostname == NULL)
+        return NULL;
+
+    size_t len = 0;
+    for (const char *p = pattern; *p != '\0'; p++) {
+        if (*p == '\\') {
+            /* An escaped symbol is literal, letters and digits are classes
+             * and other escape sequences */
+            p++;
+            if (*p == '\0' || isalnum((unsigned char)*p))
+                break;
+
+            hostname[len++] = (char)tolower((unsigned char)*p);
+        } else if (*p == '$' && p[1] == '\0') {
+            hostname[len] = '\0';
+            return hostname;
+        } else if (strchr("^$.[]|()?*+{}", *p) != NULL || *p == '\n') {
+            break;
+        } else {
+            hostname[len++] = (char)tolower((unsigned char)*p);
+        }
+    }
+
+    free(hostname);
+
+    return NULL;
+}
+
+/* FNV-1a */
+static uint32_t
+hash_hostname(const char *name, size_t len) {
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+
+    return hash;
+}
+
+static int
+backend_accepts_alpn(const struct Backend *backend,
+        const struct ClientHello *hello) {
+    return backend->alpn == NULL || (hello != NULL &&
+            alpn_list_contains(hello->alpn, hello->alpn_len, backend->alpn));
+}
+
+/*
+ * The earlier in the table of two backends, either of which may be NULL
+ */
+static struct Backend *
+first_backend(struct Backend *a, struct Backend *b) {
+    if (a == NULL || (b != NULL && b->position < a->position))
+        return b;
+
+    return a;
+}
+
+/*
+ * Append a backend to a list of entries in table order, linked by
+ * next_hostname
+ */
+static void
+append_backend(struct Backend **list, struct Backend *backend) {
+    while (*list != NULL)
+        list = &(*list)->next_hostname;
+    *list = backend;
+}
+
+static void
+index_hostname(struct BackendIndex *index, struct Backend *backend) {
+    size_t mask = index->hostnames_size - 1;
+    size_t i = hash_hostname(backend->hostname, backend->hostname_len) & mask;
+
+    while (index->hostnames[i] != NULL &&
+            (index->hostnames[i]->hostname_len != backend->hostname_len ||
+            memcmp(index->hostnames[i]->hostname, backend->hostname,
+                backend->hostname_len) != 0))
+        i = (i + 1) & mask;
+
+    /* Entries for the same hostname are chained in table order */
+    append_backend(&index->hostnames[i], backend);
+}
+
+/*
+ * Find the first entry for a literal hostname accepting the client's ALPN
+ * protocols
+ */
+static struct Backend *
+lookup_hostname(const struct BackendIndex *index, const char *name,
+        size_t name_len, const struct ClientHello *hello) {
+    if (index->hostnames_size == 0)
+        return NULL;
+
+    size_t mask = index->hostnames_size - 1;
+    for (size_t i = hash_hostname(name, name_len) & mask;
+            index->hostnames[i] != NULL; i = (i + 1) & mask) {
+        struct Backend *iter = index->hostnames[i];
+
+        if (iter->hostname_len != name_len ||
+                memcmp(iter->hostname, name, name_len) != 0)
+            continue;
+
+        for (; iter != NULL; iter = iter->next_hostname)
+            if (backend_accepts_alpn(iter, hello))
+                return iter;
+
+        return NULL;
+    }
+
+    return NULL;
+}
+
+/*
+ * Slot of the edge labelled label from a node of the domain trie, either
+ * the edge or the empty slot where it would be added
+ */
+static struct DomainLabel *
+domain_label(const struct BackendIndex *index, size_t parent,
+        const char *label, size_t label_len) {
+    size_t mask = index->labels_size - 1;
+    size_t i = (hash_hostname(label, label_len) ^ parent * 2654435761u) & mask;
+
+    while (index->labels[i].child != 0 &&
+            (index->labels[i].parent != parent ||
+            index->labels[i].label_len != label_len ||
+            memcmp(index->labels[i].label, label, label_len) != 0))
+        i = (i + 1) & mask;
+
+    return &index->labels[i];
+}
+
+/*
+ * Add a domain pattern to the trie of domains, keyed by their labels from the
+ * top level domain down, the node for each label found by hashing the label
+ * with its parent node
+ */
+static void
+index_domain(struct BackendIndex *index, struct Backend *backend) {
+    size_t node = 0;
+    size_t end = backend->hostname_len;
+
+    for (;;) {
+        size_t start = end;
+        while (start > 0 && backend->hostname[start - 1] != '.')
+            start--;
+
+        struct DomainLabel *edge = domain_label(index, node,
+                backend->hostname + start, end - start);
+        if (edge->child == 0) {
+            edge->parent = node;
+            edge->label = backend->hostname + start;
+            edge->label_len = end - start;
+            edge->child = index->domains_len++;
+        }
+        node = edge->child;
+
+        if (start == 0)
+            break;
+        end = start - 1;
+    }
+
+    if (backend->match == BACKEND_SUBDOMAINS)
+        append_backend(&index->domains[node].subdomains, backend);
+    else
+        append_backend(&index->domains[node].domain, backend);
+}
+
+/*
+ * The first entry in a list of domain pattern entries matching, which
+ * precedes best
+ */
+static struct Backend *
+first_domain_backend(struct Backend *best, struct Backend *list,
+        const struct ClientHello *hello, int newline) {
+    for (struct Backend *iter = list; iter != NULL &&
+            (best == NULL || iter->position < best->position);
+            iter = iter->next_hostname)
+        /* .* does not match a newline, which may instead precede an
+         * unanchored match */
+        if (backend_accepts_alpn(iter, hello) && !(newline && iter->anchored))
+            return iter;
+
+    return best;
+}
+
+/*
+ * Find the first domain pattern entry matching the name, from the entries
+ * at each node along the path of its labels in the trie, so in time
+ * proportional to the number of labels of the name
+ */
+static struct Backend *
+lookup_domain(const struct BackendIndex *index, const char *name,
+        size_t name_len, const struct ClientHello *hello) {
+    struct Backend *best = NULL;
+    size_t node = 0;
+    size_t end = name_len;
+
+    if (index->labels_size == 0)
+        return NULL;
+
+    int newline = memchr(name, '\n', name_len) != NULL;
+
+    for (;;) {
+        size_t start = end;
+        while (start > 0 && name[start - 1] != '.')
+            start--;
+
+        node = domain_label(index, node, name + start, end - start)->child;
+        if (node == 0)
+            break;
+
+        /* Subdomains have further labels, which may be empty */
+        if (start > 0)
+            best = first_domain_backend(best, index->domains[node].subdomains,
+                    hello, newline);
+        best = first_domain_backend(best, index->domains[node].domain,
+                hello, newline);
+
+        if (start == 0)
+            break;
+        end = start - 1;
+    }
+
+    return best;
+}
+
+/*
+ * The first of the patterns preceding bound, or any if bound is NULL, to
+ * match the name, evaluating each in turn
+ */
+static struct Backend *
+match_patterns(struct Backend **patterns, size_t len,
+        const struct Backend *bound, const char *name, size_t name_len,
+        const struct ClientHello *hello, int *matches) {
+    for (size_t i = 0; i < len; i++) {
+        struct Backend *iter = patterns[i];
+
+        if (bound != NULL && iter->position > bound->position)
+            break;
+
+        if (backend_accepts_alpn(iter, hello) &&
+                match_pattern(iter, name, name_len, matches))
+            return iter;
+    }
+
+    return NULL;
+}
+
+/*
+ * Match the name against a backend's regular expression, storing the
+ * number of substrings and their offsets, -1 if unset, in matches
+ */
+static int
+match_pattern(const struct Backend *backend, const char *name,
+        size_t name_len, int *matches) {
+    pcre2_match_data *data = backend->captures ?
+        capture_match_data : match_data;
+    int rc = pcre2_match(backend->pattern_re, (PCRE2_SPTR)name, name_len,
+            0, 0, data, match_context);
+    if (rc < 0)
+        return 0;
+
+    const PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(data);
+
+    /* Substrings which did not fit are not available */
+    if (rc == 0)
+        rc = (int)pcre2_get_ovector_count(data);
+
+    matches[0] = rc;
+    for (int i = 0; i < 2 * rc; i++)
+        matches[1 + i] = ovector[i] == PCRE2_UNSET ? -1 : (int)ovector[i];
+
+    return 1;
+}
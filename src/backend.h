@@ -27,22 +27,82 @@
 #ifndef BACKEND_H
 #define BACKEND_H
 
+#include <stdint.h>
 #include <sys/queue.h>
-#include <pcre.h>
+#define PCRE2_CODE_UNIT_WIDTH 8
+#include <pcre2.h>
 #include "address.h"
+#include "balancer.h"
+#include "pattern_set.h"
+#include "protocol.h"
+
+/* PROXY protocol versions, for use_proxy_header */
+#define PROXY_PROTOCOL_V1 1
+#define PROXY_PROTOCOL_V2 2
 
 STAILQ_HEAD(Backend_head, Backend);
 
 struct Backend {
     char *pattern;
-    struct Address *address;
-    int use_proxy_header;
+    struct Address *address;   /* the first server of a pool */
+    struct Balancer *balancer;  /* NULL unless a pool of servers */
+    int use_proxy_header;       /* PROXY protocol version, 0 for none */
+    char *alpn;                 /* required ALPN protocol, NULL for any */
 
     /* Runtime fields */
-    pcre *pattern_re;
+    enum BackendMatch {
+        BACKEND_PATTERN,        /* regular expression */
+        BACKEND_HOSTNAME,       /* the hostname */
+        BACKEND_SUBDOMAINS,     /* names ending in a dot and the hostname */
+        BACKEND_DOMAIN,         /* the hostname and its subdomains */
+    } match;
+    pcre2_code *pattern_re;     /* only for BACKEND_PATTERN */
+    int captures;               /* the address uses the pattern's groups */
+    char *hostname;             /* hostname or domain of other matches */
+    size_t hostname_len;
+    int anchored;               /* pattern begins with ^ */
+    size_t position;            /* order in the table */
+    struct Backend *next_hostname;  /* later entry for the same name */
     STAILQ_ENTRY(Backend) entries;
 };
 
+/*
+ * Node of the trie of domain patterns, with the entries matching the
+ * domain's subdomains or the domain itself
+ */
+struct DomainNode {
+    struct Backend *subdomains, *domain;
+};
+
+/* Edge of the trie from the node for a domain to that of a subdomain */
+struct DomainLabel {
+    size_t parent, child;       /* child is 0 for empty slots */
+    const char *label;
+    size_t label_len;
+};
+
+/*
+ * Index of a table's backends: entries with literal hostname patterns in an
+ * open addressing hash table, domain patterns in a trie over their labels
+ * from the top level domain down, the remaining patterns in a single
+ * automaton and those it does not support, or which require an ALPN
+ * protocol, in table order
+ */
+struct BackendIndex {
+    struct Backend **hostnames;
+    size_t hostnames_size;      /* power of two, or 0 if none */
+    struct DomainNode *domains; /* the root node first */
+    size_t domains_len;
+    struct DomainLabel *labels; /* open addressing hash table of edges */
+    size_t labels_size;         /* power of two, or 0 if none */
+    struct PatternSet *pattern_set;
+    struct Backend **pattern_set_backends;  /* by index in pattern_set */
+    size_t pattern_set_len;
+    struct Backend **patterns;
+    size_t patterns_len;
+    int alpn;                   /* some entries require an ALPN protocol */
+};
+
 struct BackendLookupResult {
     struct Backend * backend;
     int matches[32];
@@ -50,7 +110,10 @@ struct BackendLookupResult {
 
 void add_backend(struct Backend_head *, struct Backend *);
 int init_backend(struct Backend *);
-struct BackendLookupResult lookup_backend(const struct Backend_head *, const char *, size_t);
+int init_backend_index(struct BackendIndex *, const struct Backend_head *);
+void free_backend_index(struct BackendIndex *);
+struct BackendLookupResult lookup_backend(const struct BackendIndex *,
+        const char *, size_t, const struct ClientHello *);
 void print_backend_config(FILE *, const struct Backend *);
 void remove_backend(struct Backend_head *, struct Backend *);
 struct Backend *new_backend();
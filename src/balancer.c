@@ -0,0 +1,863 @@
+/*
+ * Copyright (c) 2011 and 2012, Dustin Lundquist <dustin@null-ptr.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h> /* strcasecmp() */
+#include <stdint.h>
+#include <netinet/in.h>
+#include <assert.h>
+#include "balancer.h"
+#include "address.h"
+#include "logger.h"
+
+
+static const char *const algorithm_names[] = {
+    [BALANCE_ROUND_ROBIN] = "roundrobin",
+    [BALANCE_LEAST_CONNECTIONS] = "leastconn",
+    [BALANCE_RANDOM] = "random",
+    [BALANCE_SOURCE] = "source",
+    [BALANCE_MAGLEV] = "maglev",
+    [BALANCE_LATENCY] = "latency",
+};
+
+static const char *const hash_names[] = {
+    [HASH_CLIENT] = "client",
+    [HASH_NETWORK] = "network",
+    [HASH_SNI] = "sni",
+};
+
+static const char *const check_names[] = {
+    [CHECK_NONE] = "none",
+    [CHECK_TCP] = "tcp",
+    [CHECK_TLS] = "tls",
+};
+
+/* Incremented as any server's health changes */
+static unsigned long health_generation = 0;
+
+
+static struct BackendServer *new_backend_server(struct Address *);
+static int less_loaded(const struct BalancerMember *,
+        const struct BalancerMember *);
+static int faster(const struct BalancerMember *,
+        const struct BalancerMember *);
+static int usable(const struct BalancerMember *, int);
+static int none_usable(const struct Balancer *);
+static struct BalancerMember *select_round_robin(struct Balancer *, int);
+static struct BalancerMember *select_least_connections(struct Balancer *,
+        int);
+static struct BalancerMember *select_random(struct Balancer *, int,
+        int (*)(const struct BalancerMember *,
+            const struct BalancerMember *));
+static struct BalancerMember *weighted_member(struct Balancer *,
+        unsigned long, const struct BalancerMember *, int);
+static unsigned long total_weight(const struct Balancer *, int);
+static struct ServerMapSlot *server_map_slot(const struct ServerMap *,
+        const struct Address *);
+static int parse_check_count(const char *, unsigned int, unsigned int,
+        unsigned int *);
+static int parse_seconds(const char *, double *);
+static uint64_t hash_key(const struct Balancer *, const struct sockaddr *,
+        const char *, size_t);
+static uint64_t hash_bytes(uint64_t, const void *, size_t);
+static int build_maglev_table(struct Balancer *, int);
+
+
+struct Balancer *
+new_balancer() {
+    struct Balancer *balancer = calloc(1, sizeof(struct Balancer));
+    if (balancer == NULL) {
+        err("malloc");
+        return NULL;
+    }
+
+    balancer->check.type = CHECK_NONE;
+    balancer->check.interval = HEALTH_CHECK_INTERVAL;
+    balancer->check.rise = HEALTH_CHECK_RISE;
+    balancer->check.fall = HEALTH_CHECK_FALL;
+    balancer->check.jitter = HEALTH_CHECK_JITTER;
+    balancer->retries = BALANCER_RETRIES;
+    balancer->connect_timeout = BALANCER_CONNECT_TIMEOUT;
+    balancer->eject = BALANCER_EJECT;
+    balancer->eject_time = BALANCER_EJECT_TIME;
+    balancer->reference_count = 1;
+
+    return balancer;
+}
+
+/*
+ * Add a server with the default weight, taking ownership of the address
+ *
+ * Returns true on success
+ */
+int
+balancer_add_server(struct Balancer *balancer, struct Address *address) {
+    struct BalancerMember *members = realloc(balancer->members,
+            (balancer->len + 1) * sizeof(struct BalancerMember));
+    if (members == NULL) {
+        err("%s: realloc", __func__);
+        free(address);
+        return 0;
+    }
+    balancer->members = members;
+
+    struct BackendServer *server = new_backend_server(address);
+    if (server == NULL)
+        return 0;
+    server->balancer = balancer;
+
+    members[balancer->len++] = (struct BalancerMember){
+        .server = server,
+        .weight = 1,
+    };
+    balancer_rebuild(balancer);
+
+    return 1;
+}
+
+/*
+ * Set the weight of the last server added
+ *
+ * Returns true on success
+ */
+int
+balancer_set_weight(struct Balancer *balancer, const char *weight) {
+    char *end;
+    unsigned long value = strtoul(weight, &end, 10);
+
+    if (balancer->len == 0 || *weight == '\0' || *end != '\0' ||
+            value < 1 || value > BALANCER_WEIGHT_MAX)
+        return 0;
+
+    balancer->members[balancer->len - 1].weight = (unsigned int)value;
+    balancer_rebuild(balancer);
+
+    return 1;
+}
+
+/*
+ * Returns true if name is a load balancing algorithm
+ */
+int
+balancer_set_algorithm(struct Balancer *balancer, const char *name) {
+    for (size_t i = 0;
+            i < sizeof(algorithm_names) / sizeof(algorithm_names[0]); i++) {
+        if (strcasecmp(name, algorithm_names[i]) == 0) {
+            balancer->algorithm = (enum BalanceAlgorithm)i;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Returns true if name is a key to hash for the source and maglev
+ * algorithms
+ */
+int
+balancer_set_hash(struct Balancer *balancer, const char *name) {
+    for (size_t i = 0; i < sizeof(hash_names) / sizeof(hash_names[0]); i++) {
+        if (strcasecmp(name, hash_names[i]) == 0) {
+            balancer->hash = (enum BalanceHash)i;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Set a health check option of the pool's servers from check=tcp|tls|none,
+ * check_interval=SECONDS, check_rise=N, check_fall=N or check_jitter=PERCENT
+ *
+ * Returns true if arg is a valid option
+ */
+int
+balancer_set_check(struct Balancer *balancer, const char *arg) {
+    struct HealthCheckConfig *check = &balancer->check;
+
+    if (strncasecmp(arg, "check=", 6) == 0) {
+        for (size_t i = 0;
+                i < sizeof(check_names) / sizeof(check_names[0]); i++) {
+            if (strcasecmp(arg + 6, check_names[i]) == 0) {
+                check->type = (enum HealthCheckType)i;
+                return 1;
+            }
+        }
+    } else if (strncasecmp(arg, "check_interval=", 15) == 0) {
+        return parse_seconds(arg + 15, &check->interval);
+    } else if (strncasecmp(arg, "check_rise=", 11) == 0) {
+        return parse_check_count(arg + 11, 1, 100, &check->rise);
+    } else if (strncasecmp(arg, "check_fall=", 11) == 0) {
+        return parse_check_count(arg + 11, 1, 100, &check->fall);
+    } else if (strncasecmp(arg, "check_jitter=", 13) == 0) {
+        return parse_check_count(arg + 13, 0, 50, &check->jitter);
+    }
+
+    return 0;
+}
+
+/*
+ * Set how failed connections are handled from retries=N,
+ * connect_timeout=SECONDS, eject=N or eject_time=SECONDS
+ *
+ * Returns true if arg is a valid option
+ */
+int
+balancer_set_retry(struct Balancer *balancer, const char *arg) {
+    if (strncasecmp(arg, "retries=", 8) == 0)
+        return parse_check_count(arg + 8, 0, 100, &balancer->retries);
+    else if (strncasecmp(arg, "connect_timeout=", 16) == 0)
+        return parse_seconds(arg + 16, &balancer->connect_timeout);
+    else if (strncasecmp(arg, "eject=", 6) == 0)
+        return parse_check_count(arg + 6, 0, 100, &balancer->eject);
+    else if (strncasecmp(arg, "eject_time=", 11) == 0)
+        return parse_seconds(arg + 11, &balancer->eject_time);
+
+    return 0;
+}
+
+const char *
+balancer_check_name(const struct Balancer *balancer) {
+    return check_names[balancer->check.type];
+}
+
+const char *
+balancer_algorithm_name(const struct Balancer *balancer) {
+    return algorithm_names[balancer->algorithm];
+}
+
+const char *
+balancer_hash_name(const struct Balancer *balancer) {
+    return hash_names[balancer->hash];
+}
+
+/*
+ * Choose the server for a new connection from client for the requested
+ * name, either of which may be NULL. Servers failing health checks or
+ * ejected after failed connections are skipped, unless every server is,
+ * when all are tried.
+ */
+struct BackendServer *
+balancer_select(struct Balancer *balancer, const struct sockaddr *client,
+        const char *name, size_t name_len) {
+    struct BalancerMember *member = NULL;
+
+    if (balancer->len == 0)
+        return NULL;
+
+    int all = none_usable(balancer);
+
+    switch (balancer->algorithm) {
+        case BALANCE_ROUND_ROBIN:
+            member = select_round_robin(balancer, all);
+            break;
+        case BALANCE_LEAST_CONNECTIONS:
+            member = select_least_connections(balancer, all);
+            break;
+        case BALANCE_RANDOM:
+            member = select_random(balancer, all, less_loaded);
+            break;
+        case BALANCE_LATENCY:
+            member = select_random(balancer, all, faster);
+            break;
+        case BALANCE_SOURCE:
+            member = weighted_member(balancer,
+                    hash_key(balancer, client, name, name_len) %
+                        total_weight(balancer, all),
+                    NULL, all);
+            break;
+        case BALANCE_MAGLEV:
+            if (balancer->maglev != NULL &&
+                    balancer->maglev_health != health_generation)
+                balancer_rebuild(balancer);
+            /* Without memory for the table keys are not kept to servers */
+            if (balancer->maglev == NULL &&
+                    !build_maglev_table(balancer, all)) {
+                member = select_round_robin(balancer, all);
+                break;
+            }
+            member = &balancer->members[balancer->maglev[
+                hash_key(balancer, client, name, name_len) %
+                    MAGLEV_TABLE_SIZE]];
+            break;
+    }
+
+    return member->server;
+}
+
+/*
+ * Choose the server to try when a connection to the failed server, chosen
+ * from the pool, could not be made: the next usable server of the pool, or
+ * the next server if none is
+ *
+ * Returns NULL if the server is alone or not in the pool
+ */
+struct BackendServer *
+balancer_retry(const struct Balancer *balancer,
+        const struct BackendServer *failed) {
+    size_t i;
+
+    if (balancer->len < 2)
+        return NULL;
+
+    for (i = 0; i < balancer->len; i++)
+        if (balancer->members[i].server == failed)
+            break;
+    if (i == balancer->len)
+        return NULL;
+
+    int all = none_usable(balancer);
+    for (size_t j = 1; j < balancer->len; j++) {
+        const struct BalancerMember *member =
+            &balancer->members[(i + j) % balancer->len];
+
+        if (usable(member, all))
+            return member->server;
+    }
+
+    return balancer->members[(i + 1) % balancer->len].server;
+}
+
+/*
+ * Size a map for up to len servers
+ *
+ * Returns true on success
+ */
+int
+init_server_map(struct ServerMap *map, size_t len) {
+    /* At most half full */
+    map->size = 8;
+    while (map->size < len * 2)
+        map->size *= 2;
+
+    map->slots = calloc(map->size, sizeof(struct ServerMapSlot));
+    if (map->slots == NULL) {
+        err("%s: calloc", __func__);
+        map->size = 0;
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Add the servers of a pool. Servers of several pools with the same address
+ * are all kept, to be adopted in the order they were added.
+ */
+void
+server_map_add(struct ServerMap *map, const struct Balancer *balancer) {
+    for (size_t i = 0; i < balancer->len; i++) {
+        struct BackendServer *server = balancer->members[i].server;
+        size_t j = address_hash(server->address) & (map->size - 1);
+
+        while (map->slots[j].server != NULL)
+            j = (j + 1) & (map->size - 1);
+        map->slots[j].server = server;
+    }
+}
+
+void
+free_server_map(struct ServerMap *map) {
+    free(map->slots);
+    map->slots = NULL;
+    map->size = 0;
+}
+
+/*
+ * Use the servers of the previous configuration's pools for those with the
+ * same address, keeping their connection counts. A server is adopted by one
+ * pool only, so it keeps to the settings of a single pool and a failed
+ * connection is retried within it; other pools with the address get new
+ * servers.
+ */
+void
+balancer_adopt_servers(struct Balancer *balancer,
+        struct ServerMap *previous) {
+    for (size_t i = 0; i < balancer->len; i++) {
+        struct BalancerMember *member = &balancer->members[i];
+        struct ServerMapSlot *slot =
+            server_map_slot(previous, member->server->address);
+        struct BackendServer *server = slot->server;
+
+        if (server != NULL && server != member->server) {
+            slot->adopted = 1;
+            backend_server_ref_put(member->server);
+            member->server = server;
+            server->reference_count++;
+            server->balancer = balancer;
+        }
+    }
+}
+
+/*
+ * Discard the Maglev lookup table after the servers change, it is built
+ * again when next used
+ */
+void
+balancer_rebuild(struct Balancer *balancer) {
+    free(balancer->maglev);
+    balancer->maglev = NULL;
+}
+
+/*
+ * Note a server passing or failing its health checks, or being ejected or
+ * readmitted, for Maglev tables to be built again with the usable servers
+ */
+void
+balancer_health_changed() {
+    health_generation++;
+}
+
+/*
+ * Release the pool of a backend. Its servers no longer belong to it, though
+ * connections may hold it to retry failed connections within it.
+ */
+void
+free_balancer(struct Balancer *balancer) {
+    if (balancer == NULL)
+        return;
+
+    for (size_t i = 0; i < balancer->len; i++) {
+        struct BackendServer *server = balancer->members[i].server;
+
+        if (server->balancer == balancer)
+            server->balancer = NULL;
+    }
+    balancer_ref_put(balancer);
+}
+
+void
+balancer_ref_put(struct Balancer *balancer) {
+    if (balancer == NULL)
+        return;
+
+    assert(balancer->reference_count > 0);
+    balancer->reference_count--;
+    if (balancer->reference_count == 0) {
+        for (size_t i = 0; i < balancer->len; i++)
+            backend_server_ref_put(balancer->members[i].server);
+        free(balancer->members);
+        free(balancer->maglev);
+        free(balancer);
+    }
+}
+
+struct Balancer *
+balancer_ref_get(struct Balancer *balancer) {
+    balancer->reference_count++;
+    return balancer;
+}
+
+/*
+ * Count a connection to the server, holding a reference until it is
+ * released
+ */
+struct BackendServer *
+backend_server_acquire(struct BackendServer *server) {
+    server->connections++;
+    server->reference_count++;
+
+    return server;
+}
+
+void
+backend_server_release(struct BackendServer *server) {
+    if (server == NULL)
+        return;
+
+    assert(server->connections > 0);
+    server->connections--;
+    backend_server_ref_put(server);
+}
+
+/*
+ * Note the seconds a connection to the server took to be made, in the
+ * exponentially weighted moving average of its connect time
+ */
+void
+backend_server_connected(struct BackendServer *server, double seconds) {
+    if (!server->connect_measured)
+        server->connect_time = seconds;
+    else
+        server->connect_time += (seconds - server->connect_time) *
+            CONNECT_TIME_WEIGHT;
+    server->connect_measured = 1;
+}
+
+/*
+ * A connection to the server failed or timed out: count it as taking the
+ * whole connect timeout of its pool, so failing servers are not preferred
+ */
+void
+backend_server_connect_failed(struct BackendServer *server) {
+    double seconds = server->balancer != NULL ?
+            server->balancer->connect_timeout : BALANCER_CONNECT_TIMEOUT;
+
+    backend_server_connected(server, seconds);
+}
+
+void
+backend_server_ref_put(struct BackendServer *server) {
+    assert(server->reference_count > 0);
+    server->reference_count--;
+    if (server->reference_count == 0) {
+        free(server->address);
+        free(server);
+    }
+}
+
+struct BackendServer *
+backend_server_ref_get(struct BackendServer *server) {
+    server->reference_count++;
+    return server;
+}
+
+static struct BackendServer *
+new_backend_server(struct Address *address) {
+    struct BackendServer *server = malloc(sizeof(struct BackendServer));
+    if (server == NULL) {
+        err("malloc");
+        free(address);
+        return NULL;
+    }
+
+    server->address = address;
+    server->connections = 0;
+    server->balancer = NULL;
+    server->healthy = 1;
+    server->check = NULL;
+    server->connect_failures = 0;
+    server->ejected = 0;
+    server->connect_time = 0.0;
+    server->connect_measured = 0;
+    server->reference_count = 1;
+
+    return server;
+}
+
+/*
+ * Returns true if a has fewer connections than b for its weight, counting
+ * the connection to be made so heavier servers are preferred when idle
+ */
+static int
+less_loaded(const struct BalancerMember *a, const struct BalancerMember *b) {
+    return (unsigned long)(a->server->connections + 1) * b->weight <
+        (unsigned long)(b->server->connections + 1) * a->weight;
+}
+
+/*
+ * Member a has the lower connect time for its connections and weight, a
+ * server yet to be measured being the fastest, otherwise it is less loaded
+ */
+static int
+faster(const struct BalancerMember *a, const struct BalancerMember *b) {
+    double cost_a = a->server->connect_time *
+        (a->server->connections + 1) * b->weight;
+    double cost_b = b->server->connect_time *
+        (b->server->connections + 1) * a->weight;
+
+    if (a->server->connect_measured != b->server->connect_measured)
+        return !a->server->connect_measured;
+
+    if (cost_a == cost_b)
+        return less_loaded(a, b);
+
+    return cost_a < cost_b;
+}
+
+/*
+ * The slot of the first server with the address not yet adopted, or an
+ * empty slot if there is none
+ */
+static struct ServerMapSlot *
+server_map_slot(const struct ServerMap *map, const struct Address *address) {
+    size_t i = address_hash(address) & (map->size - 1);
+
+    while (map->slots[i].server != NULL && (map->slots[i].adopted ||
+                address_compare(map->slots[i].server->address,
+                    address) != 0))
+        i = (i + 1) & (map->size - 1);
+
+    return &map->slots[i];
+}
+
+/*
+ * The member may be chosen, being healthy and not ejected, all members may
+ * be if all is set
+ */
+static int
+usable(const struct BalancerMember *member, int all) {
+    return all || (member->server->healthy && !member->server->ejected);
+}
+
+static int
+none_usable(const struct Balancer *balancer) {
+    for (size_t i = 0; i < balancer->len; i++)
+        if (usable(&balancer->members[i], 0))
+            return 0;
+
+    return 1;
+}
+
+/*
+ * Smooth weighted round robin: each server gains its weight, and the
+ * server chosen loses the total, interleaving servers of unequal weight
+ */
+static struct BalancerMember *
+select_round_robin(struct Balancer *balancer, int all) {
+    struct BalancerMember *best = NULL;
+    int total = 0;
+
+    for (size_t i = 0; i < balancer->len; i++) {
+        struct BalancerMember *member = &balancer->members[i];
+
+        if (!usable(member, all))
+            continue;
+
+        member->current_weight += (int)member->weight;
+        total += (int)member->weight;
+        if (best == NULL || member->current_weight > best->current_weight)
+            best = member;
+    }
+    best->current_weight -= total;
+
+    return best;
+}
+
+/* Ties go to each server in turn */
+static struct BalancerMember *
+select_least_connections(struct Balancer *balancer, int all) {
+    struct BalancerMember *best = NULL;
+
+    for (size_t i = 0; i < balancer->len; i++) {
+        struct BalancerMember *member =
+            &balancer->members[(balancer->next + i) % balancer->len];
+
+        if (!usable(member, all))
+            continue;
+
+        if (best == NULL || less_loaded(member, best))
+            best = member;
+    }
+    balancer->next = (balancer->next + 1) % balancer->len;
+
+    return best;
+}
+
+/*
+ * The better of two different servers chosen in proportion to their
+ * weights
+ */
+static struct BalancerMember *
+select_random(struct Balancer *balancer, int all,
+        int (*better)(const struct BalancerMember *,
+            const struct BalancerMember *)) {
+    unsigned long total = total_weight(balancer, all);
+    struct BalancerMember *a =
+        weighted_member(balancer, (unsigned long)random() % total, NULL, all);
+
+    /* The only server */
+    if (total == a->weight)
+        return a;
+
+    struct BalancerMember *b = weighted_member(balancer,
+            (unsigned long)random() % (total - a->weight), a, all);
+
+    return better(b, a) ? b : a;
+}
+
+/*
+ * The usable member in whose share of the total weight, less that of the
+ * excluded member if not NULL, point falls
+ */
+static struct BalancerMember *
+weighted_member(struct Balancer *balancer, unsigned long point,
+        const struct BalancerMember *exclude, int all) {
+    for (size_t i = 0; i < balancer->len; i++) {
+        if (&balancer->members[i] == exclude ||
+                !usable(&balancer->members[i], all))
+            continue;
+        if (point < balancer->members[i].weight)
+            return &balancer->members[i];
+        point -= balancer->members[i].weight;
+    }
+
+    assert(0);
+    return &balancer->members[0];
+}
+
+static unsigned long
+total_weight(const struct Balancer *balancer, int all) {
+    unsigned long total = 0;
+
+    for (size_t i = 0; i < balancer->len; i++)
+        if (usable(&balancer->members[i], all))
+            total += balancer->members[i].weight;
+
+    return total;
+}
+
+/*
+ * Hash of the client's IP address, without the port, its network, or the
+ * requested name
+ */
+static uint64_t
+hash_key(const struct Balancer *balancer, const struct sockaddr *client,
+        const char *name, size_t name_len) {
+    const void *bytes = NULL;
+    size_t len = 0;
+
+    if (balancer->hash == HASH_SNI) {
+        bytes = name;
+        len = name != NULL ? name_len : 0;
+    } else if (client != NULL && client->sa_family == AF_INET) {
+        bytes = &((const struct sockaddr_in *)client)->sin_addr;
+        len = balancer->hash == HASH_NETWORK ? 3 : sizeof(struct in_addr);
+    } else if (client != NULL && client->sa_family == AF_INET6) {
+        bytes = &((const struct sockaddr_in6 *)client)->sin6_addr;
+        len = balancer->hash == HASH_NETWORK ? 6 : sizeof(struct in6_addr);
+    }
+
+    return hash_bytes(14695981039346656037u, bytes, len);
+}
+
+static int
+parse_check_count(const char *str, unsigned int min, unsigned int max,
+        unsigned int *count) {
+    char *end;
+    unsigned long value = strtoul(str, &end, 10);
+
+    if (*str == '\0' || *end != '\0' || value < min || value > max)
+        return 0;
+
+    *count = (unsigned int)value;
+    return 1;
+}
+
+static int
+parse_seconds(const char *str, double *seconds) {
+    char *end;
+    double value = strtod(str, &end);
+
+    if (*str == '\0' || *end != '\0' || !(value >= 0.01 && value <= 3600.0))
+        return 0;
+
+    *seconds = value;
+    return 1;
+}
+
+/* 64 bit FNV-1a continuing from hash, with a final mix of the bits */
+static uint64_t
+hash_bytes(uint64_t hash, const void *bytes, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ ((const uint8_t *)bytes)[i]) * 1099511628211u;
+
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdu;
+    hash ^= hash >> 33;
+
+    return hash;
+}
+
+/*
+ * Build the Maglev lookup table: each server has its own permutation of
+ * the table's entries from hashes of its address, and in turn claims the
+ * next free entry of its permutation, once for each unit of its weight.
+ * As a server's permutation does not depend on the other servers, adding or
+ * removing a server, or its failing health checks, moves few keys between
+ * the others.
+ *
+ * Returns true on success
+ */
+static int
+build_maglev_table(struct Balancer *balancer, int all) {
+    size_t size = MAGLEV_TABLE_SIZE;
+
+    if (balancer->len > UINT16_MAX) {
+        warn("%s: too many servers", __func__);
+        return 0;
+    }
+
+    uint16_t *table = malloc(size * sizeof(uint16_t));
+    size_t *permutation = malloc(3 * balancer->len * sizeof(size_t));
+    if (table == NULL || permutation == NULL) {
+        err("%s: malloc", __func__);
+        free(table);
+        free(permutation);
+        return 0;
+    }
+
+    /* Offset, skip and position in the permutation of each server */
+    size_t *offset = permutation;
+    size_t *skip = permutation + balancer->len;
+    size_t *next = permutation + 2 * balancer->len;
+    for (size_t i = 0; i < balancer->len; i++) {
+        char address[ADDRESS_BUFFER_SIZE];
+
+        display_address(balancer->members[i].server->address,
+                address, sizeof(address));
+        uint64_t hash = hash_bytes(14695981039346656037u,
+                address, strlen(address));
+
+        offset[i] = hash % size;
+        skip[i] = hash_bytes(hash, address, strlen(address)) % (size - 1) + 1;
+        next[i] = 0;
+    }
+
+    for (size_t i = 0; i < size; i++)
+        table[i] = UINT16_MAX;
+
+    /* Every permutation visits each entry as the size is prime */
+    size_t filled = 0;
+    while (filled < size) {
+        for (size_t i = 0; i < balancer->len && filled < size; i++) {
+            if (!usable(&balancer->members[i], all))
+                continue;
+
+            for (unsigned int j = 0; j < balancer->members[i].weight &&
+                    filled < size; j++) {
+                size_t entry;
+
+                do {
+                    entry = (size_t)((offset[i] +
+                                (uint64_t)next[i] * skip[i]) % size);
+                    next[i]++;
+                } while (table[entry] != UINT16_MAX);
+
+                table[entry] = (uint16_t)i;
+                filled++;
+            }
+        }
+    }
+
+    free(permutation);
+    balancer->maglev = table;
+    balancer->maglev_health = health_generation;
+
+    return 1;
+}
@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2011 and 2012, Dustin Lundquist <dustin@null-ptr.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef BALANCER_H
+#define BALANCER_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include "address.h"
+
+#define BALANCER_WEIGHT_MAX 256
+/*
+ * Prime size of Maglev lookup tables, the same for every pool so keys move
+ * only between servers added or removed; shares are within about 1% of the
+ * weights for pools of up to 160 servers
+ */
+#define MAGLEV_TABLE_SIZE 16381
+
+#define HEALTH_CHECK_INTERVAL 5.0
+#define HEALTH_CHECK_RISE 2
+#define HEALTH_CHECK_FALL 3
+#define HEALTH_CHECK_JITTER 10
+
+#define BALANCER_RETRIES 1
+#define BALANCER_CONNECT_TIMEOUT 5.0
+#define BALANCER_EJECT 5
+#define BALANCER_EJECT_TIME 30.0
+/* Weight of each new connect time in a server's moving average */
+#define CONNECT_TIME_WEIGHT 0.3
+
+enum BalanceAlgorithm {
+    BALANCE_ROUND_ROBIN,        /* in proportion to the weights */
+    BALANCE_LEAST_CONNECTIONS,  /* fewest connections for the weight */
+    BALANCE_RANDOM,             /* the less loaded of two random choices */
+    BALANCE_SOURCE,             /* hash of the key */
+    BALANCE_MAGLEV,             /* consistent hash of the key */
+    BALANCE_LATENCY,            /* the faster of two random choices */
+};
+
+enum BalanceHash {
+    HASH_CLIENT,                /* the client's IP address */
+    HASH_NETWORK,               /* its /24 or IPv6 /48 network */
+    HASH_SNI,                   /* the requested hostname */
+};
+
+enum HealthCheckType {
+    CHECK_NONE,
+    CHECK_TCP,                  /* the server accepts a connection */
+    CHECK_TLS,                  /* and answers a client hello */
+};
+
+struct HealthCheckConfig {
+    enum HealthCheckType type;
+    double interval;            /* seconds between checks, and timeout */
+    unsigned int rise, fall;    /* consecutive results to change state */
+    unsigned int jitter;        /* percentage the interval varies by */
+};
+
+struct HealthCheck;
+struct Balancer;
+
+/*
+ * A server address of a backend pool. Servers are reference counted, held
+ * by each connection to them, and passed on to the pools of a reloaded
+ * configuration with the same address, so their connection counts and
+ * health persist.
+ */
+struct BackendServer {
+    struct Address *address;
+    struct Balancer *balancer;  /* pool of the current configuration */
+    unsigned int connections;   /* open connections to the server */
+    int healthy;                /* not failing health checks */
+    struct HealthCheck *check;  /* active health check, or NULL */
+    unsigned int connect_failures;  /* in a row */
+    int ejected;                /* after failed connections, for a time */
+    double connect_time;        /* moving average in seconds */
+    int connect_measured;       /* connect_time has a sample */
+    int reference_count;
+};
+
+struct BalancerMember {
+    struct BackendServer *server;
+    unsigned int weight;
+    int current_weight;         /* for smooth weighted round robin */
+};
+
+struct Balancer {
+    enum BalanceAlgorithm algorithm;
+    enum BalanceHash hash;
+    struct BalancerMember *members;
+    size_t len;
+    size_t next;                /* first member considered for ties */
+    uint16_t *maglev;           /* member indexes, built when first used */
+    unsigned long maglev_health;    /* health generation of the table */
+    struct HealthCheckConfig check;
+    unsigned int retries;       /* other servers tried after a failure */
+    double connect_timeout;     /* seconds before trying another server */
+    unsigned int eject;         /* failed connections to eject, 0 never */
+    double eject_time;          /* seconds a server is ejected for */
+    int reference_count;        /* its backend's and each connection's */
+};
+
+struct ServerMapSlot {
+    struct BackendServer *server;
+    int adopted;                /* by a pool of the new configuration */
+};
+
+/*
+ * The servers of the pools of a previous configuration by address, for the
+ * pools of a reloaded configuration to adopt, each by one pool at most
+ */
+struct ServerMap {
+    struct ServerMapSlot *slots;    /* open addressing hash table */
+    size_t size;                    /* a power of two */
+};
+
+struct Balancer *new_balancer();
+int balancer_add_server(struct Balancer *, struct Address *);
+int balancer_set_weight(struct Balancer *, const char *);
+int balancer_set_algorithm(struct Balancer *, const char *);
+int balancer_set_hash(struct Balancer *, const char *);
+const char *balancer_algorithm_name(const struct Balancer *);
+const char *balancer_hash_name(const struct Balancer *);
+int balancer_set_check(struct Balancer *, const char *);
+const char *balancer_check_name(const struct Balancer *);
+int balancer_set_retry(struct Balancer *, const char *);
+struct BackendServer *balancer_select(struct Balancer *,
+        const struct sockaddr *, const char *, size_t);
+struct BackendServer *balancer_retry(const struct Balancer *,
+        const struct BackendServer *);
+void balancer_rebuild(struct Balancer *);
+void balancer_health_changed();
+int init_server_map(struct ServerMap *, size_t);
+void server_map_add(struct ServerMap *, const struct Balancer *);
+void free_server_map(struct ServerMap *);
+void balancer_adopt_servers(struct Balancer *, struct ServerMap *);
+void free_balancer(struct Balancer *);
+void balancer_ref_put(struct Balancer *);
+struct Balancer *balancer_ref_get(struct Balancer *);
+void backend_server_ref_put(struct BackendServer *);
+struct BackendServer *backend_server_ref_get(struct BackendServer *);
+struct BackendServer *backend_server_acquire(struct BackendServer *);
+void backend_server_release(struct BackendServer *);
+void backend_server_connected(struct BackendServer *, double);
+void backend_server_connect_failed(struct BackendServer *);
+
+#endif
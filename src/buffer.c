@@ -129,12 +129,16 @@ buffer_recv(struct Buffer *buffer, int sockfd, int flags, struct ev_loop *loop)
     return bytes;
 }
 
+/*
+ * Send up to len bytes from the buffer, or its entire contents if len is 0
+ */
 ssize_t
-buffer_send(struct Buffer *buffer, int sockfd, int flags, struct ev_loop *loop) {
+buffer_send(struct Buffer *buffer, int sockfd, size_t len, int flags,
+        struct ev_loop *loop) {
     struct iovec iov[2];
     struct msghdr msg = {
         .msg_iov = iov,
-        .msg_iovlen = setup_read_iov(buffer, iov, 0)
+        .msg_iovlen = setup_read_iov(buffer, iov, len)
     };
 
     ssize_t bytes = sendmsg(sockfd, &msg, flags);
@@ -147,6 +151,36 @@ buffer_send(struct Buffer *buffer, int sockfd, int flags, struct ev_loop *loop)
     return bytes;
 }
 
+/*
+ * Send header_len bytes of header followed by up to len bytes from the
+ * buffer, in a single call so the header need not be copied into the buffer.
+ * Returns the number of bytes of both sent, only those beyond the header are
+ * consumed from the buffer.
+ */
+ssize_t
+buffer_send_header(struct Buffer *buffer, int sockfd, const void *header,
+        size_t header_len, size_t len, int flags, struct ev_loop *loop) {
+    struct iovec iov[3] = {
+        { .iov_base = (void *)header, .iov_len = header_len }
+    };
+    struct msghdr msg = {
+        .msg_iov = iov,
+        .msg_iovlen = 1
+    };
+
+    if (len > 0)
+        msg.msg_iovlen += setup_read_iov(buffer, &iov[1], len);
+
+    ssize_t bytes = sendmsg(sockfd, &msg, flags);
+
+    buffer->last_send = ev_now(loop);
+
+    if (bytes > 0 && (size_t)bytes > header_len)
+        advance_read_position(buffer, (size_t)bytes - header_len);
+
+    return bytes;
+}
+
 /*
  * Read data from file into buffer
  */
@@ -236,6 +270,34 @@ buffer_peek(const struct Buffer *src, void *dst, size_t len) {
     return bytes_copied;
 }
 
+/*
+ * Setup a struct iovec iov[2] referencing the contents of a buffer after
+ * skipping the first offset bytes, without copying or coalescing.
+ * struct iovec *iov MUST be at least length 2.
+ * returns the number of entries setup
+ */
+size_t
+buffer_peek_iov(const struct Buffer *buffer, struct iovec *iov, size_t offset) {
+    if (offset >= buffer->len)
+        return 0;
+
+    size_t start = (buffer->head + offset) & buffer->size_mask;
+    size_t read_len = buffer->len - offset;
+
+    iov[0].iov_base = buffer->buffer + start;
+    if (start + read_len <= buffer_size(buffer)) {
+        iov[0].iov_len = read_len;
+
+        return 1;
+    } else {
+        iov[0].iov_len = buffer_size(buffer) - start;
+        iov[1].iov_base = buffer->buffer;
+        iov[1].iov_len = read_len - iov[0].iov_len;
+
+        return 2;
+    }
+}
+
 size_t
 buffer_pop(struct Buffer *src, void *dst, size_t len) {
     size_t bytes = buffer_peek(src, dst, len);
@@ -28,6 +28,7 @@
 
 #include <stdio.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <ev.h>
 
 
@@ -46,11 +47,14 @@ struct Buffer *new_buffer(size_t, struct ev_loop *);
 void free_buffer(struct Buffer *);
 
 ssize_t buffer_recv(struct Buffer *, int, int, struct ev_loop *);
-ssize_t buffer_send(struct Buffer *, int, int, struct ev_loop *);
+ssize_t buffer_send(struct Buffer *, int, size_t, int, struct ev_loop *);
+ssize_t buffer_send_header(struct Buffer *, int, const void *, size_t, size_t,
+        int, struct ev_loop *);
 ssize_t buffer_read(struct Buffer *, int);
 ssize_t buffer_write(struct Buffer *, int);
 ssize_t buffer_resize(struct Buffer *, size_t);
 size_t buffer_peek(const struct Buffer *, void *, size_t);
+size_t buffer_peek_iov(const struct Buffer *, struct iovec *, size_t);
 size_t buffer_coalesce(struct Buffer *, const void **);
 size_t buffer_pop(struct Buffer *, void *, size_t);
 size_t buffer_push(struct Buffer *, const void *, size_t);
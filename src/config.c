@@ -25,6 +25,7 @@
  */
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
@@ -32,6 +33,8 @@
 #include "config.h"
 #include "logger.h"
 #include "connection.h"
+#include "flow.h"
+#include "quic.h"
 
 
 struct LoggerBuilder {
@@ -43,6 +46,7 @@ struct LoggerBuilder {
 static int accept_username(struct Config *, const char *);
 static int accept_groupname(struct Config *, const char *);
 static int accept_pidfile(struct Config *, const char *);
+static int accept_max_connections(struct Config *, const char *);
 static int end_listener_stanza(struct Config *, struct Listener *);
 static int end_table_stanza(struct Config *, struct Table *);
 static int end_backend(struct Table *, struct Backend *);
@@ -57,6 +61,8 @@ static struct ResolverConfig *new_resolver_config();
 static int accept_resolver_nameserver(struct ResolverConfig *, const char *);
 static int accept_resolver_search(struct ResolverConfig *, const char *);
 static int accept_resolver_mode(struct ResolverConfig *, const char *);
+static int accept_resolver_attempt_delay(struct ResolverConfig *,
+        const char *);
 static int end_resolver_stanza(struct Config *, struct ResolverConfig *);
 static inline size_t string_vector_len(char **);
 static int append_to_string_vector(char ***, const char *) __attribute__((nonnull(1)));
@@ -95,6 +101,10 @@ static const struct Keyword resolver_stanza_grammar[] = {
         .keyword="mode",
         .parse_arg=(int(*)(void *, const char *))accept_resolver_mode,
     },
+    {
+        .keyword="attempt_delay",
+        .parse_arg=(int(*)(void *, const char *))accept_resolver_attempt_delay,
+    },
     {
         .keyword = NULL,
     },
@@ -136,6 +146,22 @@ static const struct Keyword listener_stanza_grammar[] = {
         .keyword="bad_requests",
         .parse_arg= (int(*)(void *, const char *))accept_listener_bad_request_action,
     },
+    {
+        .keyword="max_connections",
+        .parse_arg=(int(*)(void *, const char *))accept_listener_max_connections,
+    },
+    {
+        .keyword="max_request_size",
+        .parse_arg=(int(*)(void *, const char *))accept_listener_max_request_size,
+    },
+    {
+        .keyword="per_request_routing",
+        .parse_arg=(int(*)(void *, const char *))accept_listener_per_request_routing,
+    },
+    {
+        .keyword="accept_proxy_protocol",
+        .parse_arg=(int(*)(void *, const char *))accept_listener_accept_proxy_protocol,
+    },
     {
         .keyword = NULL,
     },
@@ -165,6 +191,10 @@ static struct Keyword global_grammar[] = {
         .keyword="pidfile",
         .parse_arg=(int(*)(void *, const char *))accept_pidfile,
     },
+    {
+        .keyword="max_connections",
+        .parse_arg=(int(*)(void *, const char *))accept_max_connections,
+    },
     {
         .keyword="resolver",
         .create=(void *(*)())new_resolver_config,
@@ -210,6 +240,9 @@ static const char *const resolver_mode_names[] = {
     "ipv6_first",
 };
 
+/* Milliseconds before racing the next address of a hostname server */
+static const unsigned int default_attempt_delay = 250;
+
 
 struct Config *
 init_config(const char *filename, struct ev_loop *loop) {
@@ -221,6 +254,7 @@ init_config(const char *filename, struct ev_loop *loop) {
 
     SLIST_INIT(&config->listeners);
     SLIST_INIT(&config->tables);
+    config->resolver.attempt_delay = default_attempt_delay;
 
     config->filename = strdup(filename);
     if (config->filename == NULL) {
@@ -298,6 +332,9 @@ reload_config(struct Config *config, struct ev_loop *loop) {
     logger_ref_put(config->access_log);
     config->access_log = logger_ref_get(new_config->access_log);
 
+    config->max_connections = new_config->max_connections;
+    set_connection_limit(config->max_connections);
+
     reload_tables(&config->tables, &new_config->tables);
 
     listeners_reload(&config->listeners, &new_config->listeners,
@@ -320,6 +357,9 @@ print_config(FILE *file, struct Config *config) {
     if (config->pidfile)
         fprintf(file, "pidfile %s\n\n", config->pidfile);
 
+    if (config->max_connections)
+        fprintf(file, "max_connections %zu\n\n", config->max_connections);
+
     print_resolver_config(file, &config->resolver);
 
     SLIST_FOREACH(listener, &config->listeners, entries) {
@@ -376,9 +416,24 @@ accept_pidfile(struct Config *config, const char *pidfile) {
     return 1;
 }
 
+static int
+accept_max_connections(struct Config *config, const char *max) {
+    if (!is_numeric(max) || max[0] == '-') {
+        err("Invalid max_connections: %s", max);
+        return 0;
+    }
+
+    config->max_connections = strtoul(max, NULL, 10);
+
+    return 1;
+}
+
 static int
 end_listener_stanza(struct Config *config, struct Listener *listener) {
-    listener->accept_cb = &accept_connection;
+    if (listener->protocol == quic_protocol)
+        listener->accept_cb = &accept_flow_datagram;
+    else
+        listener->accept_cb = &accept_connection;
 
     if (valid_listener(listener) <= 0) {
         err("Invalid listener");
@@ -410,8 +465,6 @@ static int
 end_backend(struct Table *table, struct Backend *backend) {
     /* TODO check backend */
 
-    table->use_proxy_header = table->use_proxy_header ||
-                              backend->use_proxy_header;
     add_backend(&table->backends, backend);
 
     return 1;
@@ -570,6 +623,7 @@ new_resolver_config() {
         resolver->nameservers = NULL;
         resolver->search = NULL;
         resolver->mode = 0;
+        resolver->attempt_delay = default_attempt_delay;
     }
 
     return resolver;
@@ -653,6 +707,20 @@ accept_resolver_mode(struct ResolverConfig *resolver, const char *mode) {
     return -1;
 }
 
+static int
+accept_resolver_attempt_delay(struct ResolverConfig *resolver,
+        const char *delay) {
+    if (!is_numeric(delay) || delay[0] == '-' ||
+            strtoul(delay, NULL, 10) > 10000) {
+        err("Invalid attempt_delay: %s", delay);
+        return -1;
+    }
+
+    resolver->attempt_delay = strtoul(delay, NULL, 10);
+
+    return 1;
+}
+
 static int
 end_resolver_stanza(struct Config *config, struct ResolverConfig *resolver) {
     config->resolver = *resolver;
@@ -673,5 +741,8 @@ print_resolver_config(FILE *file, struct ResolverConfig *resolver) {
 
     fprintf(file, "\tmode %s\n", resolver_mode_names[resolver->mode]);
 
+    if (resolver->attempt_delay != default_attempt_delay)
+        fprintf(file, "\tattempt_delay %u\n", resolver->attempt_delay);
+
     fprintf(file, "}\n\n");
 }
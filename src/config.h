@@ -35,10 +35,12 @@ struct Config {
     char *user;
     char *group;
     char *pidfile;
+    size_t max_connections;
     struct ResolverConfig {
         char **nameservers;
         char **search;
         int mode;
+        unsigned int attempt_delay; /* milliseconds */
     } resolver;
     struct Logger *access_log;
     struct Listener_head listeners;
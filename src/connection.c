@@ -29,6 +29,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 #include <sys/queue.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -45,46 +46,102 @@
 #include "address.h"
 #include "protocol.h"
 #include "logger.h"
+#include "server_pool.h"
+#include "proxy_protocol.h"
+#include "health.h"
 
 
 #define IS_TEMPORARY_SOCKERR(_errno) (_errno == EAGAIN || \
                                       _errno == EWOULDBLOCK || \
                                       _errno == EINTR)
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
 
 
 struct resolv_cb_data {
     struct Connection *connection;
     const struct Address *address;
     struct ev_loop *loop;
-    int cb_free_addr;
 };
 
 
+static const size_t CONNECTION_BUFFER_SIZE = 4096;
+/* Each request routed earns a fifth of a retry of a failed server
+ * connection, so retries add at most a fifth to the connections made, with
+ * a reserve for bursts of failures */
+static const double RETRY_BUDGET_RATIO = 0.2;
+static const double RETRY_BUDGET_MAX = 100.0;
+
+
 static TAILQ_HEAD(ConnectionHead, Connection) connections;
+static size_t connection_count = 0;
+static size_t max_connections = 0; /* 0 for unlimited */
+/* Spare descriptor released to shed a pending connection at the fd limit */
+static int reserve_fd = -1;
+/* Connection IDs, the random prefix makes them unique across processes */
+static uint8_t connection_id_prefix[8];
+static uint64_t next_connection_id = 0;
+static double retry_budget = 10.0;
+/* Head start of each address of a hostname server over the next (RFC 8305
+ * Connection Attempt Delay), 0 to try the next once the last fails */
+static double connection_attempt_delay = 0.25;
 
 
 static inline int client_socket_open(const struct Connection *);
 static inline int server_socket_open(const struct Connection *);
 
 static void reactivate_watcher(struct ev_loop *, struct ev_io *,
-        const struct Buffer *, const struct Buffer *);
+        const struct Buffer *, size_t);
+static size_t server_output_len(const struct Connection *);
+static size_t server_request_len(const struct Connection *);
+static ssize_t send_to_server(struct Connection *, struct ev_loop *);
 
 static void connection_cb(struct ev_loop *, struct ev_io *, int);
-static void resolv_cb(struct Address *, void *);
+static void connect_timeout_cb(struct ev_loop *, struct ev_timer *, int);
+static void attempt_timer_cb(struct ev_loop *, struct ev_timer *, int);
+static void attempt_cb(struct ev_loop *, struct ev_io *, int);
+static void finish_connection_event(struct Connection *, struct ev_loop *);
+static void resolv_cb(struct Address **, size_t, void *);
 static void reactivate_watchers(struct Connection *, struct ev_loop *);
-static void insert_proxy_v1_header(struct Connection *);
+static void build_proxy_header(struct Connection *);
+static size_t build_proxy_v1_header(const struct Connection *, uint8_t *);
+static size_t build_proxy_v2_header(const struct Connection *, uint8_t *);
+static uint8_t *push_proxy_v2_tlv(uint8_t *, uint8_t, const void *, size_t);
+static const char *format_ip_address(const struct sockaddr_storage *,
+        char *, size_t, uint16_t *);
+static int receive_proxy_header(struct Connection *);
 static void parse_client_request(struct Connection *);
+static int grow_client_buffer(struct Connection *);
 static void resolve_server_address(struct Connection *, struct ev_loop *);
+static void use_server_address(struct Connection *, const struct Address *,
+        struct ev_loop *);
+static int set_server_attempts(struct Connection *, struct Address **,
+        size_t, uint16_t);
+static int next_server_attempt(struct Connection *, struct ev_loop *);
+static void race_next_attempt(struct Connection *, struct ev_loop *);
+static void resume_server_attempt(struct Connection *,
+        struct ServerAttempt *, struct ev_loop *);
+static void stop_server_attempts(struct Connection *, struct ev_loop *);
 static void initiate_server_connect(struct Connection *, struct ev_loop *);
+static void start_connect_timers(struct Connection *, struct ev_loop *);
+static int open_server_socket(struct Connection *, struct ev_loop *);
+static int server_connect_complete(struct Connection *, struct ev_loop *);
+static void server_connect_failed(struct Connection *, int, struct ev_loop *);
+static int retry_server_connect(struct Connection *, int, struct ev_loop *);
+static void frame_http_exchange(struct Connection *);
+static int http_exchange_complete(const struct Connection *);
+static void release_server_socket(struct Connection *, struct ev_loop *);
 static void close_connection(struct Connection *, struct ev_loop *);
 static void close_client_socket(struct Connection *, struct ev_loop *);
 static void abort_connection(struct Connection *);
+static void shed_connection(struct Listener *);
 static void close_server_socket(struct Connection *, struct ev_loop *);
 static struct Connection *new_connection(struct ev_loop *);
 static void log_connection(struct Connection *);
-static void log_bad_request(struct Connection *, const char *, size_t, int);
+static void log_bad_request(struct Connection *, int);
+static void format_client_hello(const struct ClientHello *, char *, size_t);
 static void free_connection(struct Connection *);
+static void release_backend_server(struct Connection *);
 static void print_connection(FILE *, const struct Connection *);
 static void free_resolv_cb_data(struct resolv_cb_data *);
 
@@ -92,6 +149,31 @@ static void free_resolv_cb_data(struct resolv_cb_data *);
 void
 init_connections() {
     TAILQ_INIT(&connections);
+
+    reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (reserve_fd < 0)
+        warn("Unable to open reserve file descriptor: %s", strerror(errno));
+
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd < 0 || read(fd, connection_id_prefix,
+                sizeof(connection_id_prefix)) !=
+                (ssize_t)sizeof(connection_id_prefix)) {
+        uint64_t seed = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+
+        memcpy(connection_id_prefix, &seed, sizeof(connection_id_prefix));
+    }
+    if (fd >= 0)
+        close(fd);
+}
+
+void
+set_connection_limit(size_t limit) {
+    max_connections = limit;
+}
+
+void
+set_connection_attempt_delay(double delay) {
+    connection_attempt_delay = delay;
 }
 
 /**
@@ -101,12 +183,20 @@ init_connections() {
  */
 int
 accept_connection(struct Listener *listener, struct ev_loop *loop) {
+    if (connection_limit_reached(listener, loop)) {
+        shed_connection(listener);
+
+        errno = EBUSY;
+        return 0;
+    }
+
     struct Connection *con = new_connection(loop);
     if (con == NULL) {
         err("new_connection failed");
         return 0;
     }
     con->listener = listener_ref_get(listener);
+    count_connection(con->listener);
 
 #ifdef HAVE_ACCEPT4
     int sockfd = accept4(listener->watcher.fd,
@@ -124,6 +214,20 @@ accept_connection(struct Listener *listener, struct ev_loop *loop) {
         warn("accept failed: %s", strerror(errno));
         free_connection(con);
 
+        /* Idle server connections are the first to go at the fd limit, the
+         * pending client is accepted on the next call */
+        if ((saved_errno == EMFILE || saved_errno == ENFILE) &&
+                close_idle_server(loop)) {
+            errno = EAGAIN;
+            return 0;
+        }
+
+        /* When connection limits are configured prefer refusing clients we
+         * are unable to serve over leaving them in the listen backlog */
+        if ((saved_errno == EMFILE || saved_errno == ENFILE) &&
+                (max_connections != 0 || listener->max_connections != 0))
+            shed_connection(listener);
+
         errno = saved_errno;
         return 0;
     }
@@ -150,15 +254,14 @@ accept_connection(struct Listener *listener, struct ev_loop *loop) {
     con->client.watcher.data = con;
     con->state = ACCEPTED;
     con->established_timestamp = ev_now(loop);
+    con->per_request = listener->per_request_routing;
+    con->await_proxy_header = listener->accept_proxy_protocol;
+    con->id = next_connection_id++;
 
     TAILQ_INSERT_HEAD(&connections, con, entries);
 
     ev_io_start(loop, client_watcher);
 
-    if (con->listener->table->use_proxy_header ||
-            con->listener->fallback_use_proxy_header)
-        insert_proxy_v1_header(con);
-
     return 1;
 }
 
@@ -173,6 +276,91 @@ free_connections(struct ev_loop *loop) {
         close_connection(iter, loop);
         free_connection(iter);
     }
+
+    free_server_pools(loop);
+
+    if (reserve_fd >= 0) {
+        close(reserve_fd);
+        reserve_fd = -1;
+    }
+}
+
+/*
+ * Test if accepting another connection on this listener would exceed either
+ * the global or the listener's connection limit. Idle server connections
+ * count toward the global limit, and are closed to make room for clients.
+ */
+int
+connection_limit_reached(const struct Listener *listener,
+        struct ev_loop *loop) {
+    if (max_connections != 0)
+        while (connection_count < max_connections &&
+                connection_count + server_pool_idle_count() >=
+                    max_connections &&
+                close_idle_server(loop))
+            ;
+
+    return (max_connections != 0 &&
+            connection_count + server_pool_idle_count() >= max_connections) ||
+        (listener->max_connections != 0 &&
+            listener->connection_count >= listener->max_connections);
+}
+
+/*
+ * Count a connection, or a QUIC flow, toward the limits
+ */
+void
+count_connection(struct Listener *listener) {
+    listener->connection_count++;
+    connection_count++;
+}
+
+void
+uncount_connection(struct Listener *listener) {
+    listener->connection_count--;
+    connection_count--;
+}
+
+
+/*
+ * Accept and immediately close a pending connection, so clients we can not
+ * serve are refused promptly rather than left waiting in the listen backlog.
+ *
+ * If we are out of file descriptors the reserve descriptor is released for
+ * the duration of the accept. Refusals are logged at most once a second,
+ * with a count of those refused since the previous notice.
+ */
+static void
+shed_connection(struct Listener *listener) {
+    static time_t last_notice;
+    static unsigned int refused;
+
+    int sockfd = accept(listener->watcher.fd, NULL, NULL);
+    if (sockfd < 0 && (errno == EMFILE || errno == ENFILE) &&
+            reserve_fd >= 0) {
+        close(reserve_fd);
+        sockfd = accept(listener->watcher.fd, NULL, NULL);
+        if (sockfd >= 0)
+            close(sockfd);
+        reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    } else if (sockfd >= 0) {
+        close(sockfd);
+    }
+
+    if (sockfd < 0)
+        return;
+
+    refused++;
+    time_t now = time(NULL);
+    if (now != last_notice) {
+        char address[ADDRESS_BUFFER_SIZE];
+
+        notice("Connection limit reached on %s, refused %u connection%s",
+                display_address(listener->address, address, sizeof(address)),
+                refused, refused == 1 ? "" : "s");
+        last_notice = now;
+        refused = 0;
+    }
 }
 
 /* dumps a list of all connections for debugging */
@@ -251,6 +439,13 @@ connection_cb(struct ev_loop *loop, struct ev_io *w, int revents) {
     void (*close_socket)(struct Connection *, struct ev_loop *) =
         is_client ? close_client_socket : close_server_socket;
 
+    /* The connection to the server is made, or failed, once it is ready */
+    if (!is_client && con->server_connecting &&
+            !server_connect_complete(con, loop)) {
+        finish_connection_event(con, loop);
+        return;
+    }
+
     /* Receive first in case the socket was closed */
     if (revents & EV_READ && buffer_room(input_buffer)) {
         ssize_t bytes_received = buffer_recv(input_buffer, w->fd, 0, loop);
@@ -267,9 +462,17 @@ connection_cb(struct ev_loop *loop, struct ev_io *w, int revents) {
         }
     }
 
+    /* Find where the request being forwarded and its response end */
+    if (con->per_request && server_socket_open(con))
+        frame_http_exchange(con);
+
     /* Transmit */
-    if (revents & EV_WRITE && buffer_len(output_buffer)) {
-        ssize_t bytes_transmitted = buffer_send(output_buffer, w->fd, 0, loop);
+    size_t output_len = is_client ?
+        buffer_len(output_buffer) : server_output_len(con);
+    if (revents & EV_WRITE && output_len) {
+        ssize_t bytes_transmitted = is_client ?
+            buffer_send(output_buffer, w->fd, output_len, 0, loop) :
+            send_to_server(con, loop);
         if (bytes_transmitted < 0 && !IS_TEMPORARY_SOCKERR(errno)) {
             warn("send(%s): %s, closing connection",
                     socket_name,
@@ -279,21 +482,124 @@ connection_cb(struct ev_loop *loop, struct ev_io *w, int revents) {
         }
     }
 
+    /* Once the response is complete the next request is routed afresh */
+    if (con->per_request && con->state == CONNECTED &&
+            http_exchange_complete(con))
+        release_server_socket(con, loop);
+
     /* Handle any state specific logic, note we may transition through several
      * states during a single call */
-    if (is_client && con->state == ACCEPTED)
+    if (con->state == ACCEPTED)
         parse_client_request(con);
-    if (is_client && con->state == PARSED)
+    if (con->state == PARSED)
         resolve_server_address(con, loop);
-    if (is_client && con->state == RESOLVED)
+    if (con->state == RESOLVED)
         initiate_server_connect(con, loop);
 
+    if (con->per_request && server_socket_open(con))
+        frame_http_exchange(con);
+
+    /* Return a client buffer enlarged for the request to its normal size
+     * once it has been forwarded */
+    if (con->state == CONNECTED &&
+            buffer_size(con->client.buffer) > CONNECTION_BUFFER_SIZE &&
+            buffer_len(con->client.buffer) <= CONNECTION_BUFFER_SIZE)
+        buffer_resize(con->client.buffer, CONNECTION_BUFFER_SIZE);
+
     /* Close other socket if we have flushed corresponding buffer */
     if (con->state == SERVER_CLOSED && buffer_len(con->server.buffer) == 0)
         close_client_socket(con, loop);
-    if (con->state == CLIENT_CLOSED && buffer_len(con->client.buffer) == 0)
+    if (con->state == CLIENT_CLOSED && server_output_len(con) == 0)
         close_server_socket(con, loop);
 
+    finish_connection_event(con, loop);
+}
+
+/* The server did not accept the connection in time */
+static void
+connect_timeout_cb(struct ev_loop *loop, struct ev_timer *w, int revents) {
+    struct Connection *con = (struct Connection *)w->data;
+
+    if (revents & EV_TIMER && con->server_connecting) {
+        ev_io_stop(loop, &con->server.watcher);
+        if (close(con->server.watcher.fd) < 0)
+            warn("close failed: %s", strerror(errno));
+        /* The timeout is for all the addresses of a hostname server */
+        stop_server_attempts(con, loop);
+
+        server_connect_failed(con, ETIMEDOUT, loop);
+        finish_connection_event(con, loop);
+    }
+}
+
+/* The server has not accepted the connection before the next address of
+ * its hostname is due, race an attempt to that too */
+static void
+attempt_timer_cb(struct ev_loop *loop, struct ev_timer *w, int revents) {
+    struct Connection *con = (struct Connection *)w->data;
+
+    if (revents & EV_TIMER && con->state == CONNECTED &&
+            con->server_connecting && con->next_attempt < con->attempts_len) {
+        race_next_attempt(con, loop);
+        finish_connection_event(con, loop);
+    }
+}
+
+/* A raced attempt is ready, the first connection made is kept */
+static void
+attempt_cb(struct ev_loop *loop, struct ev_io *w, int revents) {
+    struct Connection *con = (struct Connection *)w->data;
+    struct ServerAttempt *attempt = NULL;
+    int error = 0;
+    socklen_t len = sizeof(error);
+
+    if (!(revents & EV_WRITE))
+        return;
+
+    for (size_t i = 0; i < con->attempts_len; i++)
+        if (&con->attempts[i].watcher == w)
+            attempt = &con->attempts[i];
+    assert(attempt != NULL);
+
+    if (getsockopt(w->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+        error = errno;
+
+    if (error != 0) {
+        char server[INET6_ADDRSTRLEN + 8];
+
+        ev_io_stop(loop, w);
+        if (close(w->fd) < 0)
+            warn("close failed: %s", strerror(errno));
+        warn("Failed to open connection to %s: %s",
+                display_sockaddr(&attempt->addr, server, sizeof(server)),
+                strerror(error));
+
+        /* The next address need not wait for its start */
+        if (con->state == CONNECTED && con->server_connecting &&
+                con->next_attempt < con->attempts_len) {
+            ev_timer_stop(loop, &con->attempt_timer);
+            race_next_attempt(con, loop);
+            finish_connection_event(con, loop);
+        }
+        return;
+    }
+
+    /* Abandon the current attempt for this one */
+    ev_io_stop(loop, &con->server.watcher);
+    if (close(con->server.watcher.fd) < 0)
+        warn("close failed: %s", strerror(errno));
+    ev_timer_stop(loop, &con->attempt_timer);
+
+    resume_server_attempt(con, attempt, loop);
+    finish_connection_event(con, loop);
+}
+
+/*
+ * Free the connection once both sockets are closed, otherwise wait for the
+ * events it is ready for
+ */
+static void
+finish_connection_event(struct Connection *con, struct ev_loop *loop) {
     if (con->state == CLOSED) {
         TAILQ_REMOVE(&connections, con, entries);
 
@@ -315,11 +621,11 @@ reactivate_watchers(struct Connection *con, struct ev_loop *loop) {
     /* Reactivate watchers */
     if (client_socket_open(con))
         reactivate_watcher(loop, client_watcher,
-                con->client.buffer, con->server.buffer);
+                con->client.buffer, buffer_len(con->server.buffer));
 
     if (server_socket_open(con))
         reactivate_watcher(loop, server_watcher,
-                con->server.buffer, con->client.buffer);
+                con->server.buffer, server_output_len(con));
 
     /* Neither watcher is active when the corresponding socket is closed */
     assert(client_socket_open(con) || !ev_is_active(client_watcher));
@@ -338,14 +644,13 @@ reactivate_watchers(struct Connection *con, struct ev_loop *loop) {
 
 static void
 reactivate_watcher(struct ev_loop *loop, struct ev_io *w,
-        const struct Buffer *input_buffer,
-        const struct Buffer *output_buffer) {
+        const struct Buffer *input_buffer, size_t output_len) {
     int events = 0;
 
     if (buffer_room(input_buffer))
         events |= EV_READ;
 
-    if (buffer_len(output_buffer))
+    if (output_len)
         events |= EV_WRITE;
 
     if (ev_is_active(w)) {
@@ -362,89 +667,292 @@ reactivate_watcher(struct ev_loop *loop, struct ev_io *w,
     }
 }
 
+/*
+ * Length of the client buffer which may be sent to the server: when routing
+ * each request only the request the server was chosen for
+ */
+static size_t
+server_request_len(const struct Connection *con) {
+    if (con->per_request)
+        return con->http.request_end - con->client.buffer->tx_bytes;
+
+    return buffer_len(con->client.buffer);
+}
+
+/*
+ * Length of output pending for the server, including any unsent part of
+ * the PROXY header
+ */
+static size_t
+server_output_len(const struct Connection *con) {
+    return con->proxy_header_len - con->proxy_header_sent +
+        server_request_len(con);
+}
+
+/*
+ * Send pending output to the server, with the remainder of the PROXY header
+ * passed alongside the client buffer rather than copied into it
+ */
+static ssize_t
+send_to_server(struct Connection *con, struct ev_loop *loop) {
+    size_t header_len = con->proxy_header_len - con->proxy_header_sent;
+    size_t len = server_request_len(con);
+
+    if (header_len == 0)
+        return buffer_send(con->client.buffer, con->server.watcher.fd,
+                len, 0, loop);
+
+    ssize_t bytes = buffer_send_header(con->client.buffer,
+            con->server.watcher.fd,
+            con->proxy_header + con->proxy_header_sent, header_len,
+            len, 0, loop);
+    if (bytes > 0)
+        con->proxy_header_sent += MIN((size_t)bytes, header_len);
+
+    return bytes;
+}
+
+/*
+ * Build the PROXY header for the server chosen, once the connection to it is
+ * opened and all the details it carries are known
+ */
 static void
-insert_proxy_v1_header(struct Connection *con) {
-    char buf[INET6_ADDRSTRLEN] = { '\0' };
-    size_t buf_len;
+build_proxy_header(struct Connection *con) {
+    switch (con->use_proxy_header) {
+        case PROXY_PROTOCOL_V1:
+            con->proxy_header_len =
+                build_proxy_v1_header(con, con->proxy_header);
+            break;
+        case PROXY_PROTOCOL_V2:
+            con->proxy_header_len =
+                build_proxy_v2_header(con, con->proxy_header);
+            break;
+        default:
+            con->proxy_header_len = 0;
+    }
+    con->proxy_header_sent = 0;
+}
+
+static size_t
+build_proxy_v1_header(const struct Connection *con, uint8_t *header) {
+    char source[INET6_ADDRSTRLEN];
+    char destination[INET6_ADDRSTRLEN];
+    uint16_t source_port, destination_port;
+    int len;
+
+    if (format_ip_address(&con->client.addr, source, sizeof(source),
+                &source_port) == NULL ||
+            format_ip_address(&con->client.local_addr, destination,
+                sizeof(destination), &destination_port) == NULL)
+        len = snprintf((char *)header, PROXY_HEADER_MAX, "PROXY UNKNOWN\r\n");
+    else
+        len = snprintf((char *)header, PROXY_HEADER_MAX,
+                "PROXY %s %s %s %" PRIu16 " %" PRIu16 "\r\n",
+                con->client.addr.ss_family == AF_INET ? "TCP4" : "TCP6",
+                source, destination, source_port, destination_port);
 
-    con->header_len += buffer_push(con->client.buffer, "PROXY ", 6);
+    return (size_t)len;
+}
 
-    switch (con->client.addr.ss_family) {
+/*
+ * Format the address of an IPv4 or IPv6 socket address and store its port,
+ * returns NULL for other address families
+ */
+static const char *
+format_ip_address(const struct sockaddr_storage *addr, char *buf,
+        size_t len, uint16_t *port) {
+    switch (addr->ss_family) {
         case AF_INET:
-            con->header_len += buffer_push(con->client.buffer, "TCP4 ", 5);
+            *port = ntohs(((const struct sockaddr_in *)addr)->sin_port);
+            return inet_ntop(AF_INET,
+                    &((const struct sockaddr_in *)addr)->sin_addr,
+                    buf, (socklen_t)len);
+        case AF_INET6:
+            *port = ntohs(((const struct sockaddr_in6 *)addr)->sin6_port);
+            return inet_ntop(AF_INET6,
+                    &((const struct sockaddr_in6 *)addr)->sin6_addr,
+                    buf, (socklen_t)len);
+        default:
+            return NULL;
+    }
+}
+
+/*
+ * Version 2 header: the addresses in binary followed by TLVs for the first
+ * ALPN protocol the client offered, the requested hostname and an ID unique
+ * to this client connection
+ */
+static size_t
+build_proxy_v2_header(const struct Connection *con, uint8_t *header) {
+    uint8_t *pos = header + PP2_HEADER_LEN;
+
+    memcpy(header, PP2_SIGNATURE, PP2_SIGNATURE_LEN);
+    header[12] = PP2_VERSION_PROXY;
+
+    if (con->client.addr.ss_family == AF_INET &&
+            con->client.local_addr.ss_family == AF_INET) {
+        const struct sockaddr_in *source =
+            (const struct sockaddr_in *)&con->client.addr;
+        const struct sockaddr_in *destination =
+            (const struct sockaddr_in *)&con->client.local_addr;
+
+        header[13] = PP2_FAM_TCP4;
+        memcpy(pos, &source->sin_addr, 4);
+        memcpy(pos + 4, &destination->sin_addr, 4);
+        memcpy(pos + 8, &source->sin_port, 2);
+        memcpy(pos + 10, &destination->sin_port, 2);
+        pos += 12;
+    } else if (con->client.addr.ss_family == AF_INET6 &&
+            con->client.local_addr.ss_family == AF_INET6) {
+        const struct sockaddr_in6 *source =
+            (const struct sockaddr_in6 *)&con->client.addr;
+        const struct sockaddr_in6 *destination =
+            (const struct sockaddr_in6 *)&con->client.local_addr;
+
+        header[13] = PP2_FAM_TCP6;
+        memcpy(pos, &source->sin6_addr, 16);
+        memcpy(pos + 16, &destination->sin6_addr, 16);
+        memcpy(pos + 32, &source->sin6_port, 2);
+        memcpy(pos + 34, &destination->sin6_port, 2);
+        pos += 36;
+    } else {
+        /* The receiver ignores the addresses */
+        header[13] = PP2_FAM_UNSPEC;
+    }
 
-            inet_ntop(AF_INET,
-                      &((const struct sockaddr_in *)&con->client.addr)->
-                      sin_addr, buf, sizeof(buf));
-            buf_len = strlen(buf);
-            con->header_len += buffer_push(con->client.buffer, buf, buf_len);
+    /* The ALPN extension lists protocols each prefixed by its length */
+    const struct ClientHello *hello = &con->parse_state.hello;
+    if (hello->alpn_len > 0 && hello->alpn[0] > 0 &&
+            (size_t)hello->alpn[0] < hello->alpn_len)
+        pos = push_proxy_v2_tlv(pos, PP2_TYPE_ALPN,
+                hello->alpn + 1, hello->alpn[0]);
+
+    if (con->hostname_len > 0 && con->hostname_len <= 255)
+        pos = push_proxy_v2_tlv(pos, PP2_TYPE_AUTHORITY,
+                con->hostname, con->hostname_len);
+
+    uint8_t unique_id[sizeof(connection_id_prefix) + 8];
+    memcpy(unique_id, connection_id_prefix, sizeof(connection_id_prefix));
+    for (size_t i = 0; i < 8; i++)
+        unique_id[sizeof(connection_id_prefix) + i] =
+            (uint8_t)(con->id >> (56 - 8 * i));
+    pos = push_proxy_v2_tlv(pos, PP2_TYPE_UNIQUE_ID,
+            unique_id, sizeof(unique_id));
+
+    size_t len = (size_t)(pos - header);
+    assert(len <= PROXY_HEADER_MAX);
+    header[14] = (uint8_t)((len - PP2_HEADER_LEN) >> 8);
+    header[15] = (uint8_t)((len - PP2_HEADER_LEN) & 0xFF);
+
+    return len;
+}
 
-            con->header_len += buffer_push(con->client.buffer, " ", 1);
+static uint8_t *
+push_proxy_v2_tlv(uint8_t *pos, uint8_t type, const void *value, size_t len) {
+    pos[0] = type;
+    pos[1] = (uint8_t)(len >> 8);
+    pos[2] = (uint8_t)(len & 0xFF);
+    memcpy(pos + 3, value, len);
 
-            inet_ntop(AF_INET,
-                      &((const struct sockaddr_in *)&con->client.local_addr)->
-                      sin_addr, buf, sizeof(buf));
-            buf_len = strlen(buf);
-            con->header_len += buffer_push(con->client.buffer, buf, buf_len);
+    return pos + 3 + len;
+}
 
-            buf_len = snprintf(buf, sizeof(buf), " %" PRIu16,
-                              ntohs(((const struct sockaddr_in *)&con->
-                              client.addr)->sin_port));
-            con->header_len += buffer_push(con->client.buffer, buf, buf_len);
+/*
+ * Consume the PROXY header a load balancer sent ahead of the client's data,
+ * taking the client and listener addresses from it. Until its length is
+ * known only the start of the header is examined, and it is parsed once,
+ * when complete.
+ *
+ * Returns true once the header has been received
+ */
+static int
+receive_proxy_header(struct Connection *con) {
+    struct ProxyHeader header;
+    char client[INET6_ADDRSTRLEN + 8];
+    ssize_t result = (ssize_t)con->await_proxy_header_len;
 
-            buf_len = snprintf(buf, sizeof(buf), " %" PRIu16,
-                              ntohs(((const struct sockaddr_in *)&con->
-                              client.local_addr)->sin_port));
-            con->header_len += buffer_push(con->client.buffer, buf, buf_len);
+    if (buffer_len(con->client.buffer) == 0)
+        return 0;
 
-            break;
-        case AF_INET6:
-            con->header_len += buffer_push(con->client.buffer, "TCP6 ", 5);
-            inet_ntop(AF_INET6,
-                    &((const struct sockaddr_in6 *)&con->client.addr)->
-                    sin6_addr, buf, sizeof(buf));
-            buf_len = strlen(buf);
-            con->header_len += buffer_push(con->client.buffer, buf, buf_len);
-
-            con->header_len += buffer_push(con->client.buffer, " ", 1);
-
-            inet_ntop(AF_INET6,
-                      &((const struct sockaddr_in6 *)&con->
-                      client.local_addr)->sin6_addr, buf, sizeof(buf));
-            buf_len = strlen(buf);
-            con->header_len += buffer_push(con->client.buffer, buf, buf_len);
-
-            buf_len = snprintf(buf, sizeof(buf), " %" PRIu16,
-                              ntohs(((const struct sockaddr_in6 *)&con->
-                              client.addr)->sin6_port));
-            con->header_len += buffer_push(con->client.buffer, buf, buf_len);
-
-            buf_len = snprintf(buf, sizeof(buf), " %" PRIu16,
-                              ntohs(((const struct sockaddr_in6 *)&con->
-                              client.local_addr)->sin6_port));
-            con->header_len += buffer_push(con->client.buffer, buf, buf_len);
+    if (con->await_proxy_header_len == 0) {
+        char start[PROXY_V1_HEADER_MAX];
+        size_t len = buffer_peek(con->client.buffer, start, sizeof(start));
 
-            break;
-        default:
-            con->header_len += buffer_push(con->client.buffer, "UNKNOWN", 7);
+        result = proxy_header_length(start, len);
+        if (result > 0)
+            con->await_proxy_header_len = (size_t)result;
+    }
+
+    if (result == -1 ||
+            buffer_len(con->client.buffer) < con->await_proxy_header_len) {
+        if (buffer_room(con->client.buffer) > 0 || grow_client_buffer(con))
+            return 0; /* give load balancer a chance to send more data */
+
+        warn("PROXY header from %s exceeded %zu byte buffer size",
+                display_sockaddr(&con->client.addr, client, sizeof(client)),
+                buffer_size(con->client.buffer));
+        abort_connection(con);
+        return 0;
     }
-    con->header_len += buffer_push(con->client.buffer, "\r\n", 2);
+
+    if (result >= 0) {
+        const void *data;
+
+        buffer_coalesce(con->client.buffer, &data);
+        result = parse_proxy_header(data, con->await_proxy_header_len,
+                &header);
+    }
+    if (result < 0) {
+        warn("Invalid PROXY header from %s",
+                display_sockaddr(&con->client.addr, client, sizeof(client)));
+        abort_connection(con);
+        return 0;
+    }
+
+    buffer_pop(con->client.buffer, NULL, (size_t)result);
+
+    if (header.has_addresses) {
+        memcpy(&con->client.addr, &header.source, header.source_len);
+        con->client.addr_len = header.source_len;
+        memcpy(&con->client.local_addr, &header.destination,
+                header.destination_len);
+        con->client.local_addr_len = header.destination_len;
+    }
+    con->await_proxy_header = 0;
+
+    return 1;
 }
 
 static void
 parse_client_request(struct Connection *con) {
-    const char *payload;
-    size_t payload_len = buffer_coalesce(con->client.buffer, (const void **)&payload);
-    char *hostname = NULL;
+    struct iovec iov[2];
+    int result = -1;
 
-    /* Avoid payload_len underflow and empty request */
-    if (payload_len <= con->header_len)
+    /* The load balancer's header precedes the request */
+    if (con->await_proxy_header && !receive_proxy_header(con))
         return;
 
-    payload += con->header_len;
-    payload_len -= con->header_len;
+    size_t iov_len = buffer_peek_iov(con->client.buffer, iov,
+            con->parsed_len);
+
+    /* Avoid reparsing and empty request */
+    if (iov_len == 0)
+        return;
+
+    /* Each request starts afresh when routing every request */
+    if (con->per_request && con->parsed_len == 0) {
+        init_parse_state(&con->parse_state);
+        con->hostname = NULL;
+        con->hostname_len = 0;
+    }
+
+    /* Only pass the parser data received since the last call */
+    for (size_t i = 0; i < iov_len && result == -1; i++) {
+        result = con->listener->protocol->parse_packet(&con->parse_state,
+                iov[i].iov_base, iov[i].iov_len);
+        con->parsed_len += iov[i].iov_len;
+    }
 
-    int result = con->listener->protocol->parse_packet(payload, payload_len, &hostname);
     if (result < 0) {
         char client[INET6_ADDRSTRLEN + 8];
 
@@ -452,6 +960,9 @@ parse_client_request(struct Connection *con) {
             if (buffer_room(con->client.buffer) > 0)
                 return; /* give client a chance to send more data */
 
+            if (grow_client_buffer(con))
+                return;
+
             warn("Request from %s exceeded %zu byte buffer size",
                     display_sockaddr(&con->client.addr, client, sizeof(client)),
                     buffer_size(con->client.buffer));
@@ -464,7 +975,7 @@ parse_client_request(struct Connection *con) {
                     result);
 
             if (con->listener->log_bad_requests)
-                log_bad_request(con, payload, payload_len, result);
+                log_bad_request(con, result);
         }
 
         if (con->listener->fallback_address == NULL) {
@@ -473,11 +984,42 @@ parse_client_request(struct Connection *con) {
         }
     }
 
-    con->hostname = hostname;
-    con->hostname_len = (size_t)result;
+    if (result >= 0) {
+        if (con->parse_state.hostname_flags & HOSTNAME_INVALID_CHARS) {
+            char client[INET6_ADDRSTRLEN + 8];
+
+            debug("Request from %s included invalid characters in hostname",
+                    display_sockaddr(&con->client.addr, client, sizeof(client)));
+        }
+
+        /* The hostname is kept, normalized, in the parser state */
+        con->hostname = con->parse_state.hostname;
+        con->hostname_len = (size_t)result;
+    }
     con->state = PARSED;
 }
 
+/*
+ * Double the size of the client buffer, up to the listener's
+ * max_request_size, to receive the remainder of a large request
+ *
+ * Returns true iff the buffer was enlarged
+ */
+static int
+grow_client_buffer(struct Connection *con) {
+    size_t size = buffer_size(con->client.buffer);
+
+    if (size >= con->listener->max_request_size)
+        return 0;
+
+    if (buffer_resize(con->client.buffer, size * 2) < 0) {
+        err("Unable to grow client buffer to %zu bytes", size * 2);
+        return 0;
+    }
+
+    return 1;
+}
+
 static void
 abort_connection(struct Connection *con) {
     assert(client_socket_open(con));
@@ -486,6 +1028,7 @@ abort_connection(struct Connection *con) {
             con->listener->protocol->abort_message,
             con->listener->protocol->abort_message_len);
 
+    release_backend_server(con);
     con->state = SERVER_CLOSED;
 }
 
@@ -502,18 +1045,42 @@ resolve_server_address(struct Connection *con, struct ev_loop *loop) {
     //con->hostname = host;
     //con->hostname_len = strlen(host);
     struct LookupResult result =
-        listener_lookup_server_address(con->listener, con->hostname, con->hostname_len);
+        listener_lookup_server_address(con->listener,
+                con->hostname, con->hostname_len,
+                &con->parse_state.hello,
+                (struct sockaddr *)&con->client.addr, &con->server_address);
 
     if (result.address == NULL) {
         abort_connection(con);
         return;
-    } else if (address_is_hostname(result.address)) {
+    }
+
+    /* Count the connection to a server chosen from a pool until the server
+     * side is closed */
+    if (result.server != NULL) {
+        con->backend_server = backend_server_acquire(result.server);
+        con->balancer = balancer_ref_get(result.balancer);
+    }
+
+    retry_budget = MIN(retry_budget + RETRY_BUDGET_RATIO, RETRY_BUDGET_MAX);
+    con->connect_retries = 0;
+    con->use_proxy_header = result.use_proxy_header;
+
+    use_server_address(con, result.address, loop);
+}
+
+/*
+ * Take the address of the server to connect to, starting a DNS query for a
+ * hostname
+ */
+static void
+use_server_address(struct Connection *con, const struct Address *address,
+        struct ev_loop *loop) {
+    if (address_is_hostname(address)) {
 #ifndef HAVE_LIBUDNS
+        (void)loop;
         warn("DNS lookups not supported unless sniproxy compiled with libudns");
 
-        if (result.caller_free_address)
-            free((void *)result.address);
-
         abort_connection(con);
         return;
 #else
@@ -521,17 +1088,12 @@ resolve_server_address(struct Connection *con, struct ev_loop *loop) {
         if (cb_data == NULL) {
             err("%s: malloc", __func__);
 
-            if (result.caller_free_address)
-                free((void *)result.address);
-
             abort_connection(con);
             return;
         }
         cb_data->connection = con;
-        cb_data->address = result.address;
-        cb_data->cb_free_addr = result.caller_free_address;
+        cb_data->address = address;
         cb_data->loop = loop;
-        con->use_proxy_header = result.use_proxy_header;
 
         int resolv_mode = RESOLV_MODE_DEFAULT;
         if (con->listener->transparent_proxy) {
@@ -547,28 +1109,24 @@ resolve_server_address(struct Connection *con, struct ev_loop *loop) {
                     warn("attempt to use transparent proxy with hostname %s "
                             "on non-IP listener %s, falling back to "
                             "non-transparent mode",
-                            address_hostname(result.address),
+                            address_hostname(address),
                             display_sockaddr(con->listener->address,
                                     listener_address, sizeof(listener_address))
                             );
             }
         }
 
-        con->query_handle = resolv_query(address_hostname(result.address),
+        con->query_handle = resolv_query(address_hostname(address),
                 resolv_mode, resolv_cb,
                 (void (*)(void *))free_resolv_cb_data, cb_data);
 
         con->state = RESOLVING;
 #endif
-    } else if (address_is_sockaddr(result.address)) {
-        con->server.addr_len = address_sa_len(result.address);
+    } else if (address_is_sockaddr(address)) {
+        con->server.addr_len = address_sa_len(address);
         assert(con->server.addr_len <= sizeof(con->server.addr));
-        memcpy(&con->server.addr, address_sa(result.address),
+        memcpy(&con->server.addr, address_sa(address),
             con->server.addr_len);
-        con->use_proxy_header = result.use_proxy_header;
-
-        if (result.caller_free_address)
-            free((void *)result.address);
 
         con->state = RESOLVED;
     } else {
@@ -578,7 +1136,7 @@ resolve_server_address(struct Connection *con, struct ev_loop *loop) {
 }
 
 static void
-resolv_cb(struct Address *result, void *data) {
+resolv_cb(struct Address **results, size_t len, void *data) {
     struct resolv_cb_data *cb_data = (struct resolv_cb_data *)data;
     struct Connection *con = cb_data->connection;
     struct ev_loop *loop = cb_data->loop;
@@ -588,38 +1146,249 @@ resolv_cb(struct Address *result, void *data) {
         return;
     }
 
-    if (result == NULL) {
+    /* The query is done, a retry below may start another */
+    con->query_handle = NULL;
+
+    if (len == 0) {
         notice("unable to resolve %s, closing connection",
                 address_hostname(cb_data->address));
         abort_connection(con);
+    } else if (!set_server_attempts(con, results, len,
+                address_port(cb_data->address))) {
+        abort_connection(con);
     } else {
-        assert(address_is_sockaddr(result));
+        next_server_attempt(con, loop);
+    }
 
-        /* copy port from server_address */
-        address_set_port(result, address_port(cb_data->address));
+    reactivate_watchers(con, loop);
+}
 
-        con->server.addr_len = address_sa_len(result);
-        assert(con->server.addr_len <= sizeof(con->server.addr));
-        memcpy(&con->server.addr, address_sa(result), con->server.addr_len);
+static void
+free_resolv_cb_data(struct resolv_cb_data *cb_data) {
+    free(cb_data);
+}
 
+/*
+ * Keep the addresses a hostname server resolved to, with the port of the
+ * server
+ *
+ * Returns false if they could not be kept
+ */
+static int
+set_server_attempts(struct Connection *con, struct Address **addresses,
+        size_t len, uint16_t port) {
+    struct ServerAttempt *attempts = calloc(len, sizeof(struct ServerAttempt));
+    if (attempts == NULL) {
+        err("%s: calloc", __func__);
+        return 0;
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        assert(address_is_sockaddr(addresses[i]));
+        address_set_port(addresses[i], port);
+
+        attempts[i].addr_len = address_sa_len(addresses[i]);
+        assert(attempts[i].addr_len <= sizeof(attempts[i].addr));
+        memcpy(&attempts[i].addr, address_sa(addresses[i]),
+                attempts[i].addr_len);
+        ev_init(&attempts[i].watcher, attempt_cb);
+        attempts[i].watcher.data = con;
+    }
+
+    free(con->attempts);
+    con->attempts = attempts;
+    con->attempts_len = len;
+    con->next_attempt = 0;
+
+    return 1;
+}
+
+/*
+ * Connect to the next address of a hostname server, or once every address
+ * has been tried continue with an attempt still racing
+ *
+ * Returns false if there is neither
+ */
+static int
+next_server_attempt(struct Connection *con, struct ev_loop *loop) {
+    if (con->next_attempt < con->attempts_len) {
+        struct ServerAttempt *attempt = &con->attempts[con->next_attempt++];
+
+        con->server.addr_len = attempt->addr_len;
+        memcpy(&con->server.addr, &attempt->addr, attempt->addr_len);
         con->state = RESOLVED;
 
         initiate_server_connect(con, loop);
+        return 1;
     }
 
-    con->query_handle = NULL;
-    reactivate_watchers(con, loop);
+    for (size_t i = 0; i < con->attempts_len; i++) {
+        if (ev_is_active(&con->attempts[i].watcher)) {
+            resume_server_attempt(con, &con->attempts[i], loop);
+            start_connect_timers(con, loop);
+            return 1;
+        }
+    }
+
+    return 0;
 }
 
+/*
+ * Keep the current attempt racing, and connect to the next address of the
+ * hostname server alongside it
+ */
 static void
-free_resolv_cb_data(struct resolv_cb_data *cb_data) {
-    if (cb_data->cb_free_addr)
-        free((void *)cb_data->address);
-    free(cb_data);
+race_next_attempt(struct Connection *con, struct ev_loop *loop) {
+    /* The current attempt is to the address before the next */
+    struct ServerAttempt *attempt = &con->attempts[con->next_attempt - 1];
+
+    ev_io_stop(loop, &con->server.watcher);
+    ev_io_set(&attempt->watcher, con->server.watcher.fd, EV_WRITE);
+    ev_io_start(loop, &attempt->watcher);
+
+    next_server_attempt(con, loop);
+}
+
+/* Make a raced attempt the connection to the server */
+static void
+resume_server_attempt(struct Connection *con, struct ServerAttempt *attempt,
+        struct ev_loop *loop) {
+    int sockfd = attempt->watcher.fd;
+
+    ev_io_stop(loop, &attempt->watcher);
+
+    con->server.addr_len = attempt->addr_len;
+    memcpy(&con->server.addr, &attempt->addr, attempt->addr_len);
+    con->server.local_addr_len = sizeof(con->server.local_addr);
+    if (getsockname(sockfd, (struct sockaddr *)&con->server.local_addr,
+                &con->server.local_addr_len) != 0)
+        con->server.local_addr.ss_family = AF_UNSPEC;
+
+    struct ev_io *server_watcher = &con->server.watcher;
+    ev_io_init(server_watcher, connection_cb, sockfd, EV_WRITE);
+    con->server.watcher.data = con;
+    con->server_connecting = 1;
+    if (con->state != CLIENT_CLOSED)
+        con->state = CONNECTED;
+
+    ev_io_start(loop, server_watcher);
+}
+
+/* Close the attempts still racing and forget the addresses of the hostname */
+static void
+stop_server_attempts(struct Connection *con, struct ev_loop *loop) {
+    ev_timer_stop(loop, &con->attempt_timer);
+
+    for (size_t i = 0; i < con->attempts_len; i++) {
+        struct ev_io *watcher = &con->attempts[i].watcher;
+
+        if (ev_is_active(watcher)) {
+            ev_io_stop(loop, watcher);
+            if (close(watcher->fd) < 0)
+                warn("close failed: %s", strerror(errno));
+        }
+    }
+
+    free(con->attempts);
+    con->attempts = NULL;
+    con->attempts_len = 0;
+    con->next_attempt = 0;
 }
 
 static void
 initiate_server_connect(struct Connection *con, struct ev_loop *loop) {
+    int sockfd = -1;
+
+    /* A connection kept by the server pool is bound to neither client */
+    if (con->per_request && !con->use_proxy_header &&
+            !con->listener->transparent_proxy)
+        sockfd = server_pool_get((struct sockaddr *)&con->server.addr,
+                con->server.addr_len, con->listener->source_address, loop);
+
+    con->server_connecting = sockfd < 0;
+    if (sockfd < 0) {
+        sockfd = open_server_socket(con, loop);
+    } else {
+        ev_timer_stop(loop, &con->connect_timer);
+        stop_server_attempts(con, loop);
+    }
+    if (sockfd < 0) {
+        /* Attempts still racing are abandoned with the connection */
+        if (con->state == SERVER_CLOSED) {
+            con->server_connecting = 0;
+            ev_timer_stop(loop, &con->connect_timer);
+            stop_server_attempts(con, loop);
+        }
+        return;
+    }
+
+    con->server.local_addr_len = sizeof(con->server.local_addr);
+    if (getsockname(sockfd, (struct sockaddr *)&con->server.local_addr,
+                &con->server.local_addr_len) != 0) {
+        close(sockfd);
+        warn("getsockname failed: %s", strerror(errno));
+
+        con->server_connecting = 0;
+        ev_timer_stop(loop, &con->connect_timer);
+        stop_server_attempts(con, loop);
+        abort_connection(con);
+        return;
+    }
+
+    /* Each server connection gets its own header */
+    build_proxy_header(con);
+
+    if (con->per_request) {
+        init_http_message(&con->http.request, 0);
+        init_http_message(&con->http.response, 1);
+        con->http.request_end = con->client.buffer->tx_bytes;
+        con->http.response_end = con->server.buffer->rx_bytes;
+    }
+
+    struct ev_io *server_watcher = &con->server.watcher;
+    ev_io_init(server_watcher, connection_cb, sockfd, EV_WRITE);
+    con->server.watcher.data = con;
+    con->state = CONNECTED;
+
+    ev_io_start(loop, server_watcher);
+
+    if (con->server_connecting) {
+        /* Later addresses of a hostname count towards the server's time */
+        if (con->next_attempt <= 1)
+            con->connect_start = ev_now(loop);
+        start_connect_timers(con, loop);
+    }
+}
+
+/*
+ * Time the connection to a server of a pool, so another server may be tried
+ * if this one is slow to accept, and give the next address of a hostname
+ * server its start
+ */
+static void
+start_connect_timers(struct Connection *con, struct ev_loop *loop) {
+    if (con->balancer != NULL && !ev_is_active(&con->connect_timer)) {
+        ev_timer_set(&con->connect_timer, con->balancer->connect_timeout,
+                0.0);
+        ev_timer_start(loop, &con->connect_timer);
+    }
+
+    if (con->next_attempt < con->attempts_len &&
+            connection_attempt_delay > 0.0) {
+        ev_timer_stop(loop, &con->attempt_timer);
+        ev_timer_set(&con->attempt_timer, connection_attempt_delay, 0.0);
+        ev_timer_start(loop, &con->attempt_timer);
+    }
+}
+
+/*
+ * Open a new connection to the server address
+ *
+ * Returns the socket, or -1 after aborting the connection or trying
+ * another server
+ */
+static int
+open_server_socket(struct Connection *con, struct ev_loop *loop) {
 #ifdef HAVE_ACCEPT4
     int sockfd = socket(con->server.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
 #else
@@ -631,7 +1400,7 @@ initiate_server_connect(struct Connection *con, struct ev_loop *loop) {
                 strerror(errno),
                 display_sockaddr(&con->client.addr, client, sizeof(client)));
         abort_connection(con);
-        return;
+        return -1;
     }
 
 #ifndef HAVE_ACCEPT4
@@ -653,7 +1422,7 @@ initiate_server_connect(struct Connection *con, struct ev_loop *loop) {
             err("setsockopt IP_TRANSPARENT failed: %s", strerror(errno));
             close(sockfd);
             abort_connection(con);
-            return;
+            return -1;
         }
 
         result = bind(sockfd, (struct sockaddr *)&con->client.addr,
@@ -662,7 +1431,7 @@ initiate_server_connect(struct Connection *con, struct ev_loop *loop) {
             err("bind failed: %s", strerror(errno));
             close(sockfd);
             abort_connection(con);
-            return;
+            return -1;
         }
     } else if (con->listener->source_address) {
         int on = 1;
@@ -671,7 +1440,7 @@ initiate_server_connect(struct Connection *con, struct ev_loop *loop) {
             err("setsockopt SO_REUSEADDR failed: %s", strerror(errno));
             close(sockfd);
             abort_connection(con);
-            return;
+            return -1;
         }
 
         int tries = 5;
@@ -687,45 +1456,257 @@ initiate_server_connect(struct Connection *con, struct ev_loop *loop) {
             err("bind failed: %s", strerror(errno));
             close(sockfd);
             abort_connection(con);
-            return;
+            return -1;
         }
     }
 
     int result = connect(sockfd,
             (struct sockaddr *)&con->server.addr,
             con->server.addr_len);
-    /* TODO retry connect in EADDRNOTAVAIL case */
     if (result < 0 && errno != EINPROGRESS) {
+        int error = errno;
+
         close(sockfd);
-        char server[INET6_ADDRSTRLEN + 8];
-        warn("Failed to open connection to %s: %s",
-                display_sockaddr(&con->server.addr, server, sizeof(server)),
-                strerror(errno));
-        abort_connection(con);
-        return;
+        server_connect_failed(con, error, loop);
+        return -1;
     }
 
-    if (getsockname(sockfd, (struct sockaddr *)&con->server.local_addr,
-                &con->server.local_addr_len) != 0) {
-        close(sockfd);
-        warn("getsockname failed: %s", strerror(errno));
+    return sockfd;
+}
 
-        abort_connection(con);
+/*
+ * Check the connection to the server, once its socket is ready
+ *
+ * Returns true if it was made, otherwise the socket is closed and another
+ * server tried or the connection aborted
+ */
+static int
+server_connect_complete(struct Connection *con, struct ev_loop *loop) {
+    int sockfd = con->server.watcher.fd;
+    int error = 0;
+    socklen_t len = sizeof(error);
+
+    if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+        error = errno;
+
+    if (error == 0) {
+        con->server_connecting = 0;
+        ev_timer_stop(loop, &con->connect_timer);
+        stop_server_attempts(con, loop);
+        if (con->backend_server != NULL) {
+            report_server_connect(con->backend_server, 1, loop);
+            backend_server_connected(con->backend_server,
+                    ev_now(loop) - con->connect_start);
+        }
+
+        return 1;
+    }
+
+    ev_io_stop(loop, &con->server.watcher);
+    if (close(sockfd) < 0)
+        warn("close failed: %s", strerror(errno));
+    server_connect_failed(con, error, loop);
+
+    return 0;
+}
+
+/*
+ * The server socket, now closed, failed to connect: try another server, or
+ * abort the connection
+ */
+static void
+server_connect_failed(struct Connection *con, int error,
+        struct ev_loop *loop) {
+    char server[INET6_ADDRSTRLEN + 8];
+
+    con->server_connecting = 0;
+    ev_timer_stop(loop, &con->attempt_timer);
+
+    warn("Failed to open connection to %s: %s",
+            display_sockaddr(&con->server.addr, server, sizeof(server)),
+            strerror(error));
+
+    /* The other addresses of a hostname server are tried first, within the
+     * connect timeout of the server */
+    if (con->state != CLIENT_CLOSED && next_server_attempt(con, loop))
         return;
+    ev_timer_stop(loop, &con->connect_timer);
+    stop_server_attempts(con, loop);
+
+    /* Running out of local addresses is no fault of the server */
+    if (con->backend_server != NULL && error != EADDRNOTAVAIL) {
+        report_server_connect(con->backend_server, 0, loop);
+        backend_server_connect_failed(con->backend_server);
     }
 
-    if (con->header_len && !con->use_proxy_header) {
-        /* If we prepended the PROXY header and this backend isn't configured
-         * to receive it, consume it now */
-        buffer_pop(con->client.buffer, NULL, con->header_len);
+    if (con->state == CLIENT_CLOSED) {
+        release_backend_server(con);
+        con->state = CLOSED;
+    } else if (!retry_server_connect(con, error, loop)) {
+        abort_connection(con);
     }
+}
 
-    struct ev_io *server_watcher = &con->server.watcher;
-    ev_io_init(server_watcher, connection_cb, sockfd, EV_WRITE);
-    con->server.watcher.data = con;
-    con->state = CONNECTED;
+/*
+ * Connect to the next server of the pool, or to the same address again if
+ * no local address was available. Nothing has been sent to the server, so
+ * the request is still in the client buffer to be sent to the next.
+ *
+ * Returns true if another server is being tried, within the limit of the
+ * pool and the retry budget
+ */
+static int
+retry_server_connect(struct Connection *con, int error,
+        struct ev_loop *loop) {
+    struct BackendServer *failed = con->backend_server;
+    struct BackendServer *next = NULL;
+    unsigned int retries = 1;
+
+    if (failed != NULL && con->balancer != NULL) {
+        retries = con->balancer->retries;
+        next = balancer_retry(con->balancer, failed);
+    }
 
-    ev_io_start(loop, server_watcher);
+    if (con->connect_retries >= retries ||
+            (next == NULL && error != EADDRNOTAVAIL))
+        return 0;
+
+    if (retry_budget < 1.0) {
+        notice("Retry budget exhausted, not retrying failed connection");
+        return 0;
+    }
+    retry_budget -= 1.0;
+    con->connect_retries++;
+
+    if (next == NULL) {
+        con->state = RESOLVED;
+        initiate_server_connect(con, loop);
+        return 1;
+    }
+
+    const struct Address *address = next->address;
+    backend_server_release(con->backend_server);
+    con->backend_server = backend_server_acquire(next);
+
+    /* Servers without a port use the listener's, as in the lookup */
+    if (address_port(address) == 0) {
+        struct Address *copy =
+            copy_address_to(address, &con->server_address);
+        if (copy == NULL)
+            return 0;
+
+        address_set_port(copy, address_port(con->listener->address));
+        address = copy;
+    }
+
+    use_server_address(con, address, loop);
+    if (con->state == RESOLVED)
+        initiate_server_connect(con, loop);
+
+    return 1;
+}
+
+/*
+ * Advance the framing of the request being forwarded to the server and of
+ * its response. Only the part of the client buffer framed as this request is
+ * sent to the server, anything following it waits to be routed in turn.
+ *
+ * Connections which leave HTTP/1, or which can not be framed, are relayed
+ * unmodified from then on.
+ */
+static void
+frame_http_exchange(struct Connection *con) {
+    struct iovec iov[2];
+    size_t iov_len;
+    ssize_t result = 0;
+
+    if (!(con->http.request.flags & HTTP_MESSAGE_COMPLETE)) {
+        iov_len = buffer_peek_iov(con->client.buffer, iov,
+                con->http.request_end - con->client.buffer->tx_bytes);
+
+        for (size_t i = 0; i < iov_len && result >= 0; i++) {
+            result = parse_http_message(&con->http.request,
+                    iov[i].iov_base, iov[i].iov_len);
+            if (result > 0)
+                con->http.request_end += (size_t)result;
+            if (result < (ssize_t)iov[i].iov_len)
+                break;
+        }
+    }
+
+    if (con->http.request.flags & HTTP_MESSAGE_HEAD)
+        con->http.response.no_body = 1;
+
+    if (!(con->http.response.flags & HTTP_MESSAGE_COMPLETE) && result >= 0) {
+        iov_len = buffer_peek_iov(con->server.buffer, iov,
+                con->http.response_end - con->server.buffer->tx_bytes);
+
+        for (size_t i = 0; i < iov_len && result >= 0; i++) {
+            result = parse_http_message(&con->http.response,
+                    iov[i].iov_base, iov[i].iov_len);
+            if (result > 0)
+                con->http.response_end += (size_t)result;
+            if (result < (ssize_t)iov[i].iov_len)
+                break;
+        }
+    }
+
+    if (result < 0 ||
+            (con->http.request.flags & HTTP_MESSAGE_UPGRADE) ||
+            (con->http.response.flags & HTTP_MESSAGE_UPGRADE)) {
+        char client[INET6_ADDRSTRLEN + 8];
+
+        debug("Relaying remainder of connection from %s unmodified",
+                display_sockaddr(&con->client.addr, client, sizeof(client)));
+        con->per_request = 0;
+    }
+}
+
+/*
+ * Test if the request forwarded to the server has been sent and the
+ * response to it received
+ */
+static int
+http_exchange_complete(const struct Connection *con) {
+    return (con->http.request.flags & HTTP_MESSAGE_COMPLETE) &&
+        (con->http.response.flags & HTTP_MESSAGE_COMPLETE) &&
+        con->client.buffer->tx_bytes == con->http.request_end;
+}
+
+/*
+ * Release the server connection after a complete exchange, keeping it for
+ * the next request to this server unless it is closing or bound to this
+ * client. The client connection then waits for its next request, unless
+ * either side asked for it to be closed after this one.
+ */
+static void
+release_server_socket(struct Connection *con, struct ev_loop *loop) {
+    int sockfd = con->server.watcher.fd;
+    int closing = (con->http.request.flags | con->http.response.flags) &
+        HTTP_MESSAGE_CLOSE;
+
+    ev_io_stop(loop, &con->server.watcher);
+
+    if (closing || con->use_proxy_header ||
+            con->listener->transparent_proxy ||
+            con->http.response_end != con->server.buffer->rx_bytes ||
+            (max_connections != 0 &&
+             connection_count + server_pool_idle_count() >=
+                 max_connections) ||
+            !server_pool_put((struct sockaddr *)&con->server.addr,
+                con->server.addr_len, con->listener->source_address,
+                sockfd, loop)) {
+        if (close(sockfd) < 0)
+            warn("close failed: %s", strerror(errno));
+    }
+    release_backend_server(con);
+
+    if (closing) {
+        con->state = SERVER_CLOSED;
+    } else {
+        con->state = ACCEPTED;
+        con->parsed_len = 0;
+    }
 }
 
 /* Close client socket.
@@ -742,7 +1723,9 @@ close_client_socket(struct Connection *con, struct ev_loop *loop) {
         warn("close failed: %s", strerror(errno));
 
     if (con->state == RESOLVING) {
-        resolv_cancel(con->query_handle);
+        if (con->query_handle != NULL)
+            resolv_cancel(con->query_handle);
+        con->query_handle = NULL;
         con->state = PARSED;
     }
 
@@ -766,9 +1749,12 @@ close_server_socket(struct Connection *con, struct ev_loop *loop) {
             && con->state != SERVER_CLOSED);
 
     ev_io_stop(loop, &con->server.watcher);
+    ev_timer_stop(loop, &con->connect_timer);
+    stop_server_attempts(con, loop);
 
     if (close(con->server.watcher.fd) < 0)
         warn("close failed: %s", strerror(errno));
+    release_backend_server(con);
 
     /* next state depends on previous state */
     if (con->state == CLIENT_CLOSED)
@@ -815,17 +1801,35 @@ new_connection(struct ev_loop *loop) {
     con->server.local_addr_len = sizeof(con->server.local_addr);
     con->hostname = NULL;
     con->hostname_len = 0;
-    con->header_len = 0;
+    init_parse_state(&con->parse_state);
+    con->parsed_len = 0;
     con->query_handle = NULL;
+    con->backend_server = NULL;
+    con->balancer = NULL;
+    con->server_connecting = 0;
+    con->connect_retries = 0;
+    con->connect_start = 0.0;
+    ev_init(&con->connect_timer, connect_timeout_cb);
+    con->connect_timer.data = con;
+    con->attempts = NULL;
+    con->attempts_len = 0;
+    con->next_attempt = 0;
+    ev_init(&con->attempt_timer, attempt_timer_cb);
+    con->attempt_timer.data = con;
     con->use_proxy_header = 0;
+    con->proxy_header_len = 0;
+    con->proxy_header_sent = 0;
+    con->await_proxy_header = 0;
+    con->await_proxy_header_len = 0;
+    con->per_request = 0;
 
-    con->client.buffer = new_buffer(4096, loop);
+    con->client.buffer = new_buffer(CONNECTION_BUFFER_SIZE, loop);
     if (con->client.buffer == NULL) {
         free_connection(con);
         return NULL;
     }
 
-    con->server.buffer = new_buffer(4096, loop);
+    con->server.buffer = new_buffer(CONNECTION_BUFFER_SIZE, loop);
     if (con->server.buffer == NULL) {
         free_connection(con);
         return NULL;
@@ -842,15 +1846,17 @@ log_connection(struct Connection *con) {
     char client_address[ADDRESS_BUFFER_SIZE];
     char listener_address[ADDRESS_BUFFER_SIZE];
     char server_address[ADDRESS_BUFFER_SIZE];
+    char client_hello[128];
 
 
     display_sockaddr(&con->client.addr, client_address, sizeof(client_address));
     display_sockaddr(&con->client.local_addr, listener_address, sizeof(listener_address));
     display_sockaddr(&con->server.addr, server_address, sizeof(server_address));
+    format_client_hello(&con->parse_state.hello, client_hello, sizeof(client_hello));
 
     log_msg(con->listener->access_log,
            LOG_NOTICE,
-           "%s -> %s -> %s [%.*s] %zu/%zu bytes tx %zu/%zu bytes rx %1.3f seconds",
+           "%s -> %s -> %s [%.*s] %zu/%zu bytes tx %zu/%zu bytes rx %1.3f seconds%s",
            client_address,
            listener_address,
            server_address,
@@ -860,17 +1866,49 @@ log_connection(struct Connection *con) {
            con->server.buffer->rx_bytes,
            con->client.buffer->tx_bytes,
            con->client.buffer->rx_bytes,
-           duration);
+           duration,
+           client_hello);
 }
 
+/*
+ * Format the client hello fingerprint and supported groups for the access
+ * log, or an empty string if the request was not TLS
+ */
 static void
-log_bad_request(struct Connection *con __attribute__((unused)), const char *req, size_t req_len, int parse_result) {
+format_client_hello(const struct ClientHello *hello, char *buf, size_t len) {
+    size_t pos = 0;
+
+    buf[0] = '\0';
+    if (hello->fingerprint[0] == '\0')
+        return;
+
+    pos += (size_t)snprintf(buf, len, " fingerprint %s groups ",
+            hello->fingerprint);
+
+    size_t groups = hello->group_count < CLIENT_HELLO_GROUPS_MAX ?
+        hello->group_count : CLIENT_HELLO_GROUPS_MAX;
+    for (size_t i = 0; i < groups && pos < len; i++)
+        pos += (size_t)snprintf(buf + pos, len - pos, "%s%" PRIu16,
+                i > 0 ? "," : "", hello->groups[i]);
+
+    if (groups == 0 && pos < len)
+        snprintf(buf + pos, len - pos, "none");
+}
+
+static void
+log_bad_request(struct Connection *con, int parse_result) {
+    size_t req_len = buffer_len(con->client.buffer);
+    char *request = malloc(req_len);
     size_t message_len = 64 + 6 * req_len;
     char *message = malloc(message_len);
-    if (message == NULL) {
+    if (request == NULL || message == NULL) {
         err("log_bad_request: unable to allocate message buffer");
+        free(request);
+        free(message);
         return;
     }
+    buffer_peek(con->client.buffer, request, req_len);
+    const char *req = request;
     char *message_pos = message;
     char *message_end = message + message_len;
 
@@ -887,6 +1925,7 @@ log_bad_request(struct Connection *con __attribute__((unused)), const char *req,
     debug("%s", message);
 
     free(message);
+    free(request);
 }
 
 /*
@@ -899,13 +1938,25 @@ free_connection(struct Connection *con) {
     if (con == NULL)
         return;
 
+    if (con->listener != NULL)
+        uncount_connection(con->listener);
+
+    release_backend_server(con);
     listener_ref_put(con->listener);
+    free(con->attempts);
     free_buffer(con->client.buffer);
     free_buffer(con->server.buffer);
-    free((void *)con->hostname); /* cast away const'ness */
     free(con);
 }
 
+static void
+release_backend_server(struct Connection *con) {
+    backend_server_release(con->backend_server);
+    con->backend_server = NULL;
+    balancer_ref_put(con->balancer);
+    con->balancer = NULL;
+}
+
 static void
 print_connection(FILE *file, const struct Connection *con) {
     char client[INET6_ADDRSTRLEN + 8];
@@ -28,9 +28,24 @@
 
 #include <sys/socket.h>
 #include <sys/queue.h>
+#include <stdint.h>
 #include <ev.h>
 #include "listener.h"
 #include "buffer.h"
+#include "protocol.h"
+#include "http_message.h"
+
+/* Longest PROXY header: version 2 with IPv6 addresses, an ALPN protocol and
+ * authority of up to 255 bytes each and the unique ID */
+#define PROXY_HEADER_MAX (16 + 36 + 3 + 255 + 3 + 255 + 3 + 16)
+
+/* An address a hostname server resolved to, and the connection attempt to
+ * it while it is raced against the attempt to a later address */
+struct ServerAttempt {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    struct ev_io watcher;
+};
 
 struct Connection {
     enum State {
@@ -52,18 +67,49 @@ struct Connection {
         struct Buffer *buffer;
     } client, server;
     struct Listener *listener;
-    const char *hostname; /* Requested hostname */
+    const char *hostname; /* Requested hostname, in parse_state */
     size_t hostname_len;
-    size_t header_len;
+    struct ParseState parse_state;
+    size_t parsed_len;      /* bytes of request passed to parse_packet() */
     struct ResolvQuery *query_handle;
+    /* Server address made by the lookup for this connection */
+    union AddressStorage server_address;
+    struct BackendServer *backend_server;   /* chosen from a pool */
+    struct Balancer *balancer;  /* the pool, for retries */
+    int server_connecting;  /* connection to the server not yet made */
+    unsigned int connect_retries;   /* for the request being routed */
+    struct ev_timer connect_timer;  /* for servers of a pool */
+    ev_tstamp connect_start;    /* of the first attempt to the server */
+    /* Addresses of a hostname server, in the order they are tried */
+    struct ServerAttempt *attempts;
+    size_t attempts_len;
+    size_t next_attempt;
+    struct ev_timer attempt_timer;  /* starts the next attempt */
     ev_tstamp established_timestamp;
-    int use_proxy_header;
+    int use_proxy_header;   /* PROXY protocol version for this server */
+    uint64_t id;            /* unique within this process */
+    /* PROXY header sent to the server ahead of the client buffer */
+    uint8_t proxy_header[PROXY_HEADER_MAX];
+    size_t proxy_header_len, proxy_header_sent;
+    int await_proxy_header; /* load balancer's PROXY header not yet received */
+    size_t await_proxy_header_len;  /* of that header, once known */
+    int per_request;        /* route each HTTP request separately */
+    struct {
+        struct HTTPMessage request, response;
+        size_t request_end;     /* client stream offset framed so far */
+        size_t response_end;    /* server stream offset framed so far */
+    } http;
 
     TAILQ_ENTRY(Connection) entries;
 };
 
 void init_connections();
+void set_connection_limit(size_t);
+void set_connection_attempt_delay(double);
 int accept_connection(struct Listener *, struct ev_loop *);
+int connection_limit_reached(const struct Listener *, struct ev_loop *);
+void count_connection(struct Listener *);
+void uncount_connection(struct Listener *);
 void free_connections(struct ev_loop *);
 void print_connections();
 
@@ -0,0 +1,668 @@
+/*
+ * Copyright (c) 2011 and 2012, Dustin Lundquist <dustin@null-ptr.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * UDP flows for QUIC listeners. A flow is the datagrams of one client QUIC
+ * connection. The first datagrams are held until the client hello in their
+ * Initial packets has been parsed and a server chosen. The datagrams are
+ * then relayed over a connected socket of the flow's own, so the server's
+ * replies can be told apart, until the flow has been idle for
+ * FLOW_IDLE_TIMEOUT.
+ *
+ * Flows are found by client address, or when a client's address changes by
+ * the connection ID the server chose during the handshake, each kept in
+ * hash tables of their own. Flows count toward the connection limits.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h> /* close */
+#include <fcntl.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <ev.h>
+#include "flow.h"
+#include "quic.h"
+#include "connection.h"
+#include "address.h"
+#include "logger.h"
+
+
+#define IS_TEMPORARY_SOCKERR(_errno) (_errno == EAGAIN || \
+                                      _errno == EWOULDBLOCK || \
+                                      _errno == EINTR)
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+#define FLOW_TABLE_SIZE 1024        /* buckets of flows by address or ID */
+#define DATAGRAM_MAX 65536
+
+
+/* QUIC implementations commonly default to a 30 second idle timeout */
+static const ev_tstamp FLOW_IDLE_TIMEOUT = 30.0;
+/* Datagrams held while the client hello is incomplete */
+static const size_t FLOW_PENDING_MAX = 8;
+/* Datagrams received in each callback, to share time between sockets */
+static const int FLOW_RECV_BATCH = 64;
+
+
+struct PendingDatagram {
+    size_t len;
+    STAILQ_ENTRY(PendingDatagram) entries;
+    uint8_t data[];
+};
+
+struct Flow {
+    enum FlowState {
+        FLOW_ROUTING,   /* waiting for the client hello */
+        FLOW_RELAYING,  /* relaying datagrams to and from the server */
+        FLOW_DROPPING,  /* unroutable, dropping datagrams until idle */
+    } state;
+
+    struct Listener *listener;
+    struct sockaddr_storage client_addr, server_addr;
+    socklen_t client_addr_len, server_addr_len;
+    uint8_t client_cid[QUIC_CID_MAX], server_cid[QUIC_CID_MAX];
+    size_t client_cid_len, server_cid_len;
+    char hostname[PARSE_HOSTNAME_MAX + 1];
+    size_t hostname_len;
+    struct BackendServer *backend_server;   /* chosen from a pool */
+
+    struct QuicInitial *initial;    /* while routing */
+    STAILQ_HEAD(, PendingDatagram) pending;
+    size_t pending_count;
+
+    struct ev_io watcher;           /* server socket, once relaying */
+    struct ev_timer timer;
+    ev_tstamp established_timestamp;
+    size_t client_rx_bytes, server_tx_bytes;
+    size_t server_rx_bytes, client_tx_bytes;
+
+    LIST_ENTRY(Flow) bucket_entries;
+    LIST_ENTRY(Flow) client_cid_entries;    /* if client_cid_len > 0 */
+    LIST_ENTRY(Flow) server_cid_entries;    /* if server_cid_len > 0 */
+    TAILQ_ENTRY(Flow) entries;
+};
+
+
+static LIST_HEAD(FlowBucket, Flow) flow_table[FLOW_TABLE_SIZE];
+static struct FlowBucket client_cid_table[FLOW_TABLE_SIZE];
+static struct FlowBucket server_cid_table[FLOW_TABLE_SIZE];
+/* Flows with server connection IDs of each length */
+static size_t server_cid_lengths[QUIC_CID_MAX + 1];
+static TAILQ_HEAD(, Flow) flows = TAILQ_HEAD_INITIALIZER(flows);
+static uint8_t datagram[DATAGRAM_MAX];
+
+
+static int receive_client_datagram(struct Listener *,
+        const struct sockaddr_storage *, socklen_t, size_t, struct ev_loop *);
+static struct FlowBucket *flow_bucket(const struct Listener *,
+        const struct sockaddr_storage *, socklen_t);
+static struct Flow *lookup_flow(const struct Listener *,
+        const struct sockaddr_storage *, socklen_t);
+static struct FlowBucket *cid_bucket(struct FlowBucket *,
+        const struct Listener *, const uint8_t *, size_t);
+static struct Flow *lookup_flow_cid(const struct Listener *,
+        const struct QuicHeader *, size_t);
+static void move_flow(struct Flow *, const struct sockaddr_storage *,
+        socklen_t);
+static struct Flow *new_flow(struct Listener *,
+        const struct sockaddr_storage *, socklen_t,
+        const struct QuicHeader *, struct ev_loop *);
+static int hold_datagram(struct Flow *, size_t);
+static int route_flow(struct Flow *, int, struct ev_loop *);
+static int open_server_socket(struct Flow *);
+static void send_to_server(struct Flow *, const uint8_t *, size_t);
+static void server_cb(struct ev_loop *, struct ev_io *, int);
+static void flow_timeout_cb(struct ev_loop *, struct ev_timer *, int);
+static void drop_flow(struct Flow *);
+static void close_flow(struct Flow *, struct ev_loop *);
+static void log_flow(const struct Flow *);
+
+
+/*
+ * Receive datagrams on a QUIC listener
+ *
+ * Returns 0 with errno set if the file descriptor limit was reached.
+ */
+int
+accept_flow_datagram(struct Listener *listener, struct ev_loop *loop) {
+    for (int i = 0; i < FLOW_RECV_BATCH; i++) {
+        struct sockaddr_storage addr;
+        socklen_t addr_len = sizeof(addr);
+
+        ssize_t len = recvfrom(listener->watcher.fd, datagram,
+                sizeof(datagram), 0, (struct sockaddr *)&addr, &addr_len);
+        if (len < 0) {
+            if (!IS_TEMPORARY_SOCKERR(errno))
+                warn("recvfrom failed: %s", strerror(errno));
+            break;
+        }
+
+        if (!receive_client_datagram(listener, &addr, addr_len,
+                    (size_t)len, loop))
+            return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Close and free all flows
+ */
+void
+free_flows(struct ev_loop *loop) {
+    struct Flow *flow;
+
+    while ((flow = TAILQ_FIRST(&flows)) != NULL)
+        close_flow(flow, loop);
+}
+
+static int
+receive_client_datagram(struct Listener *listener,
+        const struct sockaddr_storage *addr, socklen_t addr_len, size_t len,
+        struct ev_loop *loop) {
+    struct Flow *flow = lookup_flow(listener, addr, addr_len);
+
+    if (flow == NULL) {
+        struct QuicHeader header;
+
+        if (!parse_quic_header(datagram, len, &header))
+            return 1;
+
+        flow = lookup_flow_cid(listener, &header, len);
+        if (flow != NULL) {
+            move_flow(flow, addr, addr_len);
+        } else if (header.initial) {
+            flow = new_flow(listener, addr, addr_len, &header, loop);
+            if (flow == NULL)
+                return errno != EMFILE && errno != ENFILE;
+        } else {
+            /* Not for any flow, perhaps one which has expired */
+            return 1;
+        }
+    }
+
+    ev_timer_again(loop, &flow->timer);
+    flow->client_rx_bytes += len;
+
+    switch (flow->state) {
+        case FLOW_ROUTING: {
+            if (!hold_datagram(flow, len))
+                return route_flow(flow, -1, loop);
+
+            int result = parse_quic_initial(flow->initial, datagram, len);
+            if (result == -1 && flow->pending_count < FLOW_PENDING_MAX)
+                return 1;
+
+            return route_flow(flow, result, loop);
+        }
+        case FLOW_RELAYING:
+            send_to_server(flow, datagram, len);
+            break;
+        case FLOW_DROPPING:
+            break;
+    }
+
+    return 1;
+}
+
+static struct FlowBucket *
+flow_bucket(const struct Listener *listener,
+        const struct sockaddr_storage *addr, socklen_t addr_len) {
+    const uint8_t *bytes = (const uint8_t *)addr;
+    uint32_t hash = 2166136261u ^ (uint32_t)(uintptr_t)listener;
+
+    /* FNV-1a over the address, sin6_flowinfo does not vary in practice */
+    for (socklen_t i = 0; i < addr_len; i++)
+        hash = (hash ^ bytes[i]) * 16777619u;
+
+    return &flow_table[hash % FLOW_TABLE_SIZE];
+}
+
+static struct Flow *
+lookup_flow(const struct Listener *listener,
+        const struct sockaddr_storage *addr, socklen_t addr_len) {
+    struct Flow *flow;
+
+    LIST_FOREACH(flow, flow_bucket(listener, addr, addr_len), bucket_entries)
+        if (flow->listener == listener &&
+                flow->client_addr_len == addr_len &&
+                memcmp(&flow->client_addr, addr, addr_len) == 0)
+            return flow;
+
+    return NULL;
+}
+
+static struct FlowBucket *
+cid_bucket(struct FlowBucket *table, const struct Listener *listener,
+        const uint8_t *cid, size_t cid_len) {
+    uint32_t hash = 2166136261u ^ (uint32_t)(uintptr_t)listener;
+
+    for (size_t i = 0; i < cid_len; i++)
+        hash = (hash ^ cid[i]) * 16777619u;
+
+    return &table[hash % FLOW_TABLE_SIZE];
+}
+
+/*
+ * Find the flow of a datagram from a new client address by its destination
+ * connection ID: a connection ID chosen by the server for short header
+ * packets, or either for long header packets. Connection IDs the server
+ * issues later are encrypted, so a client changing address after switching
+ * to one of those is not recognized.
+ */
+static struct Flow *
+lookup_flow_cid(const struct Listener *listener,
+        const struct QuicHeader *header, size_t len) {
+    struct Flow *flow;
+
+    if (header->long_header) {
+        LIST_FOREACH(flow, cid_bucket(server_cid_table, listener,
+                    header->dcid, header->dcid_len), server_cid_entries)
+            if (flow->listener == listener &&
+                    flow->server_cid_len == header->dcid_len &&
+                    memcmp(flow->server_cid, header->dcid,
+                        header->dcid_len) == 0)
+                return flow;
+
+        LIST_FOREACH(flow, cid_bucket(client_cid_table, listener,
+                    header->dcid, header->dcid_len), client_cid_entries)
+            if (flow->listener == listener &&
+                    flow->client_cid_len == header->dcid_len &&
+                    memcmp(flow->client_cid, header->dcid,
+                        header->dcid_len) == 0)
+                return flow;
+
+        return NULL;
+    }
+
+    /* Short headers do not carry the length of the connection ID, so each
+     * length servers chose is tried, usually only one */
+    for (size_t cid_len = 1; cid_len <= QUIC_CID_MAX && cid_len < len;
+            cid_len++) {
+        if (server_cid_lengths[cid_len] == 0)
+            continue;
+
+        LIST_FOREACH(flow, cid_bucket(server_cid_table, listener,
+                    datagram + 1, cid_len), server_cid_entries)
+            if (flow->listener == listener &&
+                    flow->server_cid_len == cid_len &&
+                    memcmp(flow->server_cid, datagram + 1, cid_len) == 0)
+                return flow;
+    }
+
+    return NULL;
+}
+
+static void
+move_flow(struct Flow *flow, const struct sockaddr_storage *addr,
+        socklen_t addr_len) {
+    char previous[ADDRESS_BUFFER_SIZE];
+    char client[ADDRESS_BUFFER_SIZE];
+
+    debug("QUIC client %s moved to %s",
+            display_sockaddr(&flow->client_addr, previous, sizeof(previous)),
+            display_sockaddr(addr, client, sizeof(client)));
+
+    LIST_REMOVE(flow, bucket_entries);
+    memcpy(&flow->client_addr, addr, addr_len);
+    flow->client_addr_len = addr_len;
+    LIST_INSERT_HEAD(flow_bucket(flow->listener, addr, addr_len), flow,
+            bucket_entries);
+}
+
+static struct Flow *
+new_flow(struct Listener *listener, const struct sockaddr_storage *addr,
+        socklen_t addr_len, const struct QuicHeader *header,
+        struct ev_loop *loop) {
+    if (connection_limit_reached(listener, loop)) {
+        errno = EBUSY;
+        return NULL;
+    }
+
+    struct Flow *flow = calloc(1, sizeof(struct Flow));
+    if (flow == NULL) {
+        err("%s: calloc", __func__);
+        return NULL;
+    }
+
+    flow->initial = malloc(sizeof(struct QuicInitial));
+    if (flow->initial == NULL) {
+        err("%s: malloc", __func__);
+        free(flow);
+        return NULL;
+    }
+    init_quic_initial(flow->initial);
+
+    flow->state = FLOW_ROUTING;
+    flow->listener = listener_ref_get(listener);
+    count_connection(listener);
+    memcpy(&flow->client_addr, addr, addr_len);
+    flow->client_addr_len = addr_len;
+    memcpy(flow->client_cid, header->dcid, header->dcid_len);
+    flow->client_cid_len = header->dcid_len;
+    STAILQ_INIT(&flow->pending);
+    ev_io_init(&flow->watcher, server_cb, -1, EV_READ);
+    flow->watcher.data = flow;
+    ev_init(&flow->timer, flow_timeout_cb);
+    flow->timer.repeat = FLOW_IDLE_TIMEOUT;
+    flow->timer.data = flow;
+    flow->established_timestamp = ev_now(loop);
+
+    LIST_INSERT_HEAD(flow_bucket(listener, addr, addr_len), flow,
+            bucket_entries);
+    if (flow->client_cid_len > 0)
+        LIST_INSERT_HEAD(cid_bucket(client_cid_table, listener,
+                    flow->client_cid, flow->client_cid_len), flow,
+                client_cid_entries);
+    TAILQ_INSERT_HEAD(&flows, flow, entries);
+
+    return flow;
+}
+
+/*
+ * Keep a copy of the datagram received to send once the flow is routed
+ *
+ * Returns true on success
+ */
+static int
+hold_datagram(struct Flow *flow, size_t len) {
+    if (flow->pending_count >= FLOW_PENDING_MAX)
+        return 0;
+
+    struct PendingDatagram *pending =
+        malloc(sizeof(struct PendingDatagram) + len);
+    if (pending == NULL) {
+        err("%s: malloc", __func__);
+        return 0;
+    }
+
+    pending->len = len;
+    memcpy(pending->data, datagram, len);
+    STAILQ_INSERT_TAIL(&flow->pending, pending, entries);
+    flow->pending_count++;
+
+    return 1;
+}
+
+/*
+ * Choose the server for a flow from the result of parsing its Initial
+ * packets, then send it the datagrams held
+ *
+ * Returns 0 with errno set if the file descriptor limit was reached.
+ */
+static int
+route_flow(struct Flow *flow, int result, struct ev_loop *loop) {
+    struct ParseState *state = &flow->initial->parse_state;
+    char client[ADDRESS_BUFFER_SIZE];
+
+    if (result >= 0) {
+        memcpy(flow->hostname, state->hostname, (size_t)result);
+        flow->hostname_len = (size_t)result;
+    } else if (result == -1) {
+        warn("QUIC client hello from %s exceeded %zu datagrams",
+                display_sockaddr(&flow->client_addr, client, sizeof(client)),
+                FLOW_PENDING_MAX);
+    } else if (result == -2) {
+        warn("QUIC client hello from %s did not include a hostname",
+                display_sockaddr(&flow->client_addr, client, sizeof(client)));
+    } else {
+        warn("Unable to parse QUIC Initial from %s: parse_quic_initial returned %d",
+                display_sockaddr(&flow->client_addr, client, sizeof(client)),
+                result);
+    }
+
+    if (result < 0 && flow->listener->fallback_address == NULL) {
+        drop_flow(flow);
+        return 1;
+    }
+
+    union AddressStorage storage;
+    struct LookupResult server = listener_lookup_server_address(
+            flow->listener, result >= 0 ? flow->hostname : NULL,
+            flow->hostname_len, &state->hello,
+            (struct sockaddr *)&flow->client_addr, &storage);
+    if (server.address == NULL) {
+        drop_flow(flow);
+        return 1;
+    } else if (!address_is_sockaddr(server.address)) {
+        warn("QUIC listeners do not support server %s, an address is required",
+                address_hostname(server.address));
+        drop_flow(flow);
+        return 1;
+    }
+
+    flow->server_addr_len = address_sa_len(server.address);
+    memcpy(&flow->server_addr, address_sa(server.address),
+            flow->server_addr_len);
+    if (server.server != NULL)
+        flow->backend_server = backend_server_acquire(server.server);
+
+    if (!open_server_socket(flow)) {
+        int saved_errno = errno;
+
+        drop_flow(flow);
+
+        errno = saved_errno;
+        return saved_errno != EMFILE && saved_errno != ENFILE;
+    }
+
+    ev_io_start(loop, &flow->watcher);
+    flow->state = FLOW_RELAYING;
+
+    struct PendingDatagram *pending;
+    while ((pending = STAILQ_FIRST(&flow->pending)) != NULL) {
+        STAILQ_REMOVE_HEAD(&flow->pending, entries);
+        send_to_server(flow, pending->data, pending->len);
+        free(pending);
+    }
+    flow->pending_count = 0;
+
+    free(flow->initial);
+    flow->initial = NULL;
+
+    return 1;
+}
+
+/*
+ * Open a socket connected to the flow's server
+ *
+ * Returns true on success
+ */
+static int
+open_server_socket(struct Flow *flow) {
+    int sockfd = socket(flow->server_addr.ss_family, SOCK_DGRAM, 0);
+    if (sockfd < 0) {
+        warn("socket failed: %s", strerror(errno));
+        return 0;
+    }
+
+    int flags = fcntl(sockfd, F_GETFL, 0);
+    fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+
+    const struct Address *source = flow->listener->source_address;
+    if ((source != NULL && bind(sockfd, address_sa(source),
+                    address_sa_len(source)) < 0) ||
+            connect(sockfd, (struct sockaddr *)&flow->server_addr,
+                flow->server_addr_len) < 0) {
+        char server[ADDRESS_BUFFER_SIZE];
+        int saved_errno = errno;
+
+        warn("Failed to open QUIC flow to %s: %s",
+                display_sockaddr(&flow->server_addr, server, sizeof(server)),
+                strerror(errno));
+        close(sockfd);
+
+        errno = saved_errno;
+        return 0;
+    }
+
+    ev_io_set(&flow->watcher, sockfd, EV_READ);
+
+    return 1;
+}
+
+/* Datagrams which can not be sent now are dropped, as by any router */
+static void
+send_to_server(struct Flow *flow, const uint8_t *data, size_t len) {
+    ssize_t sent = send(flow->watcher.fd, data, len, 0);
+
+    if (sent > 0)
+        flow->server_tx_bytes += (size_t)sent;
+    else if (sent < 0 && !IS_TEMPORARY_SOCKERR(errno))
+        debug("send(server): %s", strerror(errno));
+}
+
+static void
+server_cb(struct ev_loop *loop, struct ev_io *w, int revents) {
+    struct Flow *flow = (struct Flow *)w->data;
+
+    if (!(revents & EV_READ))
+        return;
+
+    for (int i = 0; i < FLOW_RECV_BATCH; i++) {
+        ssize_t len = recv(w->fd, datagram, sizeof(datagram), 0);
+        if (len < 0) {
+            if (IS_TEMPORARY_SOCKERR(errno))
+                break;
+
+            /* An ICMP error from the server for an earlier datagram */
+            debug("recv(server): %s, closing QUIC flow", strerror(errno));
+            close_flow(flow, loop);
+            return;
+        }
+
+        /* The connection ID the server chose, which the client uses after
+         * the handshake */
+        struct QuicHeader header;
+        if (flow->server_cid_len == 0 &&
+                parse_quic_header(datagram, (size_t)len, &header) &&
+                header.long_header && header.scid_len > 0) {
+            memcpy(flow->server_cid, header.scid, header.scid_len);
+            flow->server_cid_len = header.scid_len;
+            LIST_INSERT_HEAD(cid_bucket(server_cid_table, flow->listener,
+                        flow->server_cid, flow->server_cid_len), flow,
+                    server_cid_entries);
+            server_cid_lengths[flow->server_cid_len]++;
+        }
+
+        flow->server_rx_bytes += (size_t)len;
+        ssize_t sent = sendto(flow->listener->watcher.fd, datagram,
+                (size_t)len, 0, (struct sockaddr *)&flow->client_addr,
+                flow->client_addr_len);
+        if (sent > 0)
+            flow->client_tx_bytes += (size_t)sent;
+        else if (sent < 0 && !IS_TEMPORARY_SOCKERR(errno))
+            debug("sendto(client): %s", strerror(errno));
+
+        ev_timer_again(loop, &flow->timer);
+    }
+}
+
+static void
+flow_timeout_cb(struct ev_loop *loop, struct ev_timer *w, int revents) {
+    struct Flow *flow = (struct Flow *)w->data;
+
+    if (revents & EV_TIMER)
+        close_flow(flow, loop);
+}
+
+/*
+ * Discard any datagrams held, and those which follow until the flow expires
+ */
+static void
+drop_flow(struct Flow *flow) {
+    struct PendingDatagram *pending;
+
+    while ((pending = STAILQ_FIRST(&flow->pending)) != NULL) {
+        STAILQ_REMOVE_HEAD(&flow->pending, entries);
+        free(pending);
+    }
+    flow->pending_count = 0;
+
+    free(flow->initial);
+    flow->initial = NULL;
+
+    flow->state = FLOW_DROPPING;
+}
+
+static void
+close_flow(struct Flow *flow, struct ev_loop *loop) {
+    if (flow->listener->access_log)
+        log_flow(flow);
+
+    if (flow->state == FLOW_RELAYING) {
+        ev_io_stop(loop, &flow->watcher);
+        if (close(flow->watcher.fd) < 0)
+            warn("close failed: %s", strerror(errno));
+    }
+    ev_timer_stop(loop, &flow->timer);
+    drop_flow(flow);
+
+    LIST_REMOVE(flow, bucket_entries);
+    if (flow->client_cid_len > 0)
+        LIST_REMOVE(flow, client_cid_entries);
+    if (flow->server_cid_len > 0) {
+        LIST_REMOVE(flow, server_cid_entries);
+        server_cid_lengths[flow->server_cid_len]--;
+    }
+    TAILQ_REMOVE(&flows, flow, entries);
+
+    uncount_connection(flow->listener);
+    backend_server_release(flow->backend_server);
+    listener_ref_put(flow->listener);
+    free(flow);
+}
+
+static void
+log_flow(const struct Flow *flow) {
+    char client_address[ADDRESS_BUFFER_SIZE];
+    char listener_address[ADDRESS_BUFFER_SIZE];
+    char server_address[ADDRESS_BUFFER_SIZE] = "-";
+
+    display_sockaddr(&flow->client_addr, client_address,
+            sizeof(client_address));
+    display_address(flow->listener->address, listener_address,
+            sizeof(listener_address));
+    if (flow->server_addr_len > 0)
+        display_sockaddr(&flow->server_addr, server_address,
+                sizeof(server_address));
+
+    log_msg(flow->listener->access_log,
+           LOG_NOTICE,
+           "%s -> %s -> %s [%.*s] quic %zu/%zu bytes tx %zu/%zu bytes rx %1.3f seconds",
+           client_address,
+           listener_address,
+           server_address,
+           (int)flow->hostname_len,
+           flow->hostname,
+           flow->server_tx_bytes,
+           flow->client_rx_bytes,
+           flow->client_tx_bytes,
+           flow->server_rx_bytes,
+           MAX(ev_now(EV_DEFAULT), flow->established_timestamp) -
+               flow->established_timestamp);
+}
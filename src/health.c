@@ -0,0 +1,546 @@
+/*
+ * Copyright (c) 2011 and 2012, Dustin Lundquist <dustin@null-ptr.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Active health checks of the servers of backend pools: each server is
+ * connected to in turn on the event loop, and for TLS checks sent a client
+ * hello it must answer with a server hello. Servers failing enough checks
+ * in a row are skipped by the balancer until they pass enough in a row.
+ *
+ * Servers of any pool which refuse enough connections in a row, or do not
+ * accept them in time, are likewise ejected for a while.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h> /* close */
+#include <fcntl.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <ev.h>
+#include "health.h"
+#include "balancer.h"
+#include "address.h"
+#include "logger.h"
+
+
+/* Length of a TLS record header and handshake message type */
+#define SERVER_HELLO_LEN 6
+
+
+struct HealthCheck {
+    struct BackendServer *server;
+    struct HealthCheckConfig config;
+    struct ev_timer timer;          /* until the next check, or its timeout */
+    struct ev_io watcher;           /* connection of the check in progress */
+    uint8_t response[SERVER_HELLO_LEN];
+    size_t response_len;
+    unsigned int successes;         /* consecutive results */
+    unsigned int failures;
+    unsigned long passed, failed;
+    unsigned long transitions;
+    unsigned long pass;             /* of start_health_checks() */
+    LIST_ENTRY(HealthCheck) entries;
+};
+
+struct Ejection {
+    struct BackendServer *server;
+    struct ev_timer timer;          /* until the server is readmitted */
+    LIST_ENTRY(Ejection) entries;
+};
+
+
+static LIST_HEAD(, HealthCheck) checks = LIST_HEAD_INITIALIZER(checks);
+static LIST_HEAD(, Ejection) ejections = LIST_HEAD_INITIALIZER(ejections);
+static unsigned long pass = 0;
+
+/* Offered in the client hello of TLS checks */
+static const uint8_t hello_cipher_suites[] = {
+    0x13, 0x01, 0x13, 0x02, 0x13, 0x03,     /* TLS 1.3 */
+    0xc0, 0x2b, 0xc0, 0x2f, 0xc0, 0x2c, 0xc0, 0x30,     /* ECDHE GCM */
+    0xcc, 0xa9, 0xcc, 0xa8,                 /* ECDHE ChaCha20 */
+    0x00, 0x9c, 0x00, 0x2f,                 /* RSA */
+};
+
+static const uint8_t hello_extensions[] = {
+    0x00, 0x0a, 0x00, 0x08,                 /* supported groups */
+        0x00, 0x06, 0x00, 0x1d, 0x00, 0x17, 0x00, 0x18,
+    0x00, 0x0b, 0x00, 0x02,                 /* EC point formats */
+        0x01, 0x00,
+    0x00, 0x0d, 0x00, 0x12,                 /* signature algorithms */
+        0x00, 0x10, 0x04, 0x03, 0x08, 0x04, 0x04, 0x01, 0x05, 0x03,
+        0x08, 0x05, 0x05, 0x01, 0x08, 0x06, 0x06, 0x01,
+    0x00, 0x2b, 0x00, 0x05,                 /* supported versions */
+        0x04, 0x03, 0x04, 0x03, 0x03,
+    0x00, 0x33, 0x00, 0x02,                 /* key share, none offered */
+        0x00, 0x00,
+};
+
+
+static void start_server_check(struct BackendServer *,
+        const struct HealthCheckConfig *, struct ev_loop *);
+static int checkable(const struct BackendServer *);
+static void remove_check(struct HealthCheck *, struct ev_loop *);
+static void check_timer_cb(struct ev_loop *, struct ev_timer *, int);
+static void check_cb(struct ev_loop *, struct ev_io *, int);
+static void begin_check(struct HealthCheck *, struct ev_loop *);
+static void end_check(struct HealthCheck *, struct ev_loop *, int,
+        const char *);
+static ev_tstamp next_check_delay(const struct HealthCheckConfig *);
+static void eject_timer_cb(struct ev_loop *, struct ev_timer *, int);
+static void end_ejection(struct Ejection *, struct ev_loop *);
+static uint8_t *put_uint16(uint8_t *, size_t);
+static uint8_t *put_uint24(uint8_t *, size_t);
+
+
+/*
+ * Check the servers of each pool configured for health checks, starting
+ * checks of new servers, updating those of servers still in a pool, and
+ * stopping those of servers no longer in one
+ */
+void
+start_health_checks(const struct Table_head *tables, struct ev_loop *loop) {
+    const struct Table *table;
+    const struct Backend *backend;
+
+    pass++;
+
+    SLIST_FOREACH(table, tables, entries) {
+        STAILQ_FOREACH(backend, &table->backends, entries) {
+            const struct Balancer *balancer = backend->balancer;
+
+            if (balancer == NULL || balancer->check.type == CHECK_NONE)
+                continue;
+
+            for (size_t i = 0; i < balancer->len; i++)
+                start_server_check(balancer->members[i].server,
+                        &balancer->check, loop);
+        }
+    }
+
+    struct HealthCheck *check = LIST_FIRST(&checks);
+    while (check != NULL) {
+        struct HealthCheck *next = LIST_NEXT(check, entries);
+
+        if (check->pass != pass)
+            remove_check(check, loop);
+
+        check = next;
+    }
+}
+
+void
+stop_health_checks(struct ev_loop *loop) {
+    struct HealthCheck *check;
+    struct Ejection *ejection;
+
+    while ((check = LIST_FIRST(&checks)) != NULL)
+        remove_check(check, loop);
+    while ((ejection = LIST_FIRST(&ejections)) != NULL)
+        end_ejection(ejection, loop);
+}
+
+void
+log_health_stats() {
+    const struct HealthCheck *check;
+    const struct Ejection *ejection;
+
+    LIST_FOREACH(check, &checks, entries) {
+        char address[ADDRESS_BUFFER_SIZE];
+
+        notice("server %s: %s, %lu checks passed, %lu failed, "
+                "%lu state changes",
+                display_address(check->server->address,
+                    address, sizeof(address)),
+                check->server->healthy ? "up" : "down",
+                check->passed, check->failed, check->transitions);
+    }
+
+    LIST_FOREACH(ejection, &ejections, entries) {
+        char address[ADDRESS_BUFFER_SIZE];
+
+        notice("server %s: ejected after failed connections",
+                display_address(ejection->server->address,
+                    address, sizeof(address)));
+    }
+}
+
+/*
+ * Count a connection to a pool's server made, or failed by the server, and
+ * eject the server after the pool's limit of failures in a row
+ */
+void
+report_server_connect(struct BackendServer *server, int success,
+        struct ev_loop *loop) {
+    const struct Balancer *balancer = server->balancer;
+
+    if (success) {
+        server->connect_failures = 0;
+        return;
+    }
+
+    server->connect_failures++;
+    if (server->ejected || balancer == NULL || balancer->eject == 0 ||
+            server->connect_failures < balancer->eject)
+        return;
+
+    struct Ejection *ejection = malloc(sizeof(struct Ejection));
+    if (ejection == NULL) {
+        err("%s: malloc", __func__);
+        return;
+    }
+
+    char address[ADDRESS_BUFFER_SIZE];
+    notice("server %s ejected for %g seconds after %u failed connections",
+            display_address(server->address, address, sizeof(address)),
+            balancer->eject_time, server->connect_failures);
+
+    ejection->server = backend_server_ref_get(server);
+    server->ejected = 1;
+    balancer_health_changed();
+
+    ev_timer_init(&ejection->timer, eject_timer_cb, balancer->eject_time, 0.0);
+    ejection->timer.data = ejection;
+    ev_timer_start(loop, &ejection->timer);
+
+    LIST_INSERT_HEAD(&ejections, ejection, entries);
+}
+
+/*
+ * Write the client hello of TLS checks, without a server name, and with an
+ * empty key share so TLS 1.3 servers may answer with a hello retry request
+ *
+ * Returns its length, or 0 if the buffer is too small
+ */
+size_t
+build_health_check_hello(uint8_t *buffer, size_t size) {
+    size_t hello_len = 2 + 32 + 1 + 2 + sizeof(hello_cipher_suites) + 2 +
+        2 + sizeof(hello_extensions);
+    size_t len = 5 + 4 + hello_len;
+
+    if (size < len)
+        return 0;
+
+    uint8_t *p = buffer;
+    *p++ = 0x16;                            /* handshake record */
+    *p++ = 0x03;
+    *p++ = 0x01;
+    p = put_uint16(p, 4 + hello_len);
+    *p++ = 0x01;                            /* client hello */
+    p = put_uint24(p, hello_len);
+    *p++ = 0x03;
+    *p++ = 0x03;
+    for (int i = 0; i < 32; i++)            /* random */
+        *p++ = (uint8_t)random();
+    *p++ = 0x00;                            /* session ID */
+    p = put_uint16(p, sizeof(hello_cipher_suites));
+    memcpy(p, hello_cipher_suites, sizeof(hello_cipher_suites));
+    p += sizeof(hello_cipher_suites);
+    *p++ = 0x01;                            /* null compression */
+    *p++ = 0x00;
+    p = put_uint16(p, sizeof(hello_extensions));
+    memcpy(p, hello_extensions, sizeof(hello_extensions));
+
+    return len;
+}
+
+static void
+start_server_check(struct BackendServer *server,
+        const struct HealthCheckConfig *config, struct ev_loop *loop) {
+    struct HealthCheck *check = server->check;
+
+    if (check != NULL) {
+        check->config = *config;
+        check->pass = pass;
+        return;
+    }
+
+    if (!checkable(server)) {
+        char address[ADDRESS_BUFFER_SIZE];
+
+        warn("Not checking health of server %s, only servers with an IP "
+                "address and port or a unix socket are checked",
+                display_address(server->address, address, sizeof(address)));
+        return;
+    }
+
+    check = calloc(1, sizeof(struct HealthCheck));
+    if (check == NULL) {
+        err("%s: calloc", __func__);
+        return;
+    }
+
+    check->server = backend_server_ref_get(server);
+    server->check = check;
+    check->config = *config;
+    check->pass = pass;
+    ev_init(&check->timer, check_timer_cb);
+    check->timer.data = check;
+    ev_init(&check->watcher, check_cb);
+    check->watcher.data = check;
+
+    LIST_INSERT_HEAD(&checks, check, entries);
+
+    /* Spread the first checks of the servers over the interval */
+    ev_timer_set(&check->timer, config->interval *
+            ((double)random() / RAND_MAX), 0.0);
+    ev_timer_start(loop, &check->timer);
+}
+
+static int
+checkable(const struct BackendServer *server) {
+    if (!address_is_sockaddr(server->address))
+        return 0;
+
+    return address_sa(server->address)->sa_family == AF_UNIX ||
+        address_port(server->address) != 0;
+}
+
+/* Stop checking the server, which is taken to be healthy */
+static void
+remove_check(struct HealthCheck *check, struct ev_loop *loop) {
+    struct BackendServer *server = check->server;
+
+    ev_timer_stop(loop, &check->timer);
+    if (ev_is_active(&check->watcher)) {
+        ev_io_stop(loop, &check->watcher);
+        close(check->watcher.fd);
+    }
+    LIST_REMOVE(check, entries);
+
+    if (!server->healthy)
+        balancer_health_changed();
+    server->healthy = 1;
+    server->check = NULL;
+    backend_server_ref_put(server);
+
+    free(check);
+}
+
+/* Time for the next check, or the current one timed out */
+static void
+check_timer_cb(struct ev_loop *loop, struct ev_timer *w, int revents) {
+    struct HealthCheck *check = (struct HealthCheck *)w->data;
+
+    if (revents & EV_TIMER) {
+        if (ev_is_active(&check->watcher))
+            end_check(check, loop, 0, "timed out");
+        else
+            begin_check(check, loop);
+    }
+}
+
+static void
+begin_check(struct HealthCheck *check, struct ev_loop *loop) {
+    const struct sockaddr *addr = address_sa(check->server->address);
+
+    int sockfd = socket(addr->sa_family, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        end_check(check, loop, 0, strerror(errno));
+        return;
+    }
+
+    int flags = fcntl(sockfd, F_GETFL, 0);
+    fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+
+    if (connect(sockfd, addr, address_sa_len(check->server->address)) < 0 &&
+            errno != EINPROGRESS) {
+        const char *reason = strerror(errno);
+
+        close(sockfd);
+        end_check(check, loop, 0, reason);
+        return;
+    }
+
+    check->response_len = 0;
+    ev_io_set(&check->watcher, sockfd, EV_WRITE);
+    ev_io_start(loop, &check->watcher);
+
+    ev_timer_set(&check->timer, check->config.interval, 0.0);
+    ev_timer_start(loop, &check->timer);
+}
+
+static void
+check_cb(struct ev_loop *loop, struct ev_io *w, int revents) {
+    struct HealthCheck *check = (struct HealthCheck *)w->data;
+    int sockfd = w->fd;
+
+    if (revents & EV_WRITE) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+
+        if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+            error = errno;
+        if (error != 0) {
+            end_check(check, loop, 0, strerror(error));
+            return;
+        }
+
+        if (check->config.type == CHECK_TCP) {
+            end_check(check, loop, 1, NULL);
+            return;
+        }
+
+        uint8_t hello[512];
+        size_t hello_len = build_health_check_hello(hello, sizeof(hello));
+        if (send(sockfd, hello, hello_len, MSG_NOSIGNAL) !=
+                (ssize_t)hello_len) {
+            end_check(check, loop, 0, "client hello not sent");
+            return;
+        }
+
+        ev_io_stop(loop, w);
+        ev_io_set(w, sockfd, EV_READ);
+        ev_io_start(loop, w);
+    } else if (revents & EV_READ) {
+        ssize_t result = recv(sockfd, check->response + check->response_len,
+                sizeof(check->response) - check->response_len, 0);
+        if (result < 0 && (errno == EAGAIN || errno == EINTR))
+            return;
+        if (result < 0) {
+            end_check(check, loop, 0, strerror(errno));
+            return;
+        }
+        if (result == 0) {
+            end_check(check, loop, 0, "connection closed");
+            return;
+        }
+
+        check->response_len += (size_t)result;
+        if (check->response_len < sizeof(check->response))
+            return;
+
+        /* A handshake record holding a server hello, or a hello retry
+         * request which has the same type */
+        if (check->response[0] == 0x16 && check->response[1] == 0x03 &&
+                check->response[5] == 0x02)
+            end_check(check, loop, 1, NULL);
+        else
+            end_check(check, loop, 0, "no server hello");
+    }
+}
+
+/*
+ * Count the result of a check, changing the server's state after enough of
+ * the same result in a row, and schedule the next check
+ */
+static void
+end_check(struct HealthCheck *check, struct ev_loop *loop, int success,
+        const char *reason) {
+    struct BackendServer *server = check->server;
+    char address[ADDRESS_BUFFER_SIZE];
+
+    if (ev_is_active(&check->watcher)) {
+        ev_io_stop(loop, &check->watcher);
+        close(check->watcher.fd);
+    }
+    ev_timer_stop(loop, &check->timer);
+
+    display_address(server->address, address, sizeof(address));
+
+    if (success) {
+        check->passed++;
+        check->successes++;
+        check->failures = 0;
+
+        if (!server->healthy && check->successes >= check->config.rise) {
+            notice("server %s is up after %u successful health checks",
+                    address, check->successes);
+            server->healthy = 1;
+            check->transitions++;
+            balancer_health_changed();
+        }
+    } else {
+        check->failed++;
+        check->failures++;
+        check->successes = 0;
+
+        debug("health check of server %s failed: %s", address, reason);
+
+        if (server->healthy && check->failures >= check->config.fall) {
+            notice("server %s is down after %u failed health checks: %s",
+                    address, check->failures, reason);
+            server->healthy = 0;
+            check->transitions++;
+            balancer_health_changed();
+        }
+    }
+
+    ev_timer_set(&check->timer, next_check_delay(&check->config), 0.0);
+    ev_timer_start(loop, &check->timer);
+}
+
+static void
+eject_timer_cb(struct ev_loop *loop, struct ev_timer *w, int revents) {
+    struct Ejection *ejection = (struct Ejection *)w->data;
+
+    if (revents & EV_TIMER) {
+        char address[ADDRESS_BUFFER_SIZE];
+
+        notice("server %s readmitted", display_address(
+                    ejection->server->address, address, sizeof(address)));
+        end_ejection(ejection, loop);
+    }
+}
+
+/* Readmit the server, with another run of failures to be ejected again */
+static void
+end_ejection(struct Ejection *ejection, struct ev_loop *loop) {
+    struct BackendServer *server = ejection->server;
+
+    ev_timer_stop(loop, &ejection->timer);
+    LIST_REMOVE(ejection, entries);
+
+    server->ejected = 0;
+    server->connect_failures = 0;
+    balancer_health_changed();
+    backend_server_ref_put(server);
+
+    free(ejection);
+}
+
+/* The interval, varied randomly by up to the jitter */
+static ev_tstamp
+next_check_delay(const struct HealthCheckConfig *config) {
+    double jitter = (double)config->jitter / 100.0;
+
+    return config->interval *
+        (1.0 + jitter * (2.0 * (double)random() / RAND_MAX - 1.0));
+}
+
+static uint8_t *
+put_uint16(uint8_t *p, size_t value) {
+    *p++ = (uint8_t)(value >> 8);
+    *p++ = (uint8_t)value;
+
+    return p;
+}
+
+static uint8_t *
+put_uint24(uint8_t *p, size_t value) {
+    *p++ = (uint8_t)(value >> 16);
+
+    return put_uint16(p, value);
+}
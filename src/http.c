@@ -24,19 +24,39 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 #include <stdio.h>
-#include <stdlib.h> /* malloc() */
-#include <string.h> /* strncpy() */
-#include <strings.h> /* strncasecmp() */
-#include <ctype.h> /* isblank(), isdigit() */
+#include <ctype.h> /* isblank(), isdigit(), tolower() */
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 #include "http.h"
+#include "http2.h"
 #include "protocol.h"
 
-#define SERVER_NAME_LEN 256
+/* Longest host value kept, a hostname and the port to be removed from it */
+#define HOST_VALUE_MAX (PARSE_HOSTNAME_MAX + PARSE_HOST_PORT_MAX)
 
+/*
+ * Request parser states, HTTP_PREFACE is the initial (zeroed) state.
+ */
+enum HTTPState {
+    HTTP_PREFACE,
+    HTTP_REQUEST_METHOD,
+    HTTP_REQUEST_TARGET,
+    HTTP_REQUEST_AUTHORITY,
+    HTTP_REQUEST_LINE,
+    HTTP_LINE_START,
+    HTTP_BLANK_LINE,
+    HTTP_HEADER_NAME,
+    HTTP_HEADER_WHITESPACE,
+    HTTP_HEADER_VALUE,
+    HTTP_SKIP_LINE,
+    HTTP2_FRAMES,
+};
 
-static int parse_http_header(const char *, size_t, char **);
-static int get_header(const char *, const char *, size_t, char **);
-static size_t next_header(const char **, size_t *);
+
+static int parse_http_header(struct ParseState *, const char *, size_t);
+static int host_header_value(struct ParseState *);
+static size_t find_newline(const char *, size_t);
 
 
 static const char http_503[] =
@@ -45,6 +65,10 @@ static const char http_503[] =
     "Connection: close\r\n\r\n"
     "Backend not available";
 
+static const char host_header[] = "host:";
+static const char absolute_uri_scheme[] = "https://";
+static const char http2_preface[] = HTTP2_PREFACE;
+
 const struct Protocol *const http_protocol = &(struct Protocol){
     .name = "http",
     .default_port = 80,
@@ -54,100 +78,216 @@ const struct Protocol *const http_protocol = &(struct Protocol){
 };
 
 /*
- * Parses a HTTP request for the Host: header
+ * Parses a HTTP request for the Host: header, or the host of an absolute URI
+ * request target (RFC7230 section 5.4) which takes precedence over it. An
+ * HTTP/2 connection preface (prior knowledge, RFC7540 section 3.4) is
+ * followed by the :authority of the first request instead.
+ *
+ * The parser is incremental: each call should be passed only the data
+ * received since the previous call with the same state.
+ *
+ * The hostname is copied to state->hostname, which is normalized by
+ * normalize_hostname().
  *
  * Returns:
- *  >=0  - length of the hostname and updates *hostname
- *         caller is responsible for freeing *hostname
+ *  >=0  - length of the hostname in state->hostname
  *  -1   - Incomplete request
  *  -2   - No Host header included in this request
- *  -3   - Invalid hostname pointer
- *  -4   - malloc failure
  *  < -4 - Invalid HTTP request
  *
  */
 static int
-parse_http_header(const char* data, size_t data_len, char **hostname) {
-    int result, i;
+parse_http_header(struct ParseState *state, const char *data, size_t data_len) {
+    int result;
 
-    if (hostname == NULL)
-        return -3;
+    for (size_t i = 0; i < data_len; i++) {
+        char c = data[i];
 
-    result = get_header("Host:", data, data_len, hostname);
-    if (result < 0)
-        return result;
+        switch (state->u.http.state) {
+            case HTTP_PREFACE:
+                if (c == http2_preface[state->u.http.match]) {
+                    if (++state->u.http.match < sizeof(http2_preface) - 1)
+                        break;
 
-    /*
-     *  if the user specifies the port in the request, it is included here.
-     *  Host: example.com:80
-     *  Host: [2001:db8::1]:8080
-     *  so we trim off port portion
-     */
-    for (i = result - 1; i >= 0; i--)
-        if ((*hostname)[i] == ':') {
-            (*hostname)[i] = '\0';
-            result = i;
-            break;
-        } else if (!isdigit((*hostname)[i])) {
-            break;
-        }
+                    state->u.http.state = HTTP2_FRAMES;
+                    result = parse_http2_frames(state, data + i + 1,
+                            data_len - i - 1);
+                    return result >= 0 ? host_header_value(state) : result;
+                }
 
-    return result;
-}
+                /* Not HTTP/2, parse what matched so far as HTTP/1 */
+                state->u.http.state = HTTP_REQUEST_METHOD;
+                result = parse_http_header(state, http2_preface,
+                        state->u.http.match);
+                if (result != -1)
+                    return result;
+                return parse_http_header(state, data + i, data_len - i);
+            case HTTP2_FRAMES:
+                result = parse_http2_frames(state, data, data_len);
+                return result >= 0 ? host_header_value(state) : result;
+            case HTTP_REQUEST_METHOD:
+                if (c == ' ') {
+                    state->u.http.match = 0;
+                    state->u.http.state = HTTP_REQUEST_TARGET;
+                } else if (c == '\n') {
+                    state->u.http.state = HTTP_LINE_START;
+                }
+                break;
+            case HTTP_REQUEST_TARGET:
+                /* match either http:// or https:// */
+                if (state->u.http.match == 4 && c == ':')
+                    state->u.http.match++;
 
-static int
-get_header(const char *header, const char *data, size_t data_len, char **value) {
-    size_t len, header_len;
+                if (tolower((unsigned char)c) != absolute_uri_scheme[state->u.http.match])
+                    state->u.http.state = c == '\n' ? HTTP_LINE_START : HTTP_REQUEST_LINE;
+                else if (++state->u.http.match == sizeof(absolute_uri_scheme) - 1)
+                    state->u.http.state = HTTP_REQUEST_AUTHORITY;
+                break;
+            case HTTP_REQUEST_AUTHORITY:
+                if (c == '/' || c == '?' || c == '#' || c == ' ' ||
+                        c == '\r' || c == '\n') {
+                    if (state->hostname_len > 0)
+                        return host_header_value(state);
 
-    header_len = strlen(header);
+                    state->u.http.state = c == '\n' ? HTTP_LINE_START : HTTP_REQUEST_LINE;
+                    break;
+                }
 
-    /* loop through headers stopping at first blank line */
-    while ((len = next_header(&data, &data_len)) != 0)
-        if (len > header_len && strncasecmp(header, data, header_len) == 0) {
-            /* Eat leading whitespace */
-            while (header_len < len && isblank(data[header_len]))
-                header_len++;
+                if (c == '@') { /* discard userinfo */
+                    state->hostname_len = 0;
+                    break;
+                }
 
-            *value = malloc(len - header_len + 1);
-            if (*value == NULL)
-                return -4;
+                if (state->hostname_len == HOST_VALUE_MAX)
+                    return -5;
 
-            strncpy(*value, data + header_len, len - header_len);
-            (*value)[len - header_len] = '\0';
+                state->hostname[state->hostname_len++] = c;
+                break;
+            case HTTP_REQUEST_LINE:
+            case HTTP_SKIP_LINE:
+                i += find_newline(data + i, data_len - i);
+                if (i < data_len)
+                    state->u.http.state = HTTP_LINE_START;
+                break;
+            case HTTP_LINE_START:
+                if (c == '\n') /* blank line: end of headers */
+                    return -2;
+                if (c == '\r') {
+                    state->u.http.state = HTTP_BLANK_LINE;
+                    break;
+                }
+                state->u.http.match = 0;
+                state->u.http.state = HTTP_HEADER_NAME;
+                /* fall through */
+            case HTTP_HEADER_NAME:
+                if (tolower((unsigned char)c) != host_header[state->u.http.match])
+                    state->u.http.state = c == '\n' ? HTTP_LINE_START : HTTP_SKIP_LINE;
+                else if (++state->u.http.match == sizeof(host_header) - 1)
+                    state->u.http.state = HTTP_HEADER_WHITESPACE;
+                break;
+            case HTTP_BLANK_LINE:
+                if (c == '\n')
+                    return -2;
+                state->u.http.state = HTTP_SKIP_LINE;
+                break;
+            case HTTP_HEADER_WHITESPACE:
+                if (isblank((unsigned char)c))
+                    break;
+                state->u.http.state = HTTP_HEADER_VALUE;
+                /* fall through */
+            case HTTP_HEADER_VALUE:
+                if (c == '\n')
+                    return host_header_value(state);
 
-            return len - header_len;
-        }
+                /* Trailing whitespace is removed, so need not be kept */
+                if (state->hostname_len == HOST_VALUE_MAX) {
+                    if (c == '\r' || isblank((unsigned char)c))
+                        break;
+                    return -5;
+                }
 
-    /* If there is no data left after reading all the headers then we do not
-     * have a complete HTTP request, there must be a blank line */
-    if (data_len == 0)
-        return -1;
+                state->hostname[state->hostname_len++] = c;
+                break;
+        }
+    }
 
-    return -2;
+    return -1;
 }
 
+/*
+ * Returns the offset of the first newline in data, or len if there is none.
+ *
+ * Most of a request is skipped over looking for the end of the line, so this
+ * compares 32 (AVX2) or 16 (SSE2) bytes at a time where available.
+ */
 static size_t
-next_header(const char **data, size_t *len) {
-    size_t header_len;
-
-    /* perhaps we can optimize this to reuse the value of header_len, rather
-     * than scanning twice.
-     * Walk our data stream until the end of the header */
-    while (*len > 2 && (*data)[0] != '\r' && (*data)[1] != '\n') {
-        (*len)--;
-        (*data)++;
+find_newline(const char *data, size_t len) {
+    size_t i = 0;
+
+#ifdef __AVX2__
+    const __m256i newline32 = _mm256_set1_epi8('\n');
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(data + i));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(
+                _mm256_cmpeq_epi8(chunk, newline32));
+
+        if (mask != 0)
+            return i + (size_t)__builtin_ctz(mask);
+    }
+#endif
+#ifdef __SSE2__
+    const __m128i newline16 = _mm_set1_epi8('\n');
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(data + i));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(
+                _mm_cmpeq_epi8(chunk, newline16));
+
+        if (mask != 0)
+            return i + (size_t)__builtin_ctz(mask);
     }
+#endif
+
+    for (; i < len; i++)
+        if (data[i] == '\n')
+            return i;
+
+    return len;
+}
+
+/*
+ * Trim the Host header value accumulated in state->hostname, returning the
+ * length of the hostname, or -5 if it is longer than a hostname may be
+ */
+static int
+host_header_value(struct ParseState *state) {
+    int i, len = (int)state->hostname_len;
+
+    /* Trailing carriage return and whitespace */
+    while (len > 0 && (state->hostname[len - 1] == '\r' ||
+                isblank((unsigned char)state->hostname[len - 1])))
+        len--;
+
+    /*
+     *  if the user specifies the port in the request, it is included here.
+     *  Host: example.com:80
+     *  Host: [2001:db8::1]:8080
+     *  so we trim off port portion
+     */
+    for (i = len - 1; i >= 0; i--)
+        if (state->hostname[i] == ':') {
+            len = i;
+            state->hostname_flags |= HOSTNAME_PORT_REMOVED;
+            break;
+        } else if (!isdigit((unsigned char)state->hostname[i])) {
+            break;
+        }
 
-    /* advanced past the <CR><LF> pair */
-    *data += 2;
-    *len -= 2;
+    if (len > PARSE_HOSTNAME_MAX)
+        return -5;
 
-    /* Find the length of the next header */
-    header_len = 0;
-    while (*len > header_len + 1
-            && (*data)[header_len] != '\r'
-            && (*data)[header_len + 1] != '\n')
-        header_len++;
+    state->hostname_len = (size_t)len;
 
-    return header_len;
+    return normalize_hostname(state);
 }
@@ -0,0 +1,557 @@
+/*
+ * Copyright (c) 2011 and 2012, Dustin Lundquist <dustin@null-ptr.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Just enough of HTTP/2 (RFC7540) and HPACK (RFC7541) to find the authority
+ * of the first request on a cleartext connection with prior knowledge, so
+ * it can be routed like an HTTP/1 request without terminating HTTP/2.
+ *
+ * The HPACK dynamic table is not maintained: the :authority (or Host) field
+ * is recognized by a literal name or its static table index, which is how
+ * clients send it in the first request of a connection.
+ */
+#include <stdint.h>
+#include <string.h>
+#include "http2.h"
+#include "protocol.h"
+
+#define FRAME_HEADER_LEN 9
+#define MAX_FRAME_SIZE 16384    /* initial SETTINGS_MAX_FRAME_SIZE */
+
+#define FRAME_TYPE_HEADERS 0x1
+#define FRAME_TYPE_CONTINUATION 0x9
+
+#define FLAG_END_HEADERS 0x04
+#define FLAG_PADDED 0x08
+#define FLAG_PRIORITY 0x20
+
+/* HPACK static table (RFC7541 Appendix A) indexes */
+#define STATIC_AUTHORITY 1
+#define STATIC_HOST 38
+
+#ifndef MIN
+#define MIN(X, Y) ((X) < (Y) ? (X) : (Y))
+#endif
+
+/*
+ * Frame parser states, FRAME_HEADER is the initial (zeroed) state
+ */
+enum FrameState {
+    FRAME_HEADER,
+    FRAME_PAD_LENGTH,
+    FRAME_PRIORITY,
+    FRAME_HEADER_BLOCK,
+    FRAME_SKIP,
+};
+
+/*
+ * Header block decoder states, HPACK_FIELD is the initial (zeroed) state
+ */
+enum HPACKState {
+    HPACK_FIELD,
+    HPACK_INDEX,
+    HPACK_NAME_INDEX,
+    HPACK_NAME_LENGTH,
+    HPACK_NAME,
+    HPACK_VALUE_LENGTH,
+    HPACK_VALUE,
+};
+
+enum HPACKField {
+    FIELD_OTHER,
+    FIELD_AUTHORITY,
+};
+
+
+static int begin_frame(struct ParseState *);
+static int begin_header_block(struct ParseState *);
+static int end_header_block_fragment(struct ParseState *);
+static int decode_header_block(struct ParseState *, const uint8_t *, size_t);
+static int decode_integer(struct ParseState *, uint8_t, unsigned int);
+static int end_integer(struct ParseState *);
+static int decode_string(struct ParseState *, const uint8_t *, size_t);
+static int end_string(struct ParseState *);
+static int emit_char(struct ParseState *, uint8_t);
+
+
+/*
+ * The HPACK Huffman code (RFC7541 Appendix B) is canonical, so it is
+ * described by the symbols ordered by code length, and the first code,
+ * index of the first symbol and number of symbols of each length.
+ */
+static const uint16_t huffman_symbols[257] = {
+     48,  49,  50,  97,  99, 101, 105, 111, 115, 116,  32,  37,
+     45,  46,  47,  51,  52,  53,  54,  55,  56,  57,  61,  65,
+     95,  98, 100, 102, 103, 104, 108, 109, 110, 112, 114, 117,
+     58,  66,  67,  68,  69,  70,  71,  72,  73,  74,  75,  76,
+     77,  78,  79,  80,  81,  82,  83,  84,  85,  86,  87,  89,
+    106, 107, 113, 118, 119, 120, 121, 122,  38,  42,  44,  59,
+     88,  90,  33,  34,  40,  41,  63,  39,  43, 124,  35,  62,
+      0,  36,  64,  91,  93, 126,  94, 125,  60,  96, 123,  92,
+    195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161,
+    167, 172, 176, 177, 179, 209, 216, 217, 227, 229, 230, 129,
+    132, 133, 134, 136, 146, 154, 156, 160, 163, 164, 169, 170,
+    173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+    233,   1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150,
+    151, 152, 155, 157, 158, 165, 166, 168, 174, 175, 180, 182,
+    183, 188, 191, 197, 231, 239,   9, 142, 144, 145, 148, 159,
+    171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+    200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243,
+    255, 203, 204, 211, 212, 214, 221, 222, 223, 241, 244, 245,
+    246, 247, 248, 250, 251, 252, 253, 254,   2,   3,   4,   5,
+      6,   7,   8,  11,  12,  14,  15,  16,  17,  18,  19,  20,
+     21,  23,  24,  25,  26,  27,  28,  29,  30,  31, 127, 220,
+    249,  10,  13,  22, 256,
+};
+
+static const uint32_t huffman_first_code[31] = {
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000014, 0x0000005c, 0x000000f8, 0x00000000, 0x000003f8, 0x000007fa,
+    0x00000ffa, 0x00001ff8, 0x00003ffc, 0x00007ffc, 0x00000000, 0x00000000,
+    0x00000000, 0x0007fff0, 0x000fffe6, 0x001fffdc, 0x003fffd2, 0x007fffd8,
+    0x00ffffea, 0x01ffffec, 0x03ffffe0, 0x07ffffde, 0x0fffffe2, 0x00000000,
+    0x3ffffffc,
+};
+
+static const uint16_t huffman_first_index[31] = {
+      0,   0,   0,   0,   0,   0,  10,  36,  68,   0,  74,  79,
+     82,  84,  90,  92,   0,   0,   0,  95,  98, 106, 119, 145,
+    174, 186, 190, 205, 224,   0, 253,
+};
+
+static const uint16_t huffman_count[31] = {
+      0,   0,   0,   0,   0,  10,  26,  32,   6,   0,   5,   3,
+      2,   6,   2,   3,   0,   0,   0,   3,   8,  13,  26,  29,
+     12,   4,  15,  19,  29,   0,   4,
+};
+
+#define HUFFMAN_EOS 256
+#define HUFFMAN_MAX_BITS 30
+
+
+/*
+ * Parse HTTP/2 frames following the connection preface for the authority of
+ * the first request, which is copied to state->hostname without
+ * normalization.
+ *
+ * Returns:
+ *  >=0  - length of the authority in state->hostname
+ *  -1   - Incomplete request
+ *  -2   - No authority included in the first request
+ *  < -4 - Invalid HTTP/2 request
+ */
+int
+parse_http2_frames(struct ParseState *state, const char *data, size_t data_len) {
+    const uint8_t *pos = (const uint8_t *)data;
+    int result;
+
+    for (;;) {
+        if (state->u.http.h2.state == FRAME_HEADER_BLOCK &&
+                state->u.http.h2.block_remaining == 0) {
+            result = end_header_block_fragment(state);
+            if (result != -1)
+                return result;
+        }
+        if (state->u.http.h2.state == FRAME_SKIP &&
+                state->u.http.h2.frame_remaining == 0)
+            state->u.http.h2.state = FRAME_HEADER;
+
+        if (data_len == 0)
+            return -1;
+
+        size_t len;
+        switch (state->u.http.h2.state) {
+            case FRAME_HEADER:
+                len = MIN(data_len,
+                        FRAME_HEADER_LEN - state->u.http.h2.frame_header_len);
+                memcpy(state->u.http.h2.frame_header +
+                        state->u.http.h2.frame_header_len, pos, len);
+                state->u.http.h2.frame_header_len += len;
+                pos += len;
+                data_len -= len;
+
+                if (state->u.http.h2.frame_header_len == FRAME_HEADER_LEN) {
+                    state->u.http.h2.frame_header_len = 0;
+                    result = begin_frame(state);
+                    if (result != -1)
+                        return result;
+                }
+                break;
+            case FRAME_PAD_LENGTH:
+                state->u.http.h2.pad_length = *pos;
+                state->u.http.h2.frame_remaining--;
+                pos++;
+                data_len--;
+
+                result = begin_header_block(state);
+                if (result != -1)
+                    return result;
+                break;
+            case FRAME_PRIORITY:
+                /* Stream dependency and weight, skipped */
+                len = MIN(data_len, state->u.http.h2.frame_remaining -
+                        state->u.http.h2.pad_length -
+                        state->u.http.h2.block_remaining);
+                state->u.http.h2.frame_remaining -= len;
+                pos += len;
+                data_len -= len;
+
+                if (state->u.http.h2.frame_remaining ==
+                        state->u.http.h2.pad_length +
+                        state->u.http.h2.block_remaining)
+                    state->u.http.h2.state = FRAME_HEADER_BLOCK;
+                break;
+            case FRAME_HEADER_BLOCK:
+                len = MIN(data_len, state->u.http.h2.block_remaining);
+                result = decode_header_block(state, pos, len);
+                if (result != -1)
+                    return result;
+
+                state->u.http.h2.block_remaining -= len;
+                state->u.http.h2.frame_remaining -= len;
+                pos += len;
+                data_len -= len;
+                break;
+            case FRAME_SKIP:
+                len = MIN(data_len, state->u.http.h2.frame_remaining);
+                state->u.http.h2.frame_remaining -= len;
+                pos += len;
+                data_len -= len;
+                break;
+        }
+    }
+}
+
+static int
+begin_frame(struct ParseState *state) {
+    const uint8_t *header = state->u.http.h2.frame_header;
+    size_t length = ((size_t)header[0] << 16) + ((size_t)header[1] << 8) +
+        (size_t)header[2];
+    uint8_t type = header[3];
+
+    if (length > MAX_FRAME_SIZE)
+        return -5;
+
+    state->u.http.h2.frame_remaining = length;
+    state->u.http.h2.frame_flags = header[4];
+    state->u.http.h2.pad_length = 0;
+
+    if (state->u.http.h2.continuation) {
+        /* RFC7540 6.10: the header block must continue in the next frame */
+        if (type != FRAME_TYPE_CONTINUATION)
+            return -5;
+
+        state->u.http.h2.block_remaining = length;
+        state->u.http.h2.state = FRAME_HEADER_BLOCK;
+    } else if (type == FRAME_TYPE_HEADERS) {
+        if (state->u.http.h2.frame_flags & FLAG_PADDED) {
+            if (length == 0)
+                return -5;
+            state->u.http.h2.state = FRAME_PAD_LENGTH;
+            return -1;
+        }
+
+        return begin_header_block(state);
+    } else if (type == FRAME_TYPE_CONTINUATION) {
+        return -5;
+    } else {
+        /* SETTINGS, WINDOW_UPDATE and any other frames */
+        state->u.http.h2.state = FRAME_SKIP;
+    }
+
+    return -1;
+}
+
+/*
+ * Locate the header block fragment within a HEADERS frame, once the pad
+ * length if any is known
+ */
+static int
+begin_header_block(struct ParseState *state) {
+    size_t priority_len =
+        state->u.http.h2.frame_flags & FLAG_PRIORITY ? 5 : 0;
+
+    if (state->u.http.h2.pad_length + priority_len >
+            state->u.http.h2.frame_remaining)
+        return -5;
+
+    state->u.http.h2.block_remaining = state->u.http.h2.frame_remaining -
+        state->u.http.h2.pad_length - priority_len;
+    state->u.http.h2.state =
+        priority_len > 0 ? FRAME_PRIORITY : FRAME_HEADER_BLOCK;
+
+    return -1;
+}
+
+static int
+end_header_block_fragment(struct ParseState *state) {
+    if (state->u.http.h2.frame_flags & FLAG_END_HEADERS) {
+        /* Header block ended part way through a field */
+        if (state->u.http.h2.hpack_state != HPACK_FIELD)
+            return -5;
+
+        return -2;
+    }
+
+    state->u.http.h2.continuation = 1;
+    state->u.http.h2.state = FRAME_SKIP; /* padding */
+
+    return -1;
+}
+
+/*
+ * Decode header block fragment data, until the authority is found
+ */
+static int
+decode_header_block(struct ParseState *state, const uint8_t *data, size_t data_len) {
+    size_t i = 0;
+    int result;
+
+    while (i < data_len) {
+        uint8_t c = data[i];
+
+        switch (state->u.http.h2.hpack_state) {
+            case HPACK_FIELD:
+                /* RFC7541 6: field representation, from the high bits */
+                if (c & 0x80) {             /* indexed field */
+                    state->u.http.h2.hpack_state = HPACK_INDEX;
+                    result = decode_integer(state, c, 7);
+                } else if (c & 0x40) {      /* literal, incremental indexing */
+                    state->u.http.h2.hpack_state = HPACK_NAME_INDEX;
+                    result = decode_integer(state, c, 6);
+                } else if (c & 0x20) {      /* dynamic table size update */
+                    state->u.http.h2.hpack_state = HPACK_INDEX;
+                    result = decode_integer(state, c, 5);
+                } else {                    /* literal, without indexing */
+                    state->u.http.h2.hpack_state = HPACK_NAME_INDEX;
+                    result = decode_integer(state, c, 4);
+                }
+                i++;
+                break;
+            case HPACK_NAME_LENGTH:
+            case HPACK_VALUE_LENGTH:
+                if (state->u.http.h2.integer_len == 0)
+                    state->u.http.h2.huffman = (c & 0x80) != 0;
+                /* fall through */
+            case HPACK_INDEX:
+            case HPACK_NAME_INDEX:
+                result = decode_integer(state, c, 7);
+                i++;
+                break;
+            case HPACK_NAME:
+            case HPACK_VALUE: {
+                size_t len = MIN(data_len - i,
+                        state->u.http.h2.string_remaining);
+
+                result = decode_string(state, data + i, len);
+                i += len;
+                break;
+            }
+            default:
+                return -5;
+        }
+
+        if (result == 1)
+            result = end_integer(state);
+        if (result == 0 && state->u.http.h2.string_remaining == 0 &&
+                (state->u.http.h2.hpack_state == HPACK_NAME ||
+                 state->u.http.h2.hpack_state == HPACK_VALUE))
+            result = end_string(state);
+        if (result != 0)
+            return result;
+    }
+
+    return -1;
+}
+
+/*
+ * Decode an integer (RFC7541 5.1) a byte at a time, using prefix_bits of
+ * the first byte.
+ *
+ * Returns 1 when the integer is complete, 0 if more bytes are required or
+ * -5 if it is too large.
+ */
+static int
+decode_integer(struct ParseState *state, uint8_t c, unsigned int prefix_bits) {
+    uint32_t prefix_max = (1U << prefix_bits) - 1;
+
+    if (state->u.http.h2.integer_len++ == 0) {
+        state->u.http.h2.integer = c & prefix_max;
+        if (state->u.http.h2.integer < prefix_max)
+            goto complete;
+        return 0;
+    }
+
+    /* Limit to 28 bits, ample for any length within a frame */
+    if (state->u.http.h2.integer_len > 5)
+        return -5;
+
+    state->u.http.h2.integer += (uint32_t)(c & 0x7f) <<
+        (7 * (state->u.http.h2.integer_len - 2));
+    if (c & 0x80)
+        return 0;
+
+complete:
+    state->u.http.h2.integer_len = 0;
+    return 1;
+}
+
+/*
+ * Act on a complete integer in the current field
+ *
+ * Returns 0 to continue decoding, otherwise the result of the parse.
+ */
+static int
+end_integer(struct ParseState *state) {
+    uint32_t value = state->u.http.h2.integer;
+
+    switch (state->u.http.h2.hpack_state) {
+        case HPACK_INDEX:
+            /* An indexed :authority from the static table has no value, and
+             * the dynamic table is empty at the start of a connection */
+            state->u.http.h2.hpack_state = HPACK_FIELD;
+            return 0;
+        case HPACK_NAME_INDEX:
+            if (value == 0) {
+                state->u.http.h2.name_len = 0;
+                state->u.http.h2.hpack_state = HPACK_NAME_LENGTH;
+            } else {
+                state->u.http.h2.field =
+                    value == STATIC_AUTHORITY || value == STATIC_HOST ?
+                    FIELD_AUTHORITY : FIELD_OTHER;
+                state->u.http.h2.hpack_state = HPACK_VALUE_LENGTH;
+            }
+            return 0;
+        case HPACK_NAME_LENGTH:
+        case HPACK_VALUE_LENGTH:
+            state->u.http.h2.hpack_state =
+                state->u.http.h2.hpack_state == HPACK_NAME_LENGTH ?
+                HPACK_NAME : HPACK_VALUE;
+            state->u.http.h2.string_remaining = value;
+            state->u.http.h2.huffman_code = 0;
+            state->u.http.h2.huffman_bits = 0;
+            if (state->u.http.h2.hpack_state == HPACK_VALUE &&
+                    state->u.http.h2.field == FIELD_AUTHORITY)
+                state->hostname_len = 0;
+            return 0;
+    }
+
+    return -5;
+}
+
+/*
+ * Consume string data, decoding it if it is a field name or the authority
+ */
+static int
+decode_string(struct ParseState *state, const uint8_t *data, size_t len) {
+    state->u.http.h2.string_remaining -= len;
+
+    if (state->u.http.h2.hpack_state == HPACK_VALUE &&
+            state->u.http.h2.field != FIELD_AUTHORITY)
+        return 0;
+
+    for (size_t i = 0; i < len; i++) {
+        int result;
+
+        if (!state->u.http.h2.huffman) {
+            result = emit_char(state, data[i]);
+            if (result != 0)
+                return result;
+            continue;
+        }
+
+        /* Canonical Huffman code, a bit at a time */
+        for (int bit = 7; bit >= 0; bit--) {
+            uint32_t code = (state->u.http.h2.huffman_code << 1) |
+                ((data[i] >> bit) & 1);
+            unsigned int bits = ++state->u.http.h2.huffman_bits;
+
+            state->u.http.h2.huffman_code = code;
+            if (bits > HUFFMAN_MAX_BITS)
+                return -5;
+            if (code < huffman_first_code[bits] ||
+                    code - huffman_first_code[bits] >= huffman_count[bits])
+                continue;
+
+            uint16_t symbol = huffman_symbols[huffman_first_index[bits] +
+                code - huffman_first_code[bits]];
+            if (symbol == HUFFMAN_EOS)
+                return -5;
+
+            result = emit_char(state, (uint8_t)symbol);
+            if (result != 0)
+                return result;
+
+            state->u.http.h2.huffman_code = 0;
+            state->u.http.h2.huffman_bits = 0;
+        }
+    }
+
+    return 0;
+}
+
+static int
+end_string(struct ParseState *state) {
+    /* RFC7541 5.2: padding is at most 7 bits of the EOS code (all ones) */
+    if (state->u.http.h2.huffman && (state->u.http.h2.huffman_bits > 7 ||
+                state->u.http.h2.huffman_code !=
+                (1U << state->u.http.h2.huffman_bits) - 1))
+        return -5;
+
+    if (state->u.http.h2.hpack_state == HPACK_NAME) {
+        size_t len = state->u.http.h2.name_len;
+        const char *name = state->u.http.h2.name;
+
+        state->u.http.h2.field =
+            (len == 10 && memcmp(name, ":authority", 10) == 0) ||
+            (len == 4 && memcmp(name, "host", 4) == 0) ?
+            FIELD_AUTHORITY : FIELD_OTHER;
+        state->u.http.h2.hpack_state = HPACK_VALUE_LENGTH;
+        return 0;
+    }
+
+    if (state->u.http.h2.field == FIELD_AUTHORITY && state->hostname_len > 0)
+        return (int)state->hostname_len;
+
+    state->u.http.h2.hpack_state = HPACK_FIELD;
+    return 0;
+}
+
+static int
+emit_char(struct ParseState *state, uint8_t c) {
+    if (state->u.http.h2.hpack_state == HPACK_NAME) {
+        /* Only the length of names longer than any we compare is kept */
+        if (state->u.http.h2.name_len < sizeof(state->u.http.h2.name))
+            state->u.http.h2.name[state->u.http.h2.name_len] = (char)c;
+        state->u.http.h2.name_len++;
+        return 0;
+    }
+
+    if (state->hostname_len == PARSE_HOSTNAME_MAX + PARSE_HOST_PORT_MAX)
+        return -5;
+
+    state->hostname[state->hostname_len++] = (char)c;
+    return 0;
+}
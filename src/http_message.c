@@ -0,0 +1,411 @@
+/*
+ * Copyright (c) 2011 and 2012, Dustin Lundquist <dustin@null-ptr.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Framing of HTTP/1.x messages relayed between a client and a server. Only
+ * what is needed to find where each message ends, and whether the
+ * connection can carry another one, is parsed: the start line, the
+ * Content-Length, Transfer-Encoding and Connection headers, and the chunked
+ * transfer coding. Everything else is passed through unexamined.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <strings.h> /* strncasecmp() */
+#include <ctype.h> /* isdigit(), isxdigit() */
+#include "http_message.h"
+
+#define IS_WHITESPACE(c) ((c) == ' ' || (c) == '\t')
+
+/*
+ * Message parser states, MESSAGE_START_LINE is the initial (zeroed) state
+ */
+enum MessageState {
+    MESSAGE_START_LINE,
+    MESSAGE_HEADER_LINE,
+    MESSAGE_BODY,
+    MESSAGE_CHUNK_SIZE,
+    MESSAGE_CHUNK_DATA,
+    MESSAGE_CHUNK_END,
+    MESSAGE_TRAILER,
+    MESSAGE_UNTIL_CLOSE,
+    MESSAGE_DONE,
+};
+
+
+static int parse_line(struct HTTPMessage *);
+static int parse_start_line(struct HTTPMessage *);
+static int parse_header_line(struct HTTPMessage *);
+static int end_of_headers(struct HTTPMessage *);
+static int parse_chunk_size(struct HTTPMessage *);
+static void message_complete(struct HTTPMessage *);
+static int has_token(const char *, size_t, const char *);
+static int last_token_is(const char *, size_t, const char *);
+
+
+void
+init_http_message(struct HTTPMessage *message, int response) {
+    memset(message, 0, sizeof(struct HTTPMessage));
+    message->response = response;
+}
+
+/*
+ * Parse the next part of a request, or a response if the message was
+ * initialized for one. Like the request parsers this is incremental, each
+ * call should be passed only the data following that already consumed.
+ *
+ * Parsing stops at the end of the message, the flags record what has been
+ * seen so far. Interim (1xx) responses are consumed as part of the final
+ * response which follows them.
+ *
+ * Returns:
+ *  >=0  - number of bytes consumed, less than data_len only if the
+ *         message is complete
+ *  -1   - the message can not be framed
+ */
+ssize_t
+parse_http_message(struct HTTPMessage *message, const char *data, size_t data_len) {
+    size_t i = 0;
+
+    while (i < data_len) {
+        size_t len;
+        char c;
+
+        switch (message->state) {
+            case MESSAGE_BODY:
+            case MESSAGE_CHUNK_DATA:
+                len = data_len - i;
+                if (len > message->remaining)
+                    len = (size_t)message->remaining;
+                message->remaining -= len;
+                i += len;
+
+                if (message->remaining > 0)
+                    break;
+                if (message->state == MESSAGE_BODY)
+                    message_complete(message);
+                else
+                    message->state = MESSAGE_CHUNK_END;
+                break;
+            case MESSAGE_UNTIL_CLOSE:
+                i = data_len;
+                break;
+            case MESSAGE_DONE:
+                return (ssize_t)i;
+            default:
+                c = data[i++];
+                if (c == '\r')
+                    break;
+
+                if (c != '\n') {
+                    if (message->line_len < sizeof(message->line) - 1)
+                        message->line[message->line_len++] = c;
+                    else
+                        message->line_overflow++;
+
+                    if (message->state == MESSAGE_START_LINE) {
+                        memmove(message->tail, message->tail + 1,
+                                sizeof(message->tail) - 1);
+                        message->tail[sizeof(message->tail) - 1] = c;
+                    }
+                    break;
+                }
+
+                if (parse_line(message) < 0)
+                    return -1;
+        }
+    }
+
+    return (ssize_t)i;
+}
+
+static int
+parse_line(struct HTTPMessage *message) {
+    int result = 0;
+
+    message->line[message->line_len] = '\0';
+
+    switch (message->state) {
+        case MESSAGE_START_LINE:
+            result = parse_start_line(message);
+            break;
+        case MESSAGE_HEADER_LINE:
+            if (message->line_len == 0)
+                result = end_of_headers(message);
+            else
+                result = parse_header_line(message);
+            break;
+        case MESSAGE_CHUNK_SIZE:
+            result = parse_chunk_size(message);
+            break;
+        case MESSAGE_CHUNK_END:
+            if (message->line_len > 0)
+                result = -1;
+            message->state = MESSAGE_CHUNK_SIZE;
+            break;
+        case MESSAGE_TRAILER:
+            if (message->line_len == 0)
+                message_complete(message);
+            break;
+    }
+
+    message->line_len = 0;
+    message->line_overflow = 0;
+    memset(message->tail, 0, sizeof(message->tail));
+
+    return result;
+}
+
+static int
+parse_start_line(struct HTTPMessage *message) {
+    const char *line = message->line;
+
+    /* Empty lines before the start line are ignored (RFC7230 section 3.5) */
+    if (message->line_len == 0)
+        return 0;
+
+    if (message->response) {
+        /* HTTP-version SP status-code SP reason-phrase */
+        if (message->line_len < 12 ||
+                strncmp(line, "HTTP/1.", 7) != 0 ||
+                !isdigit((unsigned char)line[7]) || line[8] != ' ' ||
+                !isdigit((unsigned char)line[9]) ||
+                !isdigit((unsigned char)line[10]) ||
+                !isdigit((unsigned char)line[11]))
+            return -1;
+
+        message->version = line[7] - '0';
+        message->status = (line[9] - '0') * 100 + (line[10] - '0') * 10 +
+            (line[11] - '0');
+    } else {
+        /* method SP request-target SP HTTP-version */
+        if (memcmp(message->tail, "HTTP/1.", 7) != 0 ||
+                !isdigit((unsigned char)message->tail[7]))
+            return -1;
+
+        message->version = message->tail[7] - '0';
+
+        if (strncmp(line, "HEAD ", 5) == 0)
+            message->flags |= HTTP_MESSAGE_HEAD;
+        else if (strncmp(line, "CONNECT ", 8) == 0 ||
+                strncmp(line, "PRI ", 4) == 0)
+            message->flags |= HTTP_MESSAGE_UPGRADE;
+    }
+
+    message->state = MESSAGE_HEADER_LINE;
+
+    return 0;
+}
+
+static int
+parse_header_line(struct HTTPMessage *message) {
+    const char *line = message->line;
+
+    /* Obsolete line folding continues a header we do not need */
+    if (IS_WHITESPACE(line[0]))
+        return 0;
+
+    const char *colon = memchr(line, ':', message->line_len);
+    if (colon == NULL)
+        return -1;
+
+    size_t name_len = (size_t)(colon - line);
+    const char *value = colon + 1;
+    size_t value_len = message->line_len - name_len - 1;
+
+    while (value_len > 0 && IS_WHITESPACE(value[0])) {
+        value++;
+        value_len--;
+    }
+    while (value_len > 0 && IS_WHITESPACE(value[value_len - 1]))
+        value_len--;
+
+    if (name_len == 14 && strncasecmp(line, "content-length", 14) == 0) {
+        uint64_t length = 0;
+
+        if (value_len == 0 || message->line_overflow > 0)
+            return -1;
+
+        for (size_t i = 0; i < value_len; i++) {
+            if (!isdigit((unsigned char)value[i]) ||
+                    length > (UINT64_MAX - 9) / 10)
+                return -1;
+            length = length * 10 + (uint64_t)(value[i] - '0');
+        }
+
+        /* Differing lengths could frame the message either way */
+        if (message->content_length && message->remaining != length)
+            return -1;
+
+        message->content_length = 1;
+        message->remaining = length;
+    } else if (name_len == 17 &&
+            strncasecmp(line, "transfer-encoding", 17) == 0) {
+        if (message->line_overflow > 0)
+            return -1;
+
+        message->transfer_encoding = 1;
+        message->chunked = last_token_is(value, value_len, "chunked");
+    } else if (name_len == 10 && strncasecmp(line, "connection", 10) == 0) {
+        if (has_token(value, value_len, "close"))
+            message->flags |= HTTP_MESSAGE_CLOSE;
+        if (has_token(value, value_len, "keep-alive"))
+            message->keep_alive = 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Determine how the message body is delimited (RFC7230 section 3.3.3)
+ */
+static int
+end_of_headers(struct HTTPMessage *message) {
+    message->flags |= HTTP_MESSAGE_HEADERS;
+
+    if (message->version == 0 && !message->keep_alive)
+        message->flags |= HTTP_MESSAGE_CLOSE;
+
+    if (!message->response) {
+        /* A request must not be framed by anything but the chunked coding
+         * when a transfer coding is applied */
+        if (message->transfer_encoding &&
+                (!message->chunked || message->content_length))
+            return -1;
+
+        if (message->transfer_encoding)
+            message->state = MESSAGE_CHUNK_SIZE;
+        else if (message->remaining > 0)
+            message->state = MESSAGE_BODY;
+        else
+            message_complete(message);
+    } else if (message->status / 100 == 1 && message->status != 101) {
+        int no_body = message->no_body;
+
+        /* The final response follows an interim response */
+        init_http_message(message, 1);
+        message->no_body = no_body;
+    } else if (message->status == 101) {
+        message->flags |= HTTP_MESSAGE_UPGRADE;
+        message_complete(message);
+    } else if (message->no_body ||
+            message->status == 204 || message->status == 304) {
+        message_complete(message);
+    } else if (message->transfer_encoding && message->chunked) {
+        message->state = MESSAGE_CHUNK_SIZE;
+    } else if (message->transfer_encoding || !message->content_length) {
+        /* Delimited by the server closing the connection */
+        message->flags |= HTTP_MESSAGE_CLOSE;
+        message->state = MESSAGE_UNTIL_CLOSE;
+    } else if (message->remaining > 0) {
+        message->state = MESSAGE_BODY;
+    } else {
+        message_complete(message);
+    }
+
+    return 0;
+}
+
+static int
+parse_chunk_size(struct HTTPMessage *message) {
+    const char *line = message->line;
+    uint64_t size = 0;
+    size_t i;
+
+    for (i = 0; i < message->line_len && isxdigit((unsigned char)line[i]); i++) {
+        char c = line[i];
+
+        if (size >> 60)
+            return -1;
+
+        size = size * 16 + (uint64_t)(isdigit((unsigned char)c) ?
+                c - '0' : (c | 0x20) - 'a' + 10);
+    }
+
+    /* The size may be followed by chunk extensions */
+    if (i == 0 || (i < message->line_len && line[i] != ';' &&
+                !IS_WHITESPACE(line[i])))
+        return -1;
+
+    if (size == 0) {
+        message->state = MESSAGE_TRAILER;
+    } else {
+        message->remaining = size;
+        message->state = MESSAGE_CHUNK_DATA;
+    }
+
+    return 0;
+}
+
+static void
+message_complete(struct HTTPMessage *message) {
+    message->flags |= HTTP_MESSAGE_COMPLETE;
+    message->state = MESSAGE_DONE;
+}
+
+/*
+ * Test if a comma separated header value includes a token, ignoring case
+ */
+static int
+has_token(const char *value, size_t value_len, const char *token) {
+    size_t token_len = strlen(token);
+    size_t i = 0;
+
+    while (i < value_len) {
+        size_t start, end;
+
+        while (i < value_len && (IS_WHITESPACE(value[i]) || value[i] == ','))
+            i++;
+        start = i;
+        while (i < value_len && value[i] != ',')
+            i++;
+        end = i;
+        while (end > start && IS_WHITESPACE(value[end - 1]))
+            end--;
+
+        if (end - start == token_len &&
+                strncasecmp(value + start, token, token_len) == 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Test if the last token of a comma separated header value is token,
+ * ignoring case
+ */
+static int
+last_token_is(const char *value, size_t value_len, const char *token) {
+    size_t token_len = strlen(token);
+    size_t start = value_len;
+
+    while (start > 0 && value[start - 1] != ',')
+        start--;
+    while (start < value_len && IS_WHITESPACE(value[start]))
+        start++;
+
+    return value_len - start == token_len &&
+        strncasecmp(value + start, token, token_len) == 0;
+}
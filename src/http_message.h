@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2011 and 2012, Dustin Lundquist <dustin@null-ptr.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef HTTP_MESSAGE_H
+#define HTTP_MESSAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define HTTP_MESSAGE_LINE_MAX 128
+
+/* Message flags */
+#define HTTP_MESSAGE_HEADERS    0x01    /* header section received */
+#define HTTP_MESSAGE_COMPLETE   0x02    /* end of message received */
+#define HTTP_MESSAGE_CLOSE      0x04    /* connection ends after message */
+#define HTTP_MESSAGE_UPGRADE    0x08    /* connection leaves HTTP/1 */
+#define HTTP_MESSAGE_HEAD       0x10    /* request method is HEAD */
+
+/*
+ * Framing state of an HTTP/1.x request or response (RFC7230 section 3.3.3)
+ * being relayed, so a connection can be handed to another request once it
+ * is complete.
+ */
+struct HTTPMessage {
+    int state;
+    int response;               /* parsing responses rather than requests */
+    int no_body;                /* response to a HEAD request */
+    int flags;
+    int version;                /* minor version */
+    int status;
+    int keep_alive;
+    int chunked;
+    int transfer_encoding;
+    int content_length;
+    uint64_t remaining;         /* body or chunk bytes left */
+    size_t line_len;
+    size_t line_overflow;       /* bytes of line which did not fit */
+    char line[HTTP_MESSAGE_LINE_MAX];
+    char tail[8];               /* end of the request line */
+};
+
+void init_http_message(struct HTTPMessage *, int);
+ssize_t parse_http_message(struct HTTPMessage *, const char *, size_t);
+
+#endif
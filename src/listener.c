@@ -48,16 +48,48 @@
 #include "protocol.h"
 #include "tls.h"
 #include "http.h"
+#include "quic.h"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+/*
+ * Bounds of the exponential backoff used to probe whether file descriptors
+ * have become available again after accept() failed with EMFILE or ENFILE.
+ */
+static const ev_tstamp ACCEPT_BACKOFF_MIN = 0.01;
+static const ev_tstamp ACCEPT_BACKOFF_MAX = 2.0;
+
+/*
+ * Largest client request buffered while waiting for the hostname, large
+ * enough for a client hello with post-quantum key shares.
+ */
+static const size_t DEFAULT_MAX_REQUEST_SIZE = 16384;
 
 static void close_listener(struct ev_loop *, struct Listener *);
 static void accept_cb(struct ev_loop *, struct ev_io *, int);
 static void backoff_timer_cb(struct ev_loop *, struct ev_timer *, int);
+static void suspend_listener(struct ev_loop *, struct Listener *);
+static int file_descriptors_available();
 static int init_listener(struct Listener *, const struct Table_head *, struct ev_loop *);
 static void listener_update(struct Listener *, struct Listener *,  const struct Table_head *);
 static void free_listener(struct Listener *);
 static int parse_boolean(const char *);
+static int listener_compare(const struct Listener *, const struct Listener *);
 
 
+/*
+ * Order listeners by address, then QUIC listeners after stream listeners so
+ * TCP and UDP listeners may share a port
+ */
+static int
+listener_compare(const struct Listener *a, const struct Listener *b) {
+    int result = address_compare(a->address, b->address);
+    if (result != 0)
+        return result;
+
+    return (a->protocol == quic_protocol) - (b->protocol == quic_protocol);
+}
+
 static int
 parse_boolean(const char *boolean) {
     const char *boolean_true[] = {
@@ -119,7 +151,7 @@ listeners_reload(struct Listener_head *existing_listeners,
         else if (iter_new == NULL)
             compare_result = -1;
         else
-            compare_result = address_compare(iter_existing->address, iter_new->address);
+            compare_result = listener_compare(iter_existing, iter_new);
 
         if (compare_result > 0) {
             struct Listener *new_listener = iter_new;
@@ -167,7 +199,7 @@ static void
 listener_update(struct Listener *existing_listener, struct Listener *new_listener, const struct Table_head *tables) {
     assert(existing_listener != NULL);
     assert(new_listener != NULL);
-    assert(address_compare(existing_listener->address, new_listener->address) == 0);
+    assert(listener_compare(existing_listener, new_listener) == 0);
 
     free(existing_listener->fallback_address);
     existing_listener->fallback_address = new_listener->fallback_address;
@@ -187,6 +219,11 @@ listener_update(struct Listener *existing_listener, struct Listener *new_listene
     existing_listener->access_log = logger_ref_get(new_listener->access_log);
 
     existing_listener->log_bad_requests = new_listener->log_bad_requests;
+    existing_listener->max_connections = new_listener->max_connections;
+    existing_listener->max_request_size = new_listener->max_request_size;
+    existing_listener->per_request_routing = new_listener->per_request_routing;
+    existing_listener->accept_proxy_protocol =
+        new_listener->accept_proxy_protocol;
 
     struct Table *new_table =
             table_lookup(tables, existing_listener->table_name);
@@ -221,7 +258,13 @@ new_listener() {
     listener->ipv6_v6only = 0;
     listener->transparent_proxy = 0;
     listener->fallback_use_proxy_header = 0;
+    listener->max_connections = 0;
+    listener->max_request_size = DEFAULT_MAX_REQUEST_SIZE;
+    listener->per_request_routing = 0;
+    listener->accept_proxy_protocol = 0;
     listener->reference_count = 0;
+    listener->connection_count = 0;
+    listener->backoff_interval = 0.0;
     /* Initializes sock fd to negative sentinel value to indicate watchers
      * are not active */
     ev_io_init(&listener->watcher, accept_cb, -1, EV_READ);
@@ -284,6 +327,8 @@ int
 accept_listener_protocol(struct Listener *listener, const char *protocol) {
     if (strncasecmp(protocol, http_protocol->name, strlen(protocol)) == 0)
         listener->protocol = http_protocol;
+    else if (strncasecmp(protocol, quic_protocol->name, strlen(protocol)) == 0)
+        listener->protocol = quic_protocol;
     else
         listener->protocol = tls_protocol;
 
@@ -361,7 +406,11 @@ accept_listener_fallback_address(struct Listener *listener, const char *fallback
         }
     } else if (strcasecmp("proxy", fallback) == 0 &&
             listener->fallback_use_proxy_header == 0) {
-        listener->fallback_use_proxy_header = 1;
+        listener->fallback_use_proxy_header = PROXY_PROTOCOL_V1;
+        return 1;
+    } else if (strcasecmp("proxy_v2", fallback) == 0 &&
+            listener->fallback_use_proxy_header == 0) {
+        listener->fallback_use_proxy_header = PROXY_PROTOCOL_V2;
         return 1;
     } else {
         err("Unexpected fallback argument: %s", fallback);
@@ -416,6 +465,50 @@ accept_listener_bad_request_action(struct Listener *listener, const char *action
     return 1;
 }
 
+int
+accept_listener_max_connections(struct Listener *listener, const char *max) {
+    if (!is_numeric(max) || max[0] == '-') {
+        err("Invalid max_connections: %s", max);
+        return 0;
+    }
+
+    listener->max_connections = strtoul(max, NULL, 10);
+
+    return 1;
+}
+
+int
+accept_listener_max_request_size(struct Listener *listener, const char *max) {
+    if (!is_numeric(max) || max[0] == '-') {
+        err("Invalid max_request_size: %s", max);
+        return 0;
+    }
+
+    listener->max_request_size = strtoul(max, NULL, 10);
+
+    return 1;
+}
+
+int
+accept_listener_per_request_routing(struct Listener *listener, const char *per_request) {
+    listener->per_request_routing = parse_boolean(per_request);
+    if (listener->per_request_routing == -1) {
+        return 0;
+    }
+
+    return 1;
+}
+
+int
+accept_listener_accept_proxy_protocol(struct Listener *listener, const char *accept) {
+    listener->accept_proxy_protocol = parse_boolean(accept);
+    if (listener->accept_proxy_protocol == -1) {
+        return 0;
+    }
+
+    return 1;
+}
+
 /*
  * Insert an additional listener in to the sorted list of listeners
  */
@@ -427,7 +520,7 @@ add_listener(struct Listener_head *listeners, struct Listener *listener) {
     listener_ref_get(listener);
 
     if (SLIST_FIRST(listeners) == NULL ||
-            address_compare(listener->address, SLIST_FIRST(listeners)->address) < 0) {
+            listener_compare(listener, SLIST_FIRST(listeners)) < 0) {
         SLIST_INSERT_HEAD(listeners, listener, entries);
         return;
     }
@@ -435,7 +528,7 @@ add_listener(struct Listener_head *listeners, struct Listener *listener) {
     struct Listener *iter;
     SLIST_FOREACH(iter, listeners, entries) {
         if (SLIST_NEXT(iter, entries) == NULL ||
-                address_compare(listener->address, SLIST_NEXT(iter, entries)->address) < 0) {
+                listener_compare(listener, SLIST_NEXT(iter, entries)) < 0) {
             SLIST_INSERT_AFTER(iter, listener, entries);
             return;
         }
@@ -482,11 +575,36 @@ valid_listener(const struct Listener *listener) {
             return 0;
     }
 
-    if (listener->protocol != tls_protocol && listener->protocol != http_protocol) {
+    if (listener->protocol != tls_protocol &&
+            listener->protocol != http_protocol &&
+            listener->protocol != quic_protocol) {
         err("Invalid protocol");
         return 0;
     }
 
+    if (listener->protocol == quic_protocol) {
+#ifndef HAVE_LIBCRYPTO
+        err("protocol quic requires sniproxy built with libcrypto");
+        return 0;
+#endif
+        if (address_sa(listener->address)->sa_family == AF_UNIX) {
+            err("protocol quic requires an IP address");
+            return 0;
+        }
+
+        if (listener->transparent_proxy || listener->per_request_routing ||
+                listener->accept_proxy_protocol) {
+            err("protocol quic does not support transparent source, "
+                    "per_request_routing or accept_proxy_protocol");
+            return 0;
+        }
+    }
+
+    if (listener->per_request_routing && listener->protocol != http_protocol) {
+        err("per_request_routing requires protocol http");
+        return 0;
+    }
+
     return 1;
 }
 
@@ -509,10 +627,14 @@ init_listener(struct Listener *listener, const struct Table_head *tables,
         address_set_port(listener->fallback_address,
                 address_port(listener->address));
 
+    /* QUIC listeners receive datagrams, which are never accepted */
+    int datagram = listener->protocol == quic_protocol;
+    int type = datagram ? SOCK_DGRAM : SOCK_STREAM;
+
 #ifdef HAVE_ACCEPT4
-    int sockfd = socket(address_sa(listener->address)->sa_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    int sockfd = socket(address_sa(listener->address)->sa_family, type | SOCK_NONBLOCK, 0);
 #else
-    int sockfd = socket(address_sa(listener->address)->sa_family, SOCK_STREAM, 0);
+    int sockfd = socket(address_sa(listener->address)->sa_family, type, 0);
 #endif
     if (sockfd < 0) {
         err("socket failed: %s", strerror(errno));
@@ -530,7 +652,8 @@ init_listener(struct Listener *listener, const struct Table_head *tables,
 
     /* set SO_KEEPALIVE on the server socket so that abandoned client connections
      * do not linger behind forever */
-    result = setsockopt(sockfd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+    result = datagram ? 0 :
+        setsockopt(sockfd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
     if (result < 0) {
         err("setsockopt SO_KEEPALIVE failed: %s", strerror(errno));
         close(sockfd);
@@ -570,7 +693,7 @@ init_listener(struct Listener *listener, const struct Table_head *tables,
 
     result = bind(sockfd, address_sa(listener->address),
             address_sa_len(listener->address));
-    if (result < 0 && errno == EACCES) {
+    if (result < 0 && errno == EACCES && !datagram) {
         /* Retry using binder module */
         close(sockfd);
         sockfd = bind_socket(address_sa(listener->address),
@@ -588,7 +711,7 @@ init_listener(struct Listener *listener, const struct Table_head *tables,
         return result;
     }
 
-    result = listen(sockfd, SOMAXCONN);
+    result = datagram ? 0 : listen(sockfd, SOMAXCONN);
     if (result < 0) {
         err("listen failed: %s", strerror(errno));
         close(sockfd);
@@ -610,17 +733,24 @@ init_listener(struct Listener *listener, const struct Table_head *tables,
 }
 
 /*
- * Allocate a new server address trying:
+ * Find the server address trying:
  *      1. lookup name in table for hostname or socket address
  *      2. lookup name in table for a wildcard address, then create a new
  *         address based on the request hostname (if valid)
  *      3. use the fallback address
+ *
+ * An address made for this lookup is written to storage, otherwise the
+ * result refers to an address owned by the table or listener. The client
+ * address, which may be NULL, chooses among a pool of servers.
  */
 struct LookupResult
 listener_lookup_server_address(const struct Listener *listener,
-        const char *name, size_t name_len) {
+        const char *name, size_t name_len,
+        const struct ClientHello *hello, const struct sockaddr *client,
+        union AddressStorage *storage) {
     struct LookupResult table_result =
-        table_lookup_server_address(listener->table, name, name_len);
+        table_lookup_server_address(listener->table, name, name_len, hello,
+                client);
 
     if (table_result.address == NULL) {
         /* No match in table, use fallback address if present */
@@ -628,33 +758,34 @@ listener_lookup_server_address(const struct Listener *listener,
             .address = listener->fallback_address,
             .use_proxy_header = listener->fallback_use_proxy_header
         };
-    } else if (address_is_pattern(table_result.address)) {
-        /* Pattern table entry, create a new address from hostname */
-        //struct hostent *cnameAddr;
-        //cnameAddr = gethostbyname(name);
-        char replacement[1024];
-        if (apply_pattern(name, address_pattern(table_result.address) ,table_result.matches, replacement, 1024) == 0) {
-            warn("Failed pattern %.*s in client request",
+    } else if (address_is_pattern(table_result.address) ||
+            address_is_wildcard(table_result.address)) {
+        /* Pattern or wildcard table entry, use the address the table
+         * expanded from the hostname */
+        if (table_result.expansion == NULL) {
+            warn("%s %.*s in client request",
+                    address_is_pattern(table_result.address) ?
+                        "Failed pattern" : "Invalid hostname",
                     (int)name_len, name);
 
             return (struct LookupResult){
                 .address = listener->fallback_address,
                 .use_proxy_header = listener->fallback_use_proxy_header
             };
-        }  
-        struct Address *new_addr = new_address(replacement);
-        if (new_addr == NULL) {
-            warn("Failed pattern%.*s in client request",
+        } else if (address_is_sockaddr(table_result.expansion)) {
+            warn("Refusing to proxy to socket address literal %.*s in request",
                     (int)name_len, name);
 
             return (struct LookupResult){
                 .address = listener->fallback_address,
                 .use_proxy_header = listener->fallback_use_proxy_header
             };
-        } else if (address_is_sockaddr(new_addr)) {
-            warn("Refusing to proxy to socket address literal %.*s in request",
-                    (int)name_len, name);
-            free(new_addr);
+        }
+
+        struct Address *new_addr =
+            copy_address_to(table_result.expansion, storage);
+        if (new_addr == NULL) {
+            warn("Server address for %.*s too long", (int)name_len, name);
 
             return (struct LookupResult){
                 .address = listener->fallback_address,
@@ -662,34 +793,24 @@ listener_lookup_server_address(const struct Listener *listener,
             };
         }
 
-        /* We created a valid new_addr, use the port from wildcard address if
-         * present otherwise the listener */
+        /* Use the port from wildcard address if present otherwise the
+         * listener */
         address_set_port(new_addr, address_port(table_result.address) != 0 ?
                                    address_port(table_result.address) :
                                    address_port(listener->address));
 
-
         return (struct LookupResult){
             .address = new_addr,
-            .caller_free_address = 1,
             .use_proxy_header = table_result.use_proxy_header
         };
-    
-    } else if (address_is_wildcard(table_result.address)) {
-        /* Wildcard table entry, create a new address from hostname */
-        struct Address *new_addr = new_address(name);
+    } else if (address_port(table_result.address) == 0) {
+        /* If the server port isn't specified return a copy of the address
+         * using the port from the listener, this allows sharing table across
+         * listeners */
+        struct Address *new_addr =
+            copy_address_to(table_result.address, storage);
         if (new_addr == NULL) {
-            warn("Invalid hostname %.*s in client request",
-                    (int)name_len, name);
-
-            return (struct LookupResult){
-                .address = listener->fallback_address,
-                .use_proxy_header = listener->fallback_use_proxy_header
-            };
-        } else if (address_is_sockaddr(new_addr)) {
-            warn("Refusing to proxy to socket address literal %.*s in request",
-                    (int)name_len, name);
-            free(new_addr);
+            warn("Server address for %.*s too long", (int)name_len, name);
 
             return (struct LookupResult){
                 .address = listener->fallback_address,
@@ -697,28 +818,12 @@ listener_lookup_server_address(const struct Listener *listener,
             };
         }
 
-        /* We created a valid new_addr, use the port from wildcard address if
-         * present otherwise the listener */
-        address_set_port(new_addr, address_port(table_result.address) != 0 ?
-                                   address_port(table_result.address) :
-                                   address_port(listener->address));
-
-
-        return (struct LookupResult){
-            .address = new_addr,
-            .caller_free_address = 1,
-            .use_proxy_header = table_result.use_proxy_header
-        };
-    } else if (address_port(table_result.address) == 0) {
-        /* If the server port isn't specified return a new address using the
-         * port from the listen, this allows sharing table across listeners */
-        struct Address *new_addr = copy_address(table_result.address);
-
         address_set_port(new_addr, address_port(listener->address));
 
         return (struct LookupResult){
             .address = new_addr,
-            .caller_free_address = 1,
+            .server = table_result.server,
+            .balancer = table_result.balancer,
             .use_proxy_header = table_result.use_proxy_header
         };
     } else {
@@ -746,9 +851,11 @@ print_listener_config(FILE *file, const struct Listener *listener) {
 
     if (listener->fallback_address &&
             listener->fallback_use_proxy_header)
-        fprintf(file, "\tfallback %s proxy\n",
+        fprintf(file, "\tfallback %s %s\n",
                 display_address(listener->fallback_address,
-                    address, sizeof(address)));
+                    address, sizeof(address)),
+                listener->fallback_use_proxy_header == PROXY_PROTOCOL_V2 ?
+                    "proxy_v2" : "proxy");
 
     if (listener->source_address)
         fprintf(file, "\tsource %s\n",
@@ -758,6 +865,17 @@ print_listener_config(FILE *file, const struct Listener *listener) {
     if (listener->reuseport)
         fprintf(file, "\treuseport on\n");
 
+    if (listener->max_connections)
+        fprintf(file, "\tmax_connections %zu\n", listener->max_connections);
+
+    fprintf(file, "\tmax_request_size %zu\n", listener->max_request_size);
+
+    if (listener->per_request_routing)
+        fprintf(file, "\tper_request_routing on\n");
+
+    if (listener->accept_proxy_protocol)
+        fprintf(file, "\taccept_proxy_protocol on\n");
+
     fprintf(file, "}\n\n");
 }
 
@@ -835,21 +953,51 @@ accept_cb(struct ev_loop *loop, struct ev_io *w, int revents) {
     if (revents & EV_READ) {
         int result = listener->accept_cb(listener, loop);
         if (result == 0 && (errno == EMFILE || errno == ENFILE)) {
+            suspend_listener(loop, listener);
+        } else if (listener->backoff_interval > 0.0) {
+            /* Any other outcome means file descriptors are available again */
             char address_buf[ADDRESS_BUFFER_SIZE];
-            int backoff_time = 2;
-
-            err("File descriptor limit reached! "
-                "Suspending accepting new connections on %s for %d seconds",
-                display_address(listener->address, address_buf, sizeof(address_buf)),
-                backoff_time);
-            ev_io_stop(loop, w);
 
-            ev_timer_set(&listener->backoff_timer, backoff_time, 0.0);
-            ev_timer_start(loop, &listener->backoff_timer);
+            notice("Resumed accepting new connections on %s",
+                display_address(listener->address, address_buf, sizeof(address_buf)));
+            listener->backoff_interval = 0.0;
         }
     }
 }
 
+/*
+ * Stop accepting on a listener after running out of file descriptors.
+ *
+ * Rather than a fixed suspension, the listener is re-enabled after a short
+ * interval to probe if descriptors have been released, doubling the interval
+ * each consecutive time the probe fails.
+ */
+static void
+suspend_listener(struct ev_loop *loop, struct Listener *listener) {
+    char address_buf[ADDRESS_BUFFER_SIZE];
+
+    if (listener->backoff_interval == 0.0) {
+        listener->backoff_interval = ACCEPT_BACKOFF_MIN;
+
+        err("File descriptor limit reached! "
+            "Suspending accepting new connections on %s",
+            display_address(listener->address, address_buf, sizeof(address_buf)));
+    } else {
+        listener->backoff_interval =
+            MIN(listener->backoff_interval * 2, ACCEPT_BACKOFF_MAX);
+
+        debug("File descriptor limit still reached on %s, "
+              "retrying in %.3f seconds",
+              display_address(listener->address, address_buf, sizeof(address_buf)),
+              listener->backoff_interval);
+    }
+
+    ev_io_stop(loop, &listener->watcher);
+
+    ev_timer_set(&listener->backoff_timer, listener->backoff_interval, 0.0);
+    ev_timer_start(loop, &listener->backoff_timer);
+}
+
 static void
 backoff_timer_cb(struct ev_loop *loop, struct ev_timer *w, int revents) {
     struct Listener *listener = (struct Listener *)w->data;
@@ -857,7 +1005,29 @@ backoff_timer_cb(struct ev_loop *loop, struct ev_timer *w, int revents) {
     if (revents & EV_TIMER) {
         ev_timer_stop(loop, &listener->backoff_timer);
 
+        if (!file_descriptors_available()) {
+            suspend_listener(loop, listener);
+            return;
+        }
+
         ev_io_set(&listener->watcher, listener->watcher.fd, EV_READ);
         ev_io_start(loop, &listener->watcher);
     }
 }
+
+/*
+ * Probe if enough file descriptors have been released to service another
+ * connection: one each for the client and server sockets.
+ */
+static int
+file_descriptors_available() {
+    int fds[2];
+
+    if (pipe(fds) < 0)
+        return 0;
+
+    close(fds[0]);
+    close(fds[1]);
+
+    return 1;
+}
@@ -41,11 +41,17 @@ struct Listener {
     struct Logger *access_log;
     int log_bad_requests, reuseport, transparent_proxy, ipv6_v6only;
     int fallback_use_proxy_header;
+    int per_request_routing;
+    int accept_proxy_protocol;      /* clients send a PROXY header first */
+    size_t max_connections;         /* 0 for unlimited */
+    size_t max_request_size;
 
     /* Runtime fields */
     int reference_count;
+    size_t connection_count;
     struct ev_io watcher;
     struct ev_timer backoff_timer;
+    ev_tstamp backoff_interval;     /* 0.0 when accepting normally */
     struct Table *table;
     int (*accept_cb)(struct Listener *, struct ev_loop *);
     SLIST_ENTRY(Listener) entries;
@@ -61,6 +67,10 @@ int accept_listener_protocol(struct Listener *, const char *);
 int accept_listener_reuseport(struct Listener *, const char *);
 int accept_listener_ipv6_v6only(struct Listener *, const char *);
 int accept_listener_bad_request_action(struct Listener *, const char *);
+int accept_listener_max_connections(struct Listener *, const char *);
+int accept_listener_max_request_size(struct Listener *, const char *);
+int accept_listener_per_request_routing(struct Listener *, const char *);
+int accept_listener_accept_proxy_protocol(struct Listener *, const char *);
 
 void add_listener(struct Listener_head *, struct Listener *);
 void init_listeners(struct Listener_head *, const struct Table_head *, struct ev_loop *);
@@ -70,7 +80,8 @@ void free_listeners(struct Listener_head *, struct ev_loop *);
 
 int valid_listener(const struct Listener *);
 struct LookupResult listener_lookup_server_address(const struct Listener *,
-        const char *, size_t);
+        const char *, size_t, const struct ClientHello *,
+        const struct sockaddr *, union AddressStorage *);
 void print_listener_config(FILE *, const struct Listener *);
 void listener_ref_put(struct Listener *);
 struct Listener *listener_ref_get(struct Listener *);
@@ -0,0 +1,1012 @@
+/*
+ * Copyright (c) 2011 and 2012, Dustin Lundquist <dustin@null-ptr.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Matching of a table's regular expressions in a single pass over the
+ * hostname.
+ *
+ * Each pattern is parsed and compiled to a Thompson NFA, and all of them
+ * share one lazily built DFA: a DFA state is the set of NFA states reached
+ * from every pattern's start at every position of the name, along with the
+ * lowest index of the patterns matched so far. NFA states of patterns with
+ * a higher index than that are dropped, so once the lowest index can no
+ * longer improve the set is empty and matching stops. DFA states are created
+ * as names need them and cached, and the cache is emptied when it is full.
+ *
+ * Only the subset of PCRE syntax where this gives the same result is
+ * accepted: literals, escapes, ., character classes, groups, alternation,
+ * greedy and lazy quantifiers, ^ and a $ followed only by the end of the
+ * pattern. Patterns using anything else, such as back references, lookaround
+ * assertions, option settings or possessive quantifiers, are rejected and
+ * are to be evaluated by PCRE.
+ *
+ * Letters match either case, as with PCRE2_CASELESS, since hostnames are
+ * looked up in lower case.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <ctype.h> /* isalnum() */
+#include "pattern_set.h"
+#include "logger.h"
+
+#define MAX_REPEAT 255              /* largest {n,m} bound */
+#define MAX_PATTERN_STATES 4096     /* NFA states of a single pattern */
+#define MAX_DFA_STATES 2048         /* cached DFA states, 1KiB each */
+#define DFA_TABLE_SIZE (2 * MAX_DFA_STATES)
+#define NO_MATCH INT_MAX
+
+
+struct ByteSet {
+    uint32_t bits[8];
+};
+
+struct Node {
+    enum NodeType {
+        NODE_EMPTY,
+        NODE_BYTES,
+        NODE_CONCAT,
+        NODE_ALTERNATE,
+        NODE_REPEAT,
+        NODE_BOL,
+        NODE_EOL,
+    } type;
+    int left, right;            /* children, the left only for repeat */
+    int min, max;               /* repeat bounds, max -1 for no limit */
+    struct ByteSet bytes;
+};
+
+struct Parser {
+    const char *p;
+    struct Node *nodes;
+    size_t len, size;
+};
+
+struct NfaState {
+    enum StateType {
+        STATE_BYTES,            /* consume a byte in the set */
+        STATE_SPLIT,            /* continue to both out and out1 */
+        STATE_BOL,              /* only at the start of the name */
+        STATE_EOL,              /* only at the end, or before a final \n */
+        STATE_MATCH,
+    } type;
+    int id;                     /* pattern index */
+    int out, out1;
+    int eol_match;              /* STATE_EOL leads to the match */
+    struct ByteSet bytes;
+};
+
+struct DfaState {
+    int next[256];              /* -1 until needed */
+    int best;                   /* lowest pattern matched before this state */
+    int end_best;               /* lowest pattern matched if the name ends */
+    size_t set, set_len;        /* NFA states, in sets */
+    uint32_t hash;
+};
+
+struct PatternSet {
+    struct NfaState *nfa;
+    size_t nfa_len, nfa_size;
+    int *starts;                /* start of each pattern, by index */
+    size_t starts_len, starts_size;
+
+    /* Lazily built DFA */
+    struct DfaState *dfa;
+    size_t dfa_len, dfa_size;
+    int *dfa_table;             /* open addressing hash table of dfa */
+    int *sets;
+    size_t sets_len, sets_size;
+    int start;                  /* start DFA state, -1 until needed */
+    unsigned long flushes;
+
+    /* Scratch space for epsilon closures, sized to the NFA */
+    unsigned int *mark;
+    unsigned int generation;
+    int *stack;
+    int *scratch;
+    size_t scratch_size;
+};
+
+
+static int parse_alternation(struct Parser *);
+static int parse_concatenation(struct Parser *);
+static int parse_repeat(struct Parser *);
+static int parse_atom(struct Parser *);
+static int parse_class(struct Parser *, struct ByteSet *);
+static int parse_escape(struct Parser *, struct ByteSet *);
+static int new_node(struct Parser *, enum NodeType, int, int);
+static void byte_set_add(struct ByteSet *, int, int);
+static void byte_set_invert(struct ByteSet *);
+static void byte_set_fold(struct ByteSet *);
+static int byte_set_contains(const struct ByteSet *, uint8_t);
+static int new_state(struct PatternSet *, enum StateType, int, int, int,
+        size_t);
+static int compile_node(struct PatternSet *, const struct Parser *, int,
+        int, int, size_t);
+static int check_eol(struct PatternSet *, size_t);
+static int reserve_scratch(struct PatternSet *);
+static void next_generation(struct PatternSet *);
+static void closure(struct PatternSet *, int, int, size_t *, int *);
+static int start_state(struct PatternSet *);
+static int step(struct PatternSet *, int, uint8_t);
+static int dfa_state(struct PatternSet *, size_t, int);
+static void flush_dfa(struct PatternSet *);
+static int compare_int(const void *, const void *);
+
+
+struct PatternSet *
+new_pattern_set() {
+    struct PatternSet *set = calloc(1, sizeof(struct PatternSet));
+    if (set == NULL)
+        return NULL;
+
+    set->dfa_table = malloc(DFA_TABLE_SIZE * sizeof(int));
+    if (set->dfa_table == NULL) {
+        free(set);
+        return NULL;
+    }
+    flush_dfa(set);
+
+    return set;
+}
+
+void
+free_pattern_set(struct PatternSet *set) {
+    if (set == NULL)
+        return;
+
+    free(set->nfa);
+    free(set->starts);
+    free(set->dfa);
+    free(set->dfa_table);
+    free(set->sets);
+    free(set->mark);
+    free(set->stack);
+    free(set->scratch);
+    free(set);
+}
+
+/*
+ * Add a pattern to the set
+ *
+ * Returns the pattern's index, counting from 0 in the order added, or -1 if
+ * the pattern uses syntax the set does not support
+ */
+int
+pattern_set_add(struct PatternSet *set, const char *pattern) {
+    struct Parser parser = { .p = pattern };
+    size_t first = set->nfa_len;
+    int id = (int)set->starts_len;
+    int start = -1;
+
+    int root = parse_alternation(&parser);
+    if (root >= 0 && *parser.p == '\0') {
+        int match = new_state(set, STATE_MATCH, id, -1, -1, first);
+        if (match >= 0)
+            start = compile_node(set, &parser, root, match, id, first);
+    }
+    free(parser.nodes);
+
+    if (start >= 0 && (!reserve_scratch(set) || !check_eol(set, first)))
+        start = -1;
+
+    if (start >= 0 && set->starts_len == set->starts_size) {
+        size_t size = set->starts_size > 0 ? 2 * set->starts_size : 16;
+        int *starts = realloc(set->starts, size * sizeof(int));
+        if (starts == NULL) {
+            err("%s: realloc", __func__);
+            start = -1;
+        } else {
+            set->starts = starts;
+            set->starts_size = size;
+        }
+    }
+
+    if (start < 0) {
+        set->nfa_len = first;
+        return -1;
+    }
+
+    set->starts[set->starts_len++] = start;
+    flush_dfa(set);
+
+    return id;
+}
+
+/*
+ * Match the name against every pattern of the set
+ *
+ * Returns the lowest index of the patterns which match, PATTERN_SET_NO_MATCH
+ * if none do or PATTERN_SET_ERROR if memory for the DFA could not be
+ * allocated
+ */
+int
+pattern_set_match(struct PatternSet *set, const char *name, size_t len) {
+    if (set->starts_len == 0)
+        return PATTERN_SET_NO_MATCH;
+
+    if (set->start < 0 && (set->start = start_state(set)) < 0)
+        return PATTERN_SET_ERROR;
+
+    int state = set->start;
+    int best = NO_MATCH;
+    for (size_t i = 0; i < len && set->dfa[state].set_len > 0; i++) {
+        uint8_t c = (uint8_t)name[i];
+
+        /* $ also matches before a final newline */
+        if (i == len - 1 && c == '\n' && set->dfa[state].end_best < best)
+            best = set->dfa[state].end_best;
+
+        int next = set->dfa[state].next[c];
+        if (next < 0) {
+            unsigned long flushes = set->flushes;
+
+            next = step(set, state, c);
+            if (next < 0)
+                return PATTERN_SET_ERROR;
+
+            /* Unless state was discarded to make room for next */
+            if (set->flushes == flushes)
+                set->dfa[state].next[c] = next;
+        }
+        state = next;
+    }
+
+    if (set->dfa[state].end_best < best)
+        best = set->dfa[state].end_best;
+
+    return best == NO_MATCH ? PATTERN_SET_NO_MATCH : best;
+}
+
+/*
+ * Regular expression parser, returning the index of the parsed node or -1
+ * if the pattern is not supported
+ */
+static int
+parse_alternation(struct Parser *parser) {
+    int node = parse_concatenation(parser);
+
+    while (node >= 0 && *parser->p == '|') {
+        parser->p++;
+
+        int right = parse_concatenation(parser);
+        if (right < 0)
+            return -1;
+
+        node = new_node(parser, NODE_ALTERNATE, node, right);
+    }
+
+    return node;
+}
+
+static int
+parse_concatenation(struct Parser *parser) {
+    int node = new_node(parser, NODE_EMPTY, -1, -1);
+
+    while (node >= 0 && *parser->p != '\0' && *parser->p != '|' &&
+            *parser->p != ')') {
+        int right = parse_repeat(parser);
+        if (right < 0)
+            return -1;
+
+        node = new_node(parser, NODE_CONCAT, node, right);
+    }
+
+    return node;
+}
+
+static int
+parse_repeat(struct Parser *parser) {
+    int atom = parse_atom(parser);
+    int min, max;
+
+    if (atom < 0)
+        return -1;
+
+    switch (*parser->p) {
+        case '*':
+            min = 0;
+            max = -1;
+            parser->p++;
+            break;
+        case '+':
+            min = 1;
+            max = -1;
+            parser->p++;
+            break;
+        case '?':
+            min = 0;
+            max = 1;
+            parser->p++;
+            break;
+        case '{': {
+            char *end;
+            unsigned long low, high;
+
+            /* Other braces are literal in PCRE, {,n} depending on version */
+            if (!isdigit((unsigned char)parser->p[1]))
+                return -1;
+            low = strtoul(parser->p + 1, &end, 10);
+            high = low;
+            if (*end == ',') {
+                high = ULONG_MAX;
+                if (isdigit((unsigned char)end[1]))
+                    high = strtoul(end + 1, &end, 10);
+                else
+                    end++;
+            }
+            if (*end != '}' || low > MAX_REPEAT || high < low ||
+                    (high > MAX_REPEAT && high != ULONG_MAX))
+                return -1;
+            min = (int)low;
+            max = high == ULONG_MAX ? -1 : (int)high;
+            parser->p = end + 1;
+            break;
+        }
+        default:
+            return atom;
+    }
+
+    /* Whether greedy or lazy, the same names match */
+    if (*parser->p == '?')
+        parser->p++;
+
+    /* Possessive quantifiers can prevent a match */
+    if (*parser->p != '\0' && strchr("*+?{", *parser->p) != NULL)
+        return -1;
+
+    if (parser->nodes[atom].type == NODE_BOL ||
+            parser->nodes[atom].type == NODE_EOL)
+        return -1;
+
+    int node = new_node(parser, NODE_REPEAT, atom, -1);
+    if (node >= 0) {
+        parser->nodes[node].min = min;
+        parser->nodes[node].max = max;
+    }
+
+    return node;
+}
+
+static int
+parse_atom(struct Parser *parser) {
+    struct ByteSet bytes;
+    int node;
+
+    memset(&bytes, 0, sizeof(bytes));
+
+    switch (*parser->p++) {
+        case '(':
+            if (*parser->p == '?') {
+                /* Only non-capturing groups */
+                if (parser->p[1] != ':')
+                    return -1;
+                parser->p += 2;
+            }
+
+            node = parse_alternation(parser);
+            if (node < 0 || *parser->p != ')')
+                return -1;
+            parser->p++;
+
+            return node;
+        case '[':
+            if (parse_class(parser, &bytes) < 0)
+                return -1;
+            break;
+        case '.':
+            byte_set_add(&bytes, '\n', '\n');
+            byte_set_invert(&bytes);
+            break;
+        case '^':
+            return new_node(parser, NODE_BOL, -1, -1);
+        case '$':
+            return new_node(parser, NODE_EOL, -1, -1);
+        case '\\':
+            if (*parser->p == 'A') {
+                parser->p++;
+                return new_node(parser, NODE_BOL, -1, -1);
+            } else if (*parser->p == 'Z') {
+                parser->p++;
+                return new_node(parser, NODE_EOL, -1, -1);
+            }
+
+            if (parse_escape(parser, &bytes) < 0)
+                return -1;
+            break;
+        case '*':
+        case '+':
+        case '?':
+        case '{':
+            return -1;
+        default:
+            byte_set_add(&bytes, (uint8_t)parser->p[-1], (uint8_t)parser->p[-1]);
+            break;
+    }
+
+    byte_set_fold(&bytes);
+    node = new_node(parser, NODE_BYTES, -1, -1);
+    if (node >= 0)
+        parser->nodes[node].bytes = bytes;
+
+    return node;
+}
+
+/*
+ * Parse a character class following the [
+ */
+static int
+parse_class(struct Parser *parser, struct ByteSet *bytes) {
+    int negate = 0;
+
+    if (*parser->p == '^') {
+        negate = 1;
+        parser->p++;
+    }
+
+    /* A ] first in the class is literal */
+    for (int first = 1; *parser->p != ']' || first; first = 0) {
+        struct ByteSet item;
+        int low, high;
+
+        memset(&item, 0, sizeof(item));
+
+        if (*parser->p == '\0')
+            return -1;
+
+        /* POSIX classes and collating elements */
+        if (parser->p[0] == '[' && strchr(":.=", parser->p[1]) != NULL)
+            return -1;
+
+        if (*parser->p == '\\') {
+            parser->p++;
+            low = parse_escape(parser, &item);
+            if (low < 0)
+                return -1;
+        } else {
+            low = (uint8_t)*parser->p++;
+        }
+
+        if (low > UINT8_MAX || parser->p[0] != '-' || parser->p[1] == ']' ||
+                parser->p[1] == '\0') {
+            if (low > UINT8_MAX) {
+                for (int i = 0; i < 8; i++)
+                    bytes->bits[i] |= item.bits[i];
+            } else {
+                byte_set_add(bytes, low, low);
+            }
+            continue;
+        }
+
+        /* A range */
+        parser->p++;
+        if (*parser->p == '\\') {
+            parser->p++;
+            high = parse_escape(parser, &item);
+        } else if (parser->p[0] == '[' && strchr(":.=", parser->p[1]) != NULL) {
+            return -1;
+        } else {
+            high = (uint8_t)*parser->p++;
+        }
+        if (high < low || high > UINT8_MAX)
+            return -1;
+
+        byte_set_add(bytes, low, high);
+    }
+    parser->p++;
+
+    /* A negated class excludes both cases of its letters */
+    byte_set_fold(bytes);
+    if (negate)
+        byte_set_invert(bytes);
+
+    return 0;
+}
+
+/*
+ * Parse an escape sequence following the \, adding the bytes it matches
+ *
+ * Returns the byte for a single character, 256 for a class such as \d or -1
+ * if not supported
+ */
+static int
+parse_escape(struct Parser *parser, struct ByteSet *bytes) {
+    int c = (uint8_t)*parser->p;
+    int negate = 0;
+
+    if (c == '\0')
+        return -1;
+    parser->p++;
+
+    switch (c) {
+        case 'D':
+            negate = 1;
+            /* fall through */
+        case 'd':
+            byte_set_add(bytes, '0', '9');
+            break;
+        case 'W':
+            negate = 1;
+            /* fall through */
+        case 'w':
+            byte_set_add(bytes, '0', '9');
+            byte_set_add(bytes, 'A', 'Z');
+            byte_set_add(bytes, 'a', 'z');
+            byte_set_add(bytes, '_', '_');
+            break;
+        case 'S':
+            negate = 1;
+            /* fall through */
+        case 's':
+            byte_set_add(bytes, '\t', '\r');
+            byte_set_add(bytes, ' ', ' ');
+            break;
+        case 'a':
+            c = '\a';
+            goto single;
+        case 'e':
+            c = 0x1b;
+            goto single;
+        case 'f':
+            c = '\f';
+            goto single;
+        case 'n':
+            c = '\n';
+            goto single;
+        case 'r':
+            c = '\r';
+            goto single;
+        case 't':
+            c = '\t';
+            goto single;
+        default:
+            /* Back references, assertions and other escapes */
+            if (isalnum(c))
+                return -1;
+single:
+            byte_set_add(bytes, c, c);
+            return c;
+    }
+
+    if (negate)
+        byte_set_invert(bytes);
+
+    return UINT8_MAX + 1;
+}
+
+static int
+new_node(struct Parser *parser, enum NodeType type, int left, int right) {
+    if (parser->len == parser->size) {
+        size_t size = parser->size > 0 ? 2 * parser->size : 32;
+        struct Node *nodes = realloc(parser->nodes, size * sizeof(struct Node));
+        if (nodes == NULL) {
+            err("%s: realloc", __func__);
+            return -1;
+        }
+        parser->nodes = nodes;
+        parser->size = size;
+    }
+
+    struct Node *node = &parser->nodes[parser->len];
+    memset(node, 0, sizeof(*node));
+    node->type = type;
+    node->left = left;
+    node->right = right;
+
+    return (int)parser->len++;
+}
+
+static void
+byte_set_add(struct ByteSet *bytes, int low, int high) {
+    for (int c = low; c <= high; c++)
+        bytes->bits[c >> 5] |= (uint32_t)1 << (c & 31);
+}
+
+static void
+byte_set_invert(struct ByteSet *bytes) {
+    for (int i = 0; i < 8; i++)
+        bytes->bits[i] = ~bytes->bits[i];
+}
+
+/*
+ * Add the other case of each ASCII letter in the set
+ */
+static void
+byte_set_fold(struct ByteSet *bytes) {
+    for (int c = 'a'; c <= 'z'; c++) {
+        int upper = c - 'a' + 'A';
+
+        if (byte_set_contains(bytes, (uint8_t)c) ||
+                byte_set_contains(bytes, (uint8_t)upper)) {
+            byte_set_add(bytes, c, c);
+            byte_set_add(bytes, upper, upper);
+        }
+    }
+}
+
+static int
+byte_set_contains(const struct ByteSet *bytes, uint8_t c) {
+    return (bytes->bits[c >> 5] >> (c & 31)) & 1;
+}
+
+/*
+ * Append an NFA state to those of the pattern starting at first
+ */
+static int
+new_state(struct PatternSet *set, enum StateType type, int id, int out,
+        int out1, size_t first) {
+    if (set->nfa_len - first >= MAX_PATTERN_STATES)
+        return -1;
+
+    if (set->nfa_len == set->nfa_size) {
+        size_t size = set->nfa_size > 0 ? 2 * set->nfa_size : 64;
+        struct NfaState *nfa = realloc(set->nfa, size * sizeof(struct NfaState));
+        if (nfa == NULL) {
+            err("%s: realloc", __func__);
+            return -1;
+        }
+        set->nfa = nfa;
+        set->nfa_size = size;
+    }
+
+    struct NfaState *state = &set->nfa[set->nfa_len];
+    memset(state, 0, sizeof(*state));
+    state->type = type;
+    state->id = id;
+    state->out = out;
+    state->out1 = out1;
+
+    return (int)set->nfa_len++;
+}
+
+/*
+ * Compile a parsed node to NFA states continuing to next
+ *
+ * Returns the state to start from, or -1 if the pattern is too large
+ */
+static int
+compile_node(struct PatternSet *set, const struct Parser *parser, int index,
+        int next, int id, size_t first) {
+    const struct Node *node = &parser->nodes[index];
+    int start, body;
+
+    switch (node->type) {
+        case NODE_EMPTY:
+            return next;
+        case NODE_BYTES:
+            start = new_state(set, STATE_BYTES, id, next, -1, first);
+            if (start >= 0)
+                set->nfa[start].bytes = node->bytes;
+            return start;
+        case NODE_CONCAT:
+            start = compile_node(set, parser, node->right, next, id, first);
+            if (start < 0)
+                return -1;
+            return compile_node(set, parser, node->left, start, id, first);
+        case NODE_ALTERNATE:
+            start = compile_node(set, parser, node->left, next, id, first);
+            body = compile_node(set, parser, node->right, next, id, first);
+            if (start < 0 || body < 0)
+                return -1;
+            return new_state(set, STATE_SPLIT, id, start, body, first);
+        case NODE_BOL:
+            return new_state(set, STATE_BOL, id, next, -1, first);
+        case NODE_EOL:
+            return new_state(set, STATE_EOL, id, next, -1, first);
+        case NODE_REPEAT:
+            if (node->max < 0) {
+                /* A loop, after the required repetitions */
+                start = new_state(set, STATE_SPLIT, id, -1, next, first);
+                if (start < 0)
+                    return -1;
+                body = compile_node(set, parser, node->left, start, id, first);
+                if (body < 0)
+                    return -1;
+                set->nfa[start].out = body;
+            } else {
+                /* Nested optional repetitions, x{0,2} as (x(x)?)? */
+                start = next;
+                for (int i = node->min; i < node->max; i++) {
+                    body = compile_node(set, parser, node->left, start, id, first);
+                    if (body < 0)
+                        return -1;
+                    start = new_state(set, STATE_SPLIT, id, body, next, first);
+                    if (start < 0)
+                        return -1;
+                }
+            }
+
+            for (int i = 0; i < node->min; i++) {
+                start = compile_node(set, parser, node->left, start, id, first);
+                if (start < 0)
+                    return -1;
+            }
+
+            return start;
+    }
+
+    return -1;
+}
+
+/*
+ * Mark the $ assertions of the pattern starting at first which lead to its
+ * match, rejecting the pattern if any can be followed by more of it
+ */
+static int
+check_eol(struct PatternSet *set, size_t first) {
+    for (size_t i = first; i < set->nfa_len; i++) {
+        if (set->nfa[i].type != STATE_EOL)
+            continue;
+
+        size_t depth = 0;
+        next_generation(set);
+        set->stack[depth++] = set->nfa[i].out;
+        while (depth > 0) {
+            int s = set->stack[--depth];
+            struct NfaState *state = &set->nfa[s];
+
+            if (set->mark[s] == set->generation)
+                continue;
+            set->mark[s] = set->generation;
+
+            switch (state->type) {
+                case STATE_SPLIT:
+                    set->stack[depth++] = state->out1;
+                    /* fall through */
+                case STATE_EOL:
+                    set->stack[depth++] = state->out;
+                    break;
+                case STATE_MATCH:
+                    set->nfa[i].eol_match = 1;
+                    break;
+                case STATE_BYTES:
+                case STATE_BOL:
+                    return 0;
+            }
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Size the scratch space used for closures to the NFA
+ */
+static int
+reserve_scratch(struct PatternSet *set) {
+    if (set->scratch_size >= set->nfa_len)
+        return 1;
+
+    size_t size = set->nfa_size;
+    unsigned int *mark = calloc(size, sizeof(unsigned int));
+    int *stack = malloc((2 * size + 1) * sizeof(int));
+    int *scratch = malloc(size * sizeof(int));
+    if (mark == NULL || stack == NULL || scratch == NULL) {
+        err("%s: malloc", __func__);
+        free(mark);
+        free(stack);
+        free(scratch);
+        return 0;
+    }
+
+    free(set->mark);
+    free(set->stack);
+    free(set->scratch);
+    set->mark = mark;
+    set->generation = 0;
+    set->stack = stack;
+    set->scratch = scratch;
+    set->scratch_size = size;
+
+    return 1;
+}
+
+/*
+ * Clear the marks of visited NFA states
+ */
+static void
+next_generation(struct PatternSet *set) {
+    if (++set->generation == 0) {
+        memset(set->mark, 0, set->scratch_size * sizeof(unsigned int));
+        set->generation = 1;
+    }
+}
+
+/*
+ * Add the NFA states reachable from state without consuming a byte to the
+ * scratch list, and lower best to the patterns which match there
+ */
+static void
+closure(struct PatternSet *set, int state, int at_start, size_t *len,
+        int *best) {
+    size_t depth = 0;
+
+    set->stack[depth++] = state;
+    while (depth > 0) {
+        int s = set->stack[--depth];
+        const struct NfaState *nfa = &set->nfa[s];
+
+        if (set->mark[s] == set->generation || nfa->id >= *best)
+            continue;
+        set->mark[s] = set->generation;
+
+        switch (nfa->type) {
+            case STATE_SPLIT:
+                set->stack[depth++] = nfa->out1;
+                set->stack[depth++] = nfa->out;
+                break;
+            case STATE_BOL:
+                if (at_start)
+                    set->stack[depth++] = nfa->out;
+                break;
+            case STATE_MATCH:
+                *best = nfa->id;
+                break;
+            case STATE_BYTES:
+            case STATE_EOL:
+                set->scratch[(*len)++] = s;
+                break;
+        }
+    }
+}
+
+static int
+start_state(struct PatternSet *set) {
+    size_t len = 0;
+    int best = NO_MATCH;
+
+    next_generation(set);
+    for (size_t i = 0; i < set->starts_len; i++)
+        closure(set, set->starts[i], 1, &len, &best);
+
+    return dfa_state(set, len, best);
+}
+
+/*
+ * The DFA state following state on byte c: the closures of the NFA states
+ * consuming c, and of every pattern's start as a match may begin anywhere
+ */
+static int
+step(struct PatternSet *set, int state, uint8_t c) {
+    const struct DfaState *dfa = &set->dfa[state];
+    const int *states = set->sets + dfa->set;
+    int best = dfa->best;
+    size_t len = 0;
+
+    next_generation(set);
+    for (size_t i = 0; i < dfa->set_len; i++) {
+        const struct NfaState *nfa = &set->nfa[states[i]];
+
+        if (nfa->type == STATE_BYTES && nfa->id < best &&
+                byte_set_contains(&nfa->bytes, c))
+            closure(set, nfa->out, 0, &len, &best);
+    }
+    for (size_t i = 0; i < set->starts_len && (int)i < best; i++)
+        closure(set, set->starts[i], 0, &len, &best);
+
+    return dfa_state(set, len, best);
+}
+
+/*
+ * Find or create the DFA state for the NFA states in the scratch list
+ */
+static int
+dfa_state(struct PatternSet *set, size_t len, int best) {
+    int *states = set->scratch;
+    size_t set_len = 0;
+
+    /* Patterns after the best match so far can not improve on it */
+    for (size_t i = 0; i < len; i++)
+        if (set->nfa[states[i]].id < best)
+            states[set_len++] = states[i];
+    qsort(states, set_len, sizeof(int), compare_int);
+
+    uint32_t hash = 2166136261u ^ (uint32_t)best;
+    for (size_t i = 0; i < set_len; i++)
+        hash = (hash * 16777619u) ^ (uint32_t)states[i];
+
+    size_t slot = hash & (DFA_TABLE_SIZE - 1);
+    for (int index; (index = set->dfa_table[slot]) >= 0;
+            slot = (slot + 1) & (DFA_TABLE_SIZE - 1)) {
+        const struct DfaState *dfa = &set->dfa[index];
+
+        if (dfa->hash == hash && dfa->best == best &&
+                dfa->set_len == set_len && (set_len == 0 ||
+                memcmp(set->sets + dfa->set, states,
+                    set_len * sizeof(int)) == 0))
+            return index;
+    }
+
+    if (set->dfa_len == MAX_DFA_STATES) {
+        flush_dfa(set);
+        slot = hash & (DFA_TABLE_SIZE - 1);
+    }
+
+    if (set->dfa_len == set->dfa_size) {
+        size_t size = set->dfa_size > 0 ? 2 * set->dfa_size : 16;
+        struct DfaState *dfa = realloc(set->dfa, size * sizeof(struct DfaState));
+        if (dfa == NULL) {
+            err("%s: realloc", __func__);
+            return -1;
+        }
+        set->dfa = dfa;
+        set->dfa_size = size;
+    }
+    if (set->sets_size - set->sets_len < set_len) {
+        size_t size = set->sets_size > 0 ? 2 * set->sets_size : 256;
+        while (size - set->sets_len < set_len)
+            size *= 2;
+        int *sets = realloc(set->sets, size * sizeof(int));
+        if (sets == NULL) {
+            err("%s: realloc", __func__);
+            return -1;
+        }
+        set->sets = sets;
+        set->sets_size = size;
+    }
+
+    struct DfaState *dfa = &set->dfa[set->dfa_len];
+    memset(dfa->next, -1, sizeof(dfa->next));
+    dfa->best = best;
+    dfa->end_best = best;
+    for (size_t i = 0; i < set_len; i++) {
+        const struct NfaState *nfa = &set->nfa[states[i]];
+
+        if (nfa->type == STATE_EOL && nfa->eol_match && nfa->id < dfa->end_best)
+            dfa->end_best = nfa->id;
+    }
+    dfa->set = set->sets_len;
+    dfa->set_len = set_len;
+    dfa->hash = hash;
+    if (set_len > 0)
+        memcpy(set->sets + set->sets_len, states, set_len * sizeof(int));
+    set->sets_len += set_len;
+
+    set->dfa_table[slot] = (int)set->dfa_len;
+
+    return (int)set->dfa_len++;
+}
+
+/*
+ * Discard the DFA states built so far
+ */
+static void
+flush_dfa(struct PatternSet *set) {
+    set->dfa_len = 0;
+    set->sets_len = 0;
+    set->start = -1;
+    set->flushes++;
+    memset(set->dfa_table, -1, DFA_TABLE_SIZE * sizeof(int));
+}
+
+static int
+compare_int(const void *a, const void *b) {
+    int x = *(const int *)a;
+    int y = *(const int *)b;
+
+    return (x > y) - (x < y);
+}
@@ -27,11 +27,136 @@
 #define PROTOCOL_H
 
 #include <inttypes.h>
+#include <stddef.h>
+#include <string.h>
+
+#define PARSE_HOSTNAME_MAX 255
+#define PARSE_HOST_PORT_MAX 6   /* ":65535" following an HTTP host */
+#define PARSE_ALPN_MAX 256
+#define CLIENT_HELLO_GROUPS_MAX 8
+#define CLIENT_HELLO_FINGERPRINT_LEN 36
+
+/* Hostname normalization flags */
+#define HOSTNAME_LOWERCASED     0x01    /* upper case letters were folded */
+#define HOSTNAME_PORT_REMOVED   0x02    /* a trailing :port was removed */
+#define HOSTNAME_INVALID_CHARS  0x04    /* not a valid DNS name or address */
+
+/*
+ * Attributes of a TLS client hello besides the server name, collected in the
+ * same pass for routing and logging. GREASE values (RFC8701) are not counted.
+ */
+struct ClientHello {
+    uint16_t client_version;    /* legacy version field */
+    uint16_t max_version;       /* highest version offered */
+    uint16_t cipher_count;
+    uint16_t extension_count;
+    uint16_t group_count;
+    uint16_t groups[CLIENT_HELLO_GROUPS_MAX]; /* first supported groups */
+
+    /* ALPN ProtocolNameList: each protocol prefixed by a length byte */
+    size_t alpn_len;
+    uint8_t alpn[PARSE_ALPN_MAX];
+
+    /* JA4 style fingerprint, empty until the client hello is complete */
+    char fingerprint[CLIENT_HELLO_FINGERPRINT_LEN + 1];
+};
+
+/*
+ * Incremental parser state, kept with the connection so each call to
+ * parse_packet() only needs to be passed the bytes received since the last
+ * call.
+ */
+struct ParseState {
+    union {
+        struct {
+            uint8_t record_header[5];
+            size_t record_header_len;   /* bytes of record header received */
+            size_t record_remaining;    /* bytes left in current record */
+            unsigned int records;       /* records started */
+            size_t records_len;         /* payload length of those records */
+            uint8_t version_major, version_minor;
+
+            int field;                  /* handshake field being parsed */
+            size_t field_remaining;
+            size_t value;               /* current integer field */
+            size_t pos;                 /* offset into handshake message */
+            size_t limit;               /* end of the enclosing structure */
+            size_t hello_end, extensions_end, extension_end;
+            uint16_t extension_type;
+            uint8_t name_type;
+            int have_server_name;
+            size_t list_end;            /* end of current uint16 list */
+            uint64_t cipher_hash, extension_hash, signature_hash;
+            int quic;                   /* carried in QUIC CRYPTO frames */
+        } tls;
+        struct {
+            int state;
+            size_t match;               /* bytes of header name matched */
+
+            /* HTTP/2 with prior knowledge, after the connection preface */
+            struct {
+                int state;              /* frame parser state */
+                uint8_t frame_header[9];
+                size_t frame_header_len;
+                size_t frame_remaining; /* payload bytes left in frame */
+                size_t block_remaining; /* header block bytes in frame */
+                uint8_t frame_flags;
+                uint8_t pad_length;
+                int continuation;       /* header block continues */
+
+                int hpack_state;        /* header block decoder state */
+                uint32_t integer;
+                unsigned int integer_len;   /* bytes of integer decoded */
+                int field;              /* header field being decoded */
+                int huffman;            /* string is Huffman coded */
+                size_t string_remaining;
+                uint32_t huffman_code;
+                unsigned int huffman_bits;
+                char name[10];
+                size_t name_len;
+            } h2;
+        } http;
+    } u;
+
+    size_t hostname_len;
+    int hostname_flags;
+    /* An HTTP host is kept with its port until that is removed */
+    char hostname[PARSE_HOSTNAME_MAX + PARSE_HOST_PORT_MAX + 1];
+
+    struct ClientHello hello;
+};
+
+static inline void init_parse_state(struct ParseState *state) {
+    memset(state, 0, sizeof(struct ParseState));
+}
+
+/*
+ * Canonicalize the hostname extracted by a parser for lookup: fold to lower
+ * case, flag any characters which may not appear in a hostname or address
+ * literal and NUL terminate.
+ */
+static inline int normalize_hostname(struct ParseState *state) {
+    for (size_t i = 0; i < state->hostname_len; i++) {
+        char c = state->hostname[i];
+
+        if (c >= 'A' && c <= 'Z') {
+            state->hostname[i] = (char)(c - 'A' + 'a');
+            state->hostname_flags |= HOSTNAME_LOWERCASED;
+        } else if (!((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') ||
+                    c == '-' || c == '.' || c == '_' ||
+                    c == '[' || c == ']' || c == ':')) {
+            state->hostname_flags |= HOSTNAME_INVALID_CHARS;
+        }
+    }
+    state->hostname[state->hostname_len] = '\0';
+
+    return (int)state->hostname_len;
+}
 
 struct Protocol {
     const char *const name;
     const uint16_t default_port;
-    int (*const parse_packet)(const char*, size_t, char **);
+    int (*const parse_packet)(struct ParseState *, const char*, size_t);
     const char *const abort_message;
     const size_t abort_message_len;
 };
@@ -0,0 +1,270 @@
+/*
+ * Copyright (c) 2011 and 2012, Dustin Lundquist <dustin@null-ptr.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Parser for the PROXY protocol header a load balancer places ahead of the
+ * client's data, version 1 (text) and 2 (binary), as specified in
+ * proxy-protocol.txt distributed with HAProxy
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "proxy_protocol.h"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+#define V1_PREFIX           "PROXY "
+#define V1_PREFIX_LEN       6
+#define V1_FIELDS           6
+
+
+static ssize_t parse_v1_header(const char *, size_t, struct ProxyHeader *);
+static int parse_v1_address(const char *, const char *, int,
+        struct sockaddr_storage *, socklen_t *);
+static ssize_t parse_v2_header(const unsigned char *, size_t,
+        struct ProxyHeader *);
+
+
+/*
+ * The length of the PROXY protocol header at the start of data, told by the
+ * CRLF of version 1 or the length field of version 2, so the remainder may
+ * be awaited without parsing
+ *
+ * Returns:
+ *  >=0  - length of the header
+ *   -1  - too little data to tell
+ *   -2  - not a valid header
+ */
+ssize_t
+proxy_header_length(const char *data, size_t len) {
+    if (memcmp(data, V1_PREFIX, MIN(len, V1_PREFIX_LEN)) == 0) {
+        const char *end = memchr(data, '\n', MIN(len, PROXY_V1_HEADER_MAX));
+        if (end == NULL)
+            return len < PROXY_V1_HEADER_MAX ? -1 : -2;
+
+        return (ssize_t)(end - data) + 1;
+    }
+
+    if (memcmp(data, PP2_SIGNATURE, MIN(len, PP2_SIGNATURE_LEN)) == 0) {
+        const unsigned char *bytes = (const unsigned char *)data;
+
+        if (len < PP2_HEADER_LEN)
+            return -1;
+
+        return PP2_HEADER_LEN + ((ssize_t)bytes[14] << 8 | bytes[15]);
+    }
+
+    return -2;
+}
+
+/*
+ * Parse the PROXY protocol header at the start of data
+ *
+ * Returns:
+ *  >=0  - length of the header
+ *   -1  - incomplete header
+ *   -2  - not a valid header
+ */
+ssize_t
+parse_proxy_header(const char *data, size_t len, struct ProxyHeader *header) {
+    header->has_addresses = 0;
+
+    if (memcmp(data, V1_PREFIX, MIN(len, V1_PREFIX_LEN)) == 0)
+        return len < V1_PREFIX_LEN ? -1 : parse_v1_header(data, len, header);
+
+    if (memcmp(data, PP2_SIGNATURE, MIN(len, PP2_SIGNATURE_LEN)) == 0)
+        return parse_v2_header((const unsigned char *)data, len, header);
+
+    return -2;
+}
+
+/*
+ * "PROXY TCP4 <source> <destination> <source port> <destination port>\r\n",
+ * with TCP6 for IPv6 addresses, or "PROXY UNKNOWN" followed by anything
+ */
+static ssize_t
+parse_v1_header(const char *data, size_t len, struct ProxyHeader *header) {
+    char line[PROXY_V1_HEADER_MAX];
+    char *fields[V1_FIELDS];
+    size_t field_count = 0;
+    int family;
+
+    const char *end = memchr(data, '\n', MIN(len, PROXY_V1_HEADER_MAX));
+    if (end == NULL)
+        return len < PROXY_V1_HEADER_MAX ? -1 : -2;
+    if (end[-1] != '\r')
+        return -2;
+
+    size_t line_len = (size_t)(end - data) - 1;
+    memcpy(line, data, line_len);
+    line[line_len] = '\0';
+
+    char *pos = line;
+    while (field_count < V1_FIELDS) {
+        fields[field_count++] = pos;
+        pos = strchr(pos, ' ');
+        if (pos == NULL)
+            break;
+        *pos++ = '\0';
+    }
+
+    if (field_count >= 2 && strcmp(fields[1], "UNKNOWN") == 0)
+        return (ssize_t)line_len + 2;
+
+    if (field_count != V1_FIELDS || pos != NULL)
+        return -2;
+
+    if (strcmp(fields[1], "TCP4") == 0)
+        family = AF_INET;
+    else if (strcmp(fields[1], "TCP6") == 0)
+        family = AF_INET6;
+    else
+        return -2;
+
+    if (!parse_v1_address(fields[2], fields[4], family,
+                &header->source, &header->source_len) ||
+            !parse_v1_address(fields[3], fields[5], family,
+                &header->destination, &header->destination_len))
+        return -2;
+
+    header->has_addresses = 1;
+
+    return (ssize_t)line_len + 2;
+}
+
+/*
+ * Returns true if address and port form a valid socket address of family
+ */
+static int
+parse_v1_address(const char *address, const char *port, int family,
+        struct sockaddr_storage *addr, socklen_t *addr_len) {
+    size_t port_len = strlen(port);
+
+    /* Decimal without leading zeros */
+    if (port_len == 0 || port_len > 5 ||
+            strspn(port, "0123456789") != port_len ||
+            (port[0] == '0' && port_len > 1))
+        return 0;
+
+    unsigned long port_number = strtoul(port, NULL, 10);
+    if (port_number > 65535)
+        return 0;
+
+    memset(addr, 0, sizeof(*addr));
+    if (family == AF_INET) {
+        struct sockaddr_in *sin = (struct sockaddr_in *)addr;
+
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons((uint16_t)port_number);
+        *addr_len = sizeof(struct sockaddr_in);
+
+        return inet_pton(AF_INET, address, &sin->sin_addr) == 1;
+    } else {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)addr;
+
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons((uint16_t)port_number);
+        *addr_len = sizeof(struct sockaddr_in6);
+
+        return inet_pton(AF_INET6, address, &sin6->sin6_addr) == 1;
+    }
+}
+
+/*
+ * Signature, version and command, address family and protocol, length of
+ * the remainder, then the addresses and any TLVs, which are skipped
+ */
+static ssize_t
+parse_v2_header(const unsigned char *data, size_t len,
+        struct ProxyHeader *header) {
+    if (len < PP2_HEADER_LEN)
+        return -1;
+
+    if ((data[12] >> 4) != PP2_VERSION)
+        return -2;
+
+    size_t header_len = PP2_HEADER_LEN + ((size_t)data[14] << 8 | data[15]);
+    if (len < header_len)
+        return -1;
+
+    const unsigned char *addresses = data + PP2_HEADER_LEN;
+    size_t addresses_len = header_len - PP2_HEADER_LEN;
+
+    switch (data[12] & 0x0F) {
+        case PP2_CMD_LOCAL:
+            /* Sent by the load balancer on its own behalf */
+            return (ssize_t)header_len;
+        case PP2_CMD_PROXY:
+            break;
+        default:
+            return -2;
+    }
+
+    /* Either stream or datagram protocols, for other families (AF_UNIX) the
+     * addresses are ignored */
+    if ((data[13] >> 4) == PP2_AF_INET) {
+        struct sockaddr_in *source = (struct sockaddr_in *)&header->source;
+        struct sockaddr_in *destination =
+            (struct sockaddr_in *)&header->destination;
+
+        if (addresses_len < 12)
+            return -2;
+
+        memset(&header->source, 0, sizeof(header->source));
+        memset(&header->destination, 0, sizeof(header->destination));
+        source->sin_family = AF_INET;
+        destination->sin_family = AF_INET;
+        memcpy(&source->sin_addr, addresses, 4);
+        memcpy(&destination->sin_addr, addresses + 4, 4);
+        memcpy(&source->sin_port, addresses + 8, 2);
+        memcpy(&destination->sin_port, addresses + 10, 2);
+        header->source_len = sizeof(struct sockaddr_in);
+        header->destination_len = sizeof(struct sockaddr_in);
+        header->has_addresses = 1;
+    } else if ((data[13] >> 4) == PP2_AF_INET6) {
+        struct sockaddr_in6 *source = (struct sockaddr_in6 *)&header->source;
+        struct sockaddr_in6 *destination =
+            (struct sockaddr_in6 *)&header->destination;
+
+        if (addresses_len < 36)
+            return -2;
+
+        memset(&header->source, 0, sizeof(header->source));
+        memset(&header->destination, 0, sizeof(header->destination));
+        source->sin6_family = AF_INET6;
+        destination->sin6_family = AF_INET6;
+        memcpy(&source->sin6_addr, addresses, 16);
+        memcpy(&destination->sin6_addr, addresses + 16, 16);
+        memcpy(&source->sin6_port, addresses + 32, 2);
+        memcpy(&destination->sin6_port, addresses + 34, 2);
+        header->source_len = sizeof(struct sockaddr_in6);
+        header->destination_len = sizeof(struct sockaddr_in6);
+        header->has_addresses = 1;
+    }
+
+    return (ssize_t)header_len;
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2011 and 2012, Dustin Lundquist <dustin@null-ptr.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef PROXY_PROTOCOL_H
+#define PROXY_PROTOCOL_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/* Longest version 1 header, including the CRLF */
+#define PROXY_V1_HEADER_MAX 107
+
+/* PROXY protocol version 2 header */
+#define PP2_SIGNATURE           "\x0D\x0A\x0D\x0A\x00\x0D\x0A\x51\x55\x49\x54\x0A"
+#define PP2_SIGNATURE_LEN       12
+#define PP2_HEADER_LEN          16
+#define PP2_VERSION             0x2     /* high nibble of version and command */
+#define PP2_CMD_LOCAL           0x0
+#define PP2_CMD_PROXY           0x1
+#define PP2_VERSION_PROXY       0x21
+#define PP2_AF_INET             0x1     /* high nibble of family and protocol */
+#define PP2_AF_INET6            0x2
+#define PP2_FAM_UNSPEC          0x00
+#define PP2_FAM_TCP4            0x11
+#define PP2_FAM_TCP6            0x21
+#define PP2_TYPE_ALPN           0x01
+#define PP2_TYPE_AUTHORITY      0x02
+#define PP2_TYPE_UNIQUE_ID      0x05
+
+/*
+ * Connection described by a PROXY protocol header received from a load
+ * balancer. Headers for health checks by the load balancer itself, or for
+ * other address families, carry no addresses.
+ */
+struct ProxyHeader {
+    int has_addresses;
+    struct sockaddr_storage source, destination;
+    socklen_t source_len, destination_len;
+};
+
+ssize_t proxy_header_length(const char *, size_t);
+ssize_t parse_proxy_header(const char *, size_t, struct ProxyHeader *);
+
+#endif
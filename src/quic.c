@@ -0,0 +1,561 @@
+/*
+ * Copyright (c) 2011 and 2012, Dustin Lundquist <dustin@null-ptr.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Server name extraction from QUIC Initial packets (RFC9000, RFC9001 and
+ * RFC9369 for version 2). The Initial packets a client sends to open a
+ * connection are protected with keys derived from the destination connection
+ * ID it chose, so can be decrypted by anyone on the path. The CRYPTO frames
+ * they carry are reassembled into the TLS client hello, which is passed to
+ * the TLS parser.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_LIBCRYPTO
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#endif
+#include "quic.h"
+#include "tls.h"
+#include "logger.h"
+
+#define QUIC_LONG_HEADER        0x80
+#define QUIC_FIXED_BIT          0x40
+#define QUIC_PACKET_TYPE(b)     (((b) >> 4) & 0x03)
+
+#define QUIC_FRAME_PADDING      0x00
+#define QUIC_FRAME_PING         0x01
+#define QUIC_FRAME_ACK          0x02
+#define QUIC_FRAME_ACK_ECN      0x03
+#define QUIC_FRAME_CRYPTO       0x06
+#define QUIC_FRAME_CONNECTION_CLOSE 0x1c
+
+#define AEAD_TAG_LEN            16
+#define HP_SAMPLE_LEN           16
+
+
+/*
+ * Version specific Initial salt and key labels, and long header packet types
+ */
+struct QuicVersion {
+    uint32_t version;
+    uint8_t salt[20];
+    const char *key_label, *iv_label, *hp_label;
+    uint8_t initial_type, retry_type;
+};
+
+static const struct QuicVersion quic_versions[] = {
+    {
+        .version = QUIC_VERSION_1,
+        .salt = {
+            0x38, 0x76, 0x2c, 0xf7, 0xf5, 0x59, 0x34, 0xb3, 0x4d, 0x17,
+            0x9a, 0xe6, 0xa4, 0xc8, 0x0c, 0xad, 0xcc, 0xbb, 0x7f, 0x0a
+        },
+        .key_label = "quic key",
+        .iv_label = "quic iv",
+        .hp_label = "quic hp",
+        .initial_type = 0x00,
+        .retry_type = 0x03,
+    },
+    {
+        .version = QUIC_VERSION_2,
+        .salt = {
+            0x0d, 0xed, 0xe3, 0xde, 0xf7, 0x00, 0xa6, 0xdb, 0x81, 0x93,
+            0x81, 0xbe, 0x6e, 0x26, 0x9d, 0xcb, 0xf9, 0xbd, 0x2e, 0xd9
+        },
+        .key_label = "quicv2 key",
+        .iv_label = "quicv2 iv",
+        .hp_label = "quicv2 hp",
+        .initial_type = 0x01,
+        .retry_type = 0x00,
+    },
+};
+
+const struct Protocol *const quic_protocol = &(struct Protocol){
+    .name = "quic",
+    .default_port = 443,
+    /* Datagrams are parsed by parse_quic_initial() rather than as a stream */
+    .parse_packet = NULL,
+    .abort_message = NULL,
+    .abort_message_len = 0
+};
+
+
+static const struct QuicVersion *lookup_version(uint32_t);
+static int read_varint(const uint8_t **, const uint8_t *, uint64_t *);
+static int parse_initial_packet(struct QuicInitial *,
+        const struct QuicVersion *, const struct QuicHeader *,
+        const uint8_t *, size_t, size_t);
+static int parse_frames(struct QuicInitial *, const uint8_t *, size_t);
+static int receive_crypto_data(struct QuicInitial *, uint64_t,
+        const uint8_t *, size_t);
+#ifdef HAVE_LIBCRYPTO
+static int hkdf_expand_label(const uint8_t *, const char *, uint8_t *, size_t);
+static int header_protection_mask(const uint8_t *, const uint8_t *,
+        uint8_t *);
+static int decrypt_payload(const uint8_t *, const uint8_t *, uint8_t,
+        const uint8_t *, size_t, const uint8_t *, size_t,
+        const uint8_t *, size_t, uint8_t *);
+#endif
+
+
+/*
+ * Parse the header of the QUIC packet at the start of a datagram
+ *
+ * Returns true if the packet has a valid header, of either form
+ */
+int
+parse_quic_header(const uint8_t *data, size_t len, struct QuicHeader *header) {
+    const uint8_t *end = data + len;
+    const uint8_t *pos = data;
+
+    memset(header, 0, sizeof(*header));
+
+    if (len < 1 || !(data[0] & QUIC_FIXED_BIT))
+        return 0;
+
+    if (!(data[0] & QUIC_LONG_HEADER))
+        return 1;
+
+    header->long_header = 1;
+
+    /* Version, and the connection IDs each prefixed by their length */
+    if (len < 7)
+        return 0;
+    header->version = (uint32_t)data[1] << 24 | (uint32_t)data[2] << 16 |
+        (uint32_t)data[3] << 8 | data[4];
+    pos = data + 5;
+
+    header->dcid_len = *pos++;
+    if (header->dcid_len > QUIC_CID_MAX ||
+            (size_t)(end - pos) < header->dcid_len + 1)
+        return 0;
+    memcpy(header->dcid, pos, header->dcid_len);
+    pos += header->dcid_len;
+
+    header->scid_len = *pos++;
+    if (header->scid_len > QUIC_CID_MAX ||
+            (size_t)(end - pos) < header->scid_len)
+        return 0;
+    memcpy(header->scid, pos, header->scid_len);
+
+    const struct QuicVersion *version = lookup_version(header->version);
+    header->initial = version != NULL &&
+        QUIC_PACKET_TYPE(data[0]) == version->initial_type;
+
+    return 1;
+}
+
+void
+init_quic_initial(struct QuicInitial *initial) {
+    memset(initial, 0, sizeof(*initial));
+    init_parse_state(&initial->parse_state);
+}
+
+/*
+ * Parse a datagram sent by a client opening a connection, passing the
+ * CRYPTO data of any Initial packets it contains to the TLS parser. Other
+ * packets coalesced in the datagram are skipped.
+ *
+ * Returns, as for parse_packet():
+ *  >=0  - length of the hostname in initial->parse_state.hostname
+ *  -1   - client hello incomplete
+ *  -2   - no server name in the client hello
+ *  < -4 - invalid Initial packet or client hello
+ */
+int
+parse_quic_initial(struct QuicInitial *initial, const uint8_t *data,
+        size_t len) {
+    size_t pos = 0;
+    int result = -1;
+
+    while (pos < len && result == -1) {
+        struct QuicHeader header;
+        const uint8_t *packet = data + pos;
+        const uint8_t *end = data + len;
+
+        /* Padding following the packets, or a short header packet, which
+         * runs to the end of the datagram */
+        if (!parse_quic_header(packet, len - pos, &header) ||
+                !header.long_header)
+            break;
+
+        const struct QuicVersion *version = lookup_version(header.version);
+        if (version == NULL) {
+            debug("Unsupported QUIC version 0x%08" PRIx32, header.version);
+            return -5;
+        }
+
+        if (QUIC_PACKET_TYPE(packet[0]) == version->retry_type)
+            return -5;
+
+        /* Skip to the Length field, past the token of Initial packets */
+        const uint8_t *field = packet + 7 + header.dcid_len + header.scid_len;
+        uint64_t value;
+        if (header.initial) {
+            if (!read_varint(&field, end, &value) ||
+                    value > (uint64_t)(end - field))
+                return -5;
+            field += value;
+        }
+        if (!read_varint(&field, end, &value) ||
+                value > (uint64_t)(end - field))
+            return -5;
+
+        size_t pn_offset = (size_t)(field - packet);
+        size_t packet_len = pn_offset + (size_t)value;
+
+        if (header.initial)
+            result = parse_initial_packet(initial, version, &header,
+                    packet, pn_offset, packet_len);
+
+        pos += packet_len;
+    }
+
+    return result;
+}
+
+/*
+ * Derive the key, IV and header protection key protecting a client's
+ * Initial packets from the destination connection ID it chose (RFC9001
+ * section 5.2)
+ *
+ * Returns true on success
+ */
+int
+quic_initial_keys(uint32_t version_number, const uint8_t *dcid,
+        size_t dcid_len, uint8_t *key, uint8_t *iv, uint8_t *hp) {
+#ifdef HAVE_LIBCRYPTO
+    const struct QuicVersion *version = lookup_version(version_number);
+    uint8_t initial_secret[32], client_secret[32];
+    unsigned int secret_len = sizeof(initial_secret);
+
+    if (version == NULL)
+        return 0;
+
+    /* HKDF-Extract */
+    if (HMAC(EVP_sha256(), version->salt, sizeof(version->salt),
+                dcid, dcid_len, initial_secret, &secret_len) == NULL)
+        return 0;
+
+    return hkdf_expand_label(initial_secret, "client in",
+                client_secret, sizeof(client_secret)) &&
+        hkdf_expand_label(client_secret, version->key_label, key, 16) &&
+        hkdf_expand_label(client_secret, version->iv_label, iv, 12) &&
+        hkdf_expand_label(client_secret, version->hp_label, hp, 16);
+#else
+    (void)version_number;
+    (void)dcid;
+    (void)dcid_len;
+    (void)key;
+    (void)iv;
+    (void)hp;
+
+    return 0;
+#endif
+}
+
+static const struct QuicVersion *
+lookup_version(uint32_t version) {
+    for (size_t i = 0; i < sizeof(quic_versions) / sizeof(quic_versions[0]); i++)
+        if (quic_versions[i].version == version)
+            return &quic_versions[i];
+
+    return NULL;
+}
+
+/*
+ * Read a variable length integer (RFC9000 section 16), advancing pos
+ *
+ * Returns true on success
+ */
+static int
+read_varint(const uint8_t **pos, const uint8_t *end, uint64_t *value) {
+    if (*pos >= end)
+        return 0;
+
+    size_t len = (size_t)1 << (**pos >> 6);
+    if ((size_t)(end - *pos) < len)
+        return 0;
+
+    *value = **pos & 0x3f;
+    for (size_t i = 1; i < len; i++)
+        *value = (*value << 8) | (*pos)[i];
+    *pos += len;
+
+    return 1;
+}
+
+/*
+ * Remove header protection from an Initial packet and decrypt its payload
+ */
+static int
+parse_initial_packet(struct QuicInitial *initial,
+        const struct QuicVersion *version, const struct QuicHeader *header,
+        const uint8_t *packet, size_t pn_offset, size_t packet_len) {
+#ifdef HAVE_LIBCRYPTO
+    uint8_t mask[HP_SAMPLE_LEN];
+    uint8_t first_byte, pn_bytes[4], nonce[12];
+
+    /* Initial packets following a Retry use keys for a new connection ID */
+    if (initial->version != version->version ||
+            initial->dcid_len != header->dcid_len ||
+            memcmp(initial->dcid, header->dcid, header->dcid_len) != 0) {
+        if (!quic_initial_keys(version->version, header->dcid,
+                    header->dcid_len, initial->key, initial->iv, initial->hp))
+            return -5;
+
+        initial->version = version->version;
+        memcpy(initial->dcid, header->dcid, header->dcid_len);
+        initial->dcid_len = header->dcid_len;
+    }
+
+    /* The sample is taken assuming a 4 byte packet number */
+    if (packet_len < pn_offset + 4 + HP_SAMPLE_LEN)
+        return -5;
+    if (!header_protection_mask(initial->hp, packet + pn_offset + 4, mask))
+        return -5;
+
+    first_byte = packet[0] ^ (mask[0] & 0x0f);
+    size_t pn_len = (first_byte & 0x03) + 1;
+    for (size_t i = 0; i < pn_len; i++)
+        pn_bytes[i] = packet[pn_offset + i] ^ mask[1 + i];
+
+    /* The nonce is the IV combined with the packet number. Only client
+     * Initial packets are seen, so their packet numbers are small enough
+     * that the truncated packet number is the full packet number. */
+    memcpy(nonce, initial->iv, sizeof(nonce));
+    for (size_t i = 0; i < pn_len; i++)
+        nonce[sizeof(nonce) - pn_len + i] ^= pn_bytes[i];
+
+    size_t payload_offset = pn_offset + pn_len;
+    if (packet_len < payload_offset + AEAD_TAG_LEN + 1)
+        return -5;
+    size_t payload_len = packet_len - payload_offset - AEAD_TAG_LEN;
+
+    uint8_t *payload = malloc(payload_len);
+    if (payload == NULL) {
+        err("%s: malloc", __func__);
+        return -5;
+    }
+
+    int result = -5;
+    if (decrypt_payload(initial->key, nonce, first_byte,
+                packet + 1, pn_offset - 1, pn_bytes, pn_len,
+                packet + payload_offset, payload_len, payload))
+        result = parse_frames(initial, payload, payload_len);
+    else
+        debug("Unable to decrypt QUIC Initial packet");
+
+    free(payload);
+
+    return result;
+#else
+    (void)initial;
+    (void)version;
+    (void)header;
+    (void)packet;
+    (void)pn_offset;
+    (void)packet_len;
+
+    return -5;
+#endif
+}
+
+/*
+ * Parse the frames of a decrypted Initial packet, which from a client may
+ * only be PADDING, PING, ACK, CRYPTO and CONNECTION_CLOSE frames (RFC9000
+ * section 17.2.2)
+ */
+static int
+parse_frames(struct QuicInitial *initial, const uint8_t *payload,
+        size_t len) {
+    const uint8_t *pos = payload;
+    const uint8_t *end = payload + len;
+    uint64_t type, value, offset, count;
+    int result = -1;
+
+    while (pos < end && result == -1) {
+        if (!read_varint(&pos, end, &type))
+            return -5;
+
+        switch (type) {
+            case QUIC_FRAME_PADDING:
+            case QUIC_FRAME_PING:
+                break;
+            case QUIC_FRAME_ACK:
+            case QUIC_FRAME_ACK_ECN:
+                /* Largest acknowledged, delay, range count, first range */
+                if (!read_varint(&pos, end, &value) ||
+                        !read_varint(&pos, end, &value) ||
+                        !read_varint(&pos, end, &count) ||
+                        !read_varint(&pos, end, &value))
+                    return -5;
+                /* Gap and length of each further range, and ECN counts */
+                count *= 2;
+                if (type == QUIC_FRAME_ACK_ECN)
+                    count += 3;
+                for (uint64_t i = 0; i < count; i++)
+                    if (!read_varint(&pos, end, &value))
+                        return -5;
+                break;
+            case QUIC_FRAME_CRYPTO:
+                if (!read_varint(&pos, end, &offset) ||
+                        !read_varint(&pos, end, &value) ||
+                        value > (uint64_t)(end - pos))
+                    return -5;
+                result = receive_crypto_data(initial, offset, pos,
+                        (size_t)value);
+                pos += value;
+                break;
+            case QUIC_FRAME_CONNECTION_CLOSE:
+                debug("QUIC client closed connection during handshake");
+                return -5;
+            default:
+                debug("Unexpected frame type 0x%" PRIx64
+                        " in QUIC Initial packet", type);
+                return -5;
+        }
+    }
+
+    return result;
+}
+
+/*
+ * Place CRYPTO frame data in the client hello being reassembled, and pass
+ * any data now following that already parsed to the TLS parser. CRYPTO
+ * frames may arrive in any order, and overlap or repeat each other.
+ */
+static int
+receive_crypto_data(struct QuicInitial *initial, uint64_t offset,
+        const uint8_t *data, size_t len) {
+    if (offset > QUIC_CRYPTO_MAX || len > QUIC_CRYPTO_MAX - offset) {
+        debug("QUIC client hello exceeds %d bytes", QUIC_CRYPTO_MAX);
+        return -5;
+    }
+
+    memcpy(initial->crypto + offset, data, len);
+    for (size_t i = (size_t)offset; i < (size_t)offset + len; i++)
+        initial->received[i / 8] |= (uint8_t)(1 << (i % 8));
+
+    size_t start = initial->crypto_len;
+    while (initial->crypto_len < QUIC_CRYPTO_MAX &&
+            initial->received[initial->crypto_len / 8] &
+            (1 << (initial->crypto_len % 8)))
+        initial->crypto_len++;
+
+    if (initial->crypto_len == start)
+        return -1;
+
+    return parse_tls_handshake(&initial->parse_state,
+            initial->crypto + start, initial->crypto_len - start);
+}
+
+#ifdef HAVE_LIBCRYPTO
+/*
+ * HKDF-Expand-Label from TLS 1.3 (RFC8446 section 7.1) with an empty
+ * context, for outputs no longer than the SHA-256 hash
+ */
+static int
+hkdf_expand_label(const uint8_t *secret, const char *label, uint8_t *out,
+        size_t out_len) {
+    uint8_t info[4 + 6 + 255];
+    uint8_t block[32];
+    unsigned int block_len = sizeof(block);
+    size_t label_len = strlen(label);
+    size_t info_len = 0;
+
+    /* HkdfLabel, followed by the counter of the first (only) block */
+    info[info_len++] = (uint8_t)(out_len >> 8);
+    info[info_len++] = (uint8_t)out_len;
+    info[info_len++] = (uint8_t)(6 + label_len);
+    memcpy(info + info_len, "tls13 ", 6);
+    info_len += 6;
+    memcpy(info + info_len, label, label_len);
+    info_len += label_len;
+    info[info_len++] = 0;
+    info[info_len++] = 1;
+
+    if (HMAC(EVP_sha256(), secret, 32, info, info_len,
+                block, &block_len) == NULL)
+        return 0;
+
+    memcpy(out, block, out_len);
+
+    return 1;
+}
+
+/*
+ * Header protection mask from the packet sample (RFC9001 section 5.4.3)
+ */
+static int
+header_protection_mask(const uint8_t *hp, const uint8_t *sample,
+        uint8_t *mask) {
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    int len = 0;
+    int result = ctx != NULL &&
+        EVP_EncryptInit_ex(ctx, EVP_aes_128_ecb(), NULL, hp, NULL) &&
+        EVP_CIPHER_CTX_set_padding(ctx, 0) &&
+        EVP_EncryptUpdate(ctx, mask, &len, sample, HP_SAMPLE_LEN) &&
+        len == HP_SAMPLE_LEN;
+
+    EVP_CIPHER_CTX_free(ctx);
+
+    return result;
+}
+
+/*
+ * Decrypt and authenticate an AEAD_AES_128_GCM protected payload. The
+ * associated data is the header with protection removed: the first byte,
+ * the remainder of the header up to the packet number and the packet
+ * number.
+ *
+ * Returns true if the payload was authentic
+ */
+static int
+decrypt_payload(const uint8_t *key, const uint8_t *nonce, uint8_t first_byte,
+        const uint8_t *header, size_t header_len,
+        const uint8_t *pn, size_t pn_len,
+        const uint8_t *ciphertext, size_t len, uint8_t *plaintext) {
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    int out_len = 0;
+    int result = ctx != NULL &&
+        EVP_DecryptInit_ex(ctx, EVP_aes_128_gcm(), NULL, NULL, NULL) &&
+        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, 12, NULL) &&
+        EVP_DecryptInit_ex(ctx, NULL, NULL, key, nonce) &&
+        EVP_DecryptUpdate(ctx, NULL, &out_len, &first_byte, 1) &&
+        EVP_DecryptUpdate(ctx, NULL, &out_len, header, (int)header_len) &&
+        EVP_DecryptUpdate(ctx, NULL, &out_len, pn, (int)pn_len) &&
+        EVP_DecryptUpdate(ctx, plaintext, &out_len, ciphertext, (int)len) &&
+        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, AEAD_TAG_LEN,
+                (void *)(ciphertext + len)) &&
+        EVP_DecryptFinal_ex(ctx, plaintext + out_len, &out_len) > 0;
+
+    EVP_CIPHER_CTX_free(ctx);
+
+    return result;
+}
+#endif
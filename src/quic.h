@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2011 and 2012, Dustin Lundquist <dustin@null-ptr.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef QUIC_H
+#define QUIC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "protocol.h"
+
+#define QUIC_VERSION_1      0x00000001
+#define QUIC_VERSION_2      0x6b3343cf
+
+#define QUIC_CID_MAX        20      /* longest connection ID in v1 and v2 */
+#define QUIC_CRYPTO_MAX     8192    /* longest client hello reassembled */
+
+/*
+ * Routing fields of a QUIC packet header. The length of the destination
+ * connection ID of a short header packet is only known to the server which
+ * chose it, so only the long header fields are parsed.
+ */
+struct QuicHeader {
+    int long_header;
+    int initial;                /* an Initial packet of a known version */
+    uint32_t version;
+    uint8_t dcid[QUIC_CID_MAX], scid[QUIC_CID_MAX];
+    size_t dcid_len, scid_len;
+};
+
+/*
+ * Client hello reassembled from the CRYPTO frames of the Initial packets a
+ * client sends to open a connection, and the state of parsing it
+ */
+struct QuicInitial {
+    uint32_t version;
+    uint8_t dcid[QUIC_CID_MAX];     /* destination chosen by the client */
+    size_t dcid_len;
+    uint8_t key[16], iv[12], hp[16];    /* client Initial keys for dcid */
+
+    size_t crypto_len;          /* in order bytes passed to the parser */
+    uint8_t crypto[QUIC_CRYPTO_MAX];
+    uint8_t received[QUIC_CRYPTO_MAX / 8];  /* bitmap of bytes received */
+    struct ParseState parse_state;
+};
+
+extern const struct Protocol *const quic_protocol;
+
+int parse_quic_header(const uint8_t *, size_t, struct QuicHeader *);
+void init_quic_initial(struct QuicInitial *);
+int parse_quic_initial(struct QuicInitial *, const uint8_t *, size_t);
+int quic_initial_keys(uint32_t, const uint8_t *, size_t,
+        uint8_t *, uint8_t *, uint8_t *);
+
+#endif
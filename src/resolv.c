@@ -57,7 +57,7 @@ resolv_shutdown(struct ev_loop *loop) {
 
 struct ResolvQuery *
 resolv_query(const char *hostname, int mode,
-        void (*client_cb)(struct Address *, void *),
+        void (*client_cb)(struct Address **, size_t, void *),
         void (*client_free_cb)(void *), void *client_cb_data) {
     return NULL;
 }
@@ -72,7 +72,7 @@ resolv_cancel(struct ResolvQuery *query_handle) {
  */
 
 struct ResolvQuery {
-    void (*client_cb)(struct Address *, void *);
+    void (*client_cb)(struct Address **, size_t, void *);
     void (*client_free_cb)(void *);
     void *client_cb_data;
     int resolv_mode;
@@ -94,9 +94,6 @@ static void dns_query_v6_cb(struct dns_ctx *, struct dns_rr_a6 *, void *);
 static void dns_timer_setup_cb(struct dns_ctx *, int, void *);
 static void process_client_callback(struct ResolvQuery *);
 static inline int all_queries_are_null(struct ResolvQuery *);
-static struct Address *choose_ipv4_first(struct ResolvQuery *);
-static struct Address *choose_ipv6_first(struct ResolvQuery *);
-static struct Address *choose_any(struct ResolvQuery *);
 
 
 int
@@ -154,7 +151,7 @@ resolv_shutdown(struct ev_loop * loop) {
 
 struct ResolvQuery *
 resolv_query(const char *hostname, int mode,
-        void (*client_cb)(struct Address *, void *),
+        void (*client_cb)(struct Address **, size_t, void *),
         void (*client_free_cb)(void *), void *client_cb_data) {
     struct dns_ctx *ctx = (struct dns_ctx *)resolv_io_watcher.data;
 
@@ -316,20 +313,24 @@ dns_query_v6_cb(struct dns_ctx *ctx, struct dns_rr_a6 *result, void *data) {
 }
 
 /*
- * Called once all queries have been completed
+ * Called once all queries have been completed, with every address in the
+ * order they should be tried
  */
 static void
 process_client_callback(struct ResolvQuery *cb_data) {
-    struct Address *best_address = NULL;
+    struct Address **responses = cb_data->responses;
+    size_t len = cb_data->response_count;
 
     if (cb_data->resolv_mode == RESOLV_MODE_IPV4_FIRST)
-        best_address = choose_ipv4_first(cb_data);
+        resolv_order_addresses(responses, len, AF_INET);
     else if (cb_data->resolv_mode == RESOLV_MODE_IPV6_FIRST)
-        best_address = choose_ipv6_first(cb_data);
-    else
-        best_address = choose_any(cb_data);
+        resolv_order_addresses(responses, len, AF_INET6);
+    else if (len > 0)
+        resolv_order_addresses(responses, len,
+                address_sa(responses[0])->sa_family);
 
-    cb_data->client_cb(best_address, cb_data->client_cb_data);
+    cb_data->client_cb(cb_data->responses, cb_data->response_count,
+            cb_data->client_cb_data);
 
     for (size_t i = 0; i < cb_data->response_count; i++)
         free(cb_data->responses[i]);
@@ -340,34 +341,6 @@ process_client_callback(struct ResolvQuery *cb_data) {
     free(cb_data);
 }
 
-static struct Address *
-choose_ipv4_first(struct ResolvQuery *cb_data) {
-    for (size_t i = 0; i < cb_data->response_count; i++)
-        if (address_is_sockaddr(cb_data->responses[i]) &&
-                address_sa(cb_data->responses[i])->sa_family == AF_INET)
-            return cb_data->responses[i];
-
-    return choose_any(cb_data);;
-}
-
-static struct Address *
-choose_ipv6_first(struct ResolvQuery *cb_data) {
-    for (size_t i = 0; i < cb_data->response_count; i++)
-        if (address_is_sockaddr(cb_data->responses[i]) &&
-                address_sa(cb_data->responses[i])->sa_family == AF_INET6)
-            return cb_data->responses[i];
-
-    return choose_any(cb_data);;
-}
-
-static struct Address *
-choose_any(struct ResolvQuery *cb_data) {
-    if (cb_data->response_count >= 1)
-        return cb_data->responses[0];
-
-    return NULL;
-}
-
 /*
  * DNS timeout callback
  */
@@ -405,3 +378,36 @@ all_queries_are_null(struct ResolvQuery *cb_data) {
     return result;
 }
 #endif
+
+/*
+ * Alternate the address families of resolved socket addresses, starting
+ * with the first address of the preferred family, keeping the order of the
+ * addresses of each family (RFC 8305 section 4)
+ */
+void
+resolv_order_addresses(struct Address **addresses, size_t len, int family) {
+    struct Address **ordered = malloc(len * sizeof(struct Address *));
+    size_t next[2] = { 0, 0 }; /* next of the preferred and other family */
+
+    if (ordered == NULL)
+        return;
+
+    for (size_t i = 0; i < len; i++) {
+        int other = i % 2;
+
+        /* Continue with the other family once one runs out */
+        for (int tries = 0; tries < 2; tries++, other = !other) {
+            while (next[other] < len &&
+                    (address_sa(addresses[next[other]])->sa_family ==
+                        family) == other)
+                next[other]++;
+            if (next[other] < len)
+                break;
+        }
+
+        ordered[i] = addresses[next[other]++];
+    }
+
+    memcpy(addresses, ordered, len * sizeof(struct Address *));
+    free(ordered);
+}
@@ -32,9 +32,10 @@ struct ResolvQuery;
 
 int resolv_init(struct ev_loop *, char **, char **, int);
 struct ResolvQuery *resolv_query(const char *, int,
-        void(*)(struct Address *, void *), void (*)(void *), void *);
+        void(*)(struct Address **, size_t, void *), void (*)(void *), void *);
 void resolv_cancel(struct ResolvQuery *);
 void resolv_shutdown(struct ev_loop *);
+void resolv_order_addresses(struct Address **, size_t, int);
 
 static const int RESOLV_MODE_DEFAULT = 0;
 static const int RESOLV_MODE_IPV4_ONLY = 1;
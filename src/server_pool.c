@@ -0,0 +1,296 @@
+/*
+ * Copyright (c) 2011 and 2012, Dustin Lundquist <dustin@null-ptr.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Idle keep-alive connections to HTTP servers, kept per server address and
+ * source address so a later request to the same server can skip the
+ * connection setup. A pool exists only while it has idle connections.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h> /* close */
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <ev.h>
+#include "server_pool.h"
+#include "address.h"
+#include "logger.h"
+
+
+#define SERVER_POOL_TABLE_SIZE 256  /* buckets of pools by address */
+
+/* Idle connections kept to each server */
+static const size_t SERVER_POOL_MAX_IDLE = 16;
+/* Kept shorter than common server keep-alive timeouts, so servers rarely
+ * close a connection as it is being reused */
+static const ev_tstamp SERVER_POOL_IDLE_TIMEOUT = 30.0;
+
+
+struct IdleServer {
+    struct ServerPool *pool;
+    struct ev_io watcher;
+    struct ev_timer timer;
+    TAILQ_ENTRY(IdleServer) entries;
+    TAILQ_ENTRY(IdleServer) all_entries;
+};
+
+struct ServerPool {
+    struct sockaddr_storage addr, source;
+    socklen_t addr_len, source_len;
+    size_t idle_count;
+    TAILQ_HEAD(, IdleServer) idle;      /* most recently used first */
+    LIST_ENTRY(ServerPool) entries;
+};
+
+
+static LIST_HEAD(PoolBucket, ServerPool) pool_table[SERVER_POOL_TABLE_SIZE];
+/* Idle connections of every pool, most recently used first */
+static TAILQ_HEAD(IdleServerHead, IdleServer) idle_servers =
+    TAILQ_HEAD_INITIALIZER(idle_servers);
+static size_t idle_server_count = 0;
+
+
+static struct PoolBucket *pool_bucket(const struct sockaddr *, socklen_t,
+        const struct sockaddr *, socklen_t);
+static struct ServerPool *lookup_pool(const struct sockaddr *, socklen_t,
+        const struct Address *, int);
+static void remove_idle_server(struct IdleServer *, struct ev_loop *);
+static void idle_server_cb(struct ev_loop *, struct ev_io *, int);
+static void idle_timeout_cb(struct ev_loop *, struct ev_timer *, int);
+
+
+/*
+ * Take an idle connection to a server
+ *
+ * Returns the connected socket, or -1 if there is none
+ */
+int
+server_pool_get(const struct sockaddr *addr, socklen_t addr_len,
+        const struct Address *source, struct ev_loop *loop) {
+    struct ServerPool *pool;
+
+    /* Taking the last idle connection frees the pool */
+    while ((pool = lookup_pool(addr, addr_len, source, 0)) != NULL) {
+        struct IdleServer *server = TAILQ_FIRST(&pool->idle);
+        int sockfd = server->watcher.fd;
+        char c;
+
+        remove_idle_server(server, loop);
+
+        /* The server may have closed the connection since the watcher was
+         * last run */
+        ssize_t result = recv(sockfd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return sockfd;
+
+        close(sockfd);
+    }
+
+    return -1;
+}
+
+/*
+ * Keep a connection to a server for reuse, once the last response on it is
+ * complete
+ *
+ * Returns 1 if the connection was kept or 0 if the caller should close it
+ */
+int
+server_pool_put(const struct sockaddr *addr, socklen_t addr_len,
+        const struct Address *source, int sockfd, struct ev_loop *loop) {
+    struct ServerPool *pool = lookup_pool(addr, addr_len, source, 1);
+
+    if (pool == NULL || pool->idle_count >= SERVER_POOL_MAX_IDLE)
+        return 0;
+
+    struct IdleServer *server = malloc(sizeof(struct IdleServer));
+    if (server == NULL) {
+        err("%s: malloc", __func__);
+        if (pool->idle_count == 0) {
+            LIST_REMOVE(pool, entries);
+            free(pool);
+        }
+        return 0;
+    }
+
+    server->pool = pool;
+    ev_io_init(&server->watcher, idle_server_cb, sockfd, EV_READ);
+    server->watcher.data = server;
+    ev_timer_init(&server->timer, idle_timeout_cb,
+            SERVER_POOL_IDLE_TIMEOUT, 0.0);
+    server->timer.data = server;
+
+    TAILQ_INSERT_HEAD(&pool->idle, server, entries);
+    pool->idle_count++;
+    TAILQ_INSERT_HEAD(&idle_servers, server, all_entries);
+    idle_server_count++;
+
+    ev_io_start(loop, &server->watcher);
+    ev_timer_start(loop, &server->timer);
+
+    return 1;
+}
+
+/*
+ * The number of idle connections kept to all servers
+ */
+size_t
+server_pool_idle_count() {
+    return idle_server_count;
+}
+
+/*
+ * Close the least recently used idle connection, to make room for a client
+ *
+ * Returns 1 if a connection was closed or 0 if there was none
+ */
+int
+close_idle_server(struct ev_loop *loop) {
+    struct IdleServer *server =
+        TAILQ_LAST(&idle_servers, IdleServerHead);
+
+    if (server == NULL)
+        return 0;
+
+    int sockfd = server->watcher.fd;
+    remove_idle_server(server, loop);
+    close(sockfd);
+
+    return 1;
+}
+
+/*
+ * Close all idle connections
+ */
+void
+free_server_pools(struct ev_loop *loop) {
+    while (close_idle_server(loop))
+        ;
+}
+
+static struct PoolBucket *
+pool_bucket(const struct sockaddr *addr, socklen_t addr_len,
+        const struct sockaddr *source, socklen_t source_len) {
+    const uint8_t *bytes = (const uint8_t *)addr;
+    uint32_t hash = 2166136261u;
+
+    /* FNV-1a over both addresses */
+    for (socklen_t i = 0; i < addr_len; i++)
+        hash = (hash ^ bytes[i]) * 16777619u;
+    bytes = (const uint8_t *)source;
+    for (socklen_t i = 0; i < source_len; i++)
+        hash = (hash ^ bytes[i]) * 16777619u;
+
+    return &pool_table[hash % SERVER_POOL_TABLE_SIZE];
+}
+
+static struct ServerPool *
+lookup_pool(const struct sockaddr *addr, socklen_t addr_len,
+        const struct Address *source, int create) {
+    const struct sockaddr *source_sa = source ? address_sa(source) : NULL;
+    socklen_t source_len = source ? address_sa_len(source) : 0;
+    struct PoolBucket *bucket =
+        pool_bucket(addr, addr_len, source_sa, source_len);
+    struct ServerPool *pool;
+
+    LIST_FOREACH(pool, bucket, entries)
+        if (pool->addr_len == addr_len &&
+                memcmp(&pool->addr, addr, addr_len) == 0 &&
+                pool->source_len == source_len &&
+                (source_len == 0 ||
+                 memcmp(&pool->source, source_sa, source_len) == 0))
+            return pool;
+
+    if (!create || addr_len > sizeof(pool->addr) ||
+            source_len > sizeof(pool->source))
+        return NULL;
+
+    pool = calloc(1, sizeof(struct ServerPool));
+    if (pool == NULL) {
+        err("%s: calloc", __func__);
+        return NULL;
+    }
+
+    memcpy(&pool->addr, addr, addr_len);
+    pool->addr_len = addr_len;
+    if (source_len > 0)
+        memcpy(&pool->source, source_sa, source_len);
+    pool->source_len = source_len;
+    TAILQ_INIT(&pool->idle);
+
+    LIST_INSERT_HEAD(bucket, pool, entries);
+
+    return pool;
+}
+
+/*
+ * Stop watching an idle connection, freeing its pool if it was the last
+ */
+static void
+remove_idle_server(struct IdleServer *server, struct ev_loop *loop) {
+    struct ServerPool *pool = server->pool;
+
+    ev_io_stop(loop, &server->watcher);
+    ev_timer_stop(loop, &server->timer);
+
+    TAILQ_REMOVE(&idle_servers, server, all_entries);
+    idle_server_count--;
+    TAILQ_REMOVE(&pool->idle, server, entries);
+    pool->idle_count--;
+    if (pool->idle_count == 0) {
+        LIST_REMOVE(pool, entries);
+        free(pool);
+    }
+
+    free(server);
+}
+
+/*
+ * An idle connection became readable: the server closed it, or sent data
+ * we have no request for
+ */
+static void
+idle_server_cb(struct ev_loop *loop, struct ev_io *w, int revents) {
+    struct IdleServer *server = (struct IdleServer *)w->data;
+    int sockfd = w->fd;
+
+    if (revents & EV_READ) {
+        remove_idle_server(server, loop);
+        close(sockfd);
+    }
+}
+
+static void
+idle_timeout_cb(struct ev_loop *loop, struct ev_timer *w, int revents) {
+    struct IdleServer *server = (struct IdleServer *)w->data;
+    int sockfd = server->watcher.fd;
+
+    if (revents & EV_TIMER) {
+        remove_idle_server(server, loop);
+        close(sockfd);
+    }
+}
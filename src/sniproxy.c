@@ -35,12 +35,15 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <time.h>
 #include <signal.h>
 #include <errno.h>
 #include <ev.h>
 #include "binder.h"
 #include "config.h"
 #include "connection.h"
+#include "flow.h"
+#include "health.h"
 #include "listener.h"
 #include "resolv.h"
 #include "logger.h"
@@ -101,6 +104,9 @@ main(int argc, char **argv) {
     /* ignore SIGPIPE, or it will kill us */
     signal(SIGPIPE, SIG_IGN);
 
+    /* Instances sharing a port make different random server choices */
+    srandom((unsigned int)time(NULL) ^ (unsigned int)getpid());
+
     if (background_flag) {
         if (config->pidfile != NULL)
             remove(config->pidfile);
@@ -117,6 +123,7 @@ main(int argc, char **argv) {
     set_limits(max_nofiles);
 
     init_listeners(&config->listeners, &config->tables, EV_DEFAULT);
+    start_health_checks(&config->tables, EV_DEFAULT);
 
     /* Drop permissions only when we can */
     drop_perms(config->user ? config->user : default_username, config->group);
@@ -134,11 +141,15 @@ main(int argc, char **argv) {
             config->resolver.search, config->resolver.mode);
 
     init_connections();
+    set_connection_limit(config->max_connections);
+    set_connection_attempt_delay(config->resolver.attempt_delay / 1000.0);
 
     ev_run(EV_DEFAULT, 0);
 
     free_connections(EV_DEFAULT);
+    free_flows(EV_DEFAULT);
     resolv_shutdown(EV_DEFAULT);
+    stop_health_checks(EV_DEFAULT);
 
     free_config(config, EV_DEFAULT);
 
@@ -278,9 +289,12 @@ signal_cb(struct ev_loop *loop, struct ev_signal *w, int revents) {
             case SIGHUP:
                 reopen_loggers();
                 reload_config(config, loop);
+                start_health_checks(&config->tables, loop);
                 break;
             case SIGUSR1:
                 print_connections();
+                log_table_stats(&config->tables);
+                log_health_stats();
                 break;
             case SIGINT:
             case SIGTERM:
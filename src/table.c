@@ -35,11 +35,25 @@
 
 
 static void free_table(struct Table *);
+static uint32_t cache_key_hash(const char *, size_t, const uint8_t *, size_t);
+static struct TableCacheEntry *cache_find(const struct TableCache *, uint32_t,
+        const char *, size_t, const uint8_t *, size_t);
+static struct TableCacheEntry *cache_insert(struct Table *, uint32_t,
+        const char *, size_t, const uint8_t *, size_t);
+static void cache_unlink(struct TableCache *, const struct TableCacheEntry *);
+static void fill_cache_entry(struct Table *, struct TableCacheEntry *,
+        size_t, const struct ClientHello *);
+static struct Address *expand_address(const struct Address *, const char *,
+        int *);
+static void free_table_cache(struct TableCache *);
+static void adopt_backend_servers(struct Backend_head *,
+        const struct Backend_head *);
 
 
 static inline struct BackendLookupResult
-table_lookup_backend(const struct Table *table, const char *name, size_t name_len) {
-    return lookup_backend(&table->backends, name, name_len);
+table_lookup_backend(const struct Table *table, const char *name, size_t name_len,
+        const struct ClientHello *hello) {
+    return lookup_backend(&table->backend_index, name, name_len, hello);
 }
 
 static inline void __attribute__((unused))
@@ -59,9 +73,11 @@ new_table() {
     }
 
     table->name = NULL;
-    table->use_proxy_header = 0;
     table->reference_count = 0;
     STAILQ_INIT(&table->backends);
+    memset(&table->backend_index, 0, sizeof(table->backend_index));
+    table->generation = 0;
+    memset(&table->cache, 0, sizeof(table->cache));
 
     return table;
 }
@@ -94,6 +110,8 @@ void init_table(struct Table *table) {
 
     STAILQ_FOREACH(iter, &table->backends, entries)
         init_backend(iter);
+
+    init_backend_index(&table->backend_index, &table->backends);
 }
 
 void
@@ -128,24 +146,78 @@ remove_table(struct Table_head *tables, struct Table *table) {
     table_ref_put(table);
 }
 
+/*
+ * Look up the backend for a name, from the cache of recent lookups if
+ * present, along with the address a pattern or wildcard backend expands to.
+ * For backends with a pool of servers one is chosen for the client, whose
+ * address may be NULL.
+ */
 struct LookupResult
-table_lookup_server_address(const struct Table *table, const char *name, size_t name_len) {
-    struct BackendLookupResult b = table_lookup_backend(table, name, name_len);
-    if (b.backend == NULL) {
-        info("No match found for %.*s", (int)name_len, name);
-        return (struct LookupResult){.address = NULL};
+table_lookup_server_address(struct Table *table, const char *name, size_t name_len,
+        const struct ClientHello *hello, const struct sockaddr *client) {
+    /* The ALPN list only matters to tables with entries requiring one */
+    const uint8_t *alpn = NULL;
+    size_t alpn_len = 0;
+    if (table->backend_index.alpn && hello != NULL) {
+        alpn = hello->alpn;
+        alpn_len = hello->alpn_len;
     }
 
-    struct LookupResult result;
-    result.address = b.backend->address;
-    result.caller_free_address = 0;
-    result.use_proxy_header = b.backend->use_proxy_header;
-    for(int i = 0; i < 32; ++i)	{
-        result.matches[i] = b.matches[i];
+    uint32_t hash = cache_key_hash(name, name_len, alpn, alpn_len);
+    struct TableCacheEntry *entry =
+        cache_find(&table->cache, hash, name, name_len, alpn, alpn_len);
+    if (entry != NULL && entry->generation == table->generation) {
+        entry->referenced = 1;
+        table->cache.hits++;
+    } else {
+        table->cache.misses++;
+
+        if (entry == NULL)
+            entry = cache_insert(table, hash, name, name_len, alpn, alpn_len);
+        if (entry != NULL)
+            fill_cache_entry(table, entry, name_len, hello);
     }
+
+    struct LookupResult result = {.address = NULL};
+    struct Backend *backend = NULL;
+    if (entry != NULL) {
+        result = entry->result;
+        backend = entry->backend;
+    } else {
+        /* Uncached, without memory for an expansion */
+        struct BackendLookupResult b =
+            table_lookup_backend(table, name, name_len, hello);
+        if (b.backend != NULL) {
+            result.address = b.backend->address;
+            result.use_proxy_header = b.backend->use_proxy_header;
+            memcpy(result.matches, b.matches, sizeof(result.matches));
+            backend = b.backend;
+        }
+    }
+
+    if (backend != NULL && backend->balancer != NULL) {
+        result.balancer = backend->balancer;
+        result.server = balancer_select(backend->balancer, client,
+                name, name_len);
+        result.address = result.server->address;
+    }
+
+    if (result.address == NULL)
+        info("No match found for %.*s", (int)name_len, name);
+
     return result;
 }
 
+void
+log_table_stats(const struct Table_head *tables) {
+    const struct Table *iter;
+
+    SLIST_FOREACH(iter, tables, entries)
+        notice("table %s: %zu names cached, %lu hits, %lu misses",
+                iter->name != NULL ? iter->name : "(default)",
+                iter->cache.len, iter->cache.hits, iter->cache.misses);
+}
+
 void
 reload_tables(struct Table_head *tables, struct Table_head *new_tables) {
     struct Table *iter;
@@ -182,6 +254,16 @@ reload_tables(struct Table_head *tables, struct Table_head *new_tables) {
             struct Backend_head temp = existing->backends;
             existing->backends = iter->backends;
             iter->backends = temp;
+
+            /* Keep the connection counts of servers still in use */
+            adopt_backend_servers(&existing->backends, &temp);
+
+            struct BackendIndex temp_index = existing->backend_index;
+            existing->backend_index = iter->backend_index;
+            iter->backend_index = temp_index;
+
+            /* Cached lookups refer to the previous backends */
+            existing->generation++;
         } else {
             add_table(tables, iter);
         }
@@ -214,6 +296,8 @@ free_table(struct Table *table) {
     while ((iter = STAILQ_FIRST(&table->backends)) != NULL)
         remove_backend(&table->backends, iter);
 
+    free_backend_index(&table->backend_index);
+    free_table_cache(&table->cache);
     free(table->name);
     free(table);
 }
@@ -234,3 +318,198 @@ table_ref_get(struct Table *table) {
     table->reference_count++;
     return table;
 }
+
+/* FNV-1a of the name, a NUL and the ALPN list */
+static uint32_t
+cache_key_hash(const char *name, size_t name_len, const uint8_t *alpn,
+        size_t alpn_len) {
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < name_len; i++)
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+    hash *= 16777619u;
+    for (size_t i = 0; i < alpn_len; i++)
+        hash = (hash ^ alpn[i]) * 16777619u;
+
+    return hash;
+}
+
+static struct TableCacheEntry *
+cache_find(const struct TableCache *cache, uint32_t hash, const char *name,
+        size_t name_len, const uint8_t *alpn, size_t alpn_len) {
+    if (cache->entries == NULL)
+        return NULL;
+
+    for (int i = cache->buckets[hash & (TABLE_CACHE_SIZE - 1)]; i >= 0;
+            i = cache->entries[i].next) {
+        struct TableCacheEntry *entry = &cache->entries[i];
+
+        if (entry->hash == hash &&
+                entry->key_len == name_len + 1 + alpn_len &&
+                memcmp(entry->key, name, name_len) == 0 &&
+                entry->key[name_len] == '\0' &&
+                (alpn_len == 0 ||
+                 memcmp(entry->key + name_len + 1, alpn, alpn_len) == 0))
+            return entry;
+    }
+
+    return NULL;
+}
+
+/*
+ * Add an entry for the key, replacing the first entry the clock hand finds
+ * unused since it last passed, or left from before a reload, once full
+ */
+static struct TableCacheEntry *
+cache_insert(struct Table *table, uint32_t hash, const char *name,
+        size_t name_len, const uint8_t *alpn, size_t alpn_len) {
+    struct TableCache *cache = &table->cache;
+    struct TableCacheEntry *entry;
+
+    if (cache->entries == NULL) {
+        cache->entries = calloc(TABLE_CACHE_SIZE, sizeof(struct TableCacheEntry));
+        cache->buckets = malloc(TABLE_CACHE_SIZE * sizeof(int));
+        if (cache->entries == NULL || cache->buckets == NULL) {
+            err("%s: malloc", __func__);
+            free_table_cache(cache);
+            return NULL;
+        }
+
+        for (size_t i = 0; i < TABLE_CACHE_SIZE; i++)
+            cache->buckets[i] = -1;
+    }
+
+    char *key = malloc(name_len + 1 + alpn_len);
+    if (key == NULL) {
+        err("%s: malloc", __func__);
+        return NULL;
+    }
+    memcpy(key, name, name_len);
+    key[name_len] = '\0';
+    if (alpn_len > 0)
+        memcpy(key + name_len + 1, alpn, alpn_len);
+
+    if (cache->len < TABLE_CACHE_SIZE) {
+        entry = &cache->entries[cache->len++];
+    } else {
+        while ((entry = &cache->entries[cache->hand])->referenced &&
+                entry->generation == table->generation) {
+            entry->referenced = 0;
+            cache->hand = (cache->hand + 1) % TABLE_CACHE_SIZE;
+        }
+        cache->hand = (cache->hand + 1) % TABLE_CACHE_SIZE;
+
+        cache_unlink(cache, entry);
+        free(entry->key);
+        free(entry->expansion);
+    }
+
+    memset(entry, 0, sizeof(*entry));
+    entry->key = key;
+    entry->key_len = name_len + 1 + alpn_len;
+    entry->hash = hash;
+    entry->next = cache->buckets[hash & (TABLE_CACHE_SIZE - 1)];
+    cache->buckets[hash & (TABLE_CACHE_SIZE - 1)] = (int)(entry - cache->entries);
+
+    return entry;
+}
+
+static void
+cache_unlink(struct TableCache *cache, const struct TableCacheEntry *entry) {
+    int index = (int)(entry - cache->entries);
+    int *link = &cache->buckets[entry->hash & (TABLE_CACHE_SIZE - 1)];
+
+    while (*link != index)
+        link = &cache->entries[*link].next;
+    *link = entry->next;
+}
+
+/*
+ * Look up the backend for the entry's key, and expand its address
+ */
+static void
+fill_cache_entry(struct Table *table, struct TableCacheEntry *entry,
+        size_t name_len, const struct ClientHello *hello) {
+    struct BackendLookupResult b =
+        table_lookup_backend(table, entry->key, name_len, hello);
+
+    free(entry->expansion);
+    entry->expansion = NULL;
+    entry->backend = b.backend;
+    memset(&entry->result, 0, sizeof(entry->result));
+
+    if (b.backend != NULL) {
+        entry->expansion = expand_address(b.backend->address, entry->key,
+                b.matches);
+
+        entry->result.address = b.backend->address;
+        entry->result.use_proxy_header = b.backend->use_proxy_header;
+        entry->result.expansion = entry->expansion;
+        memcpy(entry->result.matches, b.matches, sizeof(b.matches));
+    }
+
+    entry->generation = table->generation;
+}
+
+/*
+ * The address a pattern or wildcard backend address expands to for the NUL
+ * terminated name, or NULL for other addresses or if the name does not make
+ * a valid address
+ */
+static struct Address *
+expand_address(const struct Address *address, const char *name, int *matches) {
+    if (address_is_pattern(address)) {
+        char replacement[1024];
+
+        if (apply_pattern(name, address_pattern(address), matches,
+                    replacement, sizeof(replacement)) == 0)
+            return NULL;
+
+        return new_address(replacement);
+    } else if (address_is_wildcard(address)) {
+        return new_address(name);
+    }
+
+    return NULL;
+}
+
+/*
+ * Pass the servers of the previous backends' pools on to the pools of the
+ * new backends with the same addresses
+ */
+static void
+adopt_backend_servers(struct Backend_head *backends,
+        const struct Backend_head *previous) {
+    struct Backend *iter;
+    const struct Backend *previous_iter;
+    struct ServerMap map;
+    size_t len = 0;
+
+    STAILQ_FOREACH(previous_iter, previous, entries)
+        if (previous_iter->balancer != NULL)
+            len += previous_iter->balancer->len;
+
+    if (len == 0 || !init_server_map(&map, len))
+        return;
+
+    STAILQ_FOREACH(previous_iter, previous, entries)
+        if (previous_iter->balancer != NULL)
+            server_map_add(&map, previous_iter->balancer);
+
+    STAILQ_FOREACH(iter, backends, entries)
+        if (iter->balancer != NULL)
+            balancer_adopt_servers(iter->balancer, &map);
+
+    free_server_map(&map);
+}
+
+static void
+free_table_cache(struct TableCache *cache) {
+    for (size_t i = 0; i < cache->len; i++) {
+        free(cache->entries[i].key);
+        free(cache->entries[i].expansion);
+    }
+    free(cache->entries);
+    free(cache->buckets);
+    memset(cache, 0, sizeof(*cache));
+}
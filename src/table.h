@@ -32,32 +32,68 @@
 #include "address.h"
 
 #define TABLE_NAME_LEN 20
+#define TABLE_CACHE_SIZE 2048
 
 SLIST_HEAD(Table_head, Table);
 
+struct LookupResult {
+    const struct Address *address;
+    struct BackendServer *server;   /* chosen from a pool, or NULL */
+    struct Balancer *balancer;      /* the pool it was chosen from */
+    int use_proxy_header;
+    /* What a pattern or wildcard address expands to for the name, NULL if
+     * the name does not give a valid address. Owned by the table. */
+    const struct Address *expansion;
+    int matches[32];
+};
+
+/*
+ * Result of looking up a name, and for tables with entries requiring an
+ * ALPN protocol the client's ALPN list, valid while generation is the
+ * table's
+ */
+struct TableCacheEntry {
+    char *key;                  /* the name, a NUL, and the ALPN list */
+    size_t key_len;
+    uint32_t hash;
+    int next;                   /* in the bucket's chain, or -1 */
+    int referenced;             /* used since the clock hand passed */
+    unsigned long generation;
+    struct LookupResult result;
+    struct Backend *backend;    /* for entries with a pool of servers */
+    struct Address *expansion;
+};
+
+/*
+ * Hash table of recent lookups, replaced by the CLOCK algorithm once full
+ */
+struct TableCache {
+    struct TableCacheEntry *entries;
+    int *buckets;               /* TABLE_CACHE_SIZE chains */
+    size_t len, hand;
+    unsigned long hits, misses;
+};
+
 struct Table {
     char *name;
-    int use_proxy_header;
 
     /* Runtime fields */
     int reference_count;
     struct Backend_head backends;
+    struct BackendIndex backend_index;
+    unsigned long generation;   /* changed as the backends are reloaded */
+    struct TableCache cache;
     SLIST_ENTRY(Table) entries;
 };
 
-struct LookupResult {
-    const struct Address *address;
-    int caller_free_address;
-    int use_proxy_header;
-    int matches[32];
-};
-
 struct Table *new_table();
 int accept_table_arg(struct Table *, const char *);
 void add_table(struct Table_head *, struct Table *);
 struct Table *table_lookup(const struct Table_head *, const char *);
-struct LookupResult table_lookup_server_address(const struct Table *,
-                                                const char *, size_t);
+struct LookupResult table_lookup_server_address(struct Table *,
+                                                const char *, size_t,
+                                                const struct ClientHello *,
+                                                const struct sockaddr *);
 void reload_tables(struct Table_head *, struct Table_head *);
 void print_table_config(FILE *, struct Table *);
 int valid_table(struct Table *);
@@ -65,6 +101,7 @@ void init_table(struct Table *);
 void table_ref_put(struct Table *);
 struct Table *table_ref_get(struct Table *);
 void tables_reload(struct Table_head *, struct Table_head *);
+void log_table_stats(const struct Table_head *);
 
 void free_tables(struct Table_head *);
 
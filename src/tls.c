@@ -29,28 +29,87 @@
  * TLS handshake and RFC4366.
  */
 #include <stdio.h>
-#include <stdlib.h> /* malloc() */
 #include <stdint.h>
-#include <string.h> /* strncpy() */
+#include <string.h> /* memcpy() */
 #include <sys/socket.h>
 #include <sys/types.h>
 #include "tls.h"
 #include "protocol.h"
 #include "logger.h"
 
-#define SERVER_NAME_LEN 256
 #define TLS_HEADER_LEN 5
 #define TLS_HANDSHAKE_CONTENT_TYPE 0x16
 #define TLS_HANDSHAKE_TYPE_CLIENT_HELLO 0x01
 
+#define TLS_EXT_SERVER_NAME 0x0000
+#define TLS_EXT_SUPPORTED_GROUPS 0x000a
+#define TLS_EXT_SIGNATURE_ALGORITHMS 0x000d
+#define TLS_EXT_ALPN 0x0010
+#define TLS_EXT_SUPPORTED_VERSIONS 0x002b
+
 #ifndef MIN
 #define MIN(X, Y) ((X) < (Y) ? (X) : (Y))
 #endif
 
+/* RFC8701 reserved values: 0x0a0a, 0x1a1a, ... 0xfafa */
+#define IS_GREASE(X) (((X) & 0x0f0f) == 0x0a0a && ((X) >> 8) == ((X) & 0xff))
+#define IS_ALNUM(C) (((C) >= '0' && (C) <= '9') || \
+        ((C) >= 'a' && (C) <= 'z') || ((C) >= 'A' && (C) <= 'Z'))
+
+/*
+ * Client hello fields, in the order they appear in the handshake message.
+ * TLS_START is the initial (zeroed) state before any field has been read.
+ */
+enum TLSField {
+    TLS_START,
+    HANDSHAKE_TYPE,
+    HANDSHAKE_LENGTH,
+    CLIENT_VERSION,
+    RANDOM,
+    SESSION_ID_LENGTH,
+    SESSION_ID,
+    CIPHER_SUITES_LENGTH,
+    CIPHER_SUITE,
+    COMPRESSION_METHODS_LENGTH,
+    COMPRESSION_METHODS,
+    EXTENSIONS_LENGTH,
+    EXTENSION_TYPE,
+    EXTENSION_LENGTH,
+    EXTENSION_DATA,
+    SERVER_NAME_LIST_LENGTH,
+    SERVER_NAME_TYPE,
+    SERVER_NAME_LENGTH,
+    SERVER_NAME,
+    SERVER_NAME_UNKNOWN,
+    ALPN_LIST_LENGTH,
+    ALPN_PROTOCOLS,
+    SUPPORTED_GROUPS_LENGTH,
+    SUPPORTED_GROUP,
+    SIGNATURE_ALGORITHMS_LENGTH,
+    SIGNATURE_ALGORITHM,
+    SUPPORTED_VERSIONS_LENGTH,
+    SUPPORTED_VERSION,
+};
+
 
-static int parse_tls_header(const uint8_t*, size_t, char **);
-static int parse_extensions(const uint8_t*, size_t, char **);
-static int parse_server_name_extension(const uint8_t*, size_t, char **);
+static int parse_tls_header(struct ParseState *, const uint8_t*, size_t);
+static int parse_handshake(struct ParseState *, const uint8_t *, size_t);
+static int next_field(struct ParseState *);
+static int begin_field(struct ParseState *, enum TLSField, size_t);
+static int next_extension(struct ParseState *);
+static int begin_list(struct ParseState *, enum TLSField, size_t);
+static int next_list_item(struct ParseState *, enum TLSField);
+static void fingerprint_client_hello(struct ParseState *);
+static int valid_alpn_list(const uint8_t *, size_t);
+static int next_server_name(struct ParseState *);
+
+
+/* splitmix64 finalizer */
+static inline uint64_t mix_hash(uint64_t x) {
+    x = (x ^ (x >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+    x = (x ^ (x >> 27)) * UINT64_C(0x94d049bb133111eb);
+    return x ^ (x >> 31);
+}
 
 
 static const char tls_alert[] = {
@@ -63,193 +122,490 @@ static const char tls_alert[] = {
 const struct Protocol *const tls_protocol = &(struct Protocol){
     .name = "tls",
     .default_port = 443,
-    .parse_packet = (int (*const)(const char *, size_t, char **))&parse_tls_header,
+    .parse_packet = (int (*const)(struct ParseState *, const char *, size_t))&parse_tls_header,
     .abort_message = tls_alert,
     .abort_message_len = sizeof(tls_alert)
 };
 
 
 /* Parse a TLS packet for the Server Name Indication extension in the client
- * hello handshake, returning the first servername found (pointer to static
- * array)
+ * hello handshake, returning the first servername found. The versions,
+ * cipher suite count, supported groups, application layer protocol
+ * negotiation protocol list and a fingerprint of the client hello are
+ * recorded in state->hello.
+ *
+ * The parser is incremental: each call should be passed only the data
+ * received since the previous call with the same state, the client hello may
+ * be split across any number of calls and TLS records.
+ *
+ * The hostname is copied to state->hostname, which is normalized by
+ * normalize_hostname().
  *
  * Returns:
- *  >=0  - length of the hostname and updates *hostname
- *         caller is responsible for freeing *hostname
+ *  >=0  - length of the hostname in state->hostname
  *  -1   - Incomplete request
  *  -2   - No Host header included in this request
- *  -3   - Invalid hostname pointer
- *  -4   - malloc failure
  *  < -4 - Invalid TLS client hello
  */
 static int
-parse_tls_header(const uint8_t *data, size_t data_len, char **hostname) {
-    uint8_t tls_content_type;
-    uint8_t tls_version_major;
-    uint8_t tls_version_minor;
-    size_t pos = TLS_HEADER_LEN;
-    size_t len;
-
-    if (hostname == NULL)
-        return -3;
-
-    /* Check that our TCP payload is at least large enough for a TLS header */
-    if (data_len < TLS_HEADER_LEN)
-        return -1;
-
-    /* SSL 2.0 compatible Client Hello
-     *
-     * High bit of first byte (length) and content type is Client Hello
-     *
-     * See RFC5246 Appendix E.2
-     */
-    if (data[0] & 0x80 && data[2] == 1) {
-        debug("Received SSL 2.0 Client Hello which can not support SNI.");
-        return -2;
-    }
+parse_tls_header(struct ParseState *state, const uint8_t *data, size_t data_len) {
+    while (data_len > 0) {
+        /* TLS record header */
+        if (state->u.tls.record_header_len < TLS_HEADER_LEN) {
+            size_t len = MIN(data_len,
+                    TLS_HEADER_LEN - state->u.tls.record_header_len);
+            memcpy(state->u.tls.record_header + state->u.tls.record_header_len,
+                    data, len);
+            state->u.tls.record_header_len += len;
+            data += len;
+            data_len -= len;
+
+            if (state->u.tls.record_header_len < TLS_HEADER_LEN)
+                break;
+
+            const uint8_t *header = state->u.tls.record_header;
+
+            if (state->u.tls.records == 0) {
+                /* SSL 2.0 compatible Client Hello
+                 *
+                 * High bit of first byte (length) and content type is Client Hello
+                 *
+                 * See RFC5246 Appendix E.2
+                 */
+                if (header[0] & 0x80 && header[2] == 1) {
+                    debug("Received SSL 2.0 Client Hello which can not support SNI.");
+                    return -2;
+                }
 
-    tls_content_type = data[0];
-    if (tls_content_type != TLS_HANDSHAKE_CONTENT_TYPE) {
-        debug("Request did not begin with TLS handshake.");
-        return -5;
-    }
+                if (header[0] != TLS_HANDSHAKE_CONTENT_TYPE) {
+                    debug("Request did not begin with TLS handshake.");
+                    return -5;
+                }
+
+                state->u.tls.version_major = header[1];
+                state->u.tls.version_minor = header[2];
+                if (state->u.tls.version_major < 3) {
+                    debug("Received SSL %" PRIu8 ".%" PRIu8 " handshake which can not support SNI.",
+                          state->u.tls.version_major,
+                          state->u.tls.version_minor);
+
+                    return -2;
+                }
+            } else if (header[0] != TLS_HANDSHAKE_CONTENT_TYPE) {
+                /* RFC5246 6.2.1: handshake messages may be fragmented over
+                 * several records, but may not be interleaved with other
+                 * record types */
+                debug("Client hello continued in non handshake record.");
+                return -5;
+            }
+
+            state->u.tls.records++;
+            state->u.tls.record_remaining =
+                ((size_t)header[3] << 8) + (size_t)header[4];
+            state->u.tls.records_len += state->u.tls.record_remaining;
+            if (state->u.tls.record_remaining == 0)
+                return -5;
 
-    tls_version_major = data[1];
-    tls_version_minor = data[2];
-    if (tls_version_major < 3) {
-        debug("Received SSL %" PRIu8 ".%" PRIu8 " handshake which can not support SNI.",
-              tls_version_major, tls_version_minor);
+            continue;
+        }
 
-        return -2;
+        /* TLS record payload */
+        size_t len = MIN(data_len, state->u.tls.record_remaining);
+        int result = parse_handshake(state, data, len);
+        if (result != -1)
+            return result;
+
+        data += len;
+        data_len -= len;
+        state->u.tls.record_remaining -= len;
+        if (state->u.tls.record_remaining == 0)
+            state->u.tls.record_header_len = 0;
     }
 
-    /* TLS record length */
-    len = ((size_t)data[3] << 8) +
-        (size_t)data[4] + TLS_HEADER_LEN;
-    data_len = MIN(data_len, len);
+    return -1;
+}
 
-    /* Check we received entire TLS record length */
-    if (data_len < len)
-        return -1;
+/*
+ * Parse a client hello handshake message carried without TLS records, as in
+ * the CRYPTO frames of QUIC Initial packets (RFC9001 section 4). As with
+ * parse_tls_header() each call is passed the data following that passed to
+ * the previous call.
+ */
+int
+parse_tls_handshake(struct ParseState *state, const uint8_t *data,
+        size_t data_len) {
+    state->u.tls.quic = 1;
+    state->u.tls.records_len += data_len;
 
-    /*
-     * Handshake
-     */
-    if (pos + 1 > data_len) {
-        return -5;
+    return parse_handshake(state, data, data_len);
+}
+
+/*
+ * Consume handshake message data, one field at a time
+ *
+ * Returns -1 if all the data was consumed without reaching a result.
+ */
+static int
+parse_handshake(struct ParseState *state, const uint8_t *data, size_t data_len) {
+    for (;;) {
+        while (state->u.tls.field_remaining == 0) {
+            int result = next_field(state);
+            if (result != -1)
+                return result;
+        }
+
+        if (data_len == 0)
+            return -1;
+
+        size_t len = MIN(data_len, state->u.tls.field_remaining);
+
+        switch (state->u.tls.field) {
+            case HANDSHAKE_TYPE:
+            case HANDSHAKE_LENGTH:
+            case CLIENT_VERSION:
+            case SESSION_ID_LENGTH:
+            case CIPHER_SUITES_LENGTH:
+            case CIPHER_SUITE:
+            case COMPRESSION_METHODS_LENGTH:
+            case EXTENSIONS_LENGTH:
+            case EXTENSION_TYPE:
+            case EXTENSION_LENGTH:
+            case SERVER_NAME_LIST_LENGTH:
+            case SERVER_NAME_TYPE:
+            case SERVER_NAME_LENGTH:
+            case ALPN_LIST_LENGTH:
+            case SUPPORTED_GROUPS_LENGTH:
+            case SUPPORTED_GROUP:
+            case SIGNATURE_ALGORITHMS_LENGTH:
+            case SIGNATURE_ALGORITHM:
+            case SUPPORTED_VERSIONS_LENGTH:
+            case SUPPORTED_VERSION:
+                for (size_t i = 0; i < len; i++)
+                    state->u.tls.value = (state->u.tls.value << 8) + data[i];
+                break;
+            case SERVER_NAME:
+                memcpy(state->hostname + state->hostname_len, data, len);
+                state->hostname_len += len;
+                break;
+            case ALPN_PROTOCOLS:
+                memcpy(state->hello.alpn + state->hello.alpn_len, data, len);
+                state->hello.alpn_len += len;
+                break;
+            default:
+                break; /* skipped */
+        }
+
+        data += len;
+        data_len -= len;
+        state->u.tls.pos += len;
+        state->u.tls.field_remaining -= len;
     }
-    if (data[pos] != TLS_HANDSHAKE_TYPE_CLIENT_HELLO) {
-        debug("Not a client hello");
+}
 
-        return -5;
+/*
+ * Called once the current field is complete to select the next field
+ *
+ * Returns -1 to continue parsing, otherwise the result of the parse.
+ */
+static int
+next_field(struct ParseState *state) {
+    size_t value = state->u.tls.value;
+
+    switch (state->u.tls.field) {
+        case TLS_START:
+            state->u.tls.limit = SIZE_MAX;
+            return begin_field(state, HANDSHAKE_TYPE, 1);
+        case HANDSHAKE_TYPE:
+            if (value != TLS_HANDSHAKE_TYPE_CLIENT_HELLO) {
+                debug("Not a client hello");
+
+                return -5;
+            }
+            return begin_field(state, HANDSHAKE_LENGTH, 3);
+        case HANDSHAKE_LENGTH:
+            state->u.tls.hello_end = state->u.tls.pos + value;
+            state->u.tls.limit = state->u.tls.hello_end;
+            return begin_field(state, CLIENT_VERSION, 2);
+        case CLIENT_VERSION:
+            state->hello.client_version = (uint16_t)value;
+            state->hello.max_version = (uint16_t)value;
+            return begin_field(state, RANDOM, 32);
+        case RANDOM:
+            return begin_field(state, SESSION_ID_LENGTH, 1);
+        case SESSION_ID_LENGTH:
+            return begin_field(state, SESSION_ID, value);
+        case SESSION_ID:
+            return begin_field(state, CIPHER_SUITES_LENGTH, 2);
+        case CIPHER_SUITES_LENGTH:
+            return begin_list(state, CIPHER_SUITE, value);
+        case CIPHER_SUITE:
+            if (!IS_GREASE(value)) {
+                state->hello.cipher_count++;
+                state->u.tls.cipher_hash += mix_hash(value);
+            }
+            return next_list_item(state, CIPHER_SUITE);
+        case COMPRESSION_METHODS_LENGTH:
+            return begin_field(state, COMPRESSION_METHODS, value);
+        case COMPRESSION_METHODS:
+            if (state->u.tls.pos == state->u.tls.hello_end &&
+                    state->u.tls.version_major == 3 &&
+                    state->u.tls.version_minor == 0) {
+                debug("Received SSL 3.0 handshake without extensions");
+                return -2;
+            }
+            return begin_field(state, EXTENSIONS_LENGTH, 2);
+        case EXTENSIONS_LENGTH:
+            /* Some clients understate the handshake length, so allow the
+             * extensions to run to the end of the records received */
+            state->u.tls.extensions_end = state->u.tls.pos + value;
+            if (state->u.tls.extensions_end > state->u.tls.hello_end &&
+                    state->u.tls.extensions_end > state->u.tls.records_len)
+                return -5;
+            state->u.tls.limit = state->u.tls.extensions_end;
+            return next_extension(state);
+        case EXTENSION_TYPE:
+            state->u.tls.extension_type = (uint16_t)value;
+            if (!IS_GREASE(value)) {
+                state->hello.extension_count++;
+                /* Like JA4, the fingerprint leaves out the extensions
+                 * which vary with the server requested */
+                if (value != TLS_EXT_SERVER_NAME && value != TLS_EXT_ALPN)
+                    state->u.tls.extension_hash += mix_hash(value);
+            }
+            return begin_field(state, EXTENSION_LENGTH, 2);
+        case EXTENSION_LENGTH:
+            if (state->u.tls.pos + value > state->u.tls.limit)
+                return -5;
+            state->u.tls.extension_end = state->u.tls.pos + value;
+
+            switch (state->u.tls.extension_type) {
+                case TLS_EXT_SERVER_NAME:
+                    /* Only the first server name extension is used */
+                    if (state->u.tls.have_server_name)
+                        break;
+                    state->u.tls.limit = state->u.tls.extension_end;
+                    return begin_field(state, SERVER_NAME_LIST_LENGTH, 2);
+                case TLS_EXT_ALPN:
+                    state->u.tls.limit = state->u.tls.extension_end;
+                    return begin_field(state, ALPN_LIST_LENGTH, 2);
+                case TLS_EXT_SUPPORTED_GROUPS:
+                    state->u.tls.limit = state->u.tls.extension_end;
+                    return begin_field(state, SUPPORTED_GROUPS_LENGTH, 2);
+                case TLS_EXT_SIGNATURE_ALGORITHMS:
+                    state->u.tls.limit = state->u.tls.extension_end;
+                    return begin_field(state, SIGNATURE_ALGORITHMS_LENGTH, 2);
+                case TLS_EXT_SUPPORTED_VERSIONS:
+                    state->u.tls.limit = state->u.tls.extension_end;
+                    return begin_field(state, SUPPORTED_VERSIONS_LENGTH, 1);
+            }
+            return begin_field(state, EXTENSION_DATA, value);
+        case EXTENSION_DATA:
+            return next_extension(state);
+        case SERVER_NAME_LIST_LENGTH:
+            return next_server_name(state);
+        case SERVER_NAME_TYPE:
+            state->u.tls.name_type = (uint8_t)value;
+            return begin_field(state, SERVER_NAME_LENGTH, 2);
+        case SERVER_NAME_LENGTH:
+            switch (state->u.tls.name_type) {
+                case 0x00: /* host_name */
+                    if (value > PARSE_HOSTNAME_MAX)
+                        return -5;
+                    return begin_field(state, SERVER_NAME, value);
+                default:
+                    debug("Unknown server name extension name type: %" PRIu8,
+                          state->u.tls.name_type);
+                    return begin_field(state, SERVER_NAME_UNKNOWN, value);
+            }
+        case SERVER_NAME:
+            normalize_hostname(state);
+            state->u.tls.have_server_name = 1;
+            /* Skip any further names in the list */
+            return begin_field(state, EXTENSION_DATA,
+                    state->u.tls.extension_end - state->u.tls.pos);
+        case SERVER_NAME_UNKNOWN:
+            return next_server_name(state);
+        case ALPN_LIST_LENGTH:
+            if (value != state->u.tls.limit - state->u.tls.pos)
+                return -5;
+            if (value > sizeof(state->hello.alpn)) {
+                debug("Ignoring %zu byte ALPN protocol list", value);
+                return begin_field(state, EXTENSION_DATA, value);
+            }
+            state->hello.alpn_len = 0;
+            return begin_field(state, ALPN_PROTOCOLS, value);
+        case ALPN_PROTOCOLS:
+            if (!valid_alpn_list(state->hello.alpn, state->hello.alpn_len))
+                return -5;
+            return next_extension(state);
+        case SUPPORTED_GROUPS_LENGTH:
+            return begin_list(state, SUPPORTED_GROUP, value);
+        case SUPPORTED_GROUP:
+            if (!IS_GREASE(value)) {
+                if (state->hello.group_count < CLIENT_HELLO_GROUPS_MAX)
+                    state->hello.groups[state->hello.group_count] =
+                        (uint16_t)value;
+                state->hello.group_count++;
+            }
+            return next_list_item(state, SUPPORTED_GROUP);
+        case SIGNATURE_ALGORITHMS_LENGTH:
+            return begin_list(state, SIGNATURE_ALGORITHM, value);
+        case SIGNATURE_ALGORITHM:
+            /* Signature algorithms are hashed in the order offered */
+            state->u.tls.signature_hash =
+                mix_hash(state->u.tls.signature_hash ^ value);
+            return next_list_item(state, SIGNATURE_ALGORITHM);
+        case SUPPORTED_VERSIONS_LENGTH:
+            /* RFC8446 4.2.1: supersedes the legacy version field */
+            state->hello.max_version = 0;
+            return begin_list(state, SUPPORTED_VERSION, value);
+        case SUPPORTED_VERSION:
+            if (!IS_GREASE(value) && value > state->hello.max_version)
+                state->hello.max_version = (uint16_t)value;
+            return next_list_item(state, SUPPORTED_VERSION);
     }
 
-    /* Skip past fixed length records:
-       1	Handshake Type
-       3	Length
-       2	Version (again)
-       32	Random
-       to	Session ID Length
-     */
-    pos += 38;
-
-    /* Session ID */
-    if (pos + 1 > data_len)
-        return -5;
-    len = (size_t)data[pos];
-    pos += 1 + len;
+    return -5;
+}
 
-    /* Cipher Suites */
-    if (pos + 2 > data_len)
+static int
+begin_field(struct ParseState *state, enum TLSField field, size_t len) {
+    /* Check the field fits within the enclosing structure */
+    if (len > state->u.tls.limit - state->u.tls.pos)
         return -5;
-    len = ((size_t)data[pos] << 8) + (size_t)data[pos + 1];
-    pos += 2 + len;
 
-    /* Compression Methods */
-    if (pos + 1 > data_len)
-        return -5;
-    len = (size_t)data[pos];
-    pos += 1 + len;
+    state->u.tls.field = field;
+    state->u.tls.field_remaining = len;
+    state->u.tls.value = 0;
+
+    return -1;
+}
+
+static int
+next_extension(struct ParseState *state) {
+    state->u.tls.limit = state->u.tls.extensions_end;
 
-    if (pos == data_len && tls_version_major == 3 && tls_version_minor == 0) {
-        debug("Received SSL 3.0 handshake without extensions");
-        return -2;
+    /* Check we ended where we expected to */
+    if (state->u.tls.pos == state->u.tls.extensions_end) {
+        fingerprint_client_hello(state);
+
+        if (!state->u.tls.have_server_name)
+            return -2;
+
+        return (int)state->hostname_len;
     }
 
-    /* Extensions */
-    if (pos + 2 > data_len)
-        return -5;
-    len = ((size_t)data[pos] << 8) + (size_t)data[pos + 1];
-    pos += 2;
+    return begin_field(state, EXTENSION_TYPE, 2);
+}
 
-    if (pos + len > data_len)
+/*
+ * Begin a vector of uint16 values of len bytes
+ */
+static int
+begin_list(struct ParseState *state, enum TLSField item, size_t len) {
+    if (len % 2 != 0 || len > state->u.tls.limit - state->u.tls.pos)
         return -5;
-    return parse_extensions(data + pos, len, hostname);
+
+    state->u.tls.list_end = state->u.tls.pos + len;
+
+    return next_list_item(state, item);
 }
 
 static int
-parse_extensions(const uint8_t *data, size_t data_len, char **hostname) {
-    size_t pos = 0;
-    size_t len;
-
-    /* Parse each 4 bytes for the extension header */
-    while (pos + 4 <= data_len) {
-        /* Extension Length */
-        len = ((size_t)data[pos + 2] << 8) +
-            (size_t)data[pos + 3];
-
-        /* Check if it's a server name extension */
-        if (data[pos] == 0x00 && data[pos + 1] == 0x00) {
-            /* There can be only one extension of each type, so we break
-               our state and move p to beinnging of the extension here */
-            if (pos + 4 + len > data_len)
-                return -5;
-            return parse_server_name_extension(data + pos + 4, len, hostname);
+next_list_item(struct ParseState *state, enum TLSField item) {
+    if (state->u.tls.pos < state->u.tls.list_end)
+        return begin_field(state, item, 2);
+
+    if (item == CIPHER_SUITE)
+        return begin_field(state, COMPRESSION_METHODS_LENGTH, 1);
+
+    /* Skip anything following the list in the extension */
+    return begin_field(state, EXTENSION_DATA,
+            state->u.tls.extension_end - state->u.tls.pos);
+}
+
+/*
+ * Format a JA4 style fingerprint of the client hello into
+ * state->hello.fingerprint, e.g. t13d1516h2_8daaf6152771_e5627efa2ab1:
+ * transport (t for TLS, q for QUIC), version, whether a server name was
+ * sent, cipher suite and extension
+ * counts, first and last characters of the first ALPN protocol, then hashes
+ * of the cipher suites and of the extensions and signature algorithms.
+ *
+ * Rather than sorting the lists and truncating a SHA-256 as JA4 does, each
+ * hash is 48 bits of an order independent sum of mixed values accumulated
+ * while parsing, so these fingerprints are not comparable with JA4
+ * databases.
+ */
+static void
+fingerprint_client_hello(struct ParseState *state) {
+    struct ClientHello *hello = &state->hello;
+    const char *version;
+    char alpn[3] = "00";
+
+    switch (hello->max_version) {
+        case 0x0304: version = "13"; break;
+        case 0x0303: version = "12"; break;
+        case 0x0302: version = "11"; break;
+        case 0x0301: version = "10"; break;
+        case 0x0300: version = "s3"; break;
+        default:     version = "00"; break;
+    }
+
+    if (hello->alpn_len > 0) {
+        static const char hex[] = "0123456789abcdef";
+        uint8_t first = hello->alpn[1];
+        uint8_t last = hello->alpn[hello->alpn[0]];
+
+        if (IS_ALNUM(first) && IS_ALNUM(last)) {
+            alpn[0] = (char)first;
+            alpn[1] = (char)last;
+        } else {
+            alpn[0] = hex[first >> 4];
+            alpn[1] = hex[last & 0x0f];
         }
-        pos += 4 + len; /* Advance to the next extension header */
     }
-    /* Check we ended where we expected to */
-    if (pos != data_len)
-        return -5;
 
-    return -2;
+    snprintf(hello->fingerprint, sizeof(hello->fingerprint),
+            "%c%s%c%02u%02u%s_%012" PRIx64 "_%012" PRIx64,
+            state->u.tls.quic ? 'q' : 't',
+            version,
+            state->u.tls.have_server_name ? 'd' : 'i',
+            (unsigned int)MIN(hello->cipher_count, 99),
+            (unsigned int)MIN(hello->extension_count, 99),
+            alpn,
+            state->u.tls.cipher_hash >> 16,
+            mix_hash(state->u.tls.extension_hash ^
+                    state->u.tls.signature_hash) >> 16);
 }
 
+/*
+ * Check a ProtocolNameList consists of non-empty length prefixed names
+ */
 static int
-parse_server_name_extension(const uint8_t *data, size_t data_len,
-        char **hostname) {
-    size_t pos = 2; /* skip server name list length */
-    size_t len;
-
-    while (pos + 3 < data_len) {
-        len = ((size_t)data[pos + 1] << 8) +
-            (size_t)data[pos + 2];
-
-        if (pos + 3 + len > data_len)
-            return -5;
-
-        switch (data[pos]) { /* name type */
-            case 0x00: /* host_name */
-                *hostname = malloc(len + 1);
-                if (*hostname == NULL) {
-                    err("malloc() failure");
-                    return -4;
-                }
-
-                strncpy(*hostname, (const char *)(data + pos + 3), len);
+valid_alpn_list(const uint8_t *data, size_t data_len) {
+    size_t pos = 0;
 
-                (*hostname)[len] = '\0';
+    while (pos < data_len) {
+        if (data[pos] == 0)
+            return 0;
 
-                return len;
-            default:
-                debug("Unknown server name extension name type: %" PRIu8,
-                      data[pos]);
-        }
-        pos += 3 + len;
+        pos += 1 + (size_t)data[pos];
     }
-    /* Check we ended where we expected to */
-    if (pos != data_len)
+
+    return pos == data_len;
+}
+
+static int
+next_server_name(struct ParseState *state) {
+    size_t remaining = state->u.tls.limit - state->u.tls.pos;
+
+    /* No host_name in the list, the other extensions are still parsed for
+     * the fingerprint */
+    if (remaining == 0)
+        return next_extension(state);
+    if (remaining <= 3)
         return -5;
 
-    return -2;
+    return begin_field(state, SERVER_NAME_TYPE, 1);
 }
@@ -30,4 +30,6 @@
 
 extern const struct Protocol *const tls_protocol;
 
+int parse_tls_handshake(struct ParseState *, const uint8_t *, size_t);
+
 #endif
@@ -121,6 +121,12 @@ int main() {
             return 1;
         }
 
+        union AddressStorage storage;
+        struct Address *copy = copy_address_to(addr, &storage);
+        assert(copy != NULL);
+        assert(address_compare(addr, copy) == 0);
+        assert(address_port(copy) == port);
+
         free(addr);
     }
 
@@ -164,6 +170,25 @@ int main() {
         free(addr);
     } while (0);
 
+    /* The longest valid hostname fits in address storage */
+    do {
+        char hostname[256];
+        union AddressStorage storage;
+
+        memset(hostname, 'a', 255);
+        hostname[63] = hostname[127] = hostname[191] = '.';
+        hostname[255] = '\0';
+
+        struct Address *addr = new_address(hostname);
+        assert(addr != NULL);
+
+        struct Address *copy = copy_address_to(addr, &storage);
+        assert(copy != NULL);
+        assert(strcmp(address_hostname(copy), hostname) == 0);
+
+        free(addr);
+    } while (0);
+
     return 0;
 }
 
@@ -0,0 +1,506 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <arpa/inet.h>
+#include "balancer.h"
+#include "address.h"
+
+#define MAGLEV_NAMES 10000
+
+static struct Balancer *new_test_balancer(const char *, const char **);
+static struct BackendServer *select_server(struct Balancer *);
+static size_t server_index(const struct Balancer *,
+        const struct BackendServer *);
+static void test_round_robin();
+static void test_least_connections();
+static void test_random();
+static void test_latency();
+static void test_source();
+static void maglev_servers(const char **, int *, int);
+static void test_maglev();
+static void test_maglev_network();
+static void test_options();
+static void test_retry();
+static void test_adopt_servers();
+
+
+int main() {
+    test_round_robin();
+    test_least_connections();
+    test_random();
+    test_latency();
+    test_source();
+    test_maglev();
+    test_maglev_network();
+    test_options();
+    test_retry();
+    test_adopt_servers();
+
+    return 0;
+}
+
+/* A balancer of the addresses, each optionally followed by its weight */
+static struct Balancer *
+new_test_balancer(const char *algorithm, const char **servers) {
+    struct Balancer *balancer = new_balancer();
+    assert(balancer != NULL);
+    assert(balancer_set_algorithm(balancer, algorithm));
+
+    for (; *servers != NULL; servers++) {
+        if (strncmp(*servers, "weight=", 7) == 0)
+            assert(balancer_set_weight(balancer, *servers + 7));
+        else
+            assert(balancer_add_server(balancer, new_address(*servers)));
+    }
+
+    return balancer;
+}
+
+/* For a client without an IP address, not requesting a name */
+static struct BackendServer *
+select_server(struct Balancer *balancer) {
+    return balancer_select(balancer, NULL, NULL, 0);
+}
+
+static size_t
+server_index(const struct Balancer *balancer,
+        const struct BackendServer *server) {
+    for (size_t i = 0; i < balancer->len; i++)
+        if (balancer->members[i].server == server)
+            return i;
+
+    assert(0);
+    return 0;
+}
+
+/* Servers are chosen in proportion to their weights, interleaved */
+static void
+test_round_robin() {
+    struct Balancer *balancer = new_test_balancer("roundrobin",
+            (const char *[]){ "192.0.2.1", "weight=3", "192.0.2.2", NULL });
+    size_t counts[2] = {0, 0};
+    size_t run = 0, longest_run = 0;
+
+    for (int i = 0; i < 400; i++) {
+        size_t index = server_index(balancer, select_server(balancer));
+
+        counts[index]++;
+        run = index == 0 ? run + 1 : 0;
+        if (run > longest_run)
+            longest_run = run;
+    }
+
+    assert(counts[0] == 300 && counts[1] == 100);
+    assert(longest_run == 3);
+
+    free_balancer(balancer);
+}
+
+static void
+test_least_connections() {
+    struct Balancer *balancer = new_test_balancer("leastconn",
+            (const char *[]){ "192.0.2.1", "192.0.2.2", "weight=2",
+            "192.0.2.3", NULL });
+    struct BackendServer *held[8];
+
+    /* Each new connection goes to the least loaded server for its weight,
+     * so the second server takes half of them */
+    for (int i = 0; i < 8; i++)
+        held[i] = backend_server_acquire(select_server(balancer));
+
+    assert(balancer->members[0].server->connections == 2);
+    assert(balancer->members[1].server->connections == 4);
+    assert(balancer->members[2].server->connections == 2);
+
+    /* Once its connections close a server is preferred */
+    for (int i = 0; i < 8; i++) {
+        if (held[i] == balancer->members[2].server) {
+            backend_server_release(held[i]);
+            held[i] = NULL;
+        }
+    }
+    assert(balancer->members[2].server->connections == 0);
+    assert(select_server(balancer) == balancer->members[2].server);
+
+    for (int i = 0; i < 8; i++)
+        backend_server_release(held[i]);
+
+    free_balancer(balancer);
+}
+
+/* Of two different servers the less loaded is chosen */
+static void
+test_random() {
+    struct Balancer *balancer = new_test_balancer("random",
+            (const char *[]){ "192.0.2.1", "192.0.2.2", NULL });
+    struct BackendServer *busy =
+        backend_server_acquire(balancer->members[0].server);
+
+    for (int i = 0; i < 100; i++)
+        assert(select_server(balancer) == balancer->members[1].server);
+
+    backend_server_release(busy);
+
+    /* With equal loads both are chosen */
+    size_t counts[2] = {0, 0};
+    for (int i = 0; i < 100; i++)
+        counts[server_index(balancer, select_server(balancer))]++;
+    assert(counts[0] > 0 && counts[1] > 0);
+
+    free_balancer(balancer);
+}
+
+/* The server connecting faster for its load is chosen */
+static void
+test_latency() {
+    struct Balancer *balancer = new_test_balancer("latency",
+            (const char *[]){ "192.0.2.1", "192.0.2.2", NULL });
+    struct BackendServer *fast = balancer->members[0].server;
+    struct BackendServer *slow = balancer->members[1].server;
+
+    /* Moving averages of the connect times */
+    backend_server_connected(fast, 0.010);
+    assert(fast->connect_time == 0.010);
+    backend_server_connected(fast, 0.020);
+    assert(fast->connect_time > 0.010 && fast->connect_time < 0.020);
+    for (int i = 0; i < 50; i++)
+        backend_server_connected(fast, 0.002);
+    assert(fast->connect_time < 0.0021);
+
+    /* A server yet to be measured is tried */
+    assert(select_server(balancer) == slow);
+
+    backend_server_connected(slow, 0.050);
+    for (int i = 0; i < 100; i++)
+        assert(select_server(balancer) == fast);
+
+    /* Until the faster server has many more connections */
+    struct BackendServer *busy[30];
+    for (int i = 0; i < 30; i++)
+        busy[i] = backend_server_acquire(fast);
+    assert(select_server(balancer) == slow);
+
+    for (int i = 0; i < 30; i++)
+        backend_server_release(busy[i]);
+
+    /* Failures count as the whole connect timeout */
+    backend_server_connect_failed(fast);
+    assert(fast->connect_time > 0.002 &&
+            fast->connect_time < balancer->connect_timeout);
+    for (int i = 0; i < 50; i++)
+        backend_server_connect_failed(fast);
+    assert(fast->connect_time > 0.050);
+    for (int i = 0; i < 100; i++)
+        assert(select_server(balancer) == slow);
+
+    free_balancer(balancer);
+
+    /* A measured connect time of zero is not taken for unmeasured */
+    balancer = new_test_balancer("latency",
+            (const char *[]){ "192.0.2.1", "192.0.2.2", NULL });
+    backend_server_connected(balancer->members[0].server, 0.0);
+    assert(balancer->members[0].server->connect_measured);
+    assert(select_server(balancer) == balancer->members[1].server);
+    backend_server_connected(balancer->members[1].server, 0.001);
+    for (int i = 0; i < 100; i++)
+        assert(select_server(balancer) == balancer->members[0].server);
+    free_balancer(balancer);
+}
+
+/* A client's address, but not its port, always chooses the same server */
+static void
+test_source() {
+    struct Balancer *balancer = new_test_balancer("source",
+            (const char *[]){ "192.0.2.1", "192.0.2.2", "192.0.2.3", NULL });
+    size_t counts[3] = {0, 0, 0};
+
+    for (int i = 0; i < 256; i++) {
+        struct sockaddr_in client = {
+            .sin_family = AF_INET,
+            .sin_port = htons(1024),
+            .sin_addr.s_addr = htonl(0xc6336400 + (uint32_t)i),
+        };
+        struct BackendServer *server = balancer_select(balancer,
+                (struct sockaddr *)&client, NULL, 0);
+
+        client.sin_port = htons(2048);
+        assert(balancer_select(balancer, (struct sockaddr *)&client,
+                    NULL, 0) == server);
+
+        counts[server_index(balancer, server)]++;
+    }
+    assert(counts[0] > 0 && counts[1] > 0 && counts[2] > 0);
+
+    /* Clients without an IP address are still served */
+    assert(select_server(balancer) != NULL);
+
+    free_balancer(balancer);
+}
+
+/* The server each of a number of names maps to, by its last address byte */
+static void
+maglev_servers(const char **servers, int *mapped, int names) {
+    struct Balancer *balancer = new_test_balancer("maglev", servers);
+    assert(balancer_set_hash(balancer, "sni"));
+
+    for (int i = 0; i < names; i++) {
+        char name[32];
+        char address[ADDRESS_BUFFER_SIZE];
+        int len = snprintf(name, sizeof(name), "host%d.example.com", i);
+        struct BackendServer *server =
+            balancer_select(balancer, NULL, name, (size_t)len);
+
+        /* Names keep to their server */
+        assert(balancer_select(balancer, NULL, name, (size_t)len) == server);
+
+        display_address(server->address, address, sizeof(address));
+        mapped[i] = atoi(strrchr(address, '.') + 1);
+    }
+
+    free_balancer(balancer);
+}
+
+/*
+ * Names are spread evenly, or by weight, and removing or adding a server
+ * moves few names between the others
+ */
+static void
+test_maglev() {
+    static const char *servers[] = { "192.0.2.1", "192.0.2.2", "192.0.2.3",
+        "192.0.2.4", "192.0.2.5", NULL };
+    static const char *removed[] = { "192.0.2.1", "192.0.2.2", "192.0.2.4",
+        "192.0.2.5", NULL };
+    static const char *added[] = { "192.0.2.1", "192.0.2.2", "192.0.2.3",
+        "192.0.2.4", "192.0.2.5", "192.0.2.6", NULL };
+    static const char *weighted[] = { "192.0.2.1", "192.0.2.2", "weight=3",
+        NULL };
+    int before[MAGLEV_NAMES], after[MAGLEV_NAMES];
+    int counts[8] = {0};
+    int moved = 0;
+
+    maglev_servers(servers, before, MAGLEV_NAMES);
+    for (int i = 0; i < MAGLEV_NAMES; i++)
+        counts[before[i]]++;
+    for (int i = 1; i <= 5; i++)
+        assert(counts[i] > MAGLEV_NAMES / 5 * 8 / 10 &&
+                counts[i] < MAGLEV_NAMES / 5 * 12 / 10);
+
+    maglev_servers(removed, after, MAGLEV_NAMES);
+    for (int i = 0; i < MAGLEV_NAMES; i++) {
+        assert(after[i] != 3);
+        moved += before[i] != 3 && after[i] != before[i];
+    }
+    assert(moved < MAGLEV_NAMES / 20);
+
+    moved = 0;
+    maglev_servers(added, after, MAGLEV_NAMES);
+    for (int i = 0; i < MAGLEV_NAMES; i++)
+        moved += after[i] != 6 && after[i] != before[i];
+    assert(moved < MAGLEV_NAMES / 20);
+
+    memset(counts, 0, sizeof(counts));
+    maglev_servers(weighted, after, MAGLEV_NAMES);
+    for (int i = 0; i < MAGLEV_NAMES; i++)
+        counts[after[i]]++;
+    assert(counts[2] > 2 * counts[1] && counts[2] < 4 * counts[1]);
+}
+
+/* Clients of a network keep to one server, with the table rebuilt */
+static void
+test_maglev_network() {
+    struct Balancer *balancer = new_test_balancer("maglev",
+            (const char *[]){ "192.0.2.1", "192.0.2.2", "192.0.2.3", NULL });
+    struct sockaddr_in6 client = { .sin6_family = AF_INET6 };
+    size_t counts[3] = {0, 0, 0};
+
+    assert(balancer_set_hash(balancer, "network"));
+
+    for (int i = 0; i < 300; i++) {
+        client.sin6_addr.s6_addr[0] = 0x20;
+        client.sin6_addr.s6_addr[1] = 0x01;
+        client.sin6_addr.s6_addr[5] = (uint8_t)i;
+        client.sin6_addr.s6_addr[15] = 1;
+
+        struct BackendServer *server = balancer_select(balancer,
+                (struct sockaddr *)&client, NULL, 0);
+
+        client.sin6_addr.s6_addr[6] = 0xff;
+        client.sin6_addr.s6_addr[15] = 2;
+        assert(balancer_select(balancer, (struct sockaddr *)&client,
+                    NULL, 0) == server);
+        client.sin6_addr.s6_addr[6] = 0;
+
+        counts[server_index(balancer, server)]++;
+    }
+    assert(counts[0] > 0 && counts[1] > 0 && counts[2] > 0);
+
+    /* Once a server is added the table includes it */
+    assert(balancer->maglev != NULL);
+    assert(balancer_add_server(balancer, new_address("192.0.2.4")));
+    assert(balancer->maglev == NULL);
+
+    int found = 0;
+    for (int i = 0; i < 300 && !found; i++) {
+        client.sin6_addr.s6_addr[5] = (uint8_t)i;
+        found = balancer_select(balancer, (struct sockaddr *)&client,
+                NULL, 0) == balancer->members[3].server;
+    }
+    assert(found);
+
+    free_balancer(balancer);
+}
+
+static void
+test_options() {
+    struct Balancer *balancer = new_balancer();
+    assert(balancer != NULL);
+
+    assert(!balancer_set_weight(balancer, "2"));    /* no server yet */
+    assert(balancer_add_server(balancer, new_address("192.0.2.1")));
+    assert(balancer_set_weight(balancer, "256"));
+    assert(!balancer_set_weight(balancer, "0"));
+    assert(!balancer_set_weight(balancer, "257"));
+    assert(!balancer_set_weight(balancer, ""));
+    assert(!balancer_set_weight(balancer, "2x"));
+    assert(balancer->members[0].weight == 256);
+
+    assert(strcmp(balancer_algorithm_name(balancer), "roundrobin") == 0);
+    assert(balancer_set_algorithm(balancer, "LeastConn"));
+    assert(strcmp(balancer_algorithm_name(balancer), "leastconn") == 0);
+    assert(balancer_set_algorithm(balancer, "latency"));
+    assert(balancer->algorithm == BALANCE_LATENCY);
+    assert(balancer_set_algorithm(balancer, "leastconn"));
+    assert(!balancer_set_algorithm(balancer, "fastest"));
+    assert(balancer->algorithm == BALANCE_LEAST_CONNECTIONS);
+
+    assert(strcmp(balancer_hash_name(balancer), "client") == 0);
+    assert(balancer_set_hash(balancer, "SNI"));
+    assert(strcmp(balancer_hash_name(balancer), "sni") == 0);
+    assert(!balancer_set_hash(balancer, "cookie"));
+
+    assert(balancer_set_retry(balancer, "retries=0"));
+    assert(balancer_set_retry(balancer, "connect_timeout=0.5"));
+    assert(balancer_set_retry(balancer, "eject=0"));
+    assert(balancer_set_retry(balancer, "eject_time=60"));
+    assert(!balancer_set_retry(balancer, "retries=-1"));
+    assert(!balancer_set_retry(balancer, "connect_timeout=0"));
+    assert(!balancer_set_retry(balancer, "eject_time=1h"));
+    assert(!balancer_set_retry(balancer, "redispatch=1"));
+    assert(balancer->retries == 0 && balancer->connect_timeout == 0.5);
+    assert(balancer->eject == 0 && balancer->eject_time == 60.0);
+
+    free_balancer(balancer);
+}
+
+/* After a failed connection the next usable server of the pool is tried */
+static void
+test_retry() {
+    struct Balancer *balancer = new_test_balancer("maglev",
+            (const char *[]){ "192.0.2.1", "192.0.2.2", "192.0.2.3", NULL });
+    struct BackendServer *servers[3];
+
+    for (size_t i = 0; i < 3; i++)
+        servers[i] = balancer->members[i].server;
+
+    assert(balancer_retry(balancer, servers[0]) == servers[1]);
+    assert(balancer_retry(balancer, servers[2]) == servers[0]);
+
+    /* Ejected servers are neither chosen nor retried */
+    servers[1]->ejected = 1;
+    balancer_health_changed();
+    assert(balancer_retry(balancer, servers[0]) == servers[2]);
+    for (int i = 0; i < 100; i++) {
+        char name[16];
+
+        snprintf(name, sizeof(name), "%d.example", i);
+        assert(balancer_select(balancer, NULL, name, strlen(name)) !=
+                servers[1]);
+    }
+
+    /* Unless every other server is unusable too */
+    servers[2]->healthy = 0;
+    assert(balancer_retry(balancer, servers[0]) == servers[1]);
+
+    /* A connection holding the pool retries within it after a reload */
+    struct Balancer *held = balancer_ref_get(balancer);
+    free_balancer(balancer);
+    assert(servers[0]->balancer == NULL);
+    assert(balancer_retry(held, servers[0]) == servers[1]);
+
+    /* A server not in the pool, or alone in it, has no other to try */
+    balancer = new_test_balancer("roundrobin",
+            (const char *[]){ "192.0.2.1", NULL });
+    assert(balancer_retry(held, balancer->members[0].server) == NULL);
+    balancer_ref_put(held);
+    assert(balancer_retry(balancer, balancer->members[0].server) == NULL);
+    free_balancer(balancer);
+}
+
+/* Servers of a reloaded pool keep their connections, and outlive it */
+static void
+test_adopt_servers() {
+    struct Balancer *previous = new_test_balancer("roundrobin",
+            (const char *[]){ "192.0.2.1", "192.0.2.2", NULL });
+    struct Balancer *balancer = new_test_balancer("leastconn",
+            (const char *[]){ "192.0.2.2", "192.0.2.3", NULL });
+    struct BackendServer *removed =
+        backend_server_acquire(previous->members[0].server);
+    struct BackendServer *kept =
+        backend_server_acquire(previous->members[1].server);
+    struct ServerMap map;
+
+    assert(init_server_map(&map, previous->len));
+    server_map_add(&map, previous);
+    balancer_adopt_servers(balancer, &map);
+    free_server_map(&map);
+    free_balancer(previous);
+
+    assert(balancer->members[0].server == kept);
+    assert(kept->connections == 1);
+    assert(kept->balancer == balancer);
+    assert(removed->balancer == NULL);
+    assert(balancer->members[1].server->connections == 0);
+    assert(select_server(balancer) == balancer->members[1].server);
+
+    backend_server_release(removed);
+    backend_server_release(kept);
+    assert(kept->connections == 0);
+
+    free_balancer(balancer);
+
+    /* Pools sharing an address each adopt their own server, or a new one */
+    struct Balancer *previous_a = new_test_balancer("roundrobin",
+            (const char *[]){ "10.0.0.1", "10.0.0.2", NULL });
+    struct Balancer *previous_b = new_test_balancer("roundrobin",
+            (const char *[]){ "10.0.0.1", "10.0.0.3", NULL });
+    struct Balancer *a = new_test_balancer("roundrobin",
+            (const char *[]){ "10.0.0.1", "10.0.0.2", NULL });
+    struct Balancer *b = new_test_balancer("roundrobin",
+            (const char *[]){ "10.0.0.1", "10.0.0.3", NULL });
+    struct Balancer *c = new_test_balancer("roundrobin",
+            (const char *[]){ "10.0.0.1", NULL });
+
+    assert(init_server_map(&map, previous_a->len + previous_b->len));
+    server_map_add(&map, previous_a);
+    server_map_add(&map, previous_b);
+    balancer_adopt_servers(a, &map);
+    balancer_adopt_servers(b, &map);
+    balancer_adopt_servers(c, &map);
+    free_server_map(&map);
+
+    assert(a->members[0].server == previous_a->members[0].server);
+    assert(b->members[0].server == previous_b->members[0].server);
+    assert(c->members[0].server != a->members[0].server &&
+            c->members[0].server != b->members[0].server);
+    assert(a->members[0].server->balancer == a);
+    assert(b->members[0].server->balancer == b);
+    assert(c->members[0].server->balancer == c);
+    assert(balancer_retry(a, a->members[0].server) == a->members[1].server);
+
+    free_balancer(previous_a);
+    free_balancer(previous_b);
+    free_balancer(a);
+    free_balancer(b);
+    free_balancer(c);
+}
@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -168,6 +169,53 @@ static void test_buffer_coalesce() {
     assert(len == 0);
 }
 
+static void test_buffer_peek_iov() {
+    struct Buffer *buffer;
+    char input[] = "Testing wrap around behaviour.";
+    char output[sizeof(input)];
+    struct iovec iov[2];
+    size_t iov_len, i, len;
+
+    buffer = new_buffer(32, EV_DEFAULT);
+    assert(buffer != NULL);
+
+    /* Advance head so the contents wrap */
+    len = buffer_push(buffer, input, 20);
+    assert(len == 20);
+    len = buffer_pop(buffer, NULL, 19);
+    assert(len == 19);
+    len = buffer_push(buffer, input, sizeof(input));
+    assert(len == sizeof(input));
+    len = buffer_pop(buffer, NULL, 1);
+    assert(len == 1);
+
+    iov_len = buffer_peek_iov(buffer, iov, 0);
+    assert(iov_len == 2);
+    assert(iov[0].iov_len == 12);
+    assert(iov[0].iov_len + iov[1].iov_len == sizeof(input));
+
+    for (size_t offset = 0; offset < sizeof(input); offset++) {
+        len = 0;
+        iov_len = buffer_peek_iov(buffer, iov, offset);
+        assert(iov_len == (offset < 12 ? 2 : 1));
+
+        for (i = 0; i < iov_len; i++) {
+            memcpy(output + len, iov[i].iov_base, iov[i].iov_len);
+            len += iov[i].iov_len;
+        }
+        assert(len == sizeof(input) - offset);
+        assert(memcmp(input + offset, output, len) == 0);
+    }
+
+    iov_len = buffer_peek_iov(buffer, iov, sizeof(input));
+    assert(iov_len == 0);
+
+    /* peeking doesn't consume */
+    assert(buffer_len(buffer) == sizeof(input));
+
+    free_buffer(buffer);
+}
+
 int main() {
     test1();
 
@@ -178,4 +226,6 @@ int main() {
     test4();
 
     test_buffer_coalesce();
+
+    test_buffer_peek_iov();
 }
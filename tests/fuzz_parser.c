@@ -0,0 +1,491 @@
+/*
+ * Fuzzing and worst case cost harness for the TLS and HTTP request parsers
+ *
+ * Built with -DLIBFUZZER -fsanitize=fuzzer (configure --enable-fuzzing) this
+ * is a libFuzzer target, run with the seed corpus:
+ *
+ *   ./fuzz_parser fuzz/tls fuzz/http
+ *
+ * Otherwise main() provides:
+ *
+ *   fuzz_parser FILE...
+ *      Check each file, and the synthetic worst cases, as a parser input.
+ *      Suitable for AFL: afl-fuzz -i fuzz/tls -o out -- ./fuzz_parser @@
+ *   fuzz_parser bench [FILE...]
+ *      Report ns/parse for each input delivered whole and a byte at a time.
+ *   fuzz_parser search tls|http SECONDS [FILE...]
+ *      Mutate the inputs for SECONDS, keeping those which take longest to
+ *      parse, and write the most expensive input found to worst-input.
+ *
+ * Inputs are limited to MAX_INPUT bytes, the default max_request_size.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include "tls.h"
+#include "http.h"
+#include "protocol.h"
+#include "logger.h"
+
+#define MAX_INPUT 16384
+#define POPULATION 32
+
+struct Input {
+    const char *name;
+    uint8_t *data;
+    size_t len;
+    double cost;
+};
+
+static void check_input(const uint8_t *, size_t);
+static void check_protocol(const struct Protocol *, const uint8_t *, size_t);
+static int parse_chunked(const struct Protocol *, struct ParseState *,
+        const uint8_t *, size_t, size_t);
+static double parse_cost(const struct Protocol *, const uint8_t *, size_t, size_t);
+static size_t synthetic_inputs(struct Input *);
+static size_t read_inputs(struct Input *, size_t, char **, int);
+static void benchmark(struct Input *, size_t);
+static void search(const struct Protocol *, double, struct Input *, size_t);
+static size_t mutate(uint8_t *, size_t, const struct Input *, size_t);
+static uint32_t random_next();
+
+
+/* Parser debug messages are discarded */
+void
+debug(const char *format, ...) {
+    (void)format;
+}
+
+#ifdef LIBFUZZER
+int LLVMFuzzerTestOneInput(const uint8_t *, size_t);
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    if (size <= MAX_INPUT)
+        check_input(data, size);
+
+    return 0;
+}
+#else
+int main(int argc, char **argv) {
+    struct Input inputs[256];
+    size_t count = synthetic_inputs(inputs);
+
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        count += read_inputs(inputs + count,
+                sizeof(inputs) / sizeof(inputs[0]) - count, argv + 2, argc - 2);
+        benchmark(inputs, count);
+    } else if (argc > 3 && strcmp(argv[1], "search") == 0) {
+        const struct Protocol *protocol;
+
+        if (strcmp(argv[2], "tls") == 0)
+            protocol = tls_protocol;
+        else if (strcmp(argv[2], "http") == 0)
+            protocol = http_protocol;
+        else {
+            fprintf(stderr, "Unknown protocol: %s\n", argv[2]);
+            return 1;
+        }
+
+        count += read_inputs(inputs + count,
+                sizeof(inputs) / sizeof(inputs[0]) - count, argv + 4, argc - 4);
+        search(protocol, strtod(argv[3], NULL), inputs, count);
+    } else {
+        count += read_inputs(inputs + count,
+                sizeof(inputs) / sizeof(inputs[0]) - count, argv + 1, argc - 1);
+        for (size_t i = 0; i < count; i++)
+            check_input(inputs[i].data, inputs[i].len);
+    }
+
+    for (size_t i = 0; i < count; i++)
+        free(inputs[i].data);
+
+    return 0;
+}
+#endif
+
+static void
+check_input(const uint8_t *data, size_t len) {
+    check_protocol(tls_protocol, data, len);
+    check_protocol(http_protocol, data, len);
+}
+
+/*
+ * The result must not depend on how the input is split across calls
+ */
+static void
+check_protocol(const struct Protocol *protocol, const uint8_t *data, size_t len) {
+    static const size_t chunk_lens[] = { 1, 2, 7, 64 };
+    struct ParseState whole, chunked;
+    int result, chunked_result;
+
+    result = parse_chunked(protocol, &whole, data, len, len > 0 ? len : 1);
+    assert(result >= -2 || result < -4);
+    if (result >= 0) {
+        assert((size_t)result == whole.hostname_len);
+        assert(whole.hostname_len <= PARSE_HOSTNAME_MAX);
+        assert(strlen(whole.hostname) <= whole.hostname_len);
+    }
+    assert(whole.hello.alpn_len <= sizeof(whole.hello.alpn));
+    assert(strlen(whole.hello.fingerprint) < sizeof(whole.hello.fingerprint));
+
+    for (size_t i = 0; i < sizeof(chunk_lens) / sizeof(chunk_lens[0]); i++) {
+        chunked_result = parse_chunked(protocol, &chunked, data, len, chunk_lens[i]);
+        assert(chunked_result == result);
+        if (result >= 0)
+            assert(memcmp(chunked.hostname, whole.hostname,
+                        whole.hostname_len) == 0);
+        assert(strcmp(chunked.hello.fingerprint, whole.hello.fingerprint) == 0);
+    }
+}
+
+static int
+parse_chunked(const struct Protocol *protocol, struct ParseState *state,
+        const uint8_t *data, size_t len, size_t chunk_len) {
+    int result = -1;
+
+    init_parse_state(state);
+
+    for (size_t pos = 0; pos < len && result == -1; pos += chunk_len)
+        result = protocol->parse_packet(state, (const char *)data + pos,
+                len - pos < chunk_len ? len - pos : chunk_len);
+
+    return result;
+}
+
+static double
+elapsed_ns(const struct timespec *start, const struct timespec *end) {
+    return (double)(end->tv_sec - start->tv_sec) * 1e9 +
+        (double)(end->tv_nsec - start->tv_nsec);
+}
+
+/*
+ * Average time to parse the input delivered in chunk_len pieces, the best of
+ * three runs of at least 100us each to limit noise
+ */
+static double
+parse_cost(const struct Protocol *protocol, const uint8_t *data, size_t len,
+        size_t chunk_len) {
+    double best = 0.0;
+
+    for (int run = 0; run < 3; run++) {
+        struct ParseState state;
+        struct timespec start, now;
+        unsigned long iterations = 0;
+        double elapsed;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        do {
+            for (int i = 0; i < 16; i++)
+                parse_chunked(protocol, &state, data, len, chunk_len);
+            iterations += 16;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            elapsed = elapsed_ns(&start, &now);
+        } while (elapsed < 100000.0);
+
+        if (run == 0 || elapsed / iterations < best)
+            best = elapsed / iterations;
+    }
+
+    return best;
+}
+
+static struct Input
+new_input(const char *name, const uint8_t *data, size_t len) {
+    struct Input input = { .name = name, .len = len };
+
+    input.data = malloc(MAX_INPUT);
+    if (input.data == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    memcpy(input.data, data, len);
+
+    return input;
+}
+
+/*
+ * Known expensive shapes: every byte of the input is examined before the
+ * server name is found
+ */
+static size_t
+synthetic_inputs(struct Input *inputs) {
+    static uint8_t buf[MAX_INPUT];
+    static const uint8_t sni[] = {
+        0x00, 0x00, 0x00, 0x0e, 0x00, 0x0c, 0x00, 0x00, 0x09,
+        'l', 'o', 'c', 'a', 'l', 'h', 'o', 's', 't'
+    };
+    size_t count = 0;
+    size_t len, hello_len;
+
+    /* Client hello with thousands of empty extensions before the server
+     * name, in a single record */
+    memset(buf, 0, sizeof(buf));
+    len = 9;
+    buf[len++] = 0x03; buf[len++] = 0x03;   /* version */
+    len += 32;                              /* random */
+    buf[len++] = 0x00;                      /* session id */
+    buf[len++] = 0x00; buf[len++] = 0x02;   /* cipher suites */
+    buf[len++] = 0x13; buf[len++] = 0x01;
+    buf[len++] = 0x01; buf[len++] = 0x00;   /* compression methods */
+    len += 2;                               /* extensions length */
+    size_t extensions = len;
+    while (len + 4 + sizeof(sni) <= MAX_INPUT) {
+        buf[len++] = 0xff; buf[len++] = 0x00;
+        buf[len++] = 0x00; buf[len++] = 0x00;
+    }
+    memcpy(buf + len, sni, sizeof(sni));
+    len += sizeof(sni);
+    hello_len = len - 9;
+    buf[0] = 0x16; buf[1] = 0x03; buf[2] = 0x01;
+    buf[3] = (uint8_t)((len - 5) >> 8); buf[4] = (uint8_t)(len - 5);
+    buf[5] = 0x01;
+    buf[6] = 0x00; buf[7] = (uint8_t)(hello_len >> 8); buf[8] = (uint8_t)hello_len;
+    buf[extensions - 2] = (uint8_t)((len - extensions) >> 8);
+    buf[extensions - 1] = (uint8_t)(len - extensions);
+    inputs[count++] = new_input("tls-many-extensions", buf, len);
+
+    /* Same client hello fragmented into one byte records */
+    {
+        uint8_t *records = malloc(MAX_INPUT);
+        size_t records_len = 0;
+
+        if (records == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        for (size_t pos = 5; pos < len && records_len + 6 <= MAX_INPUT; pos++) {
+            records[records_len++] = 0x16;
+            records[records_len++] = 0x03;
+            records[records_len++] = 0x01;
+            records[records_len++] = 0x00;
+            records[records_len++] = 0x01;
+            records[records_len++] = buf[pos];
+        }
+        inputs[count++] = new_input("tls-one-byte-records", records, records_len);
+        free(records);
+    }
+
+    /* Request with thousands of short headers before the Host header */
+    len = (size_t)snprintf((char *)buf, sizeof(buf), "GET / HTTP/1.1\r\n");
+    while (len + 6 + 21 <= MAX_INPUT) {
+        memcpy(buf + len, "a: b\r\n", 6);
+        len += 6;
+    }
+    memcpy(buf + len, "Host: localhost\r\n\r\n", 19);
+    len += 19;
+    inputs[count++] = new_input("http-many-headers", buf, len);
+
+    /* Request with a long request target */
+    len = (size_t)snprintf((char *)buf, sizeof(buf), "GET /");
+    while (len + 40 <= MAX_INPUT)
+        buf[len++] = 'a';
+    len += (size_t)snprintf((char *)buf + len, sizeof(buf) - len,
+            " HTTP/1.1\r\nHost: localhost\r\n\r\n");
+    inputs[count++] = new_input("http-long-target", buf, len);
+
+    return count;
+}
+
+static size_t
+read_inputs(struct Input *inputs, size_t max, char **paths, int path_count) {
+    static uint8_t buf[MAX_INPUT];
+    size_t count = 0;
+
+    for (int i = 0; i < path_count && count < max; i++) {
+        FILE *file = fopen(paths[i], "rb");
+        if (file == NULL) {
+            perror(paths[i]);
+            exit(1);
+        }
+        size_t len = fread(buf, 1, sizeof(buf), file);
+        fclose(file);
+
+        inputs[count++] = new_input(paths[i], buf, len);
+    }
+
+    return count;
+}
+
+static void
+benchmark(struct Input *inputs, size_t count) {
+    const struct Protocol *protocols[] = { tls_protocol, http_protocol };
+    const char *worst_name = NULL, *worst_protocol = NULL;
+    double worst = 0.0;
+
+    for (size_t i = 0; i < count; i++) {
+        for (size_t j = 0; j < sizeof(protocols) / sizeof(protocols[0]); j++) {
+            double whole = parse_cost(protocols[j], inputs[i].data,
+                    inputs[i].len, inputs[i].len > 0 ? inputs[i].len : 1);
+            double bytes = parse_cost(protocols[j], inputs[i].data,
+                    inputs[i].len, 1);
+
+            printf("%-4s %-40s %5zu bytes: %10.1f ns/parse, %10.1f ns/parse a byte at a time\n",
+                    protocols[j]->name, inputs[i].name, inputs[i].len,
+                    whole, bytes);
+
+            if (bytes > worst) {
+                worst = bytes;
+                worst_name = inputs[i].name;
+                worst_protocol = protocols[j]->name;
+            }
+        }
+    }
+
+    if (worst_name != NULL)
+        printf("worst: %s %s, %.1f ns/parse\n", worst_protocol, worst_name, worst);
+}
+
+static int
+compare_cost(const void *a, const void *b) {
+    const struct Input *x = a, *y = b;
+
+    return (x->cost < y->cost) - (x->cost > y->cost);
+}
+
+/*
+ * Cost guided search: keep the POPULATION most expensive inputs found,
+ * replacing the cheapest with mutations of the others which take longer to
+ * parse
+ */
+static void
+search(const struct Protocol *protocol, double seconds,
+        struct Input *seeds, size_t seed_count) {
+    struct Input population[POPULATION];
+    size_t size = 0;
+    struct timespec start, now;
+    unsigned long tried = 0, kept = 0;
+
+    for (size_t i = 0; i < seed_count && size < POPULATION; i++) {
+        population[size] = new_input(seeds[i].name, seeds[i].data, seeds[i].len);
+        population[size].cost = parse_cost(protocol, population[size].data,
+                population[size].len, 1);
+        size++;
+    }
+    assert(size > 1);
+    qsort(population, size, sizeof(population[0]), compare_cost);
+
+    uint8_t *candidate = malloc(MAX_INPUT);
+    if (candidate == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        /* Favour the most expensive inputs as parents */
+        size_t parent = (random_next() % size) * (random_next() % size) / size;
+        size_t len = population[parent].len;
+
+        memcpy(candidate, population[parent].data, len);
+        len = mutate(candidate, len, population, size);
+        check_input(candidate, len);
+
+        double cost = parse_cost(protocol, candidate, len, 1);
+        tried++;
+        if (cost > population[size - 1].cost) {
+            memcpy(population[size - 1].data, candidate, len);
+            population[size - 1].len = len;
+            population[size - 1].cost = cost;
+            population[size - 1].name = "mutated";
+            qsort(population, size, sizeof(population[0]), compare_cost);
+            kept++;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while (elapsed_ns(&start, &now) < seconds * 1e9);
+
+    printf("%lu inputs tried, %lu kept\n", tried, kept);
+    printf("worst: %s %zu bytes (%s), %.1f ns/parse a byte at a time, "
+            "%.1f ns/parse whole\n",
+            protocol->name, population[0].len, population[0].name,
+            population[0].cost,
+            parse_cost(protocol, population[0].data, population[0].len,
+                population[0].len > 0 ? population[0].len : 1));
+
+    FILE *file = fopen("worst-input", "wb");
+    if (file != NULL) {
+        fwrite(population[0].data, 1, population[0].len, file);
+        fclose(file);
+    } else {
+        perror("worst-input");
+    }
+
+    free(candidate);
+    for (size_t i = 0; i < size; i++)
+        free(population[i].data);
+}
+
+/*
+ * Apply a few random byte level edits, including duplicating and splicing
+ * ranges so repeated structures (extensions, headers) can grow
+ */
+static size_t
+mutate(uint8_t *data, size_t len, const struct Input *others, size_t other_count) {
+    int edits = 1 + (int)(random_next() % 4);
+
+    while (edits-- > 0) {
+        size_t pos = len > 0 ? random_next() % len : 0;
+        size_t span = 1 + random_next() % 64;
+
+        switch (random_next() % 6) {
+            case 0: /* replace a byte */
+                if (len > 0)
+                    data[pos] = (uint8_t)random_next();
+                break;
+            case 1: /* adjust a byte, such as a length */
+                if (len > 0)
+                    data[pos] = (uint8_t)(data[pos] + (random_next() % 9) - 4);
+                break;
+            case 2: /* insert a byte */
+                if (len < MAX_INPUT) {
+                    memmove(data + pos + 1, data + pos, len - pos);
+                    data[pos] = (uint8_t)random_next();
+                    len++;
+                }
+                break;
+            case 3: /* delete a range */
+                if (span > len - pos)
+                    span = len - pos;
+                memmove(data + pos, data + pos + span, len - pos - span);
+                len -= span;
+                break;
+            case 4: /* duplicate a range */
+                if (span > len - pos)
+                    span = len - pos;
+                if (len + span <= MAX_INPUT) {
+                    memmove(data + pos + span, data + pos, len - pos);
+                    len += span;
+                }
+                break;
+            case 5: { /* splice in a range of another input */
+                const struct Input *other = &others[random_next() % other_count];
+                size_t from = other->len > 0 ? random_next() % other->len : 0;
+
+                if (span > other->len - from)
+                    span = other->len - from;
+                if (span > len - pos)
+                    span = len - pos;
+                memmove(data + pos, other->data + from, span);
+                break;
+            }
+        }
+    }
+
+    return len;
+}
+
+/* xorshift32, fixed seed so runs are repeatable */
+static uint32_t
+random_next() {
+    static uint32_t x = 2463534242U;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+
+    return x;
+}
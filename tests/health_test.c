@@ -0,0 +1,296 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <ev.h>
+#include <assert.h>
+#include "health.h"
+#include "balancer.h"
+#include "table.h"
+#include "tls.h"
+
+/* Answers with the beginning of a server hello, or closes at once */
+struct TestServer {
+    int answer;
+    struct ev_io watcher;
+};
+
+
+static void test_hello();
+static void test_checks();
+static void test_ejection();
+static int listen_on(uint16_t);
+static uint16_t unused_port();
+static void start_server(struct TestServer *, int, int, struct ev_loop *);
+static void stop_server(struct TestServer *, struct ev_loop *);
+static void accept_cb(struct ev_loop *, struct ev_io *, int);
+static void timeout_cb(struct ev_loop *, struct ev_timer *, int);
+static void run_loop(struct ev_loop *, double);
+static struct Backend *pool_backend(const char *, uint16_t, uint16_t,
+        const char *);
+static const struct BackendServer *pool_server(const struct Backend *,
+        size_t);
+
+
+int main() {
+    test_hello();
+    test_checks();
+    test_ejection();
+
+    return 0;
+}
+
+/* The client hello of TLS checks is well formed and has no server name */
+static void
+test_hello() {
+    uint8_t hello[512];
+    struct ParseState state;
+
+    size_t len = build_health_check_hello(hello, sizeof(hello));
+    assert(len > 0);
+    assert(build_health_check_hello(hello, len - 1) == 0);
+
+    init_parse_state(&state);
+    assert(tls_protocol->parse_packet(&state, (char *)hello, len) == -2);
+    assert(state.hello.max_version == 0x0304);
+    assert(state.hello.cipher_count == 11);
+    assert(state.hello.extension_count == 5);
+    assert(state.hello.group_count == 3);
+}
+
+static void
+test_checks() {
+    struct ev_loop *loop = EV_DEFAULT;
+    struct Table_head tables = SLIST_HEAD_INITIALIZER(tables);
+    struct TestServer up, down, tls, silent;
+    uint16_t up_port = unused_port();
+    uint16_t down_port = unused_port();
+    uint16_t tls_port = unused_port();
+    uint16_t silent_port = unused_port();
+
+    start_server(&up, listen_on(up_port), 0, loop);
+    start_server(&tls, listen_on(tls_port), 1, loop);
+    start_server(&silent, listen_on(silent_port), 0, loop);
+
+    struct Table *table = new_table();
+    assert(table != NULL);
+    table_ref_get(table);
+    struct Backend *tcp_pool = pool_backend("^tcp$", up_port, down_port,
+            "check=tcp");
+    struct Backend *tls_pool = pool_backend("^tls$", tls_port, silent_port,
+            "check=tls");
+    add_backend(&table->backends, tcp_pool);
+    add_backend(&table->backends, tls_pool);
+    add_table(&tables, table);
+
+    start_health_checks(&tables, loop);
+    run_loop(loop, 0.5);
+
+    assert(pool_server(tcp_pool, 0)->healthy);
+    assert(!pool_server(tcp_pool, 1)->healthy);
+    assert(pool_server(tls_pool, 0)->healthy);
+    assert(!pool_server(tls_pool, 1)->healthy);
+
+    /* Servers failing checks are not chosen */
+    for (int i = 0; i < 10; i++)
+        assert(balancer_select(tcp_pool->balancer, NULL, NULL, 0) ==
+                pool_server(tcp_pool, 0));
+
+    /* Until every server is */
+    stop_server(&up, loop);
+    run_loop(loop, 0.5);
+    assert(!pool_server(tcp_pool, 0)->healthy);
+
+    int chosen[2] = { 0, 0 };
+    for (int i = 0; i < 10; i++)
+        chosen[balancer_select(tcp_pool->balancer, NULL, NULL, 0) ==
+            pool_server(tcp_pool, 1)]++;
+    assert(chosen[0] == 5 && chosen[1] == 5);
+
+    /* A server passing checks again is chosen again */
+    start_server(&down, listen_on(down_port), 0, loop);
+    run_loop(loop, 0.5);
+    assert(pool_server(tcp_pool, 1)->healthy);
+    assert(balancer_select(tcp_pool->balancer, NULL, NULL, 0) ==
+            pool_server(tcp_pool, 1));
+
+    /* Servers of pools no longer checked are taken to be healthy */
+    assert(balancer_set_check(tls_pool->balancer, "check=none"));
+    start_health_checks(&tables, loop);
+    assert(pool_server(tls_pool, 1)->healthy);
+    assert(pool_server(tls_pool, 1)->check == NULL);
+    assert(pool_server(tcp_pool, 0)->check != NULL);
+
+    stop_health_checks(loop);
+    assert(pool_server(tcp_pool, 0)->healthy);
+    assert(pool_server(tcp_pool, 0)->check == NULL);
+
+    stop_server(&down, loop);
+    stop_server(&tls, loop);
+    stop_server(&silent, loop);
+    free_tables(&tables);
+}
+
+/* Servers failing consecutive connections are left out for a while */
+static void
+test_ejection() {
+    struct ev_loop *loop = EV_DEFAULT;
+    struct Backend_head backends = STAILQ_HEAD_INITIALIZER(backends);
+    struct Backend *backend = new_backend();
+    const char *args[] = {
+        "^eject$", "192.0.2.1", "192.0.2.2", "eject=2", "eject_time=0.1",
+    };
+
+    assert(backend != NULL);
+    for (size_t i = 0; i < sizeof(args) / sizeof(args[0]); i++)
+        assert(accept_backend_arg(backend, args[i]) > 0);
+    add_backend(&backends, backend);
+
+    struct BackendServer *server = backend->balancer->members[0].server;
+
+    /* A successful connection resets the count of failures */
+    report_server_connect(server, 0, loop);
+    report_server_connect(server, 1, loop);
+    report_server_connect(server, 0, loop);
+    assert(!server->ejected);
+
+    report_server_connect(server, 0, loop);
+    assert(server->ejected);
+    for (int i = 0; i < 10; i++)
+        assert(balancer_select(backend->balancer, NULL, NULL, 0) ==
+                pool_server(backend, 1));
+
+    run_loop(loop, 0.3);
+    assert(!server->ejected);
+    assert(server->connect_failures == 0);
+
+    /* Ejection is disabled by eject=0 */
+    assert(balancer_set_retry(backend->balancer, "eject=0"));
+    for (int i = 0; i < 10; i++)
+        report_server_connect(server, 0, loop);
+    assert(!server->ejected);
+
+    /* Stopping the checks readmits ejected servers at once */
+    assert(balancer_set_retry(backend->balancer, "eject=1"));
+    report_server_connect(server, 0, loop);
+    assert(server->ejected);
+    stop_health_checks(loop);
+    assert(!server->ejected);
+
+    remove_backend(&backends, backend);
+}
+
+static int
+listen_on(uint16_t port) {
+    struct sockaddr_in addr;
+    int on = 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(sockfd >= 0);
+    assert(setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == 0);
+    assert(bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    assert(listen(sockfd, 8) == 0);
+
+    return sockfd;
+}
+
+/* A port nothing is listening on */
+static uint16_t
+unused_port() {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int sockfd = listen_on(0);
+
+    assert(getsockname(sockfd, (struct sockaddr *)&addr, &len) == 0);
+    close(sockfd);
+
+    return ntohs(addr.sin_port);
+}
+
+static void
+start_server(struct TestServer *server, int sockfd, int answer,
+        struct ev_loop *loop) {
+    server->answer = answer;
+    ev_io_init(&server->watcher, accept_cb, sockfd, EV_READ);
+    server->watcher.data = server;
+    ev_io_start(loop, &server->watcher);
+}
+
+static void
+stop_server(struct TestServer *server, struct ev_loop *loop) {
+    ev_io_stop(loop, &server->watcher);
+    close(server->watcher.fd);
+}
+
+static void
+accept_cb(struct ev_loop *loop __attribute__((unused)), struct ev_io *w,
+        int revents) {
+    static const uint8_t server_hello[] = {
+        0x16, 0x03, 0x03, 0x00, 0x04, 0x02, 0x00, 0x00, 0x00,
+    };
+    struct TestServer *server = (struct TestServer *)w->data;
+
+    if (revents & EV_READ) {
+        int sockfd = accept(w->fd, NULL, NULL);
+        if (sockfd < 0)
+            return;
+
+        if (server->answer)
+            assert(send(sockfd, server_hello, sizeof(server_hello), 0) ==
+                    sizeof(server_hello));
+        close(sockfd);
+    }
+}
+
+static void
+timeout_cb(struct ev_loop *loop, struct ev_timer *w __attribute__((unused)),
+        int revents) {
+    if (revents & EV_TIMER)
+        ev_break(loop, EVBREAK_ALL);
+}
+
+static void
+run_loop(struct ev_loop *loop, double seconds) {
+    struct ev_timer timeout;
+
+    ev_timer_init(&timeout, timeout_cb, seconds, 0.0);
+    ev_timer_start(loop, &timeout);
+    ev_run(loop, 0);
+    ev_timer_stop(loop, &timeout);
+}
+
+/* Two servers on the loopback address, checked every 20ms */
+static struct Backend *
+pool_backend(const char *pattern, uint16_t port1, uint16_t port2,
+        const char *check) {
+    char address1[32], address2[32];
+    struct Backend *backend = new_backend();
+
+    assert(backend != NULL);
+    snprintf(address1, sizeof(address1), "127.0.0.1:%u", port1);
+    snprintf(address2, sizeof(address2), "127.0.0.1:%u", port2);
+
+    const char *args[] = {
+        pattern, address1, address2, check, "check_interval=0.02",
+        "check_rise=2", "check_fall=2", "check_jitter=0",
+    };
+    for (size_t i = 0; i < sizeof(args) / sizeof(args[0]); i++)
+        assert(accept_backend_arg(backend, args[i]) > 0);
+
+    return backend;
+}
+
+static const struct BackendServer *
+pool_server(const struct Backend *backend, size_t i) {
+    assert(i < backend->balancer->len);
+
+    return backend->balancer->members[i].server;
+}
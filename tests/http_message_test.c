@@ -0,0 +1,225 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include "http_message.h"
+
+/* Appended to each message to check parsing stops at its end */
+static const char next_request[] = "GET /next HTTP/1.1\r\nHost: localhost\r\n\r\n";
+
+static const struct message {
+    int response;
+    int no_body;
+    const char *message;
+    int flags;          /* -1 if the message can not be framed */
+} messages[] = {
+    { 0, 0,
+        "GET / HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "\r\n",
+        HTTP_MESSAGE_HEADERS | HTTP_MESSAGE_COMPLETE },
+    { 0, 0,
+        "\r\n"
+        "HEAD / HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "\r\n",
+        HTTP_MESSAGE_HEADERS | HTTP_MESSAGE_COMPLETE | HTTP_MESSAGE_HEAD },
+    { 0, 0,
+        "POST /form HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "Content-Length:  11 \r\n"
+        "\r\n"
+        "hello=world",
+        HTTP_MESSAGE_HEADERS | HTTP_MESSAGE_COMPLETE },
+    { 0, 0,
+        "POST /upload HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "Transfer-Encoding: gzip, Chunked\r\n"
+        "\r\n"
+        "5;name=value\r\n"
+        "hello\r\n"
+        "1A\r\n"
+        "abcdefghijklmnopqrstuvwxyz\r\n"
+        "0\r\n"
+        "Trailer: value\r\n"
+        "\r\n",
+        HTTP_MESSAGE_HEADERS | HTTP_MESSAGE_COMPLETE },
+    { 0, 0,
+        "GET / HTTP/1.0\r\n"
+        "Host: localhost\r\n"
+        "\r\n",
+        HTTP_MESSAGE_HEADERS | HTTP_MESSAGE_COMPLETE | HTTP_MESSAGE_CLOSE },
+    { 0, 0,
+        "GET / HTTP/1.0\r\n"
+        "Host: localhost\r\n"
+        "Connection: Keep-Alive\r\n"
+        "\r\n",
+        HTTP_MESSAGE_HEADERS | HTTP_MESSAGE_COMPLETE },
+    { 0, 0,
+        "GET / HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "Connection: TE, close\r\n"
+        "\r\n",
+        HTTP_MESSAGE_HEADERS | HTTP_MESSAGE_COMPLETE | HTTP_MESSAGE_CLOSE },
+    { 0, 0,
+        "CONNECT localhost:443 HTTP/1.1\r\n"
+        "Host: localhost:443\r\n"
+        "\r\n",
+        HTTP_MESSAGE_HEADERS | HTTP_MESSAGE_COMPLETE | HTTP_MESSAGE_UPGRADE },
+    { 1, 0,
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Length: 5\r\n"
+        "\r\n"
+        "hello",
+        HTTP_MESSAGE_HEADERS | HTTP_MESSAGE_COMPLETE },
+    { 1, 1,
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Length: 5\r\n"
+        "\r\n",
+        HTTP_MESSAGE_HEADERS | HTTP_MESSAGE_COMPLETE },
+    { 1, 0,
+        "HTTP/1.1 100 Continue\r\n"
+        "\r\n"
+        "HTTP/1.1 204 No Content\r\n"
+        "\r\n",
+        HTTP_MESSAGE_HEADERS | HTTP_MESSAGE_COMPLETE },
+    { 1, 0,
+        "HTTP/1.1 304 Not Modified\r\n"
+        "Content-Length: 100\r\n"
+        "\r\n",
+        HTTP_MESSAGE_HEADERS | HTTP_MESSAGE_COMPLETE },
+    { 1, 0,
+        "HTTP/1.1 200 OK\r\n"
+        "Transfer-Encoding: chunked\r\n"
+        "Content-Length: 100\r\n"
+        "Connection: close\r\n"
+        "\r\n"
+        "3\r\n"
+        "abc\r\n"
+        "0\r\n"
+        "\r\n",
+        HTTP_MESSAGE_HEADERS | HTTP_MESSAGE_COMPLETE | HTTP_MESSAGE_CLOSE },
+    { 1, 0,
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Connection: Upgrade\r\n"
+        "Upgrade: websocket\r\n"
+        "\r\n",
+        HTTP_MESSAGE_HEADERS | HTTP_MESSAGE_COMPLETE | HTTP_MESSAGE_UPGRADE },
+    /* Request smuggling: the body could be framed two ways */
+    { 0, 0,
+        "POST / HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "Content-Length: 4\r\n"
+        "Transfer-Encoding: chunked\r\n"
+        "\r\n",
+        -1 },
+    { 0, 0,
+        "POST / HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "Content-Length: 4\r\n"
+        "Content-Length: 5\r\n"
+        "\r\n",
+        -1 },
+    { 0, 0,
+        "POST / HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "Transfer-Encoding: chunked, gzip\r\n"
+        "\r\n",
+        -1 },
+    { 0, 0,
+        "POST / HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "Content-Length: -1\r\n"
+        "\r\n",
+        -1 },
+    { 0, 0,
+        "POST / HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "Transfer-Encoding: chunked\r\n"
+        "\r\n"
+        "fffffffffffffffff\r\n",
+        -1 },
+    { 0, 0,
+        "GET / HTTP/2.0\r\n"
+        "\r\n",
+        -1 },
+    { 1, 0,
+        "HTTP/1.1 OK\r\n"
+        "\r\n",
+        -1 },
+};
+
+/*
+ * Parse a message followed by another request, passing it to the parser in
+ * chunks of chunk_len bytes, and return the number of bytes consumed or -1
+ */
+static ssize_t
+parse_chunked(struct HTTPMessage *message, const struct message *test,
+        size_t chunk_len) {
+    char data[1024];
+    size_t len = strlen(test->message);
+    ssize_t consumed = 0;
+
+    assert(len + sizeof(next_request) <= sizeof(data));
+    memcpy(data, test->message, len);
+    memcpy(data + len, next_request, sizeof(next_request));
+    len += sizeof(next_request) - 1;
+
+    init_http_message(message, test->response);
+    message->no_body = test->no_body;
+
+    for (size_t pos = 0; pos < len; pos += chunk_len) {
+        size_t n = len - pos < chunk_len ? len - pos : chunk_len;
+        ssize_t result = parse_http_message(message, data + pos, n);
+
+        if (result < 0)
+            return -1;
+
+        consumed += result;
+        if ((size_t)result < n)
+            break;
+    }
+
+    return consumed;
+}
+
+static void
+test_messages() {
+    for (size_t i = 0; i < sizeof(messages) / sizeof(struct message); i++) {
+        size_t len = strlen(messages[i].message);
+
+        for (size_t chunk_len = 1; chunk_len <= len + 1; chunk_len++) {
+            struct HTTPMessage message;
+            ssize_t consumed = parse_chunked(&message, &messages[i], chunk_len);
+
+            if (messages[i].flags < 0) {
+                assert(consumed == -1);
+            } else {
+                assert(consumed == (ssize_t)len);
+                assert(message.flags == messages[i].flags);
+            }
+        }
+    }
+}
+
+/* A response delimited by the connection closing never completes */
+static void
+test_close_delimited() {
+    const char response[] = "HTTP/1.0 200 OK\r\n\r\nbody";
+    struct HTTPMessage message;
+
+    init_http_message(&message, 1);
+    assert(parse_http_message(&message, response, sizeof(response) - 1) ==
+            sizeof(response) - 1);
+    assert(message.flags == (HTTP_MESSAGE_HEADERS | HTTP_MESSAGE_CLOSE));
+
+    assert(parse_http_message(&message, next_request,
+                sizeof(next_request) - 1) == sizeof(next_request) - 1);
+    assert(!(message.flags & HTTP_MESSAGE_COMPLETE));
+}
+
+int main() {
+    test_messages();
+    test_close_delimited();
+
+    return 0;
+}
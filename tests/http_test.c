@@ -2,7 +2,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <time.h>
 #include "http.h"
+#include "http2.h"
+#include "protocol.h"
 
 static const char *good[] = {
     "GET / HTTP/1.1\r\n"
@@ -20,6 +23,116 @@ static const char *good[] = {
         "HOST:\t     localhost:8080\r\n"
         "Accept: */*\r\n"
         "\r\n",
+    "GET http://localhost/index.html HTTP/1.1\r\n"
+        "Host: example.com\r\n"
+        "\r\n",
+    "GET https://user@localhost:8443?query HTTP/1.1\r\n"
+        "\r\n",
+    "PRI * HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "\r\n",
+};
+static const struct normalized_request {
+    const char *request;
+    const char *hostname;
+    int flags;
+} normalized[] = {
+    {
+        "GET / HTTP/1.1\r\n"
+            "Host: LocalHost\r\n"
+            "\r\n",
+        "localhost",
+        HOSTNAME_LOWERCASED,
+    },
+    {
+        "GET / HTTP/1.1\r\n"
+            "Host: [2001:DB8::1]:8080 \r\n"
+            "\r\n",
+        "[2001:db8::1]",
+        HOSTNAME_LOWERCASED | HOSTNAME_PORT_REMOVED,
+    },
+    {
+        "GET / HTTP/1.1\r\n"
+            "Host: local host\r\n"
+            "\r\n",
+        "local host",
+        HOSTNAME_INVALID_CHARS,
+    },
+};
+#define H2_REQUEST(r) r, sizeof(r) - 1
+
+static const struct h2_request {
+    const char *request;
+    size_t len;
+    int result;
+    const char *hostname;
+} h2_requests[] = {
+    /* curl --http2-prior-knowledge */
+    {
+        H2_REQUEST(HTTP2_PREFACE
+            "\x00\x00\x12\x04\x00\x00\x00\x00\x00\x00\x03\x00\x00\x00\x64\x00"
+            "\x04\x02\x00\x00\x00\x00\x02\x00\x00\x00\x00\x00\x00\x04\x08\x00"
+            "\x00\x00\x00\x00\x01\xff\x00\x01\x00\x00\x39\x01\x05\x00\x00\x00"
+            "\x01\x82\x04\x95\x62\x72\xd1\x41\xfc\x1e\xca\x24\x5f\x15\x85\x2a"
+            "\x4b\x63\x1b\x87\xeb\x19\x68\xa0\xff\x86\x41\x8f\x9a\xca\xc8\xb9"
+            "\x7c\x8e\x9a\xe8\x2a\xe4\x3d\x37\x1f\x03\xc0\x7a\x88\x25\xb6\x50"
+            "\xc3\xab\xbc\xf2\xe1\x53\x03\x2a\x2f\x2a"),
+        16, "grpc.example.com",
+    },
+    /* Literal name and value */
+    {
+        H2_REQUEST(HTTP2_PREFACE
+            "\x00\x00\x06\x04\x00\x00\x00\x00\x00\x00\x03\x00\x00\x00\x64\x00"
+            "\x00\x19\x01\x05\x00\x00\x00\x01\x82\x86\x84\x00\x0a\x3a\x61\x75"
+            "\x74\x68\x6f\x72\x69\x74\x79\x09\x6c\x6f\x63\x61\x6c\x68\x6f\x73"
+            "\x74"),
+        9, "localhost",
+    },
+    /* Padded, with priority and continued part way through the authority */
+    {
+        H2_REQUEST(HTTP2_PREFACE
+            "\x00\x00\x06\x04\x00\x00\x00\x00\x00\x00\x03\x00\x00\x00\x64\x00"
+            "\x00\x04\x08\x00\x00\x00\x00\x00\x00\x00\x00\x01\x00\x00\x0e\x01"
+            "\x28\x00\x00\x00\x01\x03\x00\x00\x00\x00\x10\x82\x86\x84\x41\x86"
+            "\x00\x00\x00\x00\x00\x0b\x09\x04\x00\x00\x00\x01\xa0\xe4\x1d\x13"
+            "\x9d\x09\x7a\x83\x49\x50\x9f"),
+        9, "localhost",
+    },
+    /* Host header field, never indexed */
+    {
+        H2_REQUEST(HTTP2_PREFACE
+            "\x00\x00\x06\x04\x00\x00\x00\x00\x00\x00\x03\x00\x00\x00\x64\x00"
+            "\x00\x13\x01\x05\x00\x00\x00\x01\x82\x86\x84\x10\x83\x9c\xe8\x4f"
+            "\x8a\xce\x72\x0e\x8c\x67\x42\x6e\x3c\x07\x81"),
+        9, "localhost",
+    },
+    /* Empty authority */
+    {
+        H2_REQUEST(HTTP2_PREFACE
+            "\x00\x00\x06\x04\x00\x00\x00\x00\x00\x00\x03\x00\x00\x00\x64\x00"
+            "\x00\x05\x01\x05\x00\x00\x00\x01\x82\x86\x84\x41\x00"),
+        -2, NULL,
+    },
+    /* Frame larger than the default maximum frame size */
+    {
+        H2_REQUEST(HTTP2_PREFACE
+            "\x00\x40\x01\x04\x00\x00\x00\x00\x00"),
+        -5, NULL,
+    },
+    /* Header block not continued */
+    {
+        H2_REQUEST(HTTP2_PREFACE
+            "\x00\x00\x03\x01\x00\x00\x00\x00\x01\x82\x86\x84\x00\x00\x00\x04"
+            "\x00\x00\x00\x00\x00"),
+        -5, NULL,
+    },
+    /* Huffman padding is not the EOS code */
+    {
+        H2_REQUEST(HTTP2_PREFACE
+            "\x00\x00\x0b\x01\x05\x00\x00\x00\x01\x82\x41\x88\x2f\x91\xd3\x5d"
+            "\x05\x5c\x87\xa6"),
+        -5, NULL,
+    },
 };
 static const char *bad[] = {
     "GET / HTTP/1.0\r\n"
@@ -40,35 +153,243 @@ static const char *bad[] = {
         "\r\n",
 };
 
-int main() {
+/*
+ * Parse a request delivered in chunks of chunk_len bytes, or of random
+ * lengths if chunk_len is zero
+ */
+static int
+parse_chunked(struct ParseState *state, const char *request, size_t len, size_t chunk_len) {
+    int result = -1;
+
+    init_parse_state(state);
+
+    for (size_t pos = 0; pos < len && result == -1;) {
+        size_t n = chunk_len ? chunk_len : (size_t)(rand() % 40) + 1;
+        if (n > len - pos)
+            n = len - pos;
+
+        result = http_protocol->parse_packet(state, request + pos, n);
+        pos += n;
+    }
+
+    return result;
+}
+
+/*
+ * Build a random request from fragments likely to exercise the parser
+ */
+static size_t
+random_request(char *request, size_t size) {
+    static const char *fragments[] = {
+        "GET ", "/ ", "http://", "HTTPS://", "user@", "HTTP/1.1",
+        "\r\n", "\n", "\r", " ", "\t", ":", "@", "/",
+        "Host:", "host: ", "HOST:\t", "Hostname: ", "X-Host: ",
+        "localhost", "LocalHost", "example.com", ":8080", "[::1]",
+        "Cookie: 0123456789abcdef0123456789abcdef0123456789abcdef",
+        "Accept: */*", HTTP2_PREFACE, "\x00\x00\x05\x01\x05\x00\x00\x00\x01",
+    };
+    size_t len = 0;
+    int count = rand() % 32;
+
+    for (int i = 0; i < count; i++) {
+        const char *fragment = fragments[rand() % (sizeof(fragments) / sizeof(const char *))];
+        size_t fragment_len = strlen(fragment);
+
+        if (len + fragment_len >= size)
+            break;
+
+        memcpy(request + len, fragment, fragment_len);
+        len += fragment_len;
+    }
+
+    return len;
+}
+
+/*
+ * A hostname of the longest length is accepted with a port and trailing
+ * whitespace, which are removed, but no longer hostname is
+ */
+static void
+test_hostname_length() {
+    static const struct {
+        const char *before, *after;
+        size_t name_len;
+        int result;
+    } requests[] = {
+        { "GET / HTTP/1.1\r\nHost: ", "\r\n\r\n", 255, 255 },
+        { "GET / HTTP/1.1\r\nHost: ", ":8443\r\n\r\n", 253, 253 },
+        { "GET / HTTP/1.1\r\nHost: ", ":65535 \t \r\n\r\n", 255, 255 },
+        { "GET http://", ":8443/ HTTP/1.1\r\n\r\n", 255, 255 },
+        { "GET / HTTP/1.1\r\nHost: ", "\r\n\r\n", 256, -5 },
+        { "GET / HTTP/1.1\r\nHost: ", ":8443 x\r\n\r\n", 255, -5 },
+        { "GET / HTTP/1.1\r\nHost: ", ":123456\r\n\r\n", 255, -5 },
+        { "GET http://", "/ HTTP/1.1\r\n\r\n", 256, -5 },
+    };
+
+    for (size_t i = 0; i < sizeof(requests) / sizeof(requests[0]); i++) {
+        char request[512];
+        size_t len = strlen(requests[i].before);
+        struct ParseState state;
+
+        memcpy(request, requests[i].before, len);
+        memset(request + len, 'a', requests[i].name_len);
+        len += requests[i].name_len;
+        strcpy(request + len, requests[i].after);
+        len += strlen(requests[i].after);
+
+        assert(parse_chunked(&state, request, len, len) == requests[i].result);
+        assert(parse_chunked(&state, request, len, 1) == requests[i].result);
+        if (requests[i].result >= 0)
+            assert(strspn(state.hostname, "a") == requests[i].name_len &&
+                    state.hostname[requests[i].name_len] == '\0');
+    }
+}
+
+/*
+ * The whole request parse takes the vectorized newline search, compare it
+ * against byte at a time delivery which can only use the scalar search
+ */
+static void
+test_equivalence() {
+    srand(1);
+
+    for (int i = 0; i < 100000; i++) {
+        char request[1024];
+        size_t len = random_request(request, sizeof(request));
+        struct ParseState whole, scalar, chunked;
+
+        int result = parse_chunked(&whole, request, len, len ? len : 1);
+
+        assert(parse_chunked(&scalar, request, len, 1) == result);
+        assert(parse_chunked(&chunked, request, len, 0) == result);
+
+        if (result >= 0) {
+            assert(strcmp(whole.hostname, scalar.hostname) == 0);
+            assert(strcmp(whole.hostname, chunked.hostname) == 0);
+            assert(whole.hostname_flags == scalar.hostname_flags);
+            assert(whole.hostname_flags == chunked.hostname_flags);
+        }
+    }
+}
+
+/*
+ * Report the parse time of each request in the corpus, and of one with a
+ * large cookie header before the Host header
+ */
+static void
+benchmark() {
+    static char large_request[8192];
+    const char *requests[sizeof(good) / sizeof(const char *) + 1];
+    size_t request_count = 0;
+    size_t len;
+
+    for (size_t i = 0; i < sizeof(good) / sizeof(const char *); i++)
+        requests[request_count++] = good[i];
+
+    len = (size_t)snprintf(large_request, sizeof(large_request),
+            "GET / HTTP/1.1\r\nCookie: ");
+    while (len < sizeof(large_request) - 64)
+        large_request[len++] = 'c';
+    snprintf(large_request + len, sizeof(large_request) - len,
+            "\r\nHost: localhost\r\n\r\n");
+    requests[request_count++] = large_request;
+
+    for (size_t i = 0; i < request_count; i++) {
+        struct ParseState state;
+        struct timespec start, end;
+        const int iterations = 100000;
+        int result = 0;
+
+        len = strlen(requests[i]);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int j = 0; j < iterations; j++) {
+            init_parse_state(&state);
+            result += http_protocol->parse_packet(&state, requests[i], len);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        assert(result == 9 * iterations);
+
+        printf("request %zu (%zu bytes): %.1f ns/parse\n", i, len,
+                ((double)(end.tv_sec - start.tv_sec) * 1e9 +
+                 (double)(end.tv_nsec - start.tv_nsec)) / iterations);
+    }
+}
+
+int main(int argc, char **argv) {
     unsigned int i;
     int result;
-    char *hostname;
+    struct ParseState state;
+
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        benchmark();
+        return 0;
+    }
+
+    for (i = 0; i < sizeof(good) / sizeof(const char *); i++) {
+        init_parse_state(&state);
+        result = http_protocol->parse_packet(&state, good[i], strlen(good[i]));
 
+        assert(result == 9);
+
+        assert(0 == strcmp("localhost", state.hostname));
+    }
+
+    /* One byte at a time */
     for (i = 0; i < sizeof(good) / sizeof(const char *); i++) {
-        hostname = NULL;
+        size_t len = strlen(good[i]);
 
-        result = http_protocol->parse_packet(good[i], strlen(good[i]), &hostname);
+        result = -1;
+
+        init_parse_state(&state);
+        for (size_t j = 0; j < len && result == -1; j++)
+            result = http_protocol->parse_packet(&state, good[i] + j, 1);
 
         assert(result == 9);
 
-        assert(NULL != hostname);
+        assert(0 == strcmp("localhost", state.hostname));
+    }
+
+    /* Normalization */
+    for (i = 0; i < sizeof(normalized) / sizeof(struct normalized_request); i++) {
+        init_parse_state(&state);
+        result = http_protocol->parse_packet(&state, normalized[i].request,
+                strlen(normalized[i].request));
+
+        assert(result == (int)strlen(normalized[i].hostname));
 
-        assert(0 == strcmp("localhost", hostname));
+        assert(0 == strcmp(normalized[i].hostname, state.hostname));
 
-        free(hostname);
+        assert(state.hostname_flags == normalized[i].flags);
     }
 
-    for (i = 0; i < sizeof(bad) / sizeof(const char *); i++) {
-        hostname = NULL;
+    /* HTTP/2 with prior knowledge, whole and a byte at a time */
+    for (i = 0; i < sizeof(h2_requests) / sizeof(struct h2_request); i++) {
+        for (size_t chunk_len = 1; chunk_len <= h2_requests[i].len;
+                chunk_len = chunk_len == 1 ? h2_requests[i].len : chunk_len + 1) {
+            result = parse_chunked(&state, h2_requests[i].request,
+                    h2_requests[i].len, chunk_len);
 
-        result = http_protocol->parse_packet(bad[i], strlen(bad[i]), &hostname);
+            if (h2_requests[i].result < -4)
+                assert(result < -4);
+            else
+                assert(result == h2_requests[i].result);
 
-        assert(result < 0);
+            if (h2_requests[i].hostname != NULL)
+                assert(0 == strcmp(h2_requests[i].hostname, state.hostname));
+        }
+    }
+
+    for (i = 0; i < sizeof(bad) / sizeof(const char *); i++) {
+        init_parse_state(&state);
+        result = http_protocol->parse_packet(&state, bad[i], strlen(bad[i]));
 
-        assert(hostname == NULL);
+        assert(result < 0);
     }
 
+    test_hostname_length();
+    test_equivalence();
+
     return 0;
 }
-
@@ -0,0 +1,312 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#define PCRE2_CODE_UNIT_WIDTH 8
+#include <pcre2.h>
+#include "pattern_set.h"
+
+#define RANDOM_SETS 3000
+#define RANDOM_PATTERNS 6
+#define RANDOM_NAMES 40
+
+
+static const char *supported[] = {
+    "^www\\.example\\.com$",
+    "^(api|www)[0-9]+\\.example\\.com$",
+    "\\.example\\.net$",
+    "^(?:.*\\.)?example\\.org$",
+    "^[^.]+\\.example\\.info$",
+    "^[]a-c-]x$",
+    "^\\d{2,3}\\.\\w+\\S?$",
+    "^a{2}b{1,}c{0,2}?$",
+    "localhost",
+    "x|^y$|z\\Z",
+    "\\Aexample\\.test",
+    "",
+    "(a|)*$",
+    "[\\d.-]+$",
+    "^\\e\\t[\\]]?",
+    "^WWW\\.Example\\.(com|NET)$",
+    "^[^A-C]X$",
+    "^[B-Y]+$",
+};
+
+static const char *unsupported[] = {
+    "^(a)\\1$",                 /* back reference */
+    "^foo(?=bar)",              /* lookahead */
+    "(?i)example\\.com",        /* option setting */
+    "^a*+b",                    /* possessive quantifier */
+    "\\bexample",               /* word boundary */
+    "a{,3}",                    /* brace forms literal in older PCRE */
+    "x{1000}",                  /* too many repetitions */
+    "a$b",                      /* $ followed by more of the pattern */
+    "a$^",
+    "[[:alpha:]]",              /* POSIX class */
+    "\\x41",                    /* hexadecimal escape */
+    "(?<name>a)",               /* named group */
+};
+
+static const char *names[] = {
+    "www.example.com",
+    "www.example.com\n",
+    "www.example.com\n\n",
+    "api42.example.com",
+    "ftp1.example.com",
+    "x.example.net",
+    "example.net",
+    "example.org",
+    "a.b.example.org",
+    "host.example.info",
+    "a.host.example.info",
+    "]x",
+    "-x",
+    "bx",
+    "12.abc",
+    "1234.abc",
+    "12.abc!",
+    "aabcc",
+    "aabbbccc",
+    "localhost.localdomain",
+    "y",
+    "y\n",
+    "yy",
+    "z",
+    "z\n",
+    "example.test",
+    "a.example.test",
+    "aaa",
+    "1-2.3",
+    "\x1b\t",
+    "\x1b\tx",
+    "",
+    "\n",
+    "www.example.net",
+    "WWW.EXAMPLE.COM",
+    "ax",
+    "dx",
+    "DX",
+    "xyz",
+};
+
+
+static int pcre_first_match(pcre2_code **, size_t, const char *, size_t);
+static pcre2_code *compile(const char *);
+static void test_supported();
+static void test_unsupported();
+static void test_random();
+static void test_cache_flush();
+static void random_pattern(char *, size_t, int);
+static size_t random_name(char *, size_t);
+
+
+int main() {
+    test_supported();
+    test_unsupported();
+    test_random();
+    test_cache_flush();
+
+    return 0;
+}
+
+/* The first of the patterns to match, evaluating each in turn */
+static int
+pcre_first_match(pcre2_code **patterns, size_t len, const char *name,
+        size_t name_len) {
+    for (size_t i = 0; i < len; i++) {
+        pcre2_match_data *data =
+            pcre2_match_data_create_from_pattern(patterns[i], NULL);
+        assert(data != NULL);
+
+        int rc = pcre2_match(patterns[i], (PCRE2_SPTR)name, name_len, 0, 0,
+                data, NULL);
+        pcre2_match_data_free(data);
+        if (rc >= 0)
+            return (int)i;
+    }
+
+    return PATTERN_SET_NO_MATCH;
+}
+
+static pcre2_code *
+compile(const char *pattern) {
+    int error;
+    PCRE2_SIZE offset;
+
+    return pcre2_compile((PCRE2_SPTR)pattern, PCRE2_ZERO_TERMINATED,
+            PCRE2_CASELESS, &error, &offset, NULL);
+}
+
+/* Every suffix of the list of patterns agrees with PCRE on every name */
+static void
+test_supported() {
+    size_t len = sizeof(supported) / sizeof(supported[0]);
+    pcre2_code *patterns[sizeof(supported) / sizeof(supported[0])];
+
+    for (size_t first = 0; first < len; first++) {
+        struct PatternSet *set = new_pattern_set();
+        assert(set != NULL);
+
+        for (size_t i = first; i < len; i++) {
+            patterns[i] = compile(supported[i]);
+            assert(patterns[i] != NULL);
+            assert(pattern_set_add(set, supported[i]) == (int)(i - first));
+        }
+
+        for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+            size_t name_len = strlen(names[i]);
+
+            assert(pattern_set_match(set, names[i], name_len) ==
+                    pcre_first_match(patterns + first, len - first,
+                        names[i], name_len));
+        }
+
+        for (size_t i = first; i < len; i++)
+            pcre2_code_free(patterns[i]);
+        free_pattern_set(set);
+    }
+}
+
+static void
+test_unsupported() {
+    struct PatternSet *set = new_pattern_set();
+    assert(set != NULL);
+
+    assert(pattern_set_match(set, "example.com", 11) == PATTERN_SET_NO_MATCH);
+
+    for (size_t i = 0; i < sizeof(unsupported) / sizeof(unsupported[0]); i++) {
+        pcre2_code *re = compile(unsupported[i]);
+        assert(re != NULL);
+        pcre2_code_free(re);
+
+        assert(pattern_set_add(set, unsupported[i]) == -1);
+    }
+
+    /* Rejected patterns leave the set usable */
+    assert(pattern_set_add(set, "^example\\.com$") == 0);
+    assert(pattern_set_match(set, "example.com", 11) == 0);
+    assert(pattern_set_match(set, "example.org", 11) == PATTERN_SET_NO_MATCH);
+
+    free_pattern_set(set);
+}
+
+/* Sets of random patterns over a small alphabet against random names */
+static void
+test_random() {
+    srandom(1);
+
+    for (int n = 0; n < RANDOM_SETS; n++) {
+        struct PatternSet *set = new_pattern_set();
+        pcre2_code *patterns[RANDOM_PATTERNS];
+        size_t len = 0;
+
+        assert(set != NULL);
+
+        for (int i = 0; i < RANDOM_PATTERNS; i++) {
+            char pattern[64];
+
+            random_pattern(pattern, sizeof(pattern), 3);
+            pcre2_code *re = compile(pattern);
+            if (re == NULL)
+                continue;
+
+            if (pattern_set_add(set, pattern) < 0) {
+                pcre2_code_free(re);
+                continue;
+            }
+            patterns[len++] = re;
+        }
+
+        for (int i = 0; i < RANDOM_NAMES; i++) {
+            char name[16];
+            size_t name_len = random_name(name, sizeof(name));
+
+            assert(pattern_set_match(set, name, name_len) ==
+                    pcre_first_match(patterns, len, name, name_len));
+        }
+
+        for (size_t i = 0; i < len; i++)
+            pcre2_code_free(patterns[i]);
+        free_pattern_set(set);
+    }
+}
+
+/* A pattern needing a DFA state for each of 2^13 suffixes of the name */
+static void
+test_cache_flush() {
+    const char *pattern = "a[ab]{12}$";
+    struct PatternSet *set = new_pattern_set();
+    pcre2_code *re = compile(pattern);
+
+    assert(set != NULL && re != NULL);
+    assert(pattern_set_add(set, pattern) == 0);
+
+    for (int i = 0; i < 2000; i++) {
+        char name[32];
+
+        for (size_t j = 0; j < sizeof(name); j++)
+            name[j] = random() % 2 ? 'a' : 'b';
+
+        assert(pattern_set_match(set, name, sizeof(name)) ==
+                pcre_first_match(&re, 1, name, sizeof(name)));
+    }
+
+    pcre2_code_free(re);
+    free_pattern_set(set);
+}
+
+static void
+random_pattern(char *pattern, size_t size, int depth) {
+    static const char *atoms[] = {
+        "a", "b", ".", "\\.", "[ab]", "[^a]", "\\d", "\\n", "^", "$",
+        "A", "[^B]",
+    };
+    static const char *quantifiers[] = {
+        "*", "+", "?", "{2}", "{1,2}", "{0,}", "*?",
+    };
+    size_t len = 0;
+    int count = 1 + random() % 4;
+
+    pattern[0] = '\0';
+    for (int i = 0; i < count; i++) {
+        char atom[64];
+
+        if (depth > 0 && random() % 4 == 0) {
+            char inner[32];
+
+            random_pattern(inner, sizeof(inner), depth - 1);
+            snprintf(atom, sizeof(atom), "(%s%s%s)", random() % 2 ? "?:" : "",
+                    inner, random() % 2 ? "|a" : "");
+        } else {
+            snprintf(atom, sizeof(atom), "%s",
+                    atoms[random() % (sizeof(atoms) / sizeof(atoms[0]))]);
+        }
+
+        if (random() % 3 == 0 && strcmp(atom, "^") != 0 && strcmp(atom, "$") != 0)
+            strncat(atom, quantifiers[random() %
+                    (sizeof(quantifiers) / sizeof(quantifiers[0]))],
+                    sizeof(atom) - strlen(atom) - 1);
+
+        if (len + strlen(atom) + 1 > size)
+            break;
+        memcpy(pattern + len, atom, strlen(atom) + 1);
+        len += strlen(atom);
+
+        if (depth == 3 && random() % 6 == 0 && len + 2 < size) {
+            pattern[len++] = '|';
+            pattern[len] = '\0';
+        }
+    }
+}
+
+static size_t
+random_name(char *name, size_t size) {
+    static const char alphabet[] = "abB.1\n";
+    size_t len = random() % (size - 1);
+
+    for (size_t i = 0; i < len; i++)
+        name[i] = alphabet[random() % (sizeof(alphabet) - 1)];
+    name[len] = '\0';
+
+    return len;
+}
@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "proxy_protocol.h"
+
+/* Appended to each header to check parsing stops at its end */
+static const char request[] = "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n";
+
+#define HEADER(h) h, sizeof(h) - 1
+
+static const struct test {
+    const char *header;
+    size_t header_len;
+    int valid;
+    int family;             /* AF_UNSPEC if no addresses */
+    const char *source;
+    uint16_t source_port;
+} tests[] = {
+    { HEADER("PROXY TCP4 192.0.2.1 198.51.100.1 56324 443\r\n"),
+        1, AF_INET, "192.0.2.1", 56324 },
+    { HEADER("PROXY TCP6 2001:db8::1 2001:db8::2 56324 443\r\n"),
+        1, AF_INET6, "2001:db8::1", 56324 },
+    { HEADER("PROXY UNKNOWN\r\n"),
+        1, AF_UNSPEC, NULL, 0 },
+    { HEADER("PROXY UNKNOWN ffff:f...f ffff:f...f 65535 65535\r\n"),
+        1, AF_UNSPEC, NULL, 0 },
+    /* v2 PROXY TCP4 with an authority TLV */
+    { HEADER("\x0D\x0A\x0D\x0A\x00\x0D\x0A\x51\x55\x49\x54\x0A\x21\x11\x00\x1B"
+        "\xC0\x00\x02\x01" "\xC6\x33\x64\x01" "\xDC\x04" "\x01\xBB"
+        "\x02\x00\x0C" "example.com\0"),
+        1, AF_INET, "192.0.2.1", 56324 },
+    /* v2 PROXY TCP6 */
+    { HEADER("\x0D\x0A\x0D\x0A\x00\x0D\x0A\x51\x55\x49\x54\x0A\x21\x21\x00\x24"
+        "\x20\x01\x0d\xb8\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x01"
+        "\x20\x01\x0d\xb8\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x02"
+        "\xDC\x04" "\x01\xBB"),
+        1, AF_INET6, "2001:db8::1", 56324 },
+    /* v2 LOCAL health check from the load balancer */
+    { HEADER("\x0D\x0A\x0D\x0A\x00\x0D\x0A\x51\x55\x49\x54\x0A\x20\x00\x00\x00"),
+        1, AF_UNSPEC, NULL, 0 },
+    /* v2 PROXY AF_UNIX, the addresses are ignored */
+    { HEADER("\x0D\x0A\x0D\x0A\x00\x0D\x0A\x51\x55\x49\x54\x0A\x21\x31\x00\x04"
+        "\x00\x00\x00\x00"),
+        1, AF_UNSPEC, NULL, 0 },
+    { HEADER("PROXY TCP4 192.0.2.1 198.51.100.1 56324 443 extra\r\n"),
+        0, AF_UNSPEC, NULL, 0 },
+    { HEADER("PROXY TCP4 192.0.2.1  198.51.100.1 56324 443\r\n"),
+        0, AF_UNSPEC, NULL, 0 },
+    { HEADER("PROXY TCP4 2001:db8::1 198.51.100.1 56324 443\r\n"),
+        0, AF_UNSPEC, NULL, 0 },
+    { HEADER("PROXY TCP4 192.0.2.1 198.51.100.1 65536 443\r\n"),
+        0, AF_UNSPEC, NULL, 0 },
+    { HEADER("PROXY TCP4 192.0.2.1 198.51.100.1 056324 443\r\n"),
+        0, AF_UNSPEC, NULL, 0 },
+    { HEADER("PROXY UDP4 192.0.2.1 198.51.100.1 56324 443\r\n"),
+        0, AF_UNSPEC, NULL, 0 },
+    { HEADER("PROXY TCP4 192.0.2.1 198.51.100.1 56324 443\n"),
+        0, AF_UNSPEC, NULL, 0 },
+    { HEADER("GET / HTTP/1.1\r\n"),
+        0, AF_UNSPEC, NULL, 0 },
+    /* v2 with version 1 */
+    { HEADER("\x0D\x0A\x0D\x0A\x00\x0D\x0A\x51\x55\x49\x54\x0A\x11\x11\x00\x0C"
+        "\xC0\x00\x02\x01" "\xC6\x33\x64\x01" "\xDC\x04" "\x01\xBB"),
+        0, AF_UNSPEC, NULL, 0 },
+    /* v2 TCP4 too short for the addresses */
+    { HEADER("\x0D\x0A\x0D\x0A\x00\x0D\x0A\x51\x55\x49\x54\x0A\x21\x11\x00\x04"
+        "\xC0\x00\x02\x01"),
+        0, AF_UNSPEC, NULL, 0 },
+};
+
+static void
+check_header(const struct test *test, const struct ProxyHeader *header) {
+    char address[INET6_ADDRSTRLEN];
+
+    if (test->family == AF_UNSPEC) {
+        assert(!header->has_addresses);
+        return;
+    }
+
+    assert(header->has_addresses);
+    assert(header->source.ss_family == test->family);
+    assert(header->destination.ss_family == test->family);
+
+    if (test->family == AF_INET) {
+        const struct sockaddr_in *source =
+            (const struct sockaddr_in *)&header->source;
+
+        assert(header->source_len == sizeof(struct sockaddr_in));
+        inet_ntop(AF_INET, &source->sin_addr, address, sizeof(address));
+        assert(ntohs(source->sin_port) == test->source_port);
+    } else {
+        const struct sockaddr_in6 *source =
+            (const struct sockaddr_in6 *)&header->source;
+
+        assert(header->source_len == sizeof(struct sockaddr_in6));
+        inet_ntop(AF_INET6, &source->sin6_addr, address, sizeof(address));
+        assert(ntohs(source->sin6_port) == test->source_port);
+    }
+    assert(strcmp(address, test->source) == 0);
+}
+
+/*
+ * Parse each header followed by a request, and every prefix of it as it
+ * could be split across reads
+ */
+static void
+test_headers() {
+    for (size_t i = 0; i < sizeof(tests) / sizeof(struct test); i++) {
+        const struct test *test = &tests[i];
+        char data[256];
+        struct ProxyHeader header;
+
+        assert(test->header_len + sizeof(request) <= sizeof(data));
+        memcpy(data, test->header, test->header_len);
+        memcpy(data + test->header_len, request, sizeof(request));
+
+        ssize_t result = parse_proxy_header(data,
+                test->header_len + sizeof(request) - 1, &header);
+        if (test->valid) {
+            assert(result == (ssize_t)test->header_len);
+            check_header(test, &header);
+        } else {
+            assert(result == -2);
+        }
+
+        /* An invalid header may only be detected once it is complete */
+        for (size_t len = 1; len < test->header_len; len++) {
+            result = parse_proxy_header(data, len, &header);
+            assert(result == -1 || (result == -2 && !test->valid));
+        }
+    }
+}
+
+/*
+ * The length of each valid header is told from its start, once enough of it
+ * is received
+ */
+static void
+test_header_length() {
+    for (size_t i = 0; i < sizeof(tests) / sizeof(struct test); i++) {
+        const struct test *test = &tests[i];
+        char data[256];
+
+        if (!test->valid)
+            continue;
+
+        memcpy(data, test->header, test->header_len);
+        memcpy(data + test->header_len, request, sizeof(request));
+
+        assert(proxy_header_length(data,
+                    test->header_len + sizeof(request) - 1) ==
+                (ssize_t)test->header_len);
+
+        ssize_t previous = -1;
+        for (size_t len = 0; len <= test->header_len; len++) {
+            ssize_t result = proxy_header_length(data, len);
+
+            assert(result == -1 || result == (ssize_t)test->header_len);
+            assert(previous == -1 || result == previous);
+            previous = result;
+        }
+        assert(previous == (ssize_t)test->header_len);
+    }
+
+    assert(proxy_header_length("GET / HTTP/1.1\r\n", 16) == -2);
+}
+
+/* A version 1 header without the CRLF within its maximum length */
+static void
+test_long_v1_header() {
+    char data[PROXY_V1_HEADER_MAX + 1];
+    struct ProxyHeader header;
+
+    memset(data, ' ', sizeof(data));
+    memcpy(data, "PROXY TCP4", 10);
+
+    assert(parse_proxy_header(data, PROXY_V1_HEADER_MAX - 1, &header) == -1);
+    assert(parse_proxy_header(data, sizeof(data), &header) == -2);
+    assert(proxy_header_length(data, PROXY_V1_HEADER_MAX - 1) == -1);
+    assert(proxy_header_length(data, sizeof(data)) == -2);
+}
+
+int main() {
+    test_headers();
+    test_header_length();
+    test_long_v1_header();
+
+    return 0;
+}
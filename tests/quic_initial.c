@@ -0,0 +1,40 @@
+/*
+ * Write a client Initial datagram for a hostname to stdout, for
+ * quic_listener_test, optionally with a destination connection ID in hex
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "quic.h"
+#include "quic_packet.h"
+
+int main(int argc, char **argv) {
+    uint8_t dcid[QUIC_CID_MAX] = {
+        0x83, 0x94, 0xc8, 0xf0, 0x3e, 0x51, 0x57, 0x08
+    };
+    size_t dcid_len = 8;
+    uint8_t hello[512], frames[1024], datagram[1500];
+
+    if (argc < 2 || argc > 3 || strlen(argv[1]) > 255 ||
+            (argc == 3 && (strlen(argv[2]) % 2 != 0 ||
+                           strlen(argv[2]) > 2 * QUIC_CID_MAX))) {
+        fprintf(stderr, "Usage: %s hostname [dcid]\n", argv[0]);
+        return 1;
+    }
+
+    if (argc == 3) {
+        dcid_len = strlen(argv[2]) / 2;
+        for (size_t i = 0; i < dcid_len; i++) {
+            char byte[3] = { argv[2][2 * i], argv[2][2 * i + 1], '\0' };
+            dcid[i] = (uint8_t)strtoul(byte, NULL, 16);
+        }
+    }
+
+    size_t hello_len = build_client_hello(hello, sizeof(hello), argv[1]);
+    size_t frames_len = build_crypto_frame(frames, sizeof(frames), 0,
+            hello, hello_len);
+    size_t len = build_initial_packet(datagram, sizeof(datagram),
+            QUIC_VERSION_1, dcid, dcid_len, 0, frames, frames_len);
+
+    return fwrite(datagram, 1, len, stdout) == len ? 0 : 1;
+}
@@ -0,0 +1,148 @@
+/*
+ * Client Initial packets for the QUIC tests, protected as a client would
+ */
+#include <string.h>
+#include <assert.h>
+#include <openssl/evp.h>
+#include "quic_packet.h"
+#include "quic.h"
+
+static const uint8_t scid[] = { 0xc1, 0x01, 0x5e, 0x7d };
+
+static size_t
+put_uint(uint8_t *out, uint64_t value, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        out[i] = (uint8_t)(value >> (8 * (len - 1 - i)));
+
+    return len;
+}
+
+/* Two byte variable length integers are long enough for these tests */
+static size_t
+put_varint(uint8_t *out, uint64_t value) {
+    assert(value < 0x4000);
+
+    return put_uint(out, value | 0x4000, 2);
+}
+
+/*
+ * A TLS 1.3 client hello for hostname offering h3, without a TLS record
+ */
+size_t
+build_client_hello(uint8_t *out, size_t out_len, const char *hostname) {
+    size_t hostname_len = strlen(hostname);
+    size_t len = 0;
+
+    assert(out_len >= 80 + hostname_len);
+
+    out[len++] = 0x01;                      /* client hello */
+    len += 3;                               /* length, filled in below */
+    len += put_uint(out + len, 0x0303, 2);
+    memset(out + len, 0x5a, 32);            /* random */
+    len += 32;
+    out[len++] = 0;                         /* session ID */
+    len += put_uint(out + len, 2, 2);
+    len += put_uint(out + len, 0x1301, 2);  /* TLS_AES_128_GCM_SHA256 */
+    out[len++] = 1;
+    out[len++] = 0;                         /* null compression */
+
+    size_t extensions = len;
+    len += 2;
+    len += put_uint(out + len, 0x0000, 2);  /* server_name */
+    len += put_uint(out + len, hostname_len + 5, 2);
+    len += put_uint(out + len, hostname_len + 3, 2);
+    out[len++] = 0;                         /* host_name */
+    len += put_uint(out + len, hostname_len, 2);
+    memcpy(out + len, hostname, hostname_len);
+    len += hostname_len;
+    len += put_uint(out + len, 0x0010, 2);  /* ALPN */
+    len += put_uint(out + len, 5, 2);
+    len += put_uint(out + len, 3, 2);
+    out[len++] = 2;
+    memcpy(out + len, "h3", 2);
+    len += 2;
+    len += put_uint(out + len, 0x002b, 2);  /* supported_versions */
+    len += put_uint(out + len, 3, 2);
+    out[len++] = 2;
+    len += put_uint(out + len, 0x0304, 2);
+
+    put_uint(out + extensions, len - extensions - 2, 2);
+    put_uint(out + 1, len - 4, 3);
+
+    return len;
+}
+
+size_t
+build_crypto_frame(uint8_t *out, size_t out_len, size_t offset,
+        const uint8_t *data, size_t len) {
+    assert(out_len >= 5 + len);
+
+    out[0] = 0x06;
+    put_varint(out + 1, offset);
+    put_varint(out + 3, len);
+    memcpy(out + 5, data, len);
+
+    return 5 + len;
+}
+
+/*
+ * Protect frames in an Initial packet with a two byte packet number, padded
+ * to the 1200 byte minimum a client sends
+ */
+size_t
+build_initial_packet(uint8_t *out, size_t out_len, uint32_t version,
+        const uint8_t *dcid, size_t dcid_len, uint32_t pn,
+        const uint8_t *frames, size_t frames_len) {
+    uint8_t key[16], iv[12], hp[16], nonce[12], mask[16];
+    uint8_t plaintext[1200];
+    size_t len = 0;
+    int out_bytes;
+
+    assert(quic_initial_keys(version, dcid, dcid_len, key, iv, hp));
+    assert(frames_len <= sizeof(plaintext));
+    assert(out_len >= 1200);
+
+    /* PADDING frames fill out the datagram */
+    size_t header_len = 1 + 4 + 1 + dcid_len + 1 + sizeof(scid) + 1 + 2 + 2;
+    size_t payload_len = 1200 - header_len - 16;
+    assert(frames_len <= payload_len);
+    memcpy(plaintext, frames, frames_len);
+    memset(plaintext + frames_len, 0, payload_len - frames_len);
+
+    out[len++] = version == QUIC_VERSION_2 ? 0xd1 : 0xc1;
+    len += put_uint(out + len, version, 4);
+    out[len++] = (uint8_t)dcid_len;
+    memcpy(out + len, dcid, dcid_len);
+    len += dcid_len;
+    out[len++] = sizeof(scid);
+    memcpy(out + len, scid, sizeof(scid));
+    len += sizeof(scid);
+    out[len++] = 0;                         /* token */
+    len += put_varint(out + len, 2 + payload_len + 16);
+    size_t pn_offset = len;
+    len += put_uint(out + len, pn, 2);
+
+    memcpy(nonce, iv, sizeof(nonce));
+    nonce[10] ^= (uint8_t)(pn >> 8);
+    nonce[11] ^= (uint8_t)pn;
+
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    assert(EVP_EncryptInit_ex(ctx, EVP_aes_128_gcm(), NULL, key, nonce));
+    assert(EVP_EncryptUpdate(ctx, NULL, &out_bytes, out, (int)len));
+    assert(EVP_EncryptUpdate(ctx, out + len, &out_bytes, plaintext,
+                (int)payload_len));
+    assert(EVP_EncryptFinal_ex(ctx, out + len + out_bytes, &out_bytes));
+    assert(EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, 16,
+                out + len + payload_len));
+    len += payload_len + 16;
+
+    assert(EVP_EncryptInit_ex(ctx, EVP_aes_128_ecb(), NULL, hp, NULL));
+    assert(EVP_EncryptUpdate(ctx, mask, &out_bytes, out + pn_offset + 4, 16));
+    EVP_CIPHER_CTX_free(ctx);
+
+    out[0] ^= mask[0] & 0x0f;
+    out[pn_offset] ^= mask[1];
+    out[pn_offset + 1] ^= mask[2];
+
+    return len;
+}
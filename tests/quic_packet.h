@@ -0,0 +1,12 @@
+#ifndef QUIC_PACKET_H
+#define QUIC_PACKET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+size_t build_client_hello(uint8_t *, size_t, const char *);
+size_t build_crypto_frame(uint8_t *, size_t, size_t, const uint8_t *, size_t);
+size_t build_initial_packet(uint8_t *, size_t, uint32_t,
+        const uint8_t *, size_t, uint32_t, const uint8_t *, size_t);
+
+#endif
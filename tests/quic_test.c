@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include "quic.h"
+#include "quic_packet.h"
+
+/* Client Initial keys from RFC9001 appendix A.1 and RFC9369 appendix A.1 */
+static const uint8_t rfc_dcid[] = {
+    0x83, 0x94, 0xc8, 0xf0, 0x3e, 0x51, 0x57, 0x08
+};
+
+static const struct key_vector {
+    uint32_t version;
+    uint8_t key[16], iv[12], hp[16];
+} key_vectors[] = {
+    { QUIC_VERSION_1,
+        { 0x1f, 0x36, 0x96, 0x13, 0xdd, 0x76, 0xd5, 0x46,
+          0x77, 0x30, 0xef, 0xcb, 0xe3, 0xb1, 0xa2, 0x2d },
+        { 0xfa, 0x04, 0x4b, 0x2f, 0x42, 0xa3, 0xfd, 0x3b,
+          0x46, 0xfb, 0x25, 0x5c },
+        { 0x9f, 0x50, 0x44, 0x9e, 0x04, 0xa0, 0xe8, 0x10,
+          0x28, 0x3a, 0x1e, 0x99, 0x33, 0xad, 0xed, 0xd2 } },
+    { QUIC_VERSION_2,
+        { 0x8b, 0x1a, 0x0b, 0xc1, 0x21, 0x28, 0x42, 0x90,
+          0xa2, 0x9e, 0x09, 0x71, 0xb5, 0xcd, 0x04, 0x5d },
+        { 0x91, 0xf7, 0x3e, 0x23, 0x51, 0xd8, 0xfa, 0x91,
+          0x66, 0x0e, 0x90, 0x9f },
+        { 0x45, 0xb9, 0x5e, 0x15, 0x23, 0x5d, 0x6f, 0x45,
+          0xa6, 0xb1, 0x9c, 0xbc, 0xb0, 0x29, 0x4b, 0xa9 } },
+};
+
+static const char hostname[] = "quic.example.com";
+
+static void
+test_initial_keys() {
+    for (size_t i = 0; i < sizeof(key_vectors) / sizeof(key_vectors[0]); i++) {
+        uint8_t key[16], iv[12], hp[16];
+
+        assert(quic_initial_keys(key_vectors[i].version, rfc_dcid,
+                    sizeof(rfc_dcid), key, iv, hp));
+        assert(memcmp(key, key_vectors[i].key, sizeof(key)) == 0);
+        assert(memcmp(iv, key_vectors[i].iv, sizeof(iv)) == 0);
+        assert(memcmp(hp, key_vectors[i].hp, sizeof(hp)) == 0);
+    }
+
+    assert(!quic_initial_keys(0x0a0a0a0a, rfc_dcid, sizeof(rfc_dcid),
+                NULL, NULL, NULL));
+}
+
+static void
+test_header() {
+    uint8_t hello[256], frames[512], datagram[1500];
+    struct QuicHeader header;
+
+    size_t hello_len = build_client_hello(hello, sizeof(hello), hostname);
+    size_t frames_len = build_crypto_frame(frames, sizeof(frames), 0,
+            hello, hello_len);
+    size_t len = build_initial_packet(datagram, sizeof(datagram),
+            QUIC_VERSION_1, rfc_dcid, sizeof(rfc_dcid), 0, frames, frames_len);
+
+    assert(parse_quic_header(datagram, len, &header));
+    assert(header.long_header);
+    assert(header.initial);
+    assert(header.version == QUIC_VERSION_1);
+    assert(header.dcid_len == sizeof(rfc_dcid));
+    assert(memcmp(header.dcid, rfc_dcid, sizeof(rfc_dcid)) == 0);
+    assert(header.scid_len == 4);
+
+    /* Truncated long headers */
+    for (size_t i = 0; i < 7 + sizeof(rfc_dcid); i++)
+        assert(!parse_quic_header(datagram, i, &header));
+
+    /* Short header */
+    datagram[0] = 0x40;
+    assert(parse_quic_header(datagram, len, &header));
+    assert(!header.long_header);
+
+    /* Not QUIC, the fixed bit is clear */
+    datagram[0] = 0x80;
+    assert(!parse_quic_header(datagram, len, &header));
+}
+
+static void
+test_single_packet(uint32_t version) {
+    uint8_t hello[256], frames[512], datagram[1500];
+    struct QuicInitial initial;
+
+    size_t hello_len = build_client_hello(hello, sizeof(hello), hostname);
+    size_t frames_len = build_crypto_frame(frames, sizeof(frames), 0,
+            hello, hello_len);
+    size_t len = build_initial_packet(datagram, sizeof(datagram), version,
+            rfc_dcid, sizeof(rfc_dcid), 0, frames, frames_len);
+    assert(len == 1200);
+
+    init_quic_initial(&initial);
+    int result = parse_quic_initial(&initial, datagram, len);
+    assert(result == (int)strlen(hostname));
+    assert(strcmp(initial.parse_state.hostname, hostname) == 0);
+    assert(initial.parse_state.hello.fingerprint[0] == 'q');
+
+    /* Any change to the protected packet fails authentication */
+    datagram[len - 1] ^= 1;
+    init_quic_initial(&initial);
+    assert(parse_quic_initial(&initial, datagram, len) < -4);
+}
+
+/*
+ * A client hello split over two datagrams, received in either order, with
+ * the first also repeating part of the second
+ */
+static void
+test_split_packets() {
+    uint8_t hello[256], frames[512], datagrams[2][1500];
+    size_t lens[2];
+
+    size_t hello_len = build_client_hello(hello, sizeof(hello), hostname);
+    size_t split = hello_len / 2;
+
+    size_t frames_len = build_crypto_frame(frames, sizeof(frames), 0,
+            hello, split + 4);
+    lens[0] = build_initial_packet(datagrams[0], sizeof(datagrams[0]),
+            QUIC_VERSION_1, rfc_dcid, sizeof(rfc_dcid), 0, frames, frames_len);
+    frames_len = build_crypto_frame(frames, sizeof(frames), split,
+            hello + split, hello_len - split);
+    lens[1] = build_initial_packet(datagrams[1], sizeof(datagrams[1]),
+            QUIC_VERSION_1, rfc_dcid, sizeof(rfc_dcid), 1, frames, frames_len);
+
+    for (int first = 0; first < 2; first++) {
+        struct QuicInitial initial;
+
+        init_quic_initial(&initial);
+        assert(parse_quic_initial(&initial, datagrams[first],
+                    lens[first]) == -1);
+        assert(parse_quic_initial(&initial, datagrams[!first],
+                    lens[!first]) == (int)strlen(hostname));
+        assert(strcmp(initial.parse_state.hostname, hostname) == 0);
+    }
+}
+
+/* Packets coalesced after the Initial packet are skipped */
+static void
+test_coalesced_packets() {
+    uint8_t hello[256], frames[512], datagram[1500];
+    struct QuicInitial initial;
+
+    /* Two CRYPTO frames out of order in one packet */
+    size_t hello_len = build_client_hello(hello, sizeof(hello), hostname);
+    size_t frames_len = build_crypto_frame(frames, sizeof(frames), 10,
+            hello + 10, hello_len - 10);
+    frames_len += build_crypto_frame(frames + frames_len,
+            sizeof(frames) - frames_len, 0, hello, 10);
+    size_t len = build_initial_packet(datagram, sizeof(datagram),
+            QUIC_VERSION_1, rfc_dcid, sizeof(rfc_dcid), 0, frames, frames_len);
+
+    /* A 0-RTT packet with an empty payload */
+    static const uint8_t zero_rtt[] = {
+        0xd1, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x02, 0x00, 0x00
+    };
+    memcpy(datagram + len, zero_rtt, sizeof(zero_rtt));
+
+    init_quic_initial(&initial);
+    assert(parse_quic_initial(&initial, datagram, len + sizeof(zero_rtt)) ==
+            (int)strlen(hostname));
+}
+
+static void
+test_invalid_packets() {
+    uint8_t datagram[1500];
+    struct QuicInitial initial;
+
+    /* Version negotiation and unknown versions */
+    memset(datagram, 0, sizeof(datagram));
+    datagram[0] = 0xc0;
+    init_quic_initial(&initial);
+    assert(parse_quic_initial(&initial, datagram, 1200) < -4);
+
+    datagram[4] = 0x02;
+    init_quic_initial(&initial);
+    assert(parse_quic_initial(&initial, datagram, 1200) < -4);
+
+    /* Length field beyond the end of the datagram */
+    uint8_t frames[] = { 0x01 };
+    size_t len = build_initial_packet(datagram, sizeof(datagram),
+            QUIC_VERSION_1, rfc_dcid, sizeof(rfc_dcid), 0, frames,
+            sizeof(frames));
+    init_quic_initial(&initial);
+    assert(parse_quic_initial(&initial, datagram, len - 1) < -4);
+
+    /* A CRYPTO frame beyond the largest client hello buffered */
+    uint8_t hello[256];
+    size_t hello_len = build_client_hello(hello, sizeof(hello), hostname);
+    size_t frames_len = build_crypto_frame(datagram, sizeof(datagram),
+            QUIC_CRYPTO_MAX, hello, hello_len);
+    memcpy(hello, datagram, frames_len);
+    len = build_initial_packet(datagram, sizeof(datagram), QUIC_VERSION_1,
+            rfc_dcid, sizeof(rfc_dcid), 0, hello, frames_len);
+    init_quic_initial(&initial);
+    assert(parse_quic_initial(&initial, datagram, len) < -4);
+}
+
+int main() {
+    test_initial_keys();
+    test_header();
+    test_single_packet(QUIC_VERSION_1);
+    test_single_packet(QUIC_VERSION_2);
+    test_split_packets();
+    test_coalesced_packets();
+    test_invalid_packets();
+
+    return 0;
+}
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <arpa/inet.h>
 #include <ev.h>
 #include <assert.h>
@@ -8,20 +9,61 @@
 static int query_count = 0;
 
 
-static void query_cb(struct Address *result, void *data) {
-    int *query_count = (int *)data;
-    char ip_buf[INET6_ADDRSTRLEN];
+static void query_cb(struct Address **results, size_t len, void *data) {
+    int *count = (int *)data;
+    char ip_buf[INET6_ADDRSTRLEN + 8];
 
-    if (result != NULL &&
-            address_is_sockaddr(result) &&
-            display_address(result, ip_buf, sizeof(ip_buf))) {
+    for (size_t i = 0; i < len; i++) {
+        if (address_is_sockaddr(results[i]) &&
+                display_address(results[i], ip_buf, sizeof(ip_buf))) {
 
-        fprintf(stderr, "query resolved to %s\n", ip_buf);
+            fprintf(stderr, "query resolved to %s\n", ip_buf);
 
-        query_count++;
+            (*count)++;
+        }
     }
 }
 
+/*
+ * Addresses alternate between families from the preferred one, keeping
+ * their order within each family
+ */
+static void
+test_order_addresses() {
+    const char *names[] = { "192.0.2.1", "192.0.2.2", "2001:db8::1",
+        "192.0.2.3", "2001:db8::2" };
+    const size_t len = sizeof(names) / sizeof(names[0]);
+    struct Address *resolved[sizeof(names) / sizeof(names[0])];
+    struct Address *addresses[sizeof(names) / sizeof(names[0])];
+    const size_t ipv6_first[] = { 2, 0, 4, 1, 3 };
+    const size_t ipv4_first[] = { 0, 2, 1, 4, 3 };
+
+    for (size_t i = 0; i < len; i++) {
+        resolved[i] = new_address(names[i]);
+        assert(resolved[i] != NULL);
+    }
+
+    for (size_t i = 0; i < len; i++)
+        addresses[i] = resolved[i];
+    resolv_order_addresses(addresses, len, AF_INET6);
+    for (size_t i = 0; i < len; i++)
+        assert(addresses[i] == resolved[ipv6_first[i]]);
+
+    for (size_t i = 0; i < len; i++)
+        addresses[i] = resolved[i];
+    resolv_order_addresses(addresses, len, AF_INET);
+    for (size_t i = 0; i < len; i++)
+        assert(addresses[i] == resolved[ipv4_first[i]]);
+
+    /* Addresses of only the other family are left in order */
+    resolv_order_addresses(resolved, 2, AF_INET6);
+    assert(address_compare(resolved[0], addresses[0]) == 0);
+    assert(address_compare(resolved[1], addresses[2]) == 0);
+
+    for (size_t i = 0; i < len; i++)
+        free(resolved[i]);
+}
+
 static void
 test_init_cb(struct ev_loop *loop __attribute__((unused)), struct ev_timer *w __attribute__((unused)), int revents) {
     if (revents & EV_TIMER)
@@ -40,6 +82,8 @@ int main() {
     struct ev_timer timeout_watcher;
     struct ev_timer init_watcher;
 
+    test_order_addresses();
+
     resolv_init(loop, NULL, NULL, 0);
 
     ev_timer_init(&init_watcher, &test_init_cb, 0.0, 0.0);
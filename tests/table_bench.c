@@ -0,0 +1,254 @@
+/*
+ * Correctness check and benchmark of backend lookup over a large synthetic
+ * table
+ *
+ *   table_bench [ENTRIES]
+ *      Check the lookup of matching and unmatched names against a linear
+ *      evaluation of each entry's regular expression.
+ *   table_bench bench [ENTRIES]
+ *      Report ns/lookup for names found by hostname, domain and regular
+ *      expression entries and for a name matching no entry, beside the
+ *      cost of evaluating each pattern in turn without JIT compilation.
+ *
+ * A third of the entries each are hostnames, domains and regular expressions.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include "table.h"
+#include "backend.h"
+
+#define DEFAULT_ENTRIES 3000
+#define BENCH_SECONDS 0.5
+
+struct Reference {
+    const struct Backend **backends;
+    pcre2_code **patterns;
+    pcre2_match_data *match_data;
+    size_t len;
+};
+
+static struct Table *synthetic_table(size_t);
+static void entry_name(char *, size_t, size_t, int);
+static void init_reference(struct Reference *, const struct Table *);
+static void free_reference(struct Reference *);
+static const struct Backend *reference_lookup(const struct Reference *,
+        const char *);
+static void check(const struct Table *, const struct Reference *, size_t);
+static void benchmark(const struct Table *, const struct Reference *, size_t);
+static double elapsed(const struct timespec *);
+
+
+int main(int argc, char **argv) {
+    int bench = argc > 1 && strcmp(argv[1], "bench") == 0;
+    size_t entries = DEFAULT_ENTRIES;
+
+    if (argc > 1 + bench)
+        entries = strtoul(argv[1 + bench], NULL, 10);
+    if (entries < 3)
+        entries = 3;
+
+    struct Table *table = synthetic_table(entries);
+    struct Reference reference;
+
+    init_reference(&reference, table);
+
+    if (bench)
+        benchmark(table, &reference, entries);
+    else
+        check(table, &reference, entries);
+
+    free_reference(&reference);
+    table_ref_put(table);
+
+    return 0;
+}
+
+static struct Table *
+synthetic_table(size_t entries) {
+    struct Table *table = new_table();
+    assert(table != NULL);
+
+    table_ref_get(table);
+
+    for (size_t i = 0; i < entries; i++) {
+        char pattern[64];
+        char address[32];
+
+        switch (i % 3) {
+            case 0:
+                snprintf(pattern, sizeof(pattern),
+                        "^host%zu\\.example\\.com$", i);
+                break;
+            case 1:
+                snprintf(pattern, sizeof(pattern),
+                        "^.*\\.zone%zu\\.example\\.net$", i);
+                break;
+            default:
+                snprintf(pattern, sizeof(pattern),
+                        "^(api|www)[0-9]+\\.svc%zu\\.example\\.org$", i);
+                break;
+        }
+        snprintf(address, sizeof(address), "10.%zu.%zu.%zu",
+                (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff);
+
+        struct Backend *backend = new_backend();
+        assert(backend != NULL);
+        assert(accept_backend_arg(backend, pattern));
+        assert(accept_backend_arg(backend, address));
+        add_backend(&table->backends, backend);
+    }
+
+    init_table(table);
+
+    return table;
+}
+
+/* A name matched by entry i, or by none if miss is set */
+static void
+entry_name(char *name, size_t len, size_t i, int miss) {
+    switch (i % 3) {
+        case 0:
+            snprintf(name, len, "host%zu.example.%s", i, miss ? "net" : "com");
+            break;
+        case 1:
+            snprintf(name, len, "%s.zone%zu.example.net", miss ? "" : "x.y", i);
+            break;
+        default:
+            snprintf(name, len, "%s42.svc%zu.example.org",
+                    miss ? "ftp" : "api", i);
+            break;
+    }
+}
+
+static void
+init_reference(struct Reference *reference, const struct Table *table) {
+    const struct Backend *iter;
+
+    reference->len = 0;
+    STAILQ_FOREACH(iter, &table->backends, entries)
+        reference->len++;
+
+    reference->backends = calloc(reference->len, sizeof(struct Backend *));
+    reference->patterns = calloc(reference->len, sizeof(pcre2_code *));
+    assert(reference->backends != NULL && reference->patterns != NULL);
+
+    size_t i = 0;
+    STAILQ_FOREACH(iter, &table->backends, entries) {
+        int error;
+        PCRE2_SIZE error_offset;
+
+        reference->patterns[i] = pcre2_compile((PCRE2_SPTR)iter->pattern,
+                PCRE2_ZERO_TERMINATED, 0, &error, &error_offset, NULL);
+        assert(reference->patterns[i] != NULL);
+        reference->backends[i++] = iter;
+    }
+
+    reference->match_data = pcre2_match_data_create(10, NULL);
+    assert(reference->match_data != NULL);
+}
+
+static void
+free_reference(struct Reference *reference) {
+    for (size_t i = 0; i < reference->len; i++)
+        pcre2_code_free(reference->patterns[i]);
+    free(reference->patterns);
+    free(reference->backends);
+    pcre2_match_data_free(reference->match_data);
+}
+
+/* The first backend whose pattern matches, evaluating each in turn */
+static const struct Backend *
+reference_lookup(const struct Reference *reference, const char *name) {
+    for (size_t i = 0; i < reference->len; i++)
+        if (pcre2_match(reference->patterns[i], (PCRE2_SPTR)name,
+                    strlen(name), 0, 0, reference->match_data, NULL) >= 0)
+            return reference->backends[i];
+
+    return NULL;
+}
+
+static void
+check(const struct Table *table, const struct Reference *reference,
+        size_t entries) {
+    for (size_t i = 0; i < entries; i++) {
+        for (int miss = 0; miss <= 1; miss++) {
+            char name[64];
+            entry_name(name, sizeof(name), i, miss);
+
+            const struct Backend *expected = reference_lookup(reference, name);
+            struct BackendLookupResult result = lookup_backend(
+                    &table->backend_index, name, strlen(name), NULL);
+
+            assert(result.backend == expected);
+            if (expected != NULL) {
+                assert(result.matches[0] >= 1);
+                assert(result.matches[1] == 0);
+                assert(result.matches[2] == (int)strlen(name));
+            }
+            assert(miss || result.backend == reference->backends[i]);
+        }
+    }
+}
+
+static void
+benchmark(const struct Table *table, const struct Reference *reference,
+        size_t entries) {
+    static const char *kinds[] = { "hostname", "domain", "regex" };
+    char names[4][64];
+    const char *labels[4];
+
+    /* The last entry of each kind, behind every regular expression before
+     * it, and a name no entry matches */
+    for (size_t kind = 0; kind < 3; kind++) {
+        size_t i = (entries - 1) - ((entries - 1 - kind) % 3);
+        entry_name(names[kind], sizeof(names[kind]), i, 0);
+        labels[kind] = kinds[kind];
+    }
+    snprintf(names[3], sizeof(names[3]), "unknown.example.com");
+    labels[3] = "miss";
+
+    printf("%zu entries, %zu regular expressions in the automaton, %zu "
+            "evaluated in turn\n", entries,
+            table->backend_index.pattern_set_len,
+            table->backend_index.patterns_len);
+
+    for (size_t n = 0; n < 4; n++) {
+        size_t len = strlen(names[n]);
+        struct timespec start;
+        unsigned long lookups = 0;
+        unsigned long reference_lookups = 0;
+        double lookup_time;
+        double reference_time;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        do {
+            for (int j = 0; j < 100; j++)
+                lookup_backend(&table->backend_index, names[n], len, NULL);
+            lookups += 100;
+        } while ((lookup_time = elapsed(&start)) < BENCH_SECONDS);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        do {
+            reference_lookup(reference, names[n]);
+            reference_lookups++;
+        } while ((reference_time = elapsed(&start)) < BENCH_SECONDS);
+
+        printf("%-8s %-32s %12.1f ns/lookup, %12.1f ns/lookup evaluating "
+                "each pattern\n", labels[n], names[n],
+                lookup_time * 1e9 / lookups,
+                reference_time * 1e9 / reference_lookups);
+    }
+}
+
+static double
+elapsed(const struct timespec *start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (double)(now.tv_sec - start->tv_sec) +
+        (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
@@ -8,6 +8,16 @@
 
 static void test_empty_table();
 static void test_single_entry_table();
+static void test_alpn_table();
+static void test_literal_table();
+static void test_domain_table();
+static void test_pattern_set_table();
+static void test_caseless_table();
+static void test_apply_pattern();
+static void test_lookup_cache();
+static void test_pool_table();
+static struct Backend *new_pool_backend(const char **);
+static void assert_lookup(struct Table *, const char *, const char *);
 static void append_entry(struct Table *, const char *, const char *);
 static void add_new_table(struct Table_head *, const char *, const char **);
 static void test_add_table();
@@ -18,6 +28,14 @@ static int count_tables(const struct Table_head *);
 int main() {
     test_empty_table();
     test_single_entry_table();
+    test_alpn_table();
+    test_literal_table();
+    test_domain_table();
+    test_pattern_set_table();
+    test_caseless_table();
+    test_apply_pattern();
+    test_lookup_cache();
+    test_pool_table();
     test_add_table();
     test_tables_reload();
 }
@@ -37,12 +55,31 @@ test_empty_table() {
 
     const char *server_query = "example.com";
     struct LookupResult result = table_lookup_server_address(table,
-            server_query, strlen(server_query));
+            server_query, strlen(server_query), NULL, NULL);
     assert(result.address == NULL);
 
     table_ref_put(table);
 }
 
+/* A backend from its arguments, or NULL if any is rejected */
+static struct Backend *
+new_pool_backend(const char **args) {
+    struct Backend *backend = new_backend();
+    assert(backend != NULL);
+
+    for (; *args != NULL; args++) {
+        if (accept_backend_arg(backend, *args) < 0) {
+            struct Backend_head head = STAILQ_HEAD_INITIALIZER(head);
+
+            add_backend(&head, backend);
+            remove_backend(&head, backend);
+            return NULL;
+        }
+    }
+
+    return backend;
+}
+
 static void
 append_entry(struct Table *table, const char *pattern, const char *address) {
     struct Backend *backend = new_backend();
@@ -74,12 +111,376 @@ test_single_entry_table() {
 
     const char *server_query = "example.com";
     struct LookupResult result = table_lookup_server_address(table,
-            server_query, strlen(server_query));
+            server_query, strlen(server_query), NULL, NULL);
+    assert(result.address != NULL);
+
+    table_ref_put(table);
+}
+
+static void
+test_alpn_table() {
+    struct Table *table = new_table();
+    assert(table != NULL);
+
+    table_ref_get(table);
+
+    struct Backend *backend = new_backend();
+    assert(backend != NULL);
+    assert(accept_backend_arg(backend, "^example\\.com$") == 1);
+    assert(accept_backend_arg(backend, "192.0.2.10") == 1);
+    assert(accept_backend_arg(backend, "alpn=h2") == 1);
+    add_backend(&table->backends, backend);
+
+    append_entry(table, "^example\\.com$", "192.0.2.11");
+
+    init_table(table);
+
+    const char *server_query = "example.com";
+    struct ClientHello h2_hello = {
+        .alpn_len = 12,
+        .alpn = "\x02h2\x08http/1.1",
+    };
+    struct ClientHello http_hello = {
+        .alpn_len = 9,
+        .alpn = "\x08http/1.1",
+    };
+    char address[ADDRESS_BUFFER_SIZE];
+
+    struct LookupResult result = table_lookup_server_address(table,
+            server_query, strlen(server_query), &h2_hello, NULL);
+    assert(result.address != NULL);
+    display_address(result.address, address, sizeof(address));
+    assert(strcmp(address, "192.0.2.10") == 0);
+
+    result = table_lookup_server_address(table,
+            server_query, strlen(server_query), &http_hello, NULL);
+    assert(result.address != NULL);
+    display_address(result.address, address, sizeof(address));
+    assert(strcmp(address, "192.0.2.11") == 0);
+
+    result = table_lookup_server_address(table,
+            server_query, strlen(server_query), NULL, NULL);
+    assert(result.address != NULL);
+    display_address(result.address, address, sizeof(address));
+    assert(strcmp(address, "192.0.2.11") == 0);
+
+    table_ref_put(table);
+}
+
+static void
+assert_lookup(struct Table *table, const char *name,
+        const char *expected) {
+    char address[ADDRESS_BUFFER_SIZE];
+    struct LookupResult result = table_lookup_server_address(table,
+            name, strlen(name), NULL, NULL);
+
+    if (expected == NULL) {
+        assert(result.address == NULL);
+        return;
+    }
+
+    assert(result.address != NULL);
+    display_address(result.address, address, sizeof(address));
+    assert(strcmp(address, expected) == 0);
+}
+
+/* Literal hostnames looked up in the index keep their place in the table */
+static void
+test_literal_table() {
+    struct Table *table = new_table();
+    assert(table != NULL);
+
+    table_ref_get(table);
+
+    append_entry(table, "^www\\.example\\.com$", "192.0.2.10");
+    append_entry(table, "^.*\\.example\\.com$", "192.0.2.11");
+    append_entry(table, "^api\\.example\\.com$", "192.0.2.12");
+    append_entry(table, "^www\\.example\\.com$", "192.0.2.13");
+    append_entry(table, "localhost", "192.0.2.14");
+    append_entry(table, "^example-[0-9]+\\.net$", "192.0.2.15");
+
+    /* Enough entries to grow the index */
+    for (int i = 0; i < 100; i++) {
+        char pattern[64], address[64];
+
+        snprintf(pattern, sizeof(pattern), "^host%d\\.example\\.org$", i);
+        snprintf(address, sizeof(address), "192.0.2.%d", 100 + i);
+        append_entry(table, pattern, address);
+    }
+
+    init_table(table);
+
+    assert(table->backend_index.hostnames_size >= 2 * 102);
+    assert(table->backend_index.pattern_set_len == 2);
+    assert(table->backend_index.patterns_len == 0);
+
+    assert_lookup(table, "www.example.com", "192.0.2.10");
+    /* A preceding pattern matches before the literal entry */
+    assert_lookup(table, "api.example.com", "192.0.2.11");
+    assert_lookup(table, "example.com", NULL);
+    assert_lookup(table, "www.example.com.evil", NULL);
+    /* Patterns without anchors match part of the name */
+    assert_lookup(table, "localhost.localdomain", "192.0.2.14");
+    assert_lookup(table, "example-42.net", "192.0.2.15");
+    assert_lookup(table, "host0.example.org", "192.0.2.100");
+    assert_lookup(table, "host99.example.org", "192.0.2.199");
+    assert_lookup(table, "host100.example.org", NULL);
+    assert_lookup(table, "host7.example.org\n", "192.0.2.107");
+
+    table_ref_put(table);
+}
+
+/*
+ * Domain patterns found in the trie match the same names as the regular
+ * expressions they replace, in the same order
+ */
+static void
+test_domain_table() {
+    static const char *entries[] = {
+        "^www\\.example\\.com$", "192.0.2.10",
+        "^.*\\.tenant1\\.example\\.com$", "192.0.2.11",
+        "\\.example\\.com$", "192.0.2.12",
+        "^(.*\\.)?example\\.net$", "192.0.2.13",
+        "^.*\\.a\\.example\\.net$", "192.0.2.14",
+        ".*\\.b\\.example\\.org$", "192.0.2.15",
+        "^(?:.*\\.)?example\\.org$", "192.0.2.16",
+        "^[a-z]+\\.example\\.info$", "192.0.2.17",
+        "^(.*\\.)?c\\.example\\.info$", "192.0.2.18",
+    };
+    static const char *names[] = {
+        "www.example.com",
+        "x.tenant1.example.com",
+        "x.y.tenant1.example.com",
+        "tenant1.example.com",
+        "example.com",
+        "xexample.com",
+        ".example.com",
+        "x..example.com",
+        "example.net",
+        "b.a.example.net",
+        "a.example.net",
+        "example.net.",
+        "x.b.example.org",
+        "b.example.org",
+        "example.org",
+        "c.example.info",
+        "x.c.example.info",
+        "xc.example.info",
+        "a\nb.tenant1.example.com",
+        "x.tenant1.example.com\n",
+        "x.tenant1.example.com\n\n",
+        "\nexample.net",
+        "",
+    };
+    struct Table *table = new_table();
+    assert(table != NULL);
+
+    table_ref_get(table);
+
+    for (size_t i = 0; i < sizeof(entries) / sizeof(entries[0]); i += 2)
+        append_entry(table, entries[i], entries[i + 1]);
+
+    init_table(table);
+
+    /* The character class and the pattern with two labels before the
+     * domain are matched by the automaton */
+    assert(table->backend_index.pattern_set_len == 1);
+    assert(table->backend_index.patterns_len == 0);
+
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        const char *expected = NULL;
+
+        for (size_t j = 0; j < sizeof(entries) / sizeof(entries[0]); j += 2) {
+            int error;
+            PCRE2_SIZE error_offset;
+            pcre2_code *re = pcre2_compile((PCRE2_SPTR)entries[j],
+                    PCRE2_ZERO_TERMINATED, 0, &error, &error_offset, NULL);
+            assert(re != NULL);
+            pcre2_match_data *data = pcre2_match_data_create_from_pattern(re,
+                    NULL);
+
+            int rc = pcre2_match(re, (PCRE2_SPTR)names[i], strlen(names[i]),
+                    0, 0, data, NULL);
+            pcre2_match_data_free(data);
+            pcre2_code_free(re);
+            if (rc >= 0) {
+                expected = entries[j + 1];
+                break;
+            }
+        }
+
+        assert_lookup(table, names[i], expected);
+    }
+
+    table_ref_put(table);
+}
+
+/* Patterns outside the automaton keep their place in the table */
+static void
+test_pattern_set_table() {
+    struct Table *table = new_table();
+    assert(table != NULL);
+
+    table_ref_get(table);
+
+    append_entry(table, "^(a+)\\1\\.example\\.com$", "192.0.2.20");
+
+    struct Backend *backend = new_backend();
+    assert(backend != NULL);
+    assert(accept_backend_arg(backend, "^h2\\.example\\.[a-z]+$") == 1);
+    assert(accept_backend_arg(backend, "192.0.2.21") == 1);
+    assert(accept_backend_arg(backend, "alpn=h2") == 1);
+    add_backend(&table->backends, backend);
+
+    append_entry(table, "^[a-z]+\\.example\\.[a-z]+$", "192.0.2.22");
+    append_entry(table, "^aa\\.example\\.com$", "192.0.2.23");
+    append_entry(table, "example", "192.0.2.24");
+
+    init_table(table);
+
+    /* The back reference and the entry requiring ALPN are evaluated by PCRE */
+    assert(table->backend_index.pattern_set_len == 2);
+    assert(table->backend_index.patterns_len == 2);
+
+    assert_lookup(table, "aa.example.com", "192.0.2.20");
+    assert_lookup(table, "aaa.example.com", "192.0.2.22");
+    assert_lookup(table, "x.example.com", "192.0.2.22");
+    assert_lookup(table, "h2.example.com", "192.0.2.24");
+    assert_lookup(table, "www.example.co.uk", "192.0.2.24");
+    assert_lookup(table, "localhost", NULL);
+
+    struct ClientHello h2_hello = {
+        .alpn_len = 3,
+        .alpn = "\x02h2",
+    };
+    char address[ADDRESS_BUFFER_SIZE];
+    struct LookupResult result = table_lookup_server_address(table,
+            "h2.example.com", strlen("h2.example.com"), &h2_hello, NULL);
     assert(result.address != NULL);
+    display_address(result.address, address, sizeof(address));
+    assert(strcmp(address, "192.0.2.21") == 0);
+
+    table_ref_put(table);
+}
+
+/* Names are looked up in lower case, so entries match either case */
+static void
+test_caseless_table() {
+    struct Table *table = new_table();
+    assert(table != NULL);
+
+    table_ref_get(table);
+
+    append_entry(table, "^(a+)\\1\\.Example\\.org$", "192.0.2.30");
+    append_entry(table, "^[a-z]+\\.Tenant\\.com$", "192.0.2.31");
+    append_entry(table, "^Example-[0-9]+\\.NET$", "192.0.2.32");
+    append_entry(table, "^[^A-Z]+\\.example\\.info$", "192.0.2.33");
+    append_entry(table, "^Example\\.com$", "192.0.2.34");
+    append_entry(table, ".*\\.Tenant\\.net$", "192.0.2.35");
+    append_entry(table, "^(.*\\.)?EXAMPLE\\.ORG$", "192.0.2.36");
+
+    init_table(table);
+
+    assert(table->backend_index.pattern_set_len == 3);
+    assert(table->backend_index.patterns_len == 1);
+
+    assert_lookup(table, "aa.example.org", "192.0.2.30");
+    assert_lookup(table, "x.tenant.com", "192.0.2.31");
+    assert_lookup(table, "example-42.net", "192.0.2.32");
+    /* A negated class excludes both cases */
+    assert_lookup(table, "x.example.info", NULL);
+    assert_lookup(table, "1.example.info", "192.0.2.33");
+    /* Hostname and domain entries are indexed in lower case */
+    assert_lookup(table, "example.com", "192.0.2.34");
+    assert_lookup(table, "x.tenant.net", "192.0.2.35");
+    assert_lookup(table, "tenant.net", NULL);
+    assert_lookup(table, "example.org", "192.0.2.36");
+    assert_lookup(table, "x.example.org", "192.0.2.36");
 
     table_ref_put(table);
 }
 
+static void
+test_apply_pattern() {
+    /* Offsets of ^(www\.)?([a-z]+)(-x)?\.example\.com$ in name */
+    const char *name = "www.foo.example.com";
+    int matches[32] = { 4, 0, 19, 0, 4, 4, 7, -1, -1 };
+    char result[64];
+
+    assert(apply_pattern(name, "$2.internal:$$", matches, result,
+                sizeof(result)));
+    assert(strcmp(result, "foo.internal:$") == 0);
+
+    assert(apply_pattern(name, "[$3]$0", matches, result, sizeof(result)));
+    assert(strcmp(result, "[]www.foo.example.com") == 0);
+
+    /* No such substring */
+    assert(!apply_pattern(name, "$4", matches, result, sizeof(result)));
+
+    /* Too long for the result */
+    assert(!apply_pattern(name, "$0", matches, result, 19));
+    assert(apply_pattern(name, "$0", matches, result, 20));
+}
+
+static void
+test_lookup_cache() {
+    struct Table_head tables = SLIST_HEAD_INITIALIZER();
+    struct Table_head new = SLIST_HEAD_INITIALIZER();
+
+    add_new_table(&tables, "cache", (const char *[]){
+            "^example\\.com$", "192.0.2.10",
+            "^wild\\.example\\.net$", "*:443",
+            NULL});
+    struct Table *table = table_lookup(&tables, "cache");
+    assert(table != NULL);
+    init_table(table);
+
+    assert_lookup(table, "example.com", "192.0.2.10");
+    assert_lookup(table, "example.com", "192.0.2.10");
+    assert_lookup(table, "example.org", NULL);
+    assert_lookup(table, "example.org", NULL);
+    assert(table->cache.hits == 2);
+    assert(table->cache.misses == 2);
+
+    /* Wildcard entries expand to the name, once */
+    struct LookupResult result = table_lookup_server_address(table,
+            "wild.example.net", strlen("wild.example.net"), NULL, NULL);
+    assert(result.address != NULL && address_is_wildcard(result.address));
+    assert(result.expansion != NULL);
+    assert(strcmp(address_hostname(result.expansion), "wild.example.net") == 0);
+    const struct Address *expansion = result.expansion;
+    result = table_lookup_server_address(table,
+            "wild.example.net", strlen("wild.example.net"), NULL, NULL);
+    assert(result.expansion == expansion);
+    assert(table->cache.hits == 3);
+
+    /* More names than the cache holds evict the least recently used */
+    for (int i = 0; i < 2 * TABLE_CACHE_SIZE; i++) {
+        char name[64];
+
+        snprintf(name, sizeof(name), "host%d.example.com", i);
+        assert_lookup(table, name, NULL);
+        assert_lookup(table, "example.com", "192.0.2.10");
+    }
+    assert(table->cache.len == TABLE_CACHE_SIZE);
+    assert(table->cache.misses == 3 + 2 * TABLE_CACHE_SIZE);
+
+    /* Reloading the table invalidates its cached results */
+    add_new_table(&new, "cache", (const char *[]){
+            "^example\\.com$", "192.0.2.11",
+            NULL});
+    reload_tables(&tables, &new);
+    free_tables(&new);
+
+    unsigned long misses = table->cache.misses;
+    assert_lookup(table, "example.com", "192.0.2.11");
+    assert_lookup(table, "example.com", "192.0.2.11");
+    assert_lookup(table, "wild.example.net", NULL);
+    assert(table->cache.misses == misses + 2);
+
+    free_tables(&tables);
+}
+
 static void
 add_new_table(struct Table_head *tables, const char *name, const char **entries) {
     struct Table *table = new_table();
@@ -109,6 +510,112 @@ count_tables(const struct Table_head *tables) {
     return count;
 }
 
+/* Entries with several servers choose one for each lookup, cached or not */
+static void
+test_pool_table() {
+    struct Table_head tables = SLIST_HEAD_INITIALIZER();
+    struct Table_head new = SLIST_HEAD_INITIALIZER();
+    char address[ADDRESS_BUFFER_SIZE];
+
+    assert(new_pool_backend((const char *[]){
+                "^a$", "*", "192.0.2.1", NULL}) == NULL);
+    assert(new_pool_backend((const char *[]){
+                "^a$", "192.0.2.1", "proxy_protcol", NULL}) == NULL);
+    assert(new_pool_backend((const char *[]){
+                "^a$", "192.0.2.1", "weight=0", NULL}) == NULL);
+    assert(new_pool_backend((const char *[]){
+                "^a$", "192.0.2.1", "balance=fastest", NULL}) == NULL);
+    assert(new_pool_backend((const char *[]){
+                "^a$", "weight=2", NULL}) == NULL);
+    assert(new_pool_backend((const char *[]){
+                "^a$", "192.0.2.1", "hash=cookie", NULL}) == NULL);
+
+    add_new_table(&tables, "pool", NULL);
+    struct Table *table = table_lookup(&tables, "pool");
+    struct Backend *backend = new_pool_backend((const char *[]){
+            "^pool\\.example\\.com$", "192.0.2.20", "192.0.2.21", "8080",
+            "weight=2", "proxy_protocol", NULL});
+    assert(backend != NULL);
+    add_backend(&table->backends, backend);
+    append_entry(table, "^example\\.com$", "192.0.2.10");
+    init_table(table);
+
+    /* The port applies to the second server only */
+    assert(backend->balancer->len == 2);
+    assert(address_port(backend->address) == 0);
+    assert(address_port(backend->balancer->members[1].server->address) == 8080);
+
+    size_t counts[2] = {0, 0};
+    for (int i = 0; i < 6; i++) {
+        struct LookupResult result = table_lookup_server_address(table,
+                "pool.example.com", strlen("pool.example.com"), NULL, NULL);
+
+        assert(result.server != NULL);
+        assert(result.address == result.server->address);
+        assert(result.use_proxy_header == PROXY_PROTOCOL_V1);
+        display_address(result.address, address, sizeof(address));
+        counts[strcmp(address, "192.0.2.21:8080") == 0]++;
+    }
+    assert(counts[0] == 2 && counts[1] == 4);
+    assert(table->cache.hits == 5);
+
+    struct LookupResult result = table_lookup_server_address(table,
+            "example.com", strlen("example.com"), NULL, NULL);
+    assert(result.server == NULL);
+
+    /* Consistent hashing of the name keeps each name to one server */
+    backend = new_pool_backend((const char *[]){
+            "\\.example\\.net$", "192.0.2.30", "192.0.2.31", "192.0.2.32",
+            "balance=maglev", "hash=sni", NULL});
+    assert(backend != NULL);
+    add_backend(&table->backends, backend);
+    init_table(table);
+    table->generation++;
+
+    for (int i = 0; i < 20; i++) {
+        char name[32];
+
+        snprintf(name, sizeof(name), "host%d.example.net", i);
+        result = table_lookup_server_address(table, name, strlen(name),
+                NULL, NULL);
+        struct BackendServer *server = result.server;
+        assert(server != NULL);
+
+        result = table_lookup_server_address(table, name, strlen(name),
+                NULL, NULL);
+        assert(result.server == server);
+    }
+
+    /* A connection to a server outlives the configuration, and is counted
+     * by the pools of later ones */
+    result = table_lookup_server_address(table,
+            "pool.example.com", strlen("pool.example.com"), NULL, NULL);
+    struct BackendServer *server = backend_server_acquire(result.server);
+
+    add_new_table(&new, "pool", (const char *[]){
+            "^pool\\.example\\.com$", "192.0.2.20",
+            NULL});
+    backend = STAILQ_FIRST(&table_lookup(&new, "pool")->backends);
+    assert(accept_backend_arg(backend, "192.0.2.21:8080") == 1);
+    assert(accept_backend_arg(backend, "balance=leastconn") == 1);
+    reload_tables(&tables, &new);
+    free_tables(&new);
+
+    backend = STAILQ_FIRST(&table->backends);
+    assert(backend->balancer->algorithm == BALANCE_LEAST_CONNECTIONS);
+    assert(backend->balancer->members[0].server == server ||
+            backend->balancer->members[1].server == server);
+    assert(server->connections == 1);
+
+    result = table_lookup_server_address(table,
+            "pool.example.com", strlen("pool.example.com"), NULL, NULL);
+    assert(result.server != server);
+
+    free_tables(&tables);
+    assert(server->connections == 1 && server->reference_count == 1);
+    backend_server_release(server);
+}
+
 static void
 test_add_table() {
     struct Table_head tables = SLIST_HEAD_INITIALIZER();
@@ -3,6 +3,7 @@
 #include <string.h>
 #include <assert.h>
 #include "tls.h"
+#include "protocol.h"
 
 struct test_packet {
     const char *packet;
@@ -230,6 +231,46 @@ const unsigned char good_data_5[] = {
                 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x68, 0x6f, 0x73, 0x74
 };
 
+const unsigned char alpn_data[] = {
+    // TLS record
+    0x16, // Content Type: Handshake
+    0x03, 0x01, // Version: TLS 1.0
+    0x00, 0x53, // Length
+        // Handshake
+        0x01, // Handshake Type: Client Hello
+        0x00, 0x00, 0x4f, // Length
+        0x03, 0x03, // Version: TLS 1.2
+        // Random
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0x00, // Session ID Length
+        0x00, 0x02, // Cipher Suites Length
+            0x13, 0x01, // TLS_AES_128_GCM_SHA256
+        0x01, // Compression Methods
+            0x00, // NULL
+        0x00, 0x24, // Extensions Length
+            // Extension
+            0x00, 0x00, // Extension Type: Server Name
+            0x00, 0x0e, // Length
+            0x00, 0x0c, // Server Name Indication Length
+                0x00, // Server Name Type: host_name
+                0x00, 0x09, // Length
+                // "localhost"
+                0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x68, 0x6f, 0x73, 0x74,
+            // Extension
+            0x00, 0x10, // Extension Type: ALPN
+            0x00, 0x0e, // Length
+            0x00, 0x0c, // ALPN Extension Length
+                0x02, // ALPN Protocol Length
+                // "h2"
+                0x68, 0x32,
+                0x08, // ALPN Protocol Length
+                // "http/1.1"
+                0x68, 0x74, 0x74, 0x70, 0x2f, 0x31, 0x2e, 0x31,
+};
+
 const unsigned char ssl30_request[] = {
     // TLS record
     0x16, // Content Type: Handshake
@@ -335,6 +376,67 @@ const unsigned char ssl20_client_hello[] = {
         0x5d, 0xb1, 0x5a, 0x2f, 0xac, 0x72, 0x45, 0x2e
 };
 
+const unsigned char metadata_data[] = {
+    // TLS record
+    0x16, // Content Type: Handshake
+    0x03, 0x01, // Version: TLS 1.0
+    0x00, 0x73, // Length
+        // Handshake
+        0x01, // Handshake Type: Client Hello
+        0x00, 0x00, 0x6f, // Length
+        0x03, 0x03, // Version: TLS 1.2
+        // Random
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0x00, // Session ID Length
+        0x00, 0x06, // Cipher Suites Length
+            0x0a, 0x0a, // GREASE
+            0x13, 0x01, // TLS_AES_128_GCM_SHA256
+            0x13, 0x02, // TLS_AES_256_GCM_SHA384
+        0x01, // Compression Methods
+            0x00, // NULL
+        0x00, 0x40, // Extensions Length
+            // Extension
+            0x1a, 0x1a, // Extension Type: GREASE
+            0x00, 0x00, // Length
+            // Extension
+            0x00, 0x00, // Extension Type: Server Name
+            0x00, 0x0e, // Length
+            0x00, 0x0c, // Server Name Indication Length
+                0x00, // Server Name Type: host_name
+                0x00, 0x09, // Length
+                // "localhost"
+                0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x68, 0x6f, 0x73, 0x74,
+            // Extension
+            0x00, 0x0a, // Extension Type: Supported Groups
+            0x00, 0x08, // Length
+            0x00, 0x06, // Supported Groups List Length
+                0x2a, 0x2a, // GREASE
+                0x00, 0x1d, // x25519
+                0x00, 0x17, // secp256r1
+            // Extension
+            0x00, 0x0d, // Extension Type: Signature Algorithms
+            0x00, 0x06, // Length
+            0x00, 0x04, // Signature Hash Algorithms Length
+                0x04, 0x03, // ecdsa_secp256r1_sha256
+                0x08, 0x04, // rsa_pss_rsae_sha256
+            // Extension
+            0x00, 0x10, // Extension Type: ALPN
+            0x00, 0x05, // Length
+            0x00, 0x03, // ALPN Extension Length
+                0x02, // ALPN Protocol Length
+                0x68, 0x32, // "h2"
+            // Extension
+            0x00, 0x2b, // Extension Type: Supported Versions
+            0x00, 0x07, // Length
+            0x06, // Supported Versions Length
+                0x3a, 0x3a, // GREASE
+                0x03, 0x04, // TLS 1.3
+                0x03, 0x03, // TLS 1.2
+};
+
 const unsigned char bad_data_1[] = {
     0x16, 0x03, 0x01, 0x00, 0x68, 0x01, 0x00, 0x00,
     0x64, 0x03, 0x01, 0x4e, 0x4e, 0xbe, 0xc2, 0xa1,
@@ -410,7 +512,8 @@ static struct test_packet good[] = {
     { (char *)good_data_2, sizeof(good_data_2) },
     { (char *)good_data_3, sizeof(good_data_3) },
     { (char *)good_data_4, sizeof(good_data_4) },
-    { (char *)good_data_5, sizeof(good_data_5) }
+    { (char *)good_data_5, sizeof(good_data_5) },
+    { (char *)alpn_data, sizeof(alpn_data) }
 };
 
 static struct test_packet bad[] = {
@@ -421,41 +524,226 @@ static struct test_packet bad[] = {
     { (char *)bad_data_3, sizeof(bad_data_3) }
 };
 
+/*
+ * Feed a packet to the parser chunk_len bytes at a time
+ */
+static int
+parse_chunked(struct ParseState *state, const char *packet, size_t len, size_t chunk_len) {
+    int result = -1;
+
+    init_parse_state(state);
+
+    for (size_t pos = 0; pos < len && result == -1; pos += chunk_len)
+        result = tls_protocol->parse_packet(state, packet + pos,
+                len - pos < chunk_len ? len - pos : chunk_len);
+
+    return result;
+}
+
+/*
+ * Split the handshake message of a single record packet over several
+ * records of at most fragment_len bytes each
+ */
+static size_t
+fragment_records(const unsigned char *packet, size_t len, size_t fragment_len,
+        unsigned char *out) {
+    size_t out_len = 0;
+
+    for (size_t pos = 5; pos < len; pos += fragment_len) {
+        size_t payload_len = len - pos < fragment_len ? len - pos : fragment_len;
+
+        out[out_len++] = packet[0];
+        out[out_len++] = packet[1];
+        out[out_len++] = packet[2];
+        out[out_len++] = (unsigned char)(payload_len >> 8);
+        out[out_len++] = (unsigned char)payload_len;
+        memcpy(out + out_len, packet + pos, payload_len);
+        out_len += payload_len;
+    }
+
+    return out_len;
+}
+
 int main() {
     unsigned int i;
     int result;
-    char *hostname;
+    struct ParseState state;
 
     for (i = 0; i < sizeof(good) / sizeof(struct test_packet); i++) {
-        hostname = NULL;
+        init_parse_state(&state);
+        result = tls_protocol->parse_packet(&state, good[i].packet, good[i].len);
+
+        assert(result == 9);
+
+        assert(0 == strcmp("localhost", state.hostname));
+
+        assert(state.hostname_flags == 0);
+    }
 
-        result = tls_protocol->parse_packet(good[i].packet, good[i].len, &hostname);
+    /* ALPN protocol list */
+    init_parse_state(&state);
+    result = tls_protocol->parse_packet(&state, (char *)alpn_data, sizeof(alpn_data));
+    assert(result == 9);
+    assert(state.hello.alpn_len == 12);
+    assert(memcmp(state.hello.alpn, "\x02h2\x08http/1.1", 12) == 0);
 
+    /* Client hello metadata */
+    {
+        char fingerprint[sizeof(state.hello.fingerprint)];
+        unsigned char modified[sizeof(metadata_data)];
+
+        init_parse_state(&state);
+        result = tls_protocol->parse_packet(&state, (char *)metadata_data, sizeof(metadata_data));
         assert(result == 9);
+        assert(0 == strcmp("localhost", state.hostname));
+        assert(state.hello.client_version == 0x0303);
+        assert(state.hello.max_version == 0x0304);
+        assert(state.hello.cipher_count == 2);
+        assert(state.hello.extension_count == 5);
+        assert(state.hello.group_count == 2);
+        assert(state.hello.groups[0] == 0x001d);
+        assert(state.hello.groups[1] == 0x0017);
+        assert(state.hello.alpn_len == 3);
+        assert(strlen(state.hello.fingerprint) == CLIENT_HELLO_FINGERPRINT_LEN);
+        assert(strncmp(state.hello.fingerprint, "t13d0205h2_", 11) == 0);
+        strcpy(fingerprint, state.hello.fingerprint);
 
-        assert(NULL != hostname);
+        /* Same fingerprint when delivered a byte at a time */
+        result = parse_chunked(&state, (char *)metadata_data, sizeof(metadata_data), 1);
+        assert(result == 9);
+        assert(0 == strcmp(fingerprint, state.hello.fingerprint));
 
-        assert(0 == strcmp("localhost", hostname));
+        /* Cipher suite order does not change the fingerprint */
+        memcpy(modified, metadata_data, sizeof(metadata_data));
+        memcpy(modified + 48, metadata_data + 50, 2);
+        memcpy(modified + 50, metadata_data + 48, 2);
+        init_parse_state(&state);
+        result = tls_protocol->parse_packet(&state, (char *)modified, sizeof(modified));
+        assert(result == 9);
+        assert(0 == strcmp(fingerprint, state.hello.fingerprint));
 
-        free(hostname);
+        /* Signature algorithm order does */
+        memcpy(modified, metadata_data, sizeof(metadata_data));
+        modified[sizeof(modified) - 24] = 0x08;
+        modified[sizeof(modified) - 23] = 0x04;
+        modified[sizeof(modified) - 22] = 0x04;
+        modified[sizeof(modified) - 21] = 0x03;
+        init_parse_state(&state);
+        result = tls_protocol->parse_packet(&state, (char *)modified, sizeof(modified));
+        assert(result == 9);
+        assert(strncmp(fingerprint, state.hello.fingerprint, 24) == 0);
+        assert(0 != strcmp(fingerprint, state.hello.fingerprint));
+
+        /* Without a host_name the rest of the hello is still fingerprinted */
+        memcpy(modified, metadata_data, sizeof(metadata_data));
+        modified[66] = 0x01; /* Server Name Type */
+        for (size_t chunk_len = 1; chunk_len <= sizeof(modified);
+                chunk_len = chunk_len == 1 ? sizeof(modified) : chunk_len + 1) {
+            result = parse_chunked(&state, (char *)modified, sizeof(modified), chunk_len);
+            assert(result == -2);
+            assert(state.hello.alpn_len == 3);
+            assert(state.hello.max_version == 0x0304);
+            assert(strncmp(state.hello.fingerprint, "t13i0205h2_", 11) == 0);
+            assert(strcmp(fingerprint + 11, state.hello.fingerprint + 11) == 0);
+        }
+
+        /* Odd length cipher suite list */
+        memcpy(modified, metadata_data, sizeof(metadata_data));
+        modified[45] = 0x05;
+        init_parse_state(&state);
+        result = tls_protocol->parse_packet(&state, (char *)modified, sizeof(modified));
+        assert(result < -4);
     }
 
-    result = tls_protocol->parse_packet(good[0].packet, good[0].len, NULL);
-    assert(result == -3);
+    /* Malformed ALPN protocol list */
+    {
+        unsigned char bad_alpn[sizeof(alpn_data)];
 
-    for (i = 0; i < sizeof(bad) / sizeof(struct test_packet); i++) {
-        hostname = NULL;
+        memcpy(bad_alpn, alpn_data, sizeof(alpn_data));
+        bad_alpn[sizeof(bad_alpn) - 9] = 0x09; /* "http/1.1" length */
 
-        result = tls_protocol->parse_packet(bad[i].packet, bad[i].len, &hostname);
+        init_parse_state(&state);
+        result = tls_protocol->parse_packet(&state, (char *)bad_alpn, sizeof(bad_alpn));
+        assert(result < -4);
+    }
+
+    /* Incomplete client hello */
+    init_parse_state(&state);
+    result = tls_protocol->parse_packet(&state, good[0].packet, good[0].len - 1);
+    assert(result == -1);
+
+    /* Server name is normalized to lower case */
+    {
+        unsigned char upper_case[sizeof(good_data_1)];
+
+        memcpy(upper_case, good_data_1, sizeof(good_data_1));
+        memcpy(upper_case + sizeof(upper_case) - 9, "LocalHost", 9);
+
+        init_parse_state(&state);
+        result = tls_protocol->parse_packet(&state, (char *)upper_case, sizeof(upper_case));
+
+        assert(result == 9);
+
+        assert(0 == strcmp("localhost", state.hostname));
+
+        assert(state.hostname_flags == HOSTNAME_LOWERCASED);
+    }
+
+    /* Delivered in pieces */
+    for (i = 0; i < sizeof(good) / sizeof(struct test_packet); i++) {
+        static const size_t chunk_lens[] = { 1, 2, 3, 5, 7, 64 };
+
+        for (size_t j = 0; j < sizeof(chunk_lens) / sizeof(size_t); j++) {
+            result = parse_chunked(&state, good[i].packet, good[i].len, chunk_lens[j]);
+
+            assert(result == 9);
+
+            assert(0 == strcmp("localhost", state.hostname));
+        }
+    }
+
+    /* Client hello fragmented over multiple TLS records */
+    for (size_t fragment_len = 1; fragment_len < 128; fragment_len++) {
+        unsigned char fragmented[sizeof(good_data_5) * 6];
+        size_t fragmented_len = fragment_records(good_data_5,
+                sizeof(good_data_5), fragment_len, fragmented);
+
+        init_parse_state(&state);
+        result = tls_protocol->parse_packet(&state, (char *)fragmented, fragmented_len);
+
+        assert(result == 9);
+
+        assert(0 == strcmp("localhost", state.hostname));
+
+        result = parse_chunked(&state, (char *)fragmented, fragmented_len, 3);
+
+        assert(result == 9);
+
+        assert(0 == strcmp("localhost", state.hostname));
+    }
+
+    /* Continuation record of another content type */
+    {
+        unsigned char fragmented[sizeof(good_data_1) + 5];
+        size_t fragmented_len = fragment_records(good_data_1,
+                sizeof(good_data_1), 64, fragmented);
+
+        fragmented[5 + 64] = 0x17; /* Application Data */
+
+        init_parse_state(&state);
+        result = tls_protocol->parse_packet(&state, (char *)fragmented, fragmented_len);
+
+        assert(result < -4);
+    }
+
+    for (i = 0; i < sizeof(bad) / sizeof(struct test_packet); i++) {
+        init_parse_state(&state);
+        result = tls_protocol->parse_packet(&state, bad[i].packet, bad[i].len);
 
         // parse failure or not "localhost"
         assert(result < 0 ||
-               hostname == NULL ||
-               strcmp("localhost", hostname) != 0);
-
-        free(hostname);
+               strcmp("localhost", state.hostname) != 0);
     }
 
     return 0;
 }
-